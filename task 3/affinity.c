@@ -0,0 +1,233 @@
+#include "server.h"
+
+// Global variables
+int worker_cpus[MAX_WORKER_CPUS];  // --cpus, in the order workers are pinned
+int worker_cpu_count = 0;
+int acceptor_cpu = -1;
+int numa_placement = 0;
+int rss_steering = 0;
+
+static int* worker_cpu = NULL;     // CPU each worker is pinned to, -1 if unpinned
+static int* worker_node = NULL;    // NUMA node of that CPU, -1 if unpinned
+static int node_count = 1;
+static int slots_reserved = 0;     // clients came from VirtualAlloc, not calloc
+
+static volatile LONG64 steered_cpu = 0;
+static volatile LONG64 steered_node = 0;
+static volatile LONG64 unsteered = 0;
+
+// Accepts a comma separated list of CPUs and ranges such as "0-3,8,10-11"
+int parse_cpu_list(const char* list, int* cpus, int* count) {
+    *count = 0;
+    while (*list) {
+        char* end;
+        long first = strtol(list, &end, 10);
+        long last = first;
+        if (end == list) return -1;
+        if (*end == '-') {
+            const char* second = end + 1;
+            last = strtol(second, &end, 10);
+            if (end == second) return -1;
+        }
+        if (first < 0 || last < first || last >= MAX_WORKER_CPUS) return -1;
+        for (long cpu = first; cpu <= last; cpu++) {
+            if (*count == MAX_WORKER_CPUS) return -1;
+            cpus[(*count)++] = (int)cpu;
+        }
+        if (*end == '\0') break;
+        if (*end != ',') return -1;
+        list = end + 1;
+    }
+    return *count > 0 ? 0 : -1;
+}
+
+// Decides the number of workers and where each one runs, before the
+// client slots are allocated on their nodes. --numa without --cpus pins
+// the workers to the CPUs in order. Busy-poll workers come after the
+// others, each on its CPU of --busy-poll-cpus.
+int plan_workers() {
+    SYSTEM_INFO system_info;
+    GetSystemInfo(&system_info);
+    int cpus = (int)system_info.dwNumberOfProcessors;
+    if (cpus < 1) cpus = 1;
+    
+    if (numa_placement && worker_cpu_count == 0) {
+        for (int cpu = 0; cpu < cpus && cpu < MAX_WORKER_CPUS; cpu++) worker_cpus[worker_cpu_count++] = cpu;
+    }
+    if (worker_count == 0) worker_count = (worker_cpu_count > 0) ? worker_cpu_count : cpus;
+    
+    ULONG highest_node = 0;
+    if (GetNumaHighestNodeNumber(&highest_node)) node_count = (int)highest_node + 1;
+    
+    int total = worker_count + busy_poll_workers;
+    worker_cpu = (int*)malloc(total * sizeof(int));
+    worker_node = (int*)malloc(total * sizeof(int));
+    if (worker_cpu == NULL || worker_node == NULL) return -1;
+    
+    for (int i = 0; i < total; i++) {
+        worker_cpu[i] = worker_node[i] = -1;
+        if (i < worker_count && worker_cpu_count > 0) {
+            // More workers than listed CPUs share them in turn
+            worker_cpu[i] = worker_cpus[i % worker_cpu_count];
+        } else if (i >= worker_count && busy_poll_cpu_count > 0) {
+            worker_cpu[i] = busy_poll_cpus[i - worker_count];
+        } else {
+            continue;
+        }
+        
+        UCHAR node;
+        if (worker_cpu[i] >= cpus || !GetNumaProcessorNode((UCHAR)worker_cpu[i], &node) || node == 0xFF) {
+            fprintf(stderr, "Error: CPU %d in %s does not exist on this machine\n", worker_cpu[i],
+                    i < worker_count ? "--cpus" : "--busy-poll-cpus");
+            return -1;
+        }
+        worker_node[i] = node;
+    }
+    return 0;
+}
+
+int worker_cpu_of(int index) {
+    return worker_cpu[index];
+}
+
+// Restricts the calling thread to one CPU. Processor groups are not used,
+// so only the first 64 CPUs can be named.
+void pin_thread(int cpu, const char* name) {
+    if (cpu < 0) return;
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) == 0) {
+        printf("Failed to pin %s to CPU %d. Error: %lu\n", name, cpu, (unsigned long)GetLastError());
+    }
+}
+
+// The client slots, zeroed. With --numa each worker's range of slots is
+// committed on the worker's node, so the connections it owns, and their
+// queues and locks, are in memory local to the CPU that serves them.
+Client* allocate_clients(int count, int partition_size) {
+    if (!numa_placement) return (Client*)calloc(count, sizeof(Client));
+    
+    size_t size = (size_t)count * sizeof(Client);
+    Client* slots = (Client*)VirtualAlloc(NULL, size, MEM_RESERVE, PAGE_READWRITE);
+    if (slots == NULL) return NULL;
+    
+    // A page shared by two ranges goes to the node that commits it first
+    for (int w = 0; w < worker_count; w++) {
+        int first = w * partition_size;
+        int last = (first + partition_size < count) ? first + partition_size : count;
+        if (first >= last) break;
+        if (VirtualAllocExNuma(GetCurrentProcess(), &slots[first], (size_t)(last - first) * sizeof(Client),
+                               MEM_COMMIT, PAGE_READWRITE, (DWORD)worker_node[w]) == NULL) {
+            VirtualFree(slots, 0, MEM_RELEASE);
+            return NULL;
+        }
+    }
+    slots_reserved = 1;
+    return slots;
+}
+
+void free_clients(Client* slots) {
+    if (slots_reserved) {
+        VirtualFree(slots, 0, MEM_RELEASE);
+    } else {
+        free(slots);
+    }
+}
+
+// Picks the worker for a new connection from the CPU its packets are
+// received on: the least busy worker pinned to that CPU, else the least
+// busy one on the same node. Returns -1 when there is no such worker or the
+// stack cannot tell, and the connection goes round-robin.
+int steer_connection(SOCKET sock) {
+    SOCKET_PROCESSOR_AFFINITY affinity;
+    DWORD returned = 0;
+    if (WSAIoctl(sock, SIO_QUERY_RSS_PROCESSOR_INFO, NULL, 0, &affinity, sizeof(affinity),
+                 &returned, NULL, NULL) != 0) {
+        InterlockedIncrement64(&unsteered);
+        return -1;
+    }
+    
+    int same_cpu = -1, same_node = -1;
+    for (int i = 0; i < worker_count; i++) {
+        if (worker_cpu[i] == affinity.Processor.Number && affinity.Processor.Group == 0 &&
+            (same_cpu < 0 || worker_connections(i) < worker_connections(same_cpu))) {
+            same_cpu = i;
+        }
+        if (worker_node[i] == affinity.NumaNodeId &&
+            (same_node < 0 || worker_connections(i) < worker_connections(same_node))) {
+            same_node = i;
+        }
+    }
+    if (same_cpu >= 0) {
+        InterlockedIncrement64(&steered_cpu);
+        return same_cpu;
+    }
+    InterlockedIncrement64(same_node >= 0 ? &steered_node : &unsteered);
+    return same_node;
+}
+
+// Where the NIC should deliver packets so that they arrive on the CPUs of
+// the workers: one line per NUMA node with the workers pinned on it
+static int placement_hints(char* out, int size) {
+    int len = 0;
+    for (int node = 0; node < node_count && len < size; node++) {
+        char cpus[256];
+        int cpus_len = 0, lowest = -1, highest = -1;
+        for (int i = 0; i < worker_count && i < worker_cpu_count; i++) {
+            if (worker_node[i] != node) continue;
+            if (cpus_len < (int)sizeof(cpus) - 8) {
+                cpus_len += snprintf(cpus + cpus_len, sizeof(cpus) - cpus_len, "%s%d", cpus_len ? "," : "", worker_cpu[i]);
+            }
+            if (lowest < 0 || worker_cpu[i] < lowest) lowest = worker_cpu[i];
+            if (worker_cpu[i] > highest) highest = worker_cpu[i];
+        }
+        if (lowest < 0) continue;
+        len += snprintf(out + len, size - len,
+                        "  node %d: workers on CPUs %s; point receive queues and their interrupts here, e.g.\n"
+                        "    Set-NetAdapterRss -Name <NIC> -NumaNode %d -BaseProcessorNumber %d -MaxProcessorNumber %d\n",
+                        node, cpus, node, lowest, highest);
+    }
+    return len < size ? len : size - 1;
+}
+
+void print_placement() {
+    if (worker_cpu_count == 0) return;
+    
+    char hints[2048];
+    placement_hints(hints, sizeof(hints));
+    printf("Workers pinned to CPUs%s%s; placement hints:\n%s",
+           numa_placement ? ", client slots on each worker's NUMA node" : "",
+           rss_steering ? ", connections steered by RSS CPU" : "", hints);
+}
+
+int affinity_report(char* out, int size) {
+    int len = snprintf(out, size, "Workers: %d on %d NUMA node(s); %s%s%s\n"
+                       "%8s %6s %6s %12s\n",
+                       worker_count, node_count,
+                       worker_cpu_count > 0 ? "pinned (--cpus)" : "not pinned",
+                       numa_placement ? ", client slots per node (--numa)" : "",
+                       rss_steering ? ", RSS steering (--rss-steer)" : "",
+                       "worker", "cpu", "node", "connections");
+    
+    for (int i = 0; i < worker_count && len < size; i++) {
+        char cpu[16] = "-", node[16] = "-";
+        if (worker_cpu[i] >= 0) snprintf(cpu, sizeof(cpu), "%d", worker_cpu[i]);
+        if (worker_node[i] >= 0) snprintf(node, sizeof(node), "%d", worker_node[i]);
+        len += snprintf(out + len, size - len, "%8d %6s %6s %12d\n", i, cpu, node, worker_connections(i));
+    }
+    if (acceptor_cpu >= 0 && len < size) {
+        len += snprintf(out + len, size - len, "Acceptor pinned to CPU %d\n", acceptor_cpu);
+    }
+    if (numa_placement && len < size) {
+        len += snprintf(out + len, size - len, "Client slots taken from another worker's node: %lld\n",
+                        (long long)slots_borrowed());
+    }
+    if (rss_steering && len < size) {
+        len += snprintf(out + len, size - len,
+                        "Connections steered: %lld to their RSS CPU's worker, %lld to a worker on its node, %lld round-robin\n",
+                        (long long)steered_cpu, (long long)steered_node, (long long)unsteered);
+    }
+    if (worker_cpu_count > 0 && len < size) {
+        len += snprintf(out + len, size - len, "Placement hints:\n");
+        if (len < size) len += placement_hints(out + len, size - len);
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_TOPICS 64
+#define MAX_FANOUT 16
+#define BUCKET_US 10               // Histogram resolution
+#define BUCKETS 20000              // Up to 200 ms; slower messages land in the last bucket
+
+// Latencies seen by one subscriber thread after the warm-up
+typedef struct {
+    SOCKET socket;
+    LONG64 counts[BUCKETS];
+    LONG64 received;
+} Subscriber;
+
+typedef struct {
+    SOCKET socket;
+    int topic;
+} Publisher;
+
+// Global variables
+const char* server_ip;
+int port;
+int seconds = 10;
+int warmup_seconds = 1;
+int topics = 8;
+int fanout = 2;
+int rate = 2000;                   // Messages per second per publisher, 0 for as fast as possible
+int message_size = 100;
+volatile int running = 1;
+volatile int measuring = 0;
+
+LONGLONG start_ticks;
+double us_per_tick;
+
+// Function prototypes
+SOCKET connect_and_register(const char* type, const char* topic);
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+double percentile(const LONG64* counts, LONG64 total, double fraction);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            topics = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fanout") == 0 && i + 1 < argc) {
+            fanout = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (seconds < 1 || topics < 1 || topics > MAX_TOPICS || fanout < 1 || fanout > MAX_FANOUT ||
+        rate < 0 || message_size < 32 || message_size >= BUFFER_SIZE - 100) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    // Subscribers register first so they see every message
+    int subscriber_count = topics * fanout;
+    Subscriber* subscribers = (Subscriber*)calloc(subscriber_count, sizeof(Subscriber));
+    Publisher* publishers = (Publisher*)calloc(topics, sizeof(Publisher));
+    HANDLE* threads = (HANDLE*)malloc((subscriber_count + topics) * sizeof(HANDLE));
+    if (subscribers == NULL || publishers == NULL || threads == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    
+    char topic[32];
+    for (int s = 0; s < subscriber_count; s++) {
+        snprintf(topic, sizeof(topic), "AFFINITY%d", s % topics);
+        subscribers[s].socket = connect_and_register("SUBSCRIBER", topic);
+    }
+    for (int t = 0; t < topics; t++) {
+        snprintf(topic, sizeof(topic), "AFFINITY%d", t);
+        publishers[t].socket = connect_and_register("PUBLISHER", topic);
+        publishers[t].topic = t;
+    }
+    
+    printf("%d topics x %d subscribers, %d byte messages, %s per publisher, %d s (+%d s warm-up)\n",
+           topics, fanout, message_size, rate > 0 ? "rate-limited" : "unthrottled", seconds, warmup_seconds);
+    if (rate > 0) printf("Offered: %d messages/s per publisher, %lld deliveries/s in total\n",
+                         rate, (long long)rate * topics * fanout);
+    
+    start_ticks = now_ticks();
+    int thread_count = 0;
+    for (int s = 0; s < subscriber_count; s++) {
+        threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &subscribers[s], 0, NULL);
+    }
+    for (int t = 0; t < topics; t++) {
+        threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, &publishers[t], 0, NULL);
+    }
+    
+    Sleep(warmup_seconds * 1000);
+    measuring = 1;
+    LONGLONG measure_start = now_ticks();
+    Sleep(seconds * 1000);
+    measuring = 0;
+    double measured = (now_ticks() - measure_start) * us_per_tick / 1e6;
+    running = 0;
+    
+    // Closing the sockets ends any recv or send still in progress
+    for (int t = 0; t < topics; t++) closesocket(publishers[t].socket);
+    for (int s = 0; s < subscriber_count; s++) closesocket(subscribers[s].socket);
+    for (int t = 0; t < thread_count; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+    
+    static LONG64 merged[BUCKETS];
+    LONG64 total = 0;
+    for (int s = 0; s < subscriber_count; s++) {
+        for (int b = 0; b < BUCKETS; b++) merged[b] += subscribers[s].counts[b];
+        total += subscribers[s].received;
+    }
+    
+    printf("Delivered: %.0f messages/s\n", total / measured);
+    if (total > 0) {
+        printf("Latency us: p50 %.0f  p90 %.0f  p99 %.0f  p99.9 %.0f\n",
+               percentile(merged, total, 0.50), percentile(merged, total, 0.90),
+               percentile(merged, total, 0.99), percentile(merged, total, 0.999));
+    }
+    
+    WSACleanup();
+    return 0;
+}
+
+SOCKET connect_and_register(const char* type, const char* topic) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, topic);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Sends timestamped messages, at the configured rate or as fast as the
+// socket takes them, a millisecond's worth per send
+unsigned __stdcall publisher_thread(void* arg) {
+    Publisher* publisher = (Publisher*)arg;
+    char batch[64 * BUFFER_SIZE];
+    LONG64 sent = 0;
+    
+    while (running) {
+        int due = (int)sizeof(batch) / message_size;
+        if (rate > 0) {
+            double elapsed_s = (now_ticks() - start_ticks) * us_per_tick / 1e6;
+            LONG64 owed = (LONG64)(elapsed_s * rate) - sent;
+            if (owed <= 0) {
+                Sleep(1);
+                continue;
+            }
+            if (owed < due) due = (int)owed;
+        }
+        
+        // Every message of a batch carries the time it was sent
+        char stamp[24];
+        int stamp_len = snprintf(stamp, sizeof(stamp), "%lld ", (long long)now_ticks());
+        for (int m = 0; m < due; m++) {
+            char* line = batch + m * message_size;
+            memcpy(line, stamp, stamp_len);
+            memset(line + stamp_len, 'x', message_size - stamp_len - 1);
+            line[message_size - 1] = '\n';
+        }
+        if (send(publisher->socket, batch, due * message_size, 0) == SOCKET_ERROR) break;
+        sent += due;
+    }
+    return 0;
+}
+
+// Lines look like "[TOPIC] Publisher X: <ticks> xxx"
+unsigned __stdcall subscriber_thread(void* arg) {
+    Subscriber* subscriber = (Subscriber*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    char line[2 * BUFFER_SIZE];
+    int line_len = 0;
+    
+    while (running) {
+        int bytes_received = recv(subscriber->socket, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) break;
+        
+        LONGLONG now = now_ticks();
+        for (int i = 0; i < bytes_received; i++) {
+            if (line_len < (int)sizeof(line) - 1) line[line_len++] = buffer[i];
+            if (buffer[i] != '\n') continue;
+            
+            line[line_len] = '\0';
+            line_len = 0;
+            const char* payload = strstr(line, ": ");
+            if (payload == NULL || !measuring) continue;
+            
+            double latency_us = (now - _atoi64(payload + 2)) * us_per_tick;
+            int bucket = (int)(latency_us / BUCKET_US);
+            if (bucket < 0) bucket = 0;
+            if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+            subscriber->counts[bucket]++;
+            subscriber->received++;
+        }
+    }
+    return 0;
+}
+
+// Upper edge of the bucket holding the given fraction of all samples
+double percentile(const LONG64* counts, LONG64 total, double fraction) {
+    LONG64 target = (LONG64)(total * fraction);
+    LONG64 seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > target) return (b + 1) * (double)BUCKET_US;
+    }
+    return BUCKETS * (double)BUCKET_US;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--seconds N] [--topics N] [--fanout N]\n", program_name);
+    printf("          [--rate MSGS] [--size BYTES]\n");
+    printf("One publisher per topic sends --rate timestamped messages per second (0: as\n");
+    printf("fast as the server takes them) to --fanout subscribers each. Reports the\n");
+    printf("deliveries per second and the end-to-end latency percentiles.\n");
+    printf("Run it against the same server started with and without --cpus to compare\n");
+    printf("pinned and unpinned workers.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --topics 16 --fanout 4 --rate 0\n", program_name);
+}
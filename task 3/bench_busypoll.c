@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_RATES 16
+#define BUCKET_US 1                // Histogram resolution
+#define BUCKETS 100000             // Up to 100 ms; slower messages land in the last bucket
+#define SPIN_AHEAD_US 2000         // The publisher sleeps until this close to a send, then yields
+
+// One publisher and one subscriber on a topic, for one round
+typedef struct {
+    SOCKET publisher;
+    SOCKET subscriber;
+    int rate;
+    LONG64 sent;
+    LONG64 received;               // While measuring
+    LONG64* counts;
+} Round;
+
+// Global variables
+const char* server_ip;
+int port;
+int seconds = 3;
+int message_size = 64;
+const char* busy_topic = "LOWLAT";
+const char* normal_topic = "EVENTLOOP";
+int rates[MAX_RATES] = { 100, 1000, 10000 };
+int rate_count = 3;
+volatile int running = 1;
+volatile int measuring = 0;
+
+double us_per_tick;
+
+// Function prototypes
+int parse_rates(const char* list);
+void run_round(int rate, const char* topic, const char* mode);
+SOCKET connect_and_register(const char* type, const char* topic);
+int fetch_report(const char* name, char* out, int size);
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+double percentile(const LONG64* counts, LONG64 total, double fraction);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            busy_topic = argv[++i];
+        } else if (strcmp(argv[i], "--rates") == 0 && i + 1 < argc) {
+            if (parse_rates(argv[++i]) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (seconds < 1 || message_size < 32 || message_size >= BUFFER_SIZE - 100 || strcmp(busy_topic, normal_topic) == 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    // The server's report names its busy-poll topics after "topics:"
+    char report[4096];
+    const char* topics = NULL;
+    if (fetch_report("BUSY", report, sizeof(report)) > 0) topics = strstr(report, "topics:");
+    char name[80];
+    snprintf(name, sizeof(name), " %s", busy_topic);
+    const char* listed = topics ? strstr(topics, name) : NULL;
+    if (listed == NULL || (listed[strlen(name)] != ' ' && listed[strlen(name)] != '\n')) {
+        printf("Warning: the server does not busy-poll %s; start it with --busy-poll %s\n", busy_topic, busy_topic);
+    }
+    
+    printf("One publisher and one subscriber per round, %d byte messages, %d s per round (+0.5 s warm-up)\n",
+           message_size, seconds);
+    printf("%s is busy-polled, %s is served by the event loop\n", busy_topic, normal_topic);
+    printf("   rate  mode          messages   p50 us   p90 us   p99 us  p99.9 us   max us\n");
+    for (int r = 0; r < rate_count; r++) {
+        run_round(rates[r], busy_topic, "busy-poll");
+        run_round(rates[r], normal_topic, "event loop");
+    }
+    
+    if (fetch_report("BUSY", report, sizeof(report)) > 0) printf("\n%s", report);
+    
+    WSACleanup();
+    return 0;
+}
+
+// Accepts a comma separated list of positive rates such as "100,1000,10000"
+int parse_rates(const char* list) {
+    rate_count = 0;
+    while (*list) {
+        char* end;
+        long rate = strtol(list, &end, 10);
+        if (end == list || rate <= 0 || rate > 1000000 || rate_count == MAX_RATES) return -1;
+        rates[rate_count++] = (int)rate;
+        if (*end == '\0') break;
+        if (*end != ',') return -1;
+        list = end + 1;
+    }
+    return rate_count > 0 ? 0 : -1;
+}
+
+void run_round(int rate, const char* topic, const char* mode) {
+    Round round;
+    memset(&round, 0, sizeof(round));
+    round.rate = rate;
+    round.counts = (LONG64*)calloc(BUCKETS, sizeof(LONG64));
+    if (round.counts == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    round.subscriber = connect_and_register("SUBSCRIBER", topic);
+    round.publisher = connect_and_register("PUBLISHER", topic);
+    running = 1;
+    measuring = 0;
+    
+    HANDLE threads[2];
+    threads[0] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &round, 0, NULL);
+    threads[1] = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, &round, 0, NULL);
+    
+    // The first half second moves the connections to their worker and warms up
+    Sleep(500);
+    measuring = 1;
+    Sleep(seconds * 1000);
+    measuring = 0;
+    running = 0;
+    
+    // Closing the sockets ends any recv still in progress
+    closesocket(round.publisher);
+    closesocket(round.subscriber);
+    for (int t = 0; t < 2; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+    
+    LONG64 highest = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        if (round.counts[b] > 0) highest = b;
+    }
+    printf("%7d  %-10s  %10lld", rate, mode, (long long)round.received);
+    if (round.received > 0) {
+        printf("  %7.0f  %7.0f  %7.0f  %8.0f  %7.0f", percentile(round.counts, round.received, 0.50),
+               percentile(round.counts, round.received, 0.90), percentile(round.counts, round.received, 0.99),
+               percentile(round.counts, round.received, 0.999), (highest + 1) * (double)BUCKET_US);
+    }
+    printf("\n");
+    free(round.counts);
+}
+
+SOCKET connect_and_register(const char* type, const char* topic) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    // Every message is sent on its own, as a low-rate feed would
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, topic);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Reads a STATS report into out. Returns its length, 0 if there is none.
+int fetch_report(const char* name, char* out, int size) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        return 0;
+    }
+    
+    char request[64];
+    snprintf(request, sizeof(request), "STATS:%s\n", name);
+    send(sock, request, strlen(request), 0);
+    
+    int len = 0, received;
+    while (len < size - 1 && (received = recv(sock, out + len, size - 1 - len, 0)) > 0) len += received;
+    out[len] = '\0';
+    closesocket(sock);
+    return (strncmp(out, "Unknown report", 14) == 0) ? 0 : len;
+}
+
+// Sends one timestamped message at a time, on a fixed schedule of rate
+// messages per second. It sleeps while the next send is far off and
+// yields the CPU in the last SPIN_AHEAD_US, so sends are on time without
+// taking a CPU from the server.
+unsigned __stdcall publisher_thread(void* arg) {
+    Round* round = (Round*)arg;
+    char message[BUFFER_SIZE];
+    double interval_us = 1e6 / round->rate;
+    LONGLONG start = now_ticks();
+    
+    while (running) {
+        double due_us = round->sent * interval_us;
+        double now_us = (now_ticks() - start) * us_per_tick;
+        if (now_us < due_us) {
+            if (due_us - now_us > SPIN_AHEAD_US) {
+                Sleep(1);
+            } else {
+                SwitchToThread();
+            }
+            continue;
+        }
+        
+        // A publisher that fell behind does not catch up in a burst
+        if (now_us - due_us > interval_us) round->sent = (LONG64)(now_us / interval_us);
+        
+        int stamp_len = snprintf(message, sizeof(message), "%lld ", (long long)now_ticks());
+        memset(message + stamp_len, 'x', message_size - stamp_len - 1);
+        message[message_size - 1] = '\n';
+        if (send(round->publisher, message, message_size, 0) == SOCKET_ERROR) break;
+        round->sent++;
+    }
+    return 0;
+}
+
+// Lines look like "[TOPIC] Publisher X: <ticks> xxx"
+unsigned __stdcall subscriber_thread(void* arg) {
+    Round* round = (Round*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    char line[2 * BUFFER_SIZE];
+    int line_len = 0;
+    
+    while (running) {
+        int bytes_received = recv(round->subscriber, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) break;
+        
+        LONGLONG now = now_ticks();
+        for (int i = 0; i < bytes_received; i++) {
+            if (line_len < (int)sizeof(line) - 1) line[line_len++] = buffer[i];
+            if (buffer[i] != '\n') continue;
+            
+            line[line_len] = '\0';
+            line_len = 0;
+            const char* payload = strstr(line, ": ");
+            if (payload == NULL || !measuring) continue;
+            
+            double latency_us = (now - _atoi64(payload + 2)) * us_per_tick;
+            int bucket = (int)(latency_us / BUCKET_US);
+            if (bucket < 0) bucket = 0;
+            if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+            round->counts[bucket]++;
+            round->received++;
+        }
+    }
+    return 0;
+}
+
+// Upper edge of the bucket holding the given fraction of all samples
+double percentile(const LONG64* counts, LONG64 total, double fraction) {
+    LONG64 target = (LONG64)(total * fraction);
+    LONG64 seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > target) return (b + 1) * (double)BUCKET_US;
+    }
+    return BUCKETS * (double)BUCKET_US;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--seconds N] [--size BYTES] [--topic TOPIC] [--rates LIST]\n", program_name);
+    printf("Publishes timestamped messages one at a time at each rate of --rates (default\n");
+    printf("100,1000,10000 per second), first on --topic (default LOWLAT), which the server\n");
+    printf("should busy-poll, then on EVENTLOOP, which it serves from its ordinary workers.\n");
+    printf("Reports the end-to-end latency percentiles of each round.\n");
+    printf("Examples:\n");
+    printf("  server.exe 5000 --quiet --busy-poll LOWLAT --busy-poll-cpus 3\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --seconds 10 --rates 100,500,2000\n", program_name);
+}
@@ -0,0 +1,258 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define READ_BUFFER_SIZE (1 << 20)
+#define REPORT_SIZE 65536
+
+// Global variables
+const char* server_ip;
+int port;
+const char* topic = "REPLAY";
+int message_count = 200000;
+int payload_size = 500;
+int passes = 3;
+
+double us_per_tick;
+
+// Function prototypes
+SOCKET connect_and_register(const char* registration, char* reply, int reply_size);
+int fetch_log_report(char* out, int size);
+LONGLONG logged_bytes(const char* report, const char* log_topic);
+void catch_up_counters(const char* report, LONGLONG* zero_copy, LONGLONG* copied);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            topic = argv[++i];
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            message_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            payload_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--passes") == 0 && i + 1 < argc) {
+            passes = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (message_count < 1 || passes < 1 || payload_size < 1 || payload_size > BUFFER_SIZE - 200) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    char* report = (char*)malloc(REPORT_SIZE);
+    char* buffer = (char*)malloc(READ_BUFFER_SIZE);
+    if (report == NULL || buffer == NULL) return 1;
+    
+    // A fresh topic, so the log holds exactly what is published here
+    char log_topic[128];
+    char registration[256];
+    char reply[64];
+    snprintf(log_topic, sizeof(log_topic), "%s.%lu", topic, (unsigned long)GetCurrentProcessId());
+    snprintf(registration, sizeof(registration), "PUBLISHER:%s", log_topic);
+    SOCKET publisher = connect_and_register(registration, reply, sizeof(reply));
+    if (strncmp(reply, "OK ", 3) != 0) {
+        printf("Registration failed: %s", reply);
+        return 1;
+    }
+    int publisher_id = atoi(reply + 3);
+    
+    // Subscribers receive "[TOPIC] Publisher ID: payload\n"
+    char prefix[256];
+    int line_length = snprintf(prefix, sizeof(prefix), "[%s] Publisher %d: ", log_topic, publisher_id) + payload_size + 1;
+    LONGLONG expected = (LONGLONG)message_count * line_length;
+    
+    char* batch = (char*)malloc(64 * (payload_size + 1));
+    if (batch == NULL) return 1;
+    for (int n = 0; n < 64; n++) {
+        memset(batch + n * (payload_size + 1), 'x', payload_size);
+        batch[n * (payload_size + 1) + payload_size] = '\n';
+    }
+    
+    printf("Publishing %d messages of %d bytes (%.1f MB of log) to '%s'...\n",
+           message_count, payload_size, expected / 1048576.0, log_topic);
+    for (int i = 0; i < message_count; i += 64) {
+        int lines = (message_count - i < 64) ? message_count - i : 64;
+        if (send(publisher, batch, lines * (payload_size + 1), 0) == SOCKET_ERROR) {
+            printf("Publish failed. Error: %d\n", WSAGetLastError());
+            return 1;
+        }
+    }
+    
+    // Catch-up only measures the log once every message is in it
+    LONGLONG start = now_ticks();
+    while (1) {
+        if (fetch_log_report(report, REPORT_SIZE) != 0) return 1;
+        LONGLONG logged = logged_bytes(report, log_topic);
+        if (logged < 0 && strstr(report, "disabled") != NULL) {
+            printf("The server has no topic log; start it with --log-dir\n");
+            return 1;
+        }
+        if (logged >= expected) break;
+        if ((now_ticks() - start) * us_per_tick > 120e6) {
+            printf("Timed out with %lld of %lld bytes logged\n", (long long)logged, (long long)expected);
+            return 1;
+        }
+        Sleep(50);
+    }
+    
+    printf("pass       MB   seconds     GB/s  user-space copies/byte\n");
+    snprintf(registration, sizeof(registration), "SUBSCRIBER:%s@0", log_topic);
+    for (int pass = 1; pass <= passes; pass++) {
+        LONGLONG zero_before, copied_before, zero_after, copied_after;
+        fetch_log_report(report, REPORT_SIZE);
+        catch_up_counters(report, &zero_before, &copied_before);
+        
+        LONGLONG pass_start = now_ticks();
+        SOCKET subscriber = connect_and_register(registration, reply, sizeof(reply));
+        LONGLONG received = 0;
+        while (received < expected) {
+            int bytes = recv(subscriber, buffer, READ_BUFFER_SIZE, 0);
+            if (bytes <= 0) {
+                printf("Catch-up ended after %lld of %lld bytes\n", (long long)received, (long long)expected);
+                return 1;
+            }
+            received += bytes;
+        }
+        double seconds = (now_ticks() - pass_start) * us_per_tick / 1e6;
+        closesocket(subscriber);
+        
+        // The session counts its bytes once they are handed to the socket
+        Sleep(100);
+        fetch_log_report(report, REPORT_SIZE);
+        catch_up_counters(report, &zero_after, &copied_after);
+        LONGLONG zero_copy = zero_after - zero_before;
+        LONGLONG copied = copied_after - copied_before;
+        
+        printf("%4d  %7.1f  %8.3f  %7.2f  %22.2f\n", pass, received / 1048576.0, seconds,
+               received / seconds / 1e9, (zero_copy + copied) > 0 ? 2.0 * copied / (zero_copy + copied) : 0.0);
+    }
+    
+    closesocket(publisher);
+    free(batch);
+    free(buffer);
+    free(report);
+    WSACleanup();
+    return 0;
+}
+
+// Registers and stores the server's one-line reply
+SOCKET connect_and_register(const char* registration, char* reply, int reply_size) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[256];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    
+    int length = 0;
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+        if (length < reply_size - 1) reply[length++] = c;
+    } while (c != '\n');
+    reply[length] = '\0';
+    return sock;
+}
+
+// Reads the whole "STATS:LOG" report
+int fetch_log_report(char* out, int size) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        return -1;
+    }
+    send(sock, "STATS:LOG\n", 10, 0);
+    
+    int length = 0;
+    int bytes;
+    while (length < size - 1 && (bytes = recv(sock, out + length, size - 1 - length, 0)) > 0) {
+        length += bytes;
+    }
+    out[length] = '\0';
+    closesocket(sock);
+    return 0;
+}
+
+// End offset of a topic in "  TOPIC: offsets A to B in ..." lines, -1 if absent
+LONGLONG logged_bytes(const char* report, const char* log_topic) {
+    char key[160];
+    snprintf(key, sizeof(key), "  %s: offsets ", log_topic);
+    const char* line = strstr(report, key);
+    if (line == NULL) return -1;
+    
+    long long first, end;
+    if (sscanf(line + strlen(key), "%lld to %lld", &first, &end) != 2) return -1;
+    return end;
+}
+
+// Totals of "Catch-up bytes: X zero-copy, Y through user space"
+void catch_up_counters(const char* report, LONGLONG* zero_copy, LONGLONG* copied) {
+    long long x = 0, y = 0;
+    const char* line = strstr(report, "Catch-up bytes: ");
+    if (line != NULL) sscanf(line, "Catch-up bytes: %lld zero-copy, %lld through user space", &x, &y);
+    *zero_copy = x;
+    *copied = y;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--messages N] [--size BYTES] [--passes N] [--topic T]\n", program_name);
+    printf("Fills a fresh topic log and replays it from offset 0 with catch-up\n");
+    printf("subscribers, reporting replay throughput and how many times each byte was\n");
+    printf("copied through user space on the broker. The server needs --log-dir; run it\n");
+    printf("once more with --catchup-copy to compare against read-and-send.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --messages 1000000 --size 200 --passes 5\n", program_name);
+}
@@ -0,0 +1,562 @@
+// The server itself is compiled into the benchmark, so the routing and
+// parsing code runs in-process without a network round trip; its main()
+// is renamed out of the way of this one
+#define main server_main
+#include "server.c"
+#undef main
+
+#define MAX_COUNTS 16
+#define MAX_RESULTS 128
+#define BATCH 64                   // Operations between two clock readings
+#define BACKGROUND_TOPICS 16
+#define FANOUT_TOPIC "FANOUT"
+#define PAYLOAD_TOPIC "PAYLOAD"
+#define CHURN_TOPIC "CHURN"
+#define MISSING_TOPIC "NO-POLICY"
+#define DEDUP_TOPIC "DEDUP"
+
+// One measured case of the suite
+typedef struct {
+    char name[32];
+    int param;
+    LONGLONG ops;
+    double ns_per_op;
+    double cycles_per_op;
+    double allocs_per_op;          // System allocator calls: malloc, calloc, realloc
+    double pool_per_op;            // Message buffers taken from the pool
+} Result;
+
+// Global variables
+int table_sizes[MAX_COUNTS] = { 16, 256, 4096, 32768 };
+int table_count = 4;
+int policy_counts[MAX_COUNTS] = { 1, 16, 64 };
+int policy_count = 3;
+int fanouts[MAX_COUNTS] = { 1, 10, 100, 1000 };
+int fanout_count = 4;
+int payload_sizes[MAX_COUNTS] = { 16, 64, 256, 1024, 4096 };
+int payload_count = 5;
+int populations[MAX_COUNTS] = { 100, 1000, 4000 };
+int population_count = 3;
+int producer_totals[MAX_COUNTS] = { 1, 1000, 50000 };
+int producer_total_count = 3;
+int slots = DEFAULT_MAX_CLIENTS;
+int background = 1000;             // Subscribers of other topics during the fan-out sweep
+int case_ms = 200;
+const char* json_path = NULL;
+const char* baseline_path = NULL;
+double threshold = 10.0;           // Percent slower than the baseline that counts as a regression
+
+Result results[MAX_RESULTS];
+int result_count = 0;
+Result baseline[MAX_RESULTS];
+int baseline_count = 0;
+
+SOCKET sink = INVALID_SOCKET;
+struct sockaddr_in sink_address;
+char (*topic_table)[MAX_TOPIC_LENGTH] = NULL;
+int table_size = 0;
+int* fanout_slots = NULL;
+int fanout_size = 0;
+int* background_slots = NULL;
+int background_size = 0;
+int churn_route_id = 0;            // Held for the whole run
+Message* fanout_message = NULL;
+char payload[65536];
+int payload_size = 0;
+struct Producer** bench_producers = NULL;
+UINT64* producer_sequences = NULL;     // Highest sequence sent by each producer
+int producer_size = 0;
+char report[STATS_REPORT_SIZE];
+volatile LONG64 checksum = 0;      // Keeps results of the measured calls alive
+
+LONG64 heap_allocations = 0;
+LONG64 pool_allocations = 0;
+double us_per_tick;
+
+// Function prototypes
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* block, size_t size);
+void* __real_pool_alloc(int size);
+int open_sink();
+int add_subscriber(const char* topic);
+void drop_subscriber(int slot);
+int set_fanout(int count);
+int set_background(int count);
+void drain_fanout();
+void op_topic_id(int i);
+void op_topic_policy(int i);
+void op_fanout(int i);
+void op_payload(int i);
+int set_producers(int count);
+void op_dedup_new(int i);
+void op_dedup_duplicate(int i);
+void op_churn(int i);
+void op_subscriber_count(int i);
+void op_queue_report(int i);
+void measure(const char* name, int param, void (*op)(int), void (*after_batch)());
+int read_baseline(const char* path);
+const Result* find_baseline(const char* name, int param);
+int write_json(const char* path);
+int parse_counts(const char* list, int* counts, int* total, int min, int max);
+LONGLONG now_ticks();
+void print_bench_usage(const char* program_name);
+
+// The linker sends every allocation of the server code through these
+// (-Wl,--wrap), which is how allocations per operation are counted
+void* __wrap_malloc(size_t size) {
+    heap_allocations++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    heap_allocations++;
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* block, size_t size) {
+    heap_allocations++;
+    return __real_realloc(block, size);
+}
+
+void* __wrap_pool_alloc(int size) {
+    pool_allocations++;
+    return __real_pool_alloc(size);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        int ok = 1;
+        if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], table_sizes, &table_count, 1, 60000) == 0);
+        } else if (strcmp(argv[i], "--policies") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], policy_counts, &policy_count, 0, MAX_TOPIC_POLICIES) == 0);
+        } else if (strcmp(argv[i], "--fanout") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], fanouts, &fanout_count, 1, 1000000) == 0);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], payload_sizes, &payload_count, 1, (int)sizeof(payload)) == 0);
+        } else if (strcmp(argv[i], "--population") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], populations, &population_count, 0, 1000000) == 0);
+        } else if (strcmp(argv[i], "--producers") == 0 && i + 1 < argc) {
+            ok = (parse_counts(argv[++i], producer_totals, &producer_total_count, 1, DEFAULT_MAX_PRODUCERS) == 0);
+        } else if (strcmp(argv[i], "--slots") == 0 && i + 1 < argc) {
+            slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--background") == 0 && i + 1 < argc) {
+            background = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ms") == 0 && i + 1 < argc) {
+            case_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            print_bench_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    int most_fanout = 0, most_population = 0;
+    for (int f = 0; f < fanout_count; f++) if (fanouts[f] > most_fanout) most_fanout = fanouts[f];
+    for (int p = 0; p < population_count; p++) if (populations[p] > most_population) most_population = populations[p];
+    if (case_ms < 1 || background < 0 || threshold <= 0 || most_fanout + background + 1 > slots ||
+        most_population + 1 > slots) {
+        print_bench_usage(argv[0]);
+        return 1;
+    }
+    if (baseline_path != NULL && read_baseline(baseline_path) != 0) {
+        printf("Cannot read baseline %s\n", baseline_path);
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    // A broker with no workers or listener: the client table and the
+    // modules registration and routing need
+    verbose = 0;
+    max_clients = slots;
+    initialize_server();
+    fanout_slots = (int*)malloc(slots * sizeof(int));
+    background_slots = (int*)malloc(slots * sizeof(int));
+    if (fanout_slots == NULL || background_slots == NULL || start_timers() != 0 || start_requests() != 0 ||
+        open_sink() != 0) {
+        printf("Cannot set up %d client slots\n", slots);
+        return 1;
+    }
+    for (int i = 0; i < (int)sizeof(payload); i++) payload[i] = 'a' + i % 26;
+    
+    printf("In-process routing core: %d client slots, %d ms per case\n", slots, case_ms);
+    printf("%-16s %7s %10s %10s %10s %10s %8s", "case", "param", "ops", "ns/op", "cycles/op", "allocs/op", "pool/op");
+    if (baseline_path != NULL) printf(" %12s %8s", "baseline ns", "change");
+    printf("\n");
+    
+    // Fan-out: one message to N subscribers of its topic among the
+    // background subscribers of others
+    if (set_background(background) != 0) return 1;
+    fanout_message = create_topic_message(FANOUT_TOPIC, payload, 64, 1, 0);
+    for (int f = 0; f < fanout_count; f++) {
+        if (set_fanout(fanouts[f]) != 0) return 1;
+        measure("fanout", fanouts[f], op_fanout, drain_fanout);
+    }
+    if (set_fanout(0) != 0) return 1;
+    
+    // Formatting a publish and converting it to a wire frame
+    for (int s = 0; s < payload_count; s++) {
+        payload_size = payload_sizes[s];
+        measure("payload", payload_size, op_payload, NULL);
+    }
+    
+    // Deduplication of a named producer's publish, in order and resent,
+    // spread over N producers so their windows do not stay in cache
+    for (int p = 0; p < producer_total_count; p++) {
+        if (set_producers(producer_totals[p]) != 0) return 1;
+        measure("dedup_new", producer_size, op_dedup_new, NULL);
+        measure("dedup_duplicate", producer_size, op_dedup_duplicate, NULL);
+    }
+    
+    // Registration churn and statistics over a growing client table
+    churn_route_id = wire_topic_id(CHURN_TOPIC);
+    for (int p = 0; p < population_count; p++) {
+        if (set_background(populations[p]) != 0) return 1;
+        measure("register_churn", populations[p], op_churn, NULL);
+        measure("subscriber_count", populations[p], op_subscriber_count, NULL);
+        measure("queue_report", populations[p], op_queue_report, NULL);
+    }
+    
+    // Topic lookups last: every topic of the table stays held, as by its
+    // subscribers, policies are never taken back, and every publish looks
+    // up its topic's policy
+    for (int t = 0; t < table_count; t++) {
+        topic_table = realloc(topic_table, (size_t)table_sizes[t] * MAX_TOPIC_LENGTH);
+        if (topic_table == NULL) return 1;
+        for (; table_size < table_sizes[t]; table_size++) {
+            snprintf(topic_table[table_size], MAX_TOPIC_LENGTH, "topic.%d", table_size);
+            if (wire_topic_id(topic_table[table_size]) == 0) {
+                printf("No topic ids left for %d topics\n", table_sizes[t]);
+                return 1;
+            }
+        }
+        measure("topic_id", table_size, op_topic_id, NULL);
+    }
+    for (int p = 0; p < policy_count; p++) {
+        while (topic_policy_count < policy_counts[p]) {
+            char topic[MAX_TOPIC_LENGTH];
+            snprintf(topic, sizeof(topic), "policy.%d", topic_policy_count);
+            if (add_topic_policy(topic) == NULL) return 1;
+        }
+        measure("topic_policy", topic_policy_count, op_topic_policy, NULL);
+    }
+    
+    if (json_path != NULL && write_json(json_path) != 0) {
+        printf("Cannot write %s\n", json_path);
+        return 1;
+    }
+    
+    // Slower than the baseline by more than the threshold, or allocating more
+    int regressions = 0;
+    for (int r = 0; r < result_count; r++) {
+        const Result* base = find_baseline(results[r].name, results[r].param);
+        if (base == NULL) continue;
+        if (results[r].ns_per_op > base->ns_per_op * (1.0 + threshold / 100.0) ||
+            results[r].allocs_per_op > base->allocs_per_op + 0.01) {
+            regressions++;
+        }
+    }
+    if (baseline_path != NULL) {
+        printf("%d of %d cases regressed against %s (more than %.0f%% slower or more allocations)\n",
+               regressions, result_count, baseline_path, threshold);
+    }
+    return regressions > 0 ? 2 : 0;
+}
+
+// Acknowledgements of registrations go to a UDP socket connected to
+// itself, so they need no peer; datagrams it has no room for are dropped
+int open_sink() {
+    sink = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sink == INVALID_SOCKET) return -1;
+    
+    int length = sizeof(sink_address);
+    memset(&sink_address, 0, sizeof(sink_address));
+    sink_address.sin_family = AF_INET;
+    sink_address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sink, (struct sockaddr*)&sink_address, sizeof(sink_address)) != 0 ||
+        getsockname(sink, (struct sockaddr*)&sink_address, &length) != 0 ||
+        connect(sink, (struct sockaddr*)&sink_address, sizeof(sink_address)) != 0) {
+        return -1;
+    }
+    u_long nonblocking = 1;
+    ioctlsocket(sink, FIONBIO, &nonblocking);
+    return 0;
+}
+
+// Takes a slot and registers it the way a connection's first line does.
+// Returns the slot, or -1.
+int add_subscriber(const char* topic) {
+    int slot = add_client(0, sink, sink_address);
+    if (slot == -1) return -1;
+    
+    char buffer[BUFFER_SIZE];
+    int length = snprintf(buffer, sizeof(buffer), "SUBSCRIBER:%s\n", topic);
+    if (register_client(&clients[slot], buffer, length) != 1) return -1;
+    return slot;
+}
+
+// Removes a subscriber; marked as a session, its slot leaves the shared
+// sink socket open
+void drop_subscriber(int slot) {
+    clients[slot].carrier = slot;
+    remove_client(slot);
+}
+
+// Subscribers of the fan-out topic look like slow consumers with a write
+// in progress, so every delivery is queued and none touches a socket
+int set_fanout(int count) {
+    for (; fanout_size > count; fanout_size--) drop_subscriber(fanout_slots[fanout_size - 1]);
+    for (; fanout_size < count; fanout_size++) {
+        int slot = add_subscriber(FANOUT_TOPIC);
+        if (slot == -1) {
+            printf("Cannot add fan-out subscriber %d\n", fanout_size + 1);
+            return -1;
+        }
+        clients[slot].out.pending = 1;
+        clients[slot].write_requested = 1;
+        fanout_slots[fanout_size] = slot;
+    }
+    return 0;
+}
+
+int set_background(int count) {
+    for (; background_size > count; background_size--) drop_subscriber(background_slots[background_size - 1]);
+    for (; background_size < count; background_size++) {
+        char topic[MAX_TOPIC_LENGTH];
+        snprintf(topic, sizeof(topic), "background.%d", background_size % BACKGROUND_TOPICS);
+        int slot = add_subscriber(topic);
+        if (slot == -1) {
+            printf("Cannot add background subscriber %d\n", background_size + 1);
+            return -1;
+        }
+        background_slots[background_size] = slot;
+    }
+    return 0;
+}
+
+// Lets go of the messages queued by the last batch, as a worker flushing
+// the queues would, keeping each lane's ring for the next batch
+void drain_fanout() {
+    for (int s = 0; s < fanout_size; s++) {
+        OutboundQueue* queue = &clients[fanout_slots[s]].out;
+        for (int p = 0; queue->lanes != NULL && p < PRIORITY_CLASSES; p++) {
+            OutboundLane* lane = &queue->lanes[p];
+            for (; lane->head < lane->tail; lane->head++) {
+                message_release(lane->ring[lane->head & (lane->capacity - 1)]);
+            }
+        }
+        queue->pending = 1;
+    }
+}
+
+// The reference a publish takes for its message and drops once it is out
+void op_topic_id(int i) {
+    int id = wire_topic_id(topic_table[i % table_size]);
+    checksum += id;
+    wire_topic_release(id);
+}
+
+// Most topics have no policy, so the whole table is searched
+void op_topic_policy(int i) {
+    checksum += (find_topic_policy(MISSING_TOPIC) != NULL);
+}
+
+void op_fanout(int i) {
+    message_retain(fanout_message);
+    broadcast_to_topic_subscribers(fanout_message, FANOUT_TOPIC, -1, NULL);
+}
+
+// What a publish costs before fan-out: the text line, and the frame for
+// binary subscribers made from it on first use
+void op_payload(int i) {
+    Message* message = create_topic_message(PAYLOAD_TOPIC, payload, payload_size, 1, 0);
+    if (message == NULL) return;
+    checksum += message_encoded(message, 1)->length;
+    message_release(message);
+}
+
+// A subscriber connects, registers and leaves
+// Producers are never taken back, so the table only grows
+int set_producers(int count) {
+    bench_producers = (struct Producer**)realloc(bench_producers, count * sizeof(struct Producer*));
+    producer_sequences = (UINT64*)realloc(producer_sequences, count * sizeof(UINT64));
+    if (bench_producers == NULL || producer_sequences == NULL) return -1;
+    
+    for (; producer_size < count; producer_size++) {
+        char name[MAX_PRODUCER_LENGTH];
+        snprintf(name, sizeof(name), "producer.%d", producer_size);
+        bench_producers[producer_size] = dedup_producer(DEDUP_TOPIC, name);
+        if (bench_producers[producer_size] == NULL) {
+            printf("Cannot add producer %d\n", producer_size + 1);
+            return -1;
+        }
+        producer_sequences[producer_size] = 0;
+    }
+    return 0;
+}
+
+void op_dedup_new(int i) {
+    int p = i % producer_size;
+    checksum += dedup_accept(bench_producers[p], ++producer_sequences[p]);
+}
+
+// A retransmission of one of the producer's last 64 sequences
+void op_dedup_duplicate(int i) {
+    int p = i % producer_size;
+    UINT64 back = (UINT64)(i / producer_size) % 64;
+    UINT64 sequence = (producer_sequences[p] > back) ? producer_sequences[p] - back : 1;
+    checksum += dedup_accept(bench_producers[p], sequence);
+}
+
+void op_churn(int i) {
+    int slot = add_subscriber(CHURN_TOPIC);
+    if (slot != -1) drop_subscriber(slot);
+}
+
+void op_subscriber_count(int i) {
+    checksum += count_subscribers_by_topic(churn_route_id);
+}
+
+void op_queue_report(int i) {
+    checksum += queue_report(report, sizeof(report));
+}
+
+// Runs batches of the operation for case_ms after one batch to warm up,
+// timing only the batches themselves, and records and prints the result
+void measure(const char* name, int param, void (*op)(int), void (*after_batch)()) {
+    int next = 0;
+    for (int b = 0; b < BATCH; b++) op(next++);
+    if (after_batch != NULL) after_batch();
+    
+    LONGLONG ticks = 0, ops = 0, allocations = 0, pooled = 0;
+    ULONG64 cycles = 0;
+    LONGLONG limit = (LONGLONG)(case_ms * 1000.0 / us_per_tick);
+    while (ticks < limit) {
+        LONG64 heap_before = heap_allocations, pool_before = pool_allocations;
+        ULONG64 cycles_before, cycles_after;
+        QueryThreadCycleTime(GetCurrentThread(), &cycles_before);
+        LONGLONG start = now_ticks();
+        for (int b = 0; b < BATCH; b++) op(next++);
+        ticks += now_ticks() - start;
+        QueryThreadCycleTime(GetCurrentThread(), &cycles_after);
+        cycles += cycles_after - cycles_before;
+        allocations += heap_allocations - heap_before;
+        pooled += pool_allocations - pool_before;
+        ops += BATCH;
+        if (after_batch != NULL) after_batch();
+    }
+    
+    if (result_count == MAX_RESULTS) return;
+    Result* result = &results[result_count++];
+    snprintf(result->name, sizeof(result->name), "%s", name);
+    result->param = param;
+    result->ops = ops;
+    result->ns_per_op = ticks * us_per_tick * 1000.0 / ops;
+    result->cycles_per_op = (double)cycles / ops;
+    result->allocs_per_op = (double)allocations / ops;
+    result->pool_per_op = (double)pooled / ops;
+    
+    printf("%-16s %7d %10lld %10.1f %10.0f %10.2f %8.2f", name, param, (long long)ops,
+           result->ns_per_op, result->cycles_per_op, result->allocs_per_op, result->pool_per_op);
+    const Result* base = find_baseline(name, param);
+    if (base != NULL) {
+        double change = (result->ns_per_op / base->ns_per_op - 1.0) * 100.0;
+        int regressed = (change > threshold || result->allocs_per_op > base->allocs_per_op + 0.01);
+        printf(" %12.1f %+7.1f%%%s", base->ns_per_op, change, regressed ? "  REGRESSION" : "");
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+// Reads a file written by --json; each result is on a line of its own
+int read_baseline(const char* path) {
+    FILE* file = fopen(path, "r");
+    if (file == NULL) return -1;
+    
+    char line[512];
+    while (fgets(line, sizeof(line), file) != NULL && baseline_count < MAX_RESULTS) {
+        Result* base = &baseline[baseline_count];
+        if (sscanf(line, " {\"case\": \"%31[^\"]\", \"param\": %d, \"ops\": %lld, \"ns_per_op\": %lf, "
+                   "\"cycles_per_op\": %lf, \"allocs_per_op\": %lf, \"pool_allocs_per_op\": %lf",
+                   base->name, &base->param, &base->ops, &base->ns_per_op, &base->cycles_per_op,
+                   &base->allocs_per_op, &base->pool_per_op) == 7) {
+            baseline_count++;
+        }
+    }
+    fclose(file);
+    return baseline_count > 0 ? 0 : -1;
+}
+
+const Result* find_baseline(const char* name, int param) {
+    for (int b = 0; b < baseline_count; b++) {
+        if (baseline[b].param == param && strcmp(baseline[b].name, name) == 0) return &baseline[b];
+    }
+    return NULL;
+}
+
+int write_json(const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return -1;
+    
+    fprintf(file, "{\n  \"suite\": \"bench_core\",\n  \"slots\": %d,\n  \"case_ms\": %d,\n  \"results\": [\n", slots, case_ms);
+    for (int r = 0; r < result_count; r++) {
+        const Result* result = &results[r];
+        fprintf(file, "    {\"case\": \"%s\", \"param\": %d, \"ops\": %lld, \"ns_per_op\": %.2f, "
+                "\"cycles_per_op\": %.1f, \"allocs_per_op\": %.3f, \"pool_allocs_per_op\": %.3f}%s\n",
+                result->name, result->param, (long long)result->ops, result->ns_per_op, result->cycles_per_op,
+                result->allocs_per_op, result->pool_per_op, (r + 1 < result_count) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+int parse_counts(const char* list, int* counts, int* total, int min, int max) {
+    *total = 0;
+    while (*list && *total < MAX_COUNTS) {
+        int count = atoi(list);
+        if (count < min || count > max) return -1;
+        counts[(*total)++] = count;
+        list = strchr(list, ',');
+        if (list == NULL) break;
+        list++;
+    }
+    return *total > 0 ? 0 : -1;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_bench_usage(const char* program_name) {
+    printf("Usage: %s [--fanout 1,10,100,1000] [--background N] [--sizes 16,64,256,1024,4096]\n", program_name);
+    printf("       [--population 100,1000,4000] [--topics 16,256,4096,32768] [--policies 1,16,64]\n");
+    printf("       [--producers 1,1000,50000] [--slots N] [--ms N] [--json FILE] [--baseline FILE]\n");
+    printf("       [--threshold PERCENT]\n");
+    printf("Runs the broker's routing and parsing code in-process, without connections:\n");
+    printf("fan-out of one message to --fanout subscribers among --background others,\n");
+    printf("formatting publishes of --sizes bytes, deduplication of new and resent\n");
+    printf("sequences of --producers named producers, registration churn, subscriber counts\n");
+    printf("and the QUEUES report with --population clients, and topic id and policy\n");
+    printf("lookups in tables of --topics and --policies entries. Each case runs for --ms\n");
+    printf("and reports ns, cycles, system allocations and pool buffers per operation.\n");
+    printf("--json writes the results; --baseline compares with such a file and exits\n");
+    printf("with 2 if a case is more than --threshold percent slower or allocates more.\n");
+    printf("Examples:\n");
+    printf("  %s\n", program_name);
+    printf("  %s --json before.json\n", program_name);
+    printf("  %s --baseline before.json --threshold 5\n", program_name);
+}
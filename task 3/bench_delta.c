@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_FIELDS 64
+#define DELTA_MIN_MATCH 4
+#define WINDOW 64                  // Snapshots on their way at most
+
+// A subscriber's end of a round
+typedef struct {
+    SOCKET socket;
+    int delta;                     // Registered with /DELTA
+    volatile LONG received;
+    LONGLONG bytes;
+    LONGLONG decode_ticks;
+    int mismatches;
+} Subscriber;
+
+// Global variables
+const char* server_ip;
+int port;
+int messages = 20000;
+int fields = 32;
+char (*snapshots)[BUFFER_SIZE];    // Every payload of the round, as published
+
+double us_per_tick;
+
+// Function prototypes
+void run_round(int round, int changes);
+void make_snapshots(int changes);
+SOCKET connect_and_register(const char* registration);
+unsigned __stdcall subscriber_thread(void* arg);
+int apply_delta(const char* base, int base_len, const char* ops, int ops_len, char* out, int capacity);
+int read_encoding(LONGLONG* encoded, double* total_ns);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fields") == 0 && i + 1 < argc) {
+            fields = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    // Up to 16 bytes a field must fit a line
+    if (messages < 1 || fields < 1 || fields > MAX_FIELDS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    snapshots = malloc((size_t)messages * BUFFER_SIZE);
+    if (snapshots == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    
+    printf("%d snapshots of %d fields per round, one plain and one delta subscriber\n", messages, fields);
+    printf("changed  line bytes  delta bytes   saved  encode ns  decode ns  mismatches\n");
+    int changes[] = { 1, 2, 4, 8, fields };
+    for (int r = 0; r < 5; r++) {
+        if (changes[r] > fields) continue;
+        run_round(r, changes[r]);
+    }
+    
+    free(snapshots);
+    WSACleanup();
+    return 0;
+}
+
+// Snapshots of "fNN=value" fields; each one changes the given number of
+// random fields to values of 1 to 7 digits, so fields also grow and shrink
+void make_snapshots(int changes) {
+    int values[MAX_FIELDS];
+    srand(42);
+    for (int f = 0; f < fields; f++) values[f] = rand() % 100000;
+    
+    for (int m = 0; m < messages; m++) {
+        for (int c = 0; c < changes && m > 0; c++) {
+            int digits = 1 + rand() % 7;
+            int limit = 1;
+            for (int d = 0; d < digits; d++) limit *= 10;
+            values[rand() % fields] = (rand() * 32768 + rand()) % limit;
+        }
+        int len = snprintf(snapshots[m], BUFFER_SIZE, "snapshot");
+        for (int f = 0; f < fields && len < BUFFER_SIZE - 20; f++) {
+            len += snprintf(snapshots[m] + len, BUFFER_SIZE - len, " f%02d=%d", f, values[f]);
+        }
+        snprintf(snapshots[m] + len, BUFFER_SIZE - len, "\n");
+    }
+}
+
+// Publishes the round's snapshots on a topic of its own and measures what
+// both subscribers received. The server's encoding time is read from its
+// DELTA report before and after.
+void run_round(int round, int changes) {
+    make_snapshots(changes);
+    
+    char topic[32], registration[64];
+    snprintf(topic, sizeof(topic), "SNAPSHOTS%d", round);
+    Subscriber subscribers[2];
+    memset(subscribers, 0, sizeof(subscribers));
+    for (int s = 0; s < 2; s++) {
+        subscribers[s].delta = s;
+        snprintf(registration, sizeof(registration), "SUBSCRIBER%s:%s\n", s ? "/DELTA" : "", topic);
+        subscribers[s].socket = connect_and_register(registration);
+    }
+    snprintf(registration, sizeof(registration), "PUBLISHER:%s\n", topic);
+    SOCKET publisher = connect_and_register(registration);
+    
+    LONGLONG encoded_before = 0, encoded_after = 0;
+    double ns_before = 0, ns_after = 0;
+    read_encoding(&encoded_before, &ns_before);
+    
+    HANDLE threads[2];
+    for (int s = 0; s < 2; s++) {
+        threads[s] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &subscribers[s], 0, NULL);
+    }
+    
+    // Both subscribers must keep up, so neither is dropped as a slow consumer
+    for (int m = 0; m < messages; ) {
+        LONG slowest = subscribers[0].received < subscribers[1].received ? subscribers[0].received : subscribers[1].received;
+        if (m - slowest >= WINDOW) {
+            Sleep(0);
+            continue;
+        }
+        if (send(publisher, snapshots[m], (int)strlen(snapshots[m]), 0) == SOCKET_ERROR) {
+            printf("Publishing failed. Error: %d\n", WSAGetLastError());
+            exit(1);
+        }
+        m++;
+    }
+    for (int s = 0; s < 2; s++) {
+        WaitForSingleObject(threads[s], INFINITE);
+        CloseHandle(threads[s]);
+        closesocket(subscribers[s].socket);
+    }
+    closesocket(publisher);
+    read_encoding(&encoded_after, &ns_after);
+    
+    LONGLONG encoded = encoded_after - encoded_before;
+    double line_bytes = (double)subscribers[0].bytes / messages;
+    double delta_bytes = (double)subscribers[1].bytes / messages;
+    printf("%7d  %10.1f  %11.1f  %5.1f%%  %9.0f  %9.0f  %10d\n", changes, line_bytes, delta_bytes,
+           100.0 * (line_bytes - delta_bytes) / line_bytes,
+           encoded > 0 ? (ns_after - ns_before) / encoded : 0.0,
+           subscribers[1].decode_ticks * us_per_tick * 1000 / messages,
+           subscribers[0].mismatches + subscribers[1].mismatches);
+}
+
+SOCKET connect_and_register(const char* registration) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    send(sock, registration, strlen(registration), 0);
+    
+    char reply[128];
+    int len = 0;
+    do {
+        if (len == (int)sizeof(reply) - 1 || recv(sock, &reply[len], 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (reply[len++] != '\n');
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration rejected: %.*s", len, reply);
+        exit(1);
+    }
+    return sock;
+}
+
+// Reads every snapshot of the round. The plain subscriber gets lines; the
+// delta one gets "[TOPIC] Publisher ID DELTA|KEYFRAME SLOT VERSION LENGTH"
+// frames, and rebuilds each payload. Both compare what they got with what
+// was published.
+unsigned __stdcall subscriber_thread(void* arg) {
+    Subscriber* subscriber = (Subscriber*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    char payload[BUFFER_SIZE], rebuilt[BUFFER_SIZE];
+    int payload_length = 0;
+    long version = 0;
+    int used = 0;
+    
+    while (subscriber->received < messages) {
+        int bytes_received = recv(subscriber->socket, buffer + used, sizeof(buffer) - used, 0);
+        if (bytes_received <= 0) break;
+        used += bytes_received;
+        subscriber->bytes += bytes_received;
+        
+        int pos = 0;
+        while (pos < used) {
+            char* newline = (char*)memchr(buffer + pos, '\n', used - pos);
+            if (newline == NULL) break;
+            const char* body = newline + 1;
+            int body_length = (int)(newline - (buffer + pos)) + 1;
+            
+            if (subscriber->delta) {
+                char kind[16];
+                int slot, length;
+                long frame_version;
+                *newline = '\0';
+                if (sscanf(buffer + pos, "[%*[^]]] Publisher %*s %15s %d %ld %d", kind, &slot, &frame_version, &length) != 4) {
+                    printf("Unexpected line: %s\n", buffer + pos);
+                    exit(1);
+                }
+                *newline = '\n';
+                if (used - (int)(body - buffer) < length) break;
+                
+                LONGLONG started = now_ticks();
+                if (strcmp(kind, "KEYFRAME") == 0) {
+                    memcpy(payload, body, length);
+                    payload_length = length;
+                } else {
+                    int rebuilt_length = (version == frame_version - 1)
+                                         ? apply_delta(payload, payload_length, body, length, rebuilt, sizeof(rebuilt)) : -1;
+                    if (rebuilt_length < 0) {
+                        subscriber->mismatches++;
+                    } else {
+                        memcpy(payload, rebuilt, rebuilt_length);
+                        payload_length = rebuilt_length;
+                    }
+                }
+                subscriber->decode_ticks += now_ticks() - started;
+                version = frame_version;
+                body_length = (int)(body - (buffer + pos)) + length;
+            } else {
+                const char* colon = strstr(buffer + pos, ": ");
+                payload_length = (int)(newline + 1 - (colon + 2));
+                memcpy(payload, colon + 2, payload_length);
+            }
+            
+            LONG index = subscriber->received;
+            if (payload_length != (int)strlen(snapshots[index]) || memcmp(payload, snapshots[index], payload_length) != 0) {
+                subscriber->mismatches++;
+            }
+            InterlockedIncrement(&subscriber->received);
+            pos += body_length;
+        }
+        memmove(buffer, buffer + pos, used - pos);
+        used -= pos;
+    }
+    return 0;
+}
+
+// Op bytes below 0x80 are followed by op + 1 literal bytes; the others copy
+// (op & 0x7F) + DELTA_MIN_MATCH bytes of the base from the varint offset
+// that follows. Returns the rebuilt length, or -1 for a broken delta.
+int apply_delta(const char* base, int base_len, const char* ops, int ops_len, char* out, int capacity) {
+    int pos = 0, len = 0;
+    while (pos < ops_len) {
+        unsigned char op = (unsigned char)ops[pos++];
+        if (op < 0x80) {
+            int n = op + 1;
+            if (pos + n > ops_len || len + n > capacity) return -1;
+            memcpy(out + len, ops + pos, n);
+            pos += n;
+            len += n;
+            continue;
+        }
+        
+        unsigned int offset = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            if (pos == ops_len || shift > 28) return -1;
+            byte = (unsigned char)ops[pos++];
+            offset |= (unsigned int)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        
+        int n = (op & 0x7F) + DELTA_MIN_MATCH;
+        if (offset + n > (unsigned int)base_len || len + n > capacity) return -1;
+        memcpy(out + len, base + offset, n);
+        len += n;
+    }
+    return len;
+}
+
+// Reads "Encoding: N message(s), X ns per message" from the DELTA report
+int read_encoding(LONGLONG* encoded, double* total_ns) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) return -1;
+    send(sock, "STATS:DELTA\n", 12, 0);
+    
+    char report[4096];
+    int len = 0, n;
+    while (len < (int)sizeof(report) - 1 && (n = recv(sock, report + len, sizeof(report) - 1 - len, 0)) > 0) len += n;
+    report[len] = '\0';
+    closesocket(sock);
+    
+    const char* line = strstr(report, "Encoding: ");
+    long long count;
+    double ns;
+    if (line == NULL || sscanf(line, "Encoding: %lld message(s), %lf ns", &count, &ns) != 2) return -1;
+    *encoded = count;
+    *total_ns = count * ns;
+    return 0;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--messages N] [--fields N]\n", program_name);
+    printf("Publishes --messages snapshots of --fields numeric fields, changing 1, 2, 4, 8\n");
+    printf("and then all fields from one to the next, to a plain and a delta subscriber.\n");
+    printf("Reports the bytes each received per snapshot, the server's encoding time and\n");
+    printf("the delta subscriber's decoding time per snapshot, and checks every payload.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --messages 50000 --fields 16\n", program_name);
+}
@@ -0,0 +1,20 @@
+@echo off
+setlocal EnableDelayedExpansion
+rem Measures aggregate federation throughput with 1, 2 and 4 nodes on loopback.
+
+for %%N in (1 2 4) do (
+    set /A BASE=6000+%%N*10
+    call cluster.bat %%N !BASE! --quiet > nul
+    timeout /t 2 /nobreak > nul
+
+    set PORTS=
+    for /L %%i in (1,1,%%N) do (
+        set /A PORT=BASE+%%i-1
+        set PORTS=!PORTS! !PORT!
+    )
+    bench_federation.exe 127.0.0.1 !PORTS! --seconds 5
+    echo.
+
+    taskkill /IM server.exe /F > nul
+    timeout /t 1 /nobreak > nul
+)
@@ -0,0 +1,195 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_NODES 16
+#define MAX_TOPICS 64
+
+// One benchmark connection (publisher or subscriber) and its counters
+typedef struct {
+    int port;
+    char topic[32];
+    SOCKET socket;
+    volatile LONG64 messages;
+} BenchClient;
+
+// Global variables
+const char* server_ip;
+int ports[MAX_NODES];
+int node_count = 0;
+int seconds = 5;
+int message_size = 100;
+int topic_count = 8;
+volatile int running = 1;
+
+BenchClient publishers[MAX_TOPICS];
+BenchClient subscribers[MAX_TOPICS * 2];
+
+// Function prototypes
+SOCKET connect_and_register(const char* type, BenchClient* bench);
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+LONG64 total_messages(BenchClient* list, int count);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            topic_count = atoi(argv[++i]);
+        } else if (node_count < MAX_NODES && atoi(argv[i]) > 0) {
+            ports[node_count++] = atoi(argv[i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (node_count == 0 || topic_count < 1 || topic_count > MAX_TOPICS ||
+        message_size < 2 || message_size >= BUFFER_SIZE - 100) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    // Topic i is published on node i and subscribed on node i and its
+    // neighbour, so half of all deliveries cross the mesh when nodes > 1
+    int subscriber_count = 0;
+    for (int i = 0; i < topic_count; i++) {
+        for (int k = 0; k < 2; k++) {
+            BenchClient* sub = &subscribers[subscriber_count++];
+            sub->port = ports[(i + k) % node_count];
+            snprintf(sub->topic, sizeof(sub->topic), "BENCH_%d", i);
+            sub->socket = connect_and_register("SUBSCRIBER", sub);
+            CloseHandle((HANDLE)_beginthreadex(NULL, 0, subscriber_thread, sub, 0, NULL));
+        }
+    }
+    
+    // Give the mesh time to propagate subscription interest
+    Sleep(1000);
+    
+    for (int i = 0; i < topic_count; i++) {
+        BenchClient* pub = &publishers[i];
+        pub->port = ports[i % node_count];
+        snprintf(pub->topic, sizeof(pub->topic), "BENCH_%d", i);
+        pub->socket = connect_and_register("PUBLISHER", pub);
+        CloseHandle((HANDLE)_beginthreadex(NULL, 0, publisher_thread, pub, 0, NULL));
+    }
+    
+    // Warm up, then measure a steady-state window
+    Sleep(1000);
+    LONG64 published_start = total_messages(publishers, topic_count);
+    LONG64 delivered_start = total_messages(subscribers, subscriber_count);
+    Sleep(seconds * 1000);
+    LONG64 published = total_messages(publishers, topic_count) - published_start;
+    LONG64 delivered = total_messages(subscribers, subscriber_count) - delivered_start;
+    running = 0;
+    
+    printf("nodes=%d topics=%d size=%d seconds=%d\n", node_count, topic_count, message_size, seconds);
+    printf("published: %.0f msg/s\n", (double)published / seconds);
+    printf("delivered: %.0f msg/s (%.2f MB/s)\n",
+           (double)delivered / seconds,
+           (double)delivered * message_size / seconds / (1024.0 * 1024.0));
+    
+    for (int i = 0; i < topic_count; i++) closesocket(publishers[i].socket);
+    for (int i = 0; i < subscriber_count; i++) closesocket(subscribers[i].socket);
+    WSACleanup();
+    return 0;
+}
+
+SOCKET connect_and_register(const char* type, BenchClient* bench) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(bench->port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", bench->port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, bench->topic);
+    send(sock, message, strlen(message), 0);
+    
+    // Wait for the "OK <id>" line so subscribers are routable before the
+    // publishers start
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", bench->port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+unsigned __stdcall publisher_thread(void* arg) {
+    BenchClient* pub = (BenchClient*)arg;
+    char line[BUFFER_SIZE];
+    
+    memset(line, 'x', message_size - 1);
+    line[message_size - 1] = '\n';
+    
+    while (running) {
+        if (send(pub->socket, line, message_size, 0) == SOCKET_ERROR) break;
+        pub->messages++;
+    }
+    return 0;
+}
+
+unsigned __stdcall subscriber_thread(void* arg) {
+    BenchClient* sub = (BenchClient*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    
+    while (running) {
+        int bytes_received = recv(sub->socket, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) break;
+        
+        // Each published line arrives as exactly one newline-terminated line
+        LONG64 lines = 0;
+        for (int i = 0; i < bytes_received; i++) {
+            if (buffer[i] == '\n') lines++;
+        }
+        sub->messages += lines;
+    }
+    return 0;
+}
+
+LONG64 total_messages(BenchClient* list, int count) {
+    LONG64 total = 0;
+    for (int i = 0; i < count; i++) {
+        total += list[i].messages;
+    }
+    return total;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [PORT...] [--seconds N] [--size BYTES] [--topics N]\n", program_name);
+    printf("Each PORT is one node of a running federation mesh.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 5001 5002 5003 --seconds 10\n", program_name);
+}
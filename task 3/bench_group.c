@@ -0,0 +1,265 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define READ_BUFFER_SIZE 65536
+#define MAX_MEMBERS 64
+#define MAX_SIZES 16
+
+// One consumer of the queue group
+typedef struct {
+    SOCKET socket;
+    volatile LONG processed;
+} Member;
+
+// Global variables
+const char* server_ip;
+int port;
+const char* topic = "WORK";
+int message_count = 20000;
+int work_us = 200;
+int wait_ms = 0;                   // Per message wait instead of CPU work, like a downstream call
+int sizes[MAX_SIZES] = { 1, 2, 4, 8 };
+int size_count = 4;
+
+double us_per_tick;
+volatile LONG processed_total = 0;
+
+// Function prototypes
+SOCKET connect_and_register(const char* registration);
+unsigned __stdcall member_thread(void* arg);
+double run_group(int members, double baseline);
+int parse_sizes(const char* list);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            topic = argv[++i];
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            message_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--work-us") == 0 && i + 1 < argc) {
+            work_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--wait-ms") == 0 && i + 1 < argc) {
+            wait_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            if (parse_sizes(argv[++i]) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (message_count < 1 || work_us < 0 || wait_ms < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    if (wait_ms > 0) {
+        printf("%d messages, %d ms wait per message\n", message_count, wait_ms);
+    } else {
+        printf("%d messages, %d us of CPU work per message\n", message_count, work_us);
+    }
+    printf("members   seconds     msg/s  speedup  min share  max share\n");
+    double baseline = 0;
+    for (int s = 0; s < size_count; s++) {
+        double rate = run_group(sizes[s], baseline);
+        if (s == 0) baseline = rate;
+    }
+    
+    WSACleanup();
+    return 0;
+}
+
+// Accepts a comma separated list such as "1,2,4,8"
+int parse_sizes(const char* list) {
+    size_count = 0;
+    while (*list && size_count < MAX_SIZES) {
+        int members = atoi(list);
+        if (members < 1 || members > MAX_MEMBERS) return -1;
+        sizes[size_count++] = members;
+        list = strchr(list, ',');
+        if (list == NULL) break;
+        list++;
+    }
+    return size_count > 0 ? 0 : -1;
+}
+
+SOCKET connect_and_register(const char* registration) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[256];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Processes "#OFFSET ..." lines: spins for work_us or sleeps for wait_ms,
+// then acknowledges
+unsigned __stdcall member_thread(void* arg) {
+    Member* member = (Member*)arg;
+    char* buffer = (char*)malloc(READ_BUFFER_SIZE);
+    if (buffer == NULL) return 1;
+    
+    int line_start = 1;
+    int in_offset = 0;
+    long long offset = 0;
+    while (1) {
+        int bytes_received = recv(member->socket, buffer, READ_BUFFER_SIZE, 0);
+        if (bytes_received <= 0) break;
+        
+        for (int i = 0; i < bytes_received; i++) {
+            char c = buffer[i];
+            if (line_start && c == '#') {
+                in_offset = 1;
+                offset = 0;
+            } else if (in_offset && c >= '0' && c <= '9') {
+                offset = offset * 10 + (c - '0');
+            } else if (in_offset) {
+                in_offset = 0;
+                
+                if (wait_ms > 0) {
+                    Sleep(wait_ms);
+                } else {
+                    LONGLONG until = now_ticks() + (LONGLONG)(work_us / us_per_tick);
+                    while (now_ticks() < until) {
+                    }
+                }
+                
+                char ack[32];
+                int len = snprintf(ack, sizeof(ack), "ACK %lld\n", offset);
+                send(member->socket, ack, len, 0);
+                InterlockedIncrement(&member->processed);
+                InterlockedIncrement(&processed_total);
+            }
+            line_start = (c == '\n');
+        }
+    }
+    free(buffer);
+    return 0;
+}
+
+// Publishes message_count messages to a fresh group of the given size and
+// times until every one was processed. Returns the processing rate.
+double run_group(int members, double baseline) {
+    Member group[MAX_MEMBERS];
+    HANDLE threads[MAX_MEMBERS];
+    char group_topic[128];
+    char registration[256];
+    snprintf(group_topic, sizeof(group_topic), "%s.%lu.%d", topic, (unsigned long)GetCurrentProcessId(), members);
+    
+    processed_total = 0;
+    for (int m = 0; m < members; m++) {
+        snprintf(registration, sizeof(registration), "SUBSCRIBER:%s:WORKERS", group_topic);
+        group[m].socket = connect_and_register(registration);
+        group[m].processed = 0;
+        threads[m] = (HANDLE)_beginthreadex(NULL, 0, member_thread, &group[m], 0, NULL);
+    }
+    snprintf(registration, sizeof(registration), "PUBLISHER:%s", group_topic);
+    SOCKET publisher = connect_and_register(registration);
+    
+    // Publish in batches of lines; the group backlog absorbs the burst
+    char batch[64 * 32];
+    LONGLONG start = now_ticks();
+    for (int i = 0; i < message_count; ) {
+        int len = 0;
+        for (int n = 0; n < 64 && i < message_count; n++, i++) {
+            len += snprintf(batch + len, sizeof(batch) - len, "job %d\n", i);
+        }
+        if (send(publisher, batch, len, 0) == SOCKET_ERROR) {
+            printf("Publish failed. Error: %d\n", WSAGetLastError());
+            exit(1);
+        }
+    }
+    
+    while (processed_total < message_count) {
+        if ((now_ticks() - start) * us_per_tick > 120e6) {
+            printf("Timed out with %ld of %d messages processed\n", (long)processed_total, message_count);
+            break;
+        }
+        Sleep(1);
+    }
+    double seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    LONG least = message_count;
+    LONG most = 0;
+    closesocket(publisher);
+    for (int m = 0; m < members; m++) {
+        shutdown(group[m].socket, SD_BOTH);
+        WaitForSingleObject(threads[m], INFINITE);
+        CloseHandle(threads[m]);
+        closesocket(group[m].socket);
+        if (group[m].processed < least) least = group[m].processed;
+        if (group[m].processed > most) most = group[m].processed;
+    }
+    
+    double rate = processed_total / seconds;
+    printf("%7d  %8.3f  %8.0f  %6.2fx  %8.1f%%  %8.1f%%\n", members, seconds, rate,
+           baseline > 0 ? rate / baseline : 1.0,
+           100.0 * least / message_count, 100.0 * most / message_count);
+    return rate;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--messages N] [--work-us US | --wait-ms MS]\n", program_name);
+    printf("          [--sizes 1,2,4,8] [--topic T]\n");
+    printf("Publishes a burst of messages to a queue group whose members each spend\n");
+    printf("--work-us of CPU (or wait --wait-ms, like a call to another service) per\n");
+    printf("message before acknowledging it, once per group size, and reports the\n");
+    printf("processing rate and how evenly the members shared the work.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --messages 50000 --work-us 50 --sizes 1,2,4\n", program_name);
+    printf("  %s 127.0.0.1 5000 --messages 5000 --wait-ms 1 --sizes 1,2,4,8,16\n", program_name);
+}
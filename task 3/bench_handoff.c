@@ -0,0 +1,320 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define LINE_SIZE 256
+#define REPORT_SIZE 65536
+#define DRAIN_MS 3000
+
+// What one subscriber connection has seen
+typedef struct {
+    SOCKET socket;
+    char line[LINE_SIZE];
+    int line_len;
+    LONGLONG next;                 // Sequence number expected next
+    LONGLONG last_arrival;         // Ticks of the last message
+    double longest_gap_ms;
+    int closed;
+} Subscriber;
+
+// Global variables
+const char* server_ip;
+int port;
+const char* server_command = NULL;
+int subscriber_count = 10000;
+int rate = 10;                     // Messages per second
+int seconds = 6;
+double takeover_at = 2.0;          // Seconds into publishing
+
+Subscriber* subscribers;
+volatile LONG publishing_done = 0;
+LONGLONG published = 0;
+LONGLONG delivered = 0;
+LONGLONG lost = 0;
+LONGLONG duplicated = 0;
+int disconnects = 0;
+double max_latency_ms = 0;
+double* latencies;                 // Per delivery, for percentiles
+LONGLONG latency_count = 0;
+LONGLONG latency_capacity = 0;
+
+double us_per_tick;
+
+// Function prototypes
+SOCKET connect_and_register(const char* registration);
+unsigned __stdcall publisher_thread(void* arg);
+void receive_all_subscribers(LONGLONG until);
+void handle_line(Subscriber* subscriber, LONGLONG now);
+int launch_server();
+int compare_doubles(const void* a, const void* b);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_command = argv[++i];
+        } else if (strcmp(argv[i], "--subscribers") == 0 && i + 1 < argc) {
+            subscriber_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if (server_command == NULL || subscriber_count < 1 || rate < 1 || seconds < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    takeover_at = seconds / 3.0;
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    char topic[64];
+    char registration[128];
+    snprintf(topic, sizeof(topic), "HANDOFF.%lu", (unsigned long)GetCurrentProcessId());
+    snprintf(registration, sizeof(registration), "SUBSCRIBER:%s", topic);
+    
+    subscribers = (Subscriber*)calloc(subscriber_count, sizeof(Subscriber));
+    latency_capacity = (LONGLONG)subscriber_count * rate * seconds + 1;
+    latencies = (double*)malloc(latency_capacity * sizeof(double));
+    if (subscribers == NULL || latencies == NULL) {
+        printf("Out of memory for %d subscribers\n", subscriber_count);
+        return 1;
+    }
+    
+    printf("Connecting %d subscribers...\n", subscriber_count);
+    for (int i = 0; i < subscriber_count; i++) {
+        subscribers[i].socket = connect_and_register(registration);
+        u_long nonblocking = 1;
+        ioctlsocket(subscribers[i].socket, FIONBIO, &nonblocking);
+    }
+    snprintf(registration, sizeof(registration), "PUBLISHER:%s", topic);
+    SOCKET publisher = connect_and_register(registration);
+    
+    printf("%d subscribers, %d messages/s for %d s, takeover after %.1f s\n", subscriber_count, rate, seconds, takeover_at);
+    LONGLONG start = now_ticks();
+    for (int i = 0; i < subscriber_count; i++) subscribers[i].last_arrival = start;
+    HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, (void*)(ULONG_PTR)publisher, 0, NULL);
+    
+    receive_all_subscribers(start + (LONGLONG)(takeover_at * 1e6 / us_per_tick));
+    if (launch_server() != 0) return 1;
+    while (!publishing_done) receive_all_subscribers(now_ticks() + (LONGLONG)(100000 / us_per_tick));
+    receive_all_subscribers(now_ticks() + (LONGLONG)(DRAIN_MS * 1000 / us_per_tick));
+    
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    
+    // Subscribers that still miss messages at the end lost them
+    for (int i = 0; i < subscriber_count; i++) {
+        if (subscribers[i].next < published) lost += published - subscribers[i].next;
+    }
+    
+    double longest_gap = 0;
+    for (int i = 0; i < subscriber_count; i++) {
+        if (subscribers[i].longest_gap_ms > longest_gap) longest_gap = subscribers[i].longest_gap_ms;
+    }
+    qsort(latencies, latency_count, sizeof(double), compare_doubles);
+    
+    printf("Deliveries: %lld of %lld, %lld lost, %lld duplicated, %d disconnected subscriber(s)\n",
+           (long long)delivered, (long long)published * subscriber_count, (long long)lost, (long long)duplicated, disconnects);
+    if (latency_count > 0) {
+        printf("Latency ms: p50 %.2f  p99 %.2f  p99.99 %.2f  max %.2f\n",
+               latencies[latency_count / 2], latencies[latency_count * 99 / 100],
+               latencies[latency_count * 9999 / 10000], max_latency_ms);
+    }
+    printf("Longest gap between two messages at one subscriber: %.1f ms (%.1f ms expected)\n", longest_gap, 1000.0 / rate);
+    
+    char request[32];
+    snprintf(request, sizeof(request), "STATS:HANDOFF");
+    SOCKET stats = connect_and_register(request);
+    char report[REPORT_SIZE];
+    int length = 0;
+    int bytes;
+    while (length < REPORT_SIZE - 1 && (bytes = recv(stats, report + length, REPORT_SIZE - 1 - length, 0)) > 0) {
+        length += bytes;
+    }
+    report[length] = '\0';
+    closesocket(stats);
+    printf("%s", report);
+    
+    for (int i = 0; i < subscriber_count; i++) closesocket(subscribers[i].socket);
+    closesocket(publisher);
+    WSACleanup();
+    return 0;
+}
+
+// Starts the new server, which takes over the port from the running one
+int launch_server() {
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    
+    char command[1024];
+    snprintf(command, sizeof(command), "%s", server_command);
+    printf("Starting: %s\n", command);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) {
+        printf("Failed to start the new server. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    return 0;
+}
+
+SOCKET connect_and_register(const char* registration) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[256];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    if (strncmp(registration, "STATS:", 6) == 0) return sock;
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Publishes "<SEQUENCE> <TICKS>" at a steady rate, through the takeover
+unsigned __stdcall publisher_thread(void* arg) {
+    SOCKET publisher = (SOCKET)(ULONG_PTR)arg;
+    LONGLONG start = now_ticks();
+    LONGLONG total = (LONGLONG)rate * seconds;
+    
+    for (LONGLONG seq = 0; seq < total; seq++) {
+        LONGLONG due = start + (LONGLONG)(seq * 1e6 / rate / us_per_tick);
+        while (now_ticks() < due) Sleep(1);
+        
+        char line[64];
+        int length = snprintf(line, sizeof(line), "%lld %lld\n", (long long)seq, (long long)now_ticks());
+        if (send(publisher, line, length, 0) == SOCKET_ERROR) {
+            printf("Publish failed. Error: %d\n", WSAGetLastError());
+            break;
+        }
+        published = seq + 1;
+    }
+    publishing_done = 1;
+    return 0;
+}
+
+// Polls every subscriber until the given time
+void receive_all_subscribers(LONGLONG until) {
+    WSAPOLLFD* fds = (WSAPOLLFD*)malloc(subscriber_count * sizeof(WSAPOLLFD));
+    if (fds == NULL) exit(1);
+    for (int i = 0; i < subscriber_count; i++) {
+        fds[i].fd = subscribers[i].socket;
+        fds[i].events = POLLRDNORM;
+    }
+    
+    char buffer[4096];
+    while (now_ticks() < until) {
+        for (int i = 0; i < subscriber_count; i++) fds[i].revents = 0;
+        if (WSAPoll(fds, subscriber_count, 10) <= 0) continue;
+        
+        LONGLONG now = now_ticks();
+        for (int i = 0; i < subscriber_count; i++) {
+            Subscriber* subscriber = &subscribers[i];
+            if (fds[i].revents == 0 || subscriber->closed) continue;
+            
+            int bytes = recv(subscriber->socket, buffer, sizeof(buffer), 0);
+            if (bytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) continue;
+            if (bytes <= 0) {
+                subscriber->closed = 1;
+                fds[i].fd = INVALID_SOCKET;
+                disconnects++;
+                continue;
+            }
+            for (int b = 0; b < bytes; b++) {
+                if (subscriber->line_len < LINE_SIZE - 1) subscriber->line[subscriber->line_len++] = buffer[b];
+                if (buffer[b] != '\n') continue;
+                subscriber->line[subscriber->line_len] = '\0';
+                handle_line(subscriber, now);
+                subscriber->line_len = 0;
+            }
+        }
+    }
+    free(fds);
+}
+
+// Lines read "[TOPIC] Publisher ID: <SEQUENCE> <TICKS>"
+void handle_line(Subscriber* subscriber, LONGLONG now) {
+    const char* payload = strstr(subscriber->line, ": ");
+    long long seq, sent;
+    if (payload == NULL || sscanf(payload + 2, "%lld %lld", &seq, &sent) != 2) return;
+    
+    if (seq < subscriber->next) {
+        duplicated++;
+        return;
+    }
+    lost += seq - subscriber->next;
+    subscriber->next = seq + 1;
+    delivered++;
+    
+    double latency = (now - sent) * us_per_tick / 1000.0;
+    if (latency > max_latency_ms) max_latency_ms = latency;
+    if (latency_count < latency_capacity) latencies[latency_count++] = latency;
+    
+    double gap = (now - subscriber->last_arrival) * us_per_tick / 1000.0;
+    if (gap > subscriber->longest_gap_ms) subscriber->longest_gap_ms = gap;
+    subscriber->last_arrival = now;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> --server \"<COMMAND>\" [--subscribers N] [--rate R] [--seconds S]\n", program_name);
+    printf("Connects N subscribers (default 10000) and a publisher sending R sequence\n");
+    printf("numbers per second (default 10) for S seconds (default 6). A third of the\n");
+    printf("way in it starts COMMAND, a server taking over the port, and then reports\n");
+    printf("lost, duplicated and delayed messages and dropped connections.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000 --server \"server.exe 5000 --takeover --quiet --max-clients 20000\"\n", program_name);
+}
@@ -0,0 +1,343 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <psapi.h>
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "psapi.lib")
+
+#define STARTUP_TIMEOUT_MS 5000
+#define SETTLE_MS 2000             // Lets the server register the last connections before measuring
+#define RECEIVE_TIMEOUT_MS 5000
+#define FIRST_SOURCE_PORT 1024
+#define LAST_SOURCE_PORT 65535
+#define SPARE_SLOTS 16             // Server slots beyond --connections, for the publisher
+#define PROGRESS_EVERY 100000
+
+// Memory of the server process
+typedef struct {
+    double working_set;            // Bytes resident
+    double private_bytes;          // Bytes committed to the process alone
+} Footprint;
+
+// Global variables
+int port;
+const char* server_program = "server.exe";
+int connection_count = 10000;
+int topic_count = 100;
+int source_count = 1;              // Loopback addresses 127.0.0.1 and up to connect from
+SOCKET* sockets;
+int next_source = 0;
+int next_source_port = FIRST_SOURCE_PORT;
+double us_per_tick;
+
+// Function prototypes
+int start_server(int max_clients, PROCESS_INFORMATION* process);
+void stop_server(PROCESS_INFORMATION* process);
+int measure_server(PROCESS_INFORMATION* process, Footprint* footprint);
+SOCKET open_subscriber(int index);
+SOCKET connect_and_register(const char* registration);
+int read_line(SOCKET sock, char* line, int size);
+int send_all(SOCKET sock, const char* data, int len);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connection_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            topic_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sources") == 0 && i + 1 < argc) {
+            source_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_program = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (port <= 0 || connection_count < 1 || topic_count < 1 || source_count < 1 || source_count > 254) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    sockets = (SOCKET*)malloc(connection_count * sizeof(SOCKET));
+    if (sockets == NULL) {
+        printf("Out of memory for %d connections\n", connection_count);
+        return 1;
+    }
+    
+    printf("Idle subscribers: %d connections over %d topics from %d source address(es)\n\n",
+           connection_count, topic_count, source_count);
+    
+    // The server's own overhead, with hardly any client slots
+    PROCESS_INFORMATION process;
+    Footprint base, empty, loaded;
+    if (start_server(SPARE_SLOTS, &process) != 0) return 1;
+    Sleep(SETTLE_MS);
+    int failed = measure_server(&process, &base);
+    stop_server(&process);
+    if (failed) return 1;
+    
+    // The slot table for every connection, before any connects
+    if (start_server(connection_count + SPARE_SLOTS, &process) != 0) return 1;
+    Sleep(SETTLE_MS);
+    if (measure_server(&process, &empty) != 0) {
+        stop_server(&process);
+        return 1;
+    }
+    
+    // Registrations are sent without waiting, and the acknowledgements
+    // read once every connection is open
+    LONGLONG start = now_ticks();
+    int opened = 0;
+    for (; opened < connection_count; opened++) {
+        sockets[opened] = open_subscriber(opened);
+        if (sockets[opened] == INVALID_SOCKET) break;
+        if ((opened + 1) % PROGRESS_EVERY == 0) printf("  %d connected\n", opened + 1);
+    }
+    double connect_seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    int registered = 0;
+    for (int c = 0; c < opened; c++) {
+        char reply[64];
+        if (read_line(sockets[c], reply, sizeof(reply)) == 0 && strncmp(reply, "OK", 2) == 0) registered++;
+    }
+    Sleep(SETTLE_MS);
+    failed = measure_server(&process, &loaded);
+    
+    // Every idle connection must still be served: one message per topic
+    int delivered = 0;
+    SOCKET publisher = INVALID_SOCKET;
+    for (int t = 0; t < topic_count && !failed; t++) {
+        char registration[64];
+        snprintf(registration, sizeof(registration), "PUBLISHER:idle.%d", t);
+        publisher = connect_and_register(registration);
+        if (publisher == INVALID_SOCKET) break;
+        send_all(publisher, "wake up\n", 8);
+        closesocket(publisher);
+    }
+    for (int c = 0; c < opened && !failed; c++) {
+        char line[256];
+        if (read_line(sockets[c], line, sizeof(line)) == 0 && strstr(line, "wake up") != NULL) delivered++;
+    }
+    
+    for (int c = 0; c < opened; c++) closesocket(sockets[c]);
+    stop_server(&process);
+    if (failed) return 1;
+    
+    int slots = connection_count + SPARE_SLOTS;
+    printf("%-36s %12s %12s\n", "Server", "working set", "private");
+    printf("  %-34s %9.1f MB %9.1f MB\n", "with 16 client slots", base.working_set / 1048576.0, base.private_bytes / 1048576.0);
+    char label[64];
+    snprintf(label, sizeof(label), "with %d client slots", slots);
+    printf("  %-34s %9.1f MB %9.1f MB\n", label, empty.working_set / 1048576.0, empty.private_bytes / 1048576.0);
+    snprintf(label, sizeof(label), "with %d idle subscribers", opened);
+    printf("  %-34s %9.1f MB %9.1f MB\n", label, loaded.working_set / 1048576.0, loaded.private_bytes / 1048576.0);
+    printf("\n");
+    
+    double slot_bytes = (empty.private_bytes - base.private_bytes) / (slots - SPARE_SLOTS);
+    double connection_bytes = (opened > 0) ? (loaded.private_bytes - empty.private_bytes) / opened : 0;
+    double resident_bytes = (opened > 0) ? (loaded.working_set - base.working_set) / opened : 0;
+    printf("Per client slot, taken at startup:    %6.0f bytes private\n", slot_bytes);
+    printf("Per idle connection, beyond its slot: %6.0f bytes private\n", connection_bytes);
+    printf("Per idle connection in all:           %6.0f bytes private, %.0f bytes resident\n",
+           slot_bytes + connection_bytes, resident_bytes);
+    printf("\n%d of %d connected in %.1f s, %d registered, %d got the message of their topic\n",
+           opened, connection_count, connect_seconds, registered, delivered);
+    return (opened == connection_count && registered == opened && delivered == opened) ? 0 : 1;
+}
+
+// Starts the server with room for max_clients connections and waits until
+// it accepts them
+int start_server(int max_clients, PROCESS_INFORMATION* process) {
+    char command[512];
+    snprintf(command, sizeof(command), "%s %d --quiet --no-trace --max-clients %d", server_program, port, max_clients);
+    printf("Starting: %s\n", command);
+    
+    STARTUPINFOA startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup, process)) {
+        printf("Failed to start the server. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    ULONGLONG deadline = GetTickCount64() + STARTUP_TIMEOUT_MS;
+    while (1) {
+        SOCKET probe = socket(AF_INET, SOCK_STREAM, 0);
+        int connected = (probe != INVALID_SOCKET &&
+                         connect(probe, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0);
+        if (probe != INVALID_SOCKET) closesocket(probe);
+        if (connected) return 0;
+        if (GetTickCount64() >= deadline) {
+            printf("The server did not start on port %d\n", port);
+            stop_server(process);
+            return -1;
+        }
+        Sleep(50);
+    }
+}
+
+void stop_server(PROCESS_INFORMATION* process) {
+    TerminateProcess(process->hProcess, 0);
+    WaitForSingleObject(process->hProcess, INFINITE);
+    CloseHandle(process->hProcess);
+    CloseHandle(process->hThread);
+}
+
+int measure_server(PROCESS_INFORMATION* process, Footprint* footprint) {
+    PROCESS_MEMORY_COUNTERS_EX counters;
+    if (!GetProcessMemoryInfo(process->hProcess, (PROCESS_MEMORY_COUNTERS*)&counters, sizeof(counters))) {
+        printf("Cannot read the server's memory. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    footprint->working_set = (double)counters.WorkingSetSize;
+    footprint->private_bytes = (double)counters.PrivateUsage;
+    return 0;
+}
+
+// Connects subscriber index from the next free loopback address and port;
+// binding explicitly gets past the ephemeral port range, and each source
+// address has a range of its own. Sends its registration without waiting
+// for the reply.
+SOCKET open_subscriber(int index) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    while (next_source < source_count) {
+        if (next_source_port > LAST_SOURCE_PORT) {
+            next_source++;
+            next_source_port = FIRST_SOURCE_PORT;
+            continue;
+        }
+        
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            printf("Cannot create connection %d. Error: %d\n", index + 1, WSAGetLastError());
+            return INVALID_SOCKET;
+        }
+        struct sockaddr_in source;
+        memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_port = htons((u_short)next_source_port++);
+        source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + next_source);
+        if (bind(sock, (struct sockaddr*)&source, sizeof(source)) != 0) {
+            closesocket(sock);     // Port taken; try the next
+            continue;
+        }
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+            printf("Connection %d failed. Error: %d\n", index + 1, WSAGetLastError());
+            closesocket(sock);
+            return INVALID_SOCKET;
+        }
+        
+        DWORD timeout = RECEIVE_TIMEOUT_MS;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+        char registration[64];
+        int length = snprintf(registration, sizeof(registration), "SUBSCRIBER:idle.%d\n", index % topic_count);
+        if (send_all(sock, registration, length) != 0) {
+            closesocket(sock);
+            return INVALID_SOCKET;
+        }
+        return sock;
+    }
+    printf("Out of source ports after %d connections; use more --sources\n", index);
+    return INVALID_SOCKET;
+}
+
+SOCKET connect_and_register(const char* registration) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) != 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    
+    char message[128];
+    int length = snprintf(message, sizeof(message), "%s\n", registration);
+    char reply[64];
+    if (send_all(sock, message, length) != 0 || read_line(sock, reply, sizeof(reply)) != 0 || strncmp(reply, "OK", 2) != 0) {
+        printf("Registration as %s failed\n", registration);
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+// Reads one line a byte at a time, so nothing after it is consumed
+int read_line(SOCKET sock, char* line, int size) {
+    int len = 0;
+    while (len < size - 1) {
+        if (recv(sock, line + len, 1, 0) <= 0) return -1;
+        if (line[len++] == '\n') break;
+    }
+    line[len] = '\0';
+    return 0;
+}
+
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <PORT> [--connections N] [--topics N] [--sources N] [--server PATH]\n", program_name);
+    printf("Measures what an idle subscriber costs the server. Starts the server with\n");
+    printf("16 client slots, then with room for --connections (default: 10000), and\n");
+    printf("reads its working set and private bytes each time. Then connects\n");
+    printf("--connections subscribers over loopback, spread over --topics topics\n");
+    printf("(default: 100), and reads them again once all are registered. Each\n");
+    printf("connection binds its own source port on 127.0.0.1 and the next --sources\n");
+    printf("addresses (default: 1), about 64000 connections per address. Finally one\n");
+    printf("message per topic checks that every connection is still served.\n");
+    printf("Examples:\n");
+    printf("  %s 5000\n", program_name);
+    printf("  %s 5000 --connections 1000000 --sources 16\n", program_name);
+}
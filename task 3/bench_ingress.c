@@ -0,0 +1,284 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_SECONDS 120
+#define MAX_FLOODERS 64
+#define MAX_PINGS_PER_SECOND 1000
+
+// Ping latencies and flood volume observed in one second of the run
+typedef struct {
+    double latencies_ms[MAX_PINGS_PER_SECOND];
+    int pings;
+    LONG64 flood_bytes;
+} SecondStats;
+
+// Global variables
+const char* server_ip;
+int port;
+int seconds = 10;
+int flooders = 4;
+int flood_size = 200;
+int ping_interval_ms = 10;
+volatile int running = 1;
+volatile LONG throttle_notices = 0;
+
+LONGLONG start_ticks;
+double ms_per_tick;
+SecondStats stats[MAX_SECONDS];
+double all_latencies[MAX_SECONDS * MAX_PINGS_PER_SECOND];
+
+// Function prototypes
+SOCKET connect_and_register(const char* type, const char* topic);
+unsigned __stdcall flood_thread(void* arg);
+unsigned __stdcall ping_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+void record_line(const char* line, int length, LONGLONG now);
+LONGLONG now_ticks();
+int compare_doubles(const void* a, const void* b);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--flooders") == 0 && i + 1 < argc) {
+            flooders = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            flood_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ping-interval") == 0 && i + 1 < argc) {
+            ping_interval_ms = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (seconds < 1 || seconds > MAX_SECONDS || flooders < 1 || flooders > MAX_FLOODERS ||
+        flood_size < 16 || flood_size >= BUFFER_SIZE - 100 || ping_interval_ms < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ms_per_tick = 1000.0 / (double)frequency.QuadPart;
+    
+    // Subscribers register first so they see every message
+    SOCKET flood_subscriber = connect_and_register("SUBSCRIBER", "FLOOD");
+    SOCKET ping_subscriber = connect_and_register("SUBSCRIBER", "PING");
+    SOCKET flood[MAX_FLOODERS];
+    for (int f = 0; f < flooders; f++) flood[f] = connect_and_register("PUBLISHER", "FLOOD");
+    SOCKET ping = connect_and_register("PUBLISHER", "PING");
+    
+    printf("%d publisher(s) flooding FLOOD with %d byte messages, a ping on PING every %d ms\n",
+           flooders, flood_size, ping_interval_ms);
+    
+    start_ticks = now_ticks();
+    HANDLE threads[MAX_FLOODERS + 3];
+    int thread_count = 0;
+    threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &flood_subscriber, 0, NULL);
+    threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &ping_subscriber, 0, NULL);
+    threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, ping_thread, &ping, 0, NULL);
+    for (int f = 0; f < flooders; f++) {
+        threads[thread_count++] = (HANDLE)_beginthreadex(NULL, 0, flood_thread, &flood[f], 0, NULL);
+    }
+    
+    Sleep(seconds * 1000);
+    running = 0;
+    
+    // Closing the sockets ends any recv or send still in progress
+    for (int f = 0; f < flooders; f++) closesocket(flood[f]);
+    closesocket(ping);
+    closesocket(flood_subscriber);
+    closesocket(ping_subscriber);
+    for (int t = 0; t < thread_count; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+    
+    printf("second  flood MB/s  pings   p50 ms   p99 ms   max ms\n");
+    int all_pings = 0;
+    for (int s = 0; s < seconds; s++) {
+        SecondStats* second = &stats[s];
+        printf("%6d  %10.2f  %5d", s + 1, second->flood_bytes / (1024.0 * 1024.0), second->pings);
+        if (second->pings > 0) {
+            qsort(second->latencies_ms, second->pings, sizeof(double), compare_doubles);
+            printf("  %7.2f  %7.2f  %7.2f",
+                   second->latencies_ms[second->pings / 2],
+                   second->latencies_ms[(int)(second->pings * 0.99)],
+                   second->latencies_ms[second->pings - 1]);
+            memcpy(all_latencies + all_pings, second->latencies_ms, second->pings * sizeof(double));
+            all_pings += second->pings;
+        }
+        printf("\n");
+    }
+    
+    if (all_pings > 0) {
+        qsort(all_latencies, all_pings, sizeof(double), compare_doubles);
+        printf("all     %10s  %5d  %7.2f  %7.2f  %7.2f\n", "", all_pings,
+               all_latencies[all_pings / 2], all_latencies[(int)(all_pings * 0.99)], all_latencies[all_pings - 1]);
+    }
+    printf("THROTTLED notices received by the flooding publishers: %ld\n", (long)throttle_notices);
+    
+    WSACleanup();
+    return 0;
+}
+
+SOCKET connect_and_register(const char* type, const char* topic) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, topic);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Sends flood lines as fast as the server takes them, in batches, and
+// counts the THROTTLED notices a rate-limited server answers with
+unsigned __stdcall flood_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char batch[16 * BUFFER_SIZE];
+    int per_batch = (int)sizeof(batch) / flood_size;
+    
+    for (int m = 0; m < per_batch; m++) {
+        char* line = batch + m * flood_size;
+        memset(line, 'x', flood_size - 1);
+        memcpy(line, "FLOOD ", 6);
+        line[flood_size - 1] = '\n';
+    }
+    
+    while (running) {
+        if (send(sock, batch, per_batch * flood_size, 0) == SOCKET_ERROR) break;
+        
+        while (1) {
+            fd_set readable;
+            FD_ZERO(&readable);
+            FD_SET(sock, &readable);
+            struct timeval no_wait = { 0, 0 };
+            if (select((int)sock + 1, &readable, NULL, NULL, &no_wait) <= 0) break;
+            
+            char notices[BUFFER_SIZE];
+            int bytes_received = recv(sock, notices, sizeof(notices), 0);
+            if (bytes_received <= 0) return 0;
+            for (int i = 0; i + 10 <= bytes_received; i++) {
+                if (memcmp(notices + i, "THROTTLED ", 10) == 0) InterlockedIncrement(&throttle_notices);
+            }
+        }
+    }
+    return 0;
+}
+
+// Publishes a timestamped ping every ping_interval_ms
+unsigned __stdcall ping_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char line[128];
+    
+    while (running) {
+        int len = snprintf(line, sizeof(line), "PING %lld\n", (long long)now_ticks());
+        if (send(sock, line, len, 0) == SOCKET_ERROR) break;
+        Sleep(ping_interval_ms);
+    }
+    return 0;
+}
+
+unsigned __stdcall subscriber_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    char line[2 * BUFFER_SIZE];
+    int line_len = 0;
+    
+    while (running) {
+        int bytes_received = recv(sock, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) break;
+        
+        LONGLONG now = now_ticks();
+        for (int i = 0; i < bytes_received; i++) {
+            if (line_len < (int)sizeof(line)) line[line_len++] = buffer[i];
+            if (buffer[i] == '\n') {
+                record_line(line, line_len, now);
+                line_len = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+// Each subscriber thread sees only its own topic, so the two never write
+// the same field. Lines look like "[PING] Publisher X: PING <ticks>" or "[FLOOD] ... FLOOD xxx"
+void record_line(const char* line, int length, LONGLONG now) {
+    int second = (int)((now - start_ticks) * ms_per_tick / 1000.0);
+    if (second >= MAX_SECONDS) return;
+    SecondStats* stats_now = &stats[second];
+    
+    const char* ping = strstr(line, ": PING ");
+    if (ping != NULL && ping < line + length) {
+        LONGLONG sent = _atoi64(ping + 7);
+        if (stats_now->pings < MAX_PINGS_PER_SECOND) {
+            stats_now->latencies_ms[stats_now->pings++] = (now - sent) * ms_per_tick;
+        }
+    } else {
+        stats_now->flood_bytes += length;
+    }
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--seconds N] [--flooders N] [--size BYTES]\n", program_name);
+    printf("          [--ping-interval MS]\n");
+    printf("Runaway publishers send to topic FLOOD as fast as the server reads, while a\n");
+    printf("well-behaved publisher sends timestamped pings to topic PING. Reports, per\n");
+    printf("second, the flood volume delivered and the pings' end-to-end latency.\n");
+    printf("Run it against a server with and without --publisher-limit or --topic-limit.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --flooders 8 --size 500\n", program_name);
+}
@@ -0,0 +1,261 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define CHUNK_SIZE 65536
+#define READ_BUFFER_SIZE (1 << 20)
+#define REPORT_SIZE 65536
+#define MAX_SIZES 16
+
+// Global variables
+const char* server_ip;
+int port;
+const char* topic = "LARGE";
+int sizes_mb[MAX_SIZES] = { 1, 10, 100 };
+int size_count = 3;
+
+double us_per_tick;
+LONGLONG publish_start;
+
+// What the publisher thread streams
+typedef struct {
+    SOCKET socket;
+    LONGLONG bytes;
+} Upload;
+
+// Function prototypes
+SOCKET connect_and_register(const char* registration);
+unsigned __stdcall publisher_thread(void* arg);
+int run_size(int mb);
+LONGLONG peak_in_memory();
+int parse_sizes(const char* list);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            topic = argv[++i];
+        } else if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+            if (parse_sizes(argv[++i]) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    printf("One publisher streams a message of each size in %d byte chunks to one subscriber\n", CHUNK_SIZE);
+    printf("     MB   first byte ms   last byte ms     MB/s   broker peak KB\n");
+    for (int s = 0; s < size_count; s++) {
+        if (run_size(sizes_mb[s]) != 0) return 1;
+    }
+    
+    WSACleanup();
+    return 0;
+}
+
+// Accepts a comma separated list of megabytes such as "1,10,100"
+int parse_sizes(const char* list) {
+    size_count = 0;
+    while (*list && size_count < MAX_SIZES) {
+        int mb = atoi(list);
+        if (mb < 1 || mb > 4096) return -1;
+        sizes_mb[size_count++] = mb;
+        list = strchr(list, ',');
+        if (list == NULL) break;
+        list++;
+    }
+    return size_count > 0 ? 0 : -1;
+}
+
+SOCKET connect_and_register(const char* registration) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[256];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Sends the whole message as "CHUNK BLOB <LENGTH> MORE|END" frames
+unsigned __stdcall publisher_thread(void* arg) {
+    Upload* upload = (Upload*)arg;
+    char* frame = (char*)malloc(CHUNK_SIZE + 64);
+    if (frame == NULL) return 1;
+    memset(frame, 'x', CHUNK_SIZE + 64);
+    
+    publish_start = now_ticks();
+    for (LONGLONG sent = 0; sent < upload->bytes; ) {
+        int length = (upload->bytes - sent < CHUNK_SIZE) ? (int)(upload->bytes - sent) : CHUNK_SIZE;
+        sent += length;
+        
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "CHUNK BLOB %d %s\n", length, sent == upload->bytes ? "END" : "MORE");
+        memcpy(frame + 64 - header_len, header, header_len);
+        if (send(upload->socket, frame + 64 - header_len, header_len + length, 0) == SOCKET_ERROR) {
+            printf("Publish failed. Error: %d\n", WSAGetLastError());
+            break;
+        }
+    }
+    free(frame);
+    return 0;
+}
+
+// Streams one message and times its first and last payload byte at the
+// subscriber from the moment publishing started
+int run_size(int mb) {
+    char size_topic[128];
+    char registration[256];
+    snprintf(size_topic, sizeof(size_topic), "%s.%lu.%d", topic, (unsigned long)GetCurrentProcessId(), mb);
+    
+    snprintf(registration, sizeof(registration), "SUBSCRIBER:%s", size_topic);
+    SOCKET subscriber = connect_and_register(registration);
+    snprintf(registration, sizeof(registration), "PUBLISHER:%s", size_topic);
+    Upload upload;
+    upload.socket = connect_and_register(registration);
+    upload.bytes = (LONGLONG)mb * 1024 * 1024;
+    
+    char* buffer = (char*)malloc(READ_BUFFER_SIZE);
+    if (buffer == NULL) return -1;
+    HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, &upload, 0, NULL);
+    
+    // Subscribers receive "[TOPIC] Publisher ID CHUNK BLOB LENGTH FLAG\n"
+    // headers, each followed by LENGTH payload bytes
+    char header[256];
+    int header_len = 0;
+    LONGLONG payload_left = 0;
+    LONGLONG received = 0;
+    LONGLONG first_byte = 0;
+    int ended = 0;
+    while (!ended || payload_left > 0) {
+        int bytes = recv(subscriber, buffer, READ_BUFFER_SIZE, 0);
+        if (bytes <= 0) {
+            printf("Subscriber lost after %lld of %lld bytes\n", (long long)received, (long long)upload.bytes);
+            return -1;
+        }
+        for (int i = 0; i < bytes; ) {
+            if (payload_left > 0) {
+                int take = (bytes - i < payload_left) ? bytes - i : (int)payload_left;
+                if (first_byte == 0) first_byte = now_ticks();
+                payload_left -= take;
+                received += take;
+                i += take;
+                continue;
+            }
+            
+            char c = buffer[i++];
+            if (header_len < (int)sizeof(header) - 1) header[header_len++] = c;
+            if (c != '\n') continue;
+            header[header_len] = '\0';
+            header_len = 0;
+            
+            char flag[8];
+            int length;
+            const char* chunk = strstr(header, " CHUNK BLOB ");
+            if (chunk != NULL && sscanf(chunk, " CHUNK BLOB %d %7s", &length, flag) == 2) {
+                payload_left = length;
+                ended = (strcmp(flag, "MORE") != 0);
+            }
+        }
+    }
+    LONGLONG last_byte = now_ticks();
+    
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    closesocket(upload.socket);
+    closesocket(subscriber);
+    free(buffer);
+    
+    double first_ms = (first_byte - publish_start) * us_per_tick / 1000.0;
+    double last_ms = (last_byte - publish_start) * us_per_tick / 1000.0;
+    printf("%7d  %14.2f  %13.1f  %7.0f  %15.0f\n", mb, first_ms, last_ms,
+           received / 1048576.0 / (last_ms / 1000.0), peak_in_memory() / 1024.0);
+    return 0;
+}
+
+// Peak of "  In memory: X bytes now, Y peak" in the "STATS:CHUNKS" report
+LONGLONG peak_in_memory() {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) return -1;
+    send(sock, "STATS:CHUNKS\n", 13, 0);
+    
+    char report[REPORT_SIZE];
+    int length = 0;
+    int bytes;
+    while (length < REPORT_SIZE - 1 && (bytes = recv(sock, report + length, REPORT_SIZE - 1 - length, 0)) > 0) {
+        length += bytes;
+    }
+    report[length] = '\0';
+    closesocket(sock);
+    
+    long long now = 0, peak = -1;
+    const char* line = strstr(report, "In memory: ");
+    if (line != NULL) sscanf(line, "In memory: %lld bytes now, %lld peak", &now, &peak);
+    return peak;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--sizes 1,10,100] [--topic T]\n", program_name);
+    printf("Streams one large message per size (in MB) from a publisher to a\n");
+    printf("subscriber and reports when its first and last byte arrived, the\n");
+    printf("throughput, and the most chunk memory the broker held at once.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --sizes 1,10,100,500\n", program_name);
+}
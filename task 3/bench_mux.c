@@ -0,0 +1,449 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "wire.h"
+#pragma comment(lib, "ws2_32.lib")
+
+#define RECEIVE_BUFFER_SIZE 65536
+#define REPORT_SIZE 4096
+#define MAX_TOPICS 1000
+
+// A connection the benchmark reads frames from
+typedef struct {
+    SOCKET socket;
+    char* buffer;
+    int used;
+} Reader;
+
+// Results of one round
+typedef struct {
+    int sockets;
+    int receive_buffer;            // SO_RCVBUF of one socket
+    double seconds;
+    LONG64 deliveries;
+    LONG64 frames;
+    LONG64 bytes;
+    LONG64 recv_calls;
+    LONG64 send_calls;
+} Round;
+
+// Global variables
+const char* server_ip;
+int port;
+int sessions = 100;
+int topics = 10;
+int messages = 20000;
+int burst = 100;
+int message_size = 64;
+int subscribers_of[MAX_TOPICS];    // Subscribers of each topic
+LONG64 topic_counts[65536];        // Subscribers per wire topic id, for the multiplexed round
+
+double us_per_tick;
+
+// Function prototypes
+void run_separate(Round* round);
+void run_multiplexed(Round* round);
+void publish(SOCKET* publishers, int multiplexed, Round* round, Reader* readers, int reader_count);
+LONG64 receive_burst(Reader* readers, int count, int multiplexed, LONG64 expected, Round* round);
+void put_frame(char* out, int* used, UINT8 flags, UINT32 session, const char* payload, int length);
+SOCKET connect_and_register(const char* registration);
+void read_session_reply(Reader* reader, UINT32* session, int* topic_id);
+int receive_buffer_of(SOCKET sock);
+int fetch_report(const char* name, char* out, int size);
+void print_round(const char* name, const Round* round);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc) {
+            sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            topics = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--burst") == 0 && i + 1 < argc) {
+            burst = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (sessions < 1 || topics < 1 || topics > MAX_TOPICS || topics > sessions || messages < 1 || burst < 1 ||
+        message_size < 1 || message_size > MAX_WIRE_PAYLOAD) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    for (int s = 0; s < sessions; s++) subscribers_of[s % topics]++;
+    
+    printf("%d subscribers over %d topics with a publisher each; %d messages of %d bytes in bursts of %d\n\n",
+           sessions, topics, messages, message_size, burst);
+    
+    Round separate, multiplexed;
+    run_separate(&separate);
+    run_multiplexed(&multiplexed);
+    
+    printf("%-26s %8s %10s %14s %12s %12s %12s\n", "", "sockets", "rcvbuf KB", "deliveries/s", "frames/recv",
+           "recv calls", "send calls");
+    print_round("separate connections", &separate);
+    print_round("one multiplexed connection", &multiplexed);
+    printf("\nFrames the server wrote: %lld on separate connections, %lld multiplexed (%.1fx fewer)\n",
+           (long long)separate.frames, (long long)multiplexed.frames,
+           multiplexed.frames > 0 ? separate.frames / (double)multiplexed.frames : 0.0);
+    
+    char report[REPORT_SIZE];
+    if (fetch_report("MUX", report, sizeof(report)) > 0) printf("\n%s", report);
+    
+    WSACleanup();
+    return 0;
+}
+
+// One binary connection per subscriber and per publisher
+void run_separate(Round* round) {
+    memset(round, 0, sizeof(Round));
+    Reader* readers = (Reader*)calloc(sessions, sizeof(Reader));
+    SOCKET* publishers = (SOCKET*)malloc(topics * sizeof(SOCKET));
+    if (readers == NULL || publishers == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    
+    char registration[64];
+    for (int s = 0; s < sessions; s++) {
+        snprintf(registration, sizeof(registration), "SUBSCRIBER/BINARY:MUXBENCH%d", s % topics);
+        readers[s].socket = connect_and_register(registration);
+        readers[s].buffer = (char*)malloc(RECEIVE_BUFFER_SIZE);
+        if (readers[s].buffer == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    for (int t = 0; t < topics; t++) {
+        snprintf(registration, sizeof(registration), "PUBLISHER/BINARY:MUXBENCH%d", t);
+        publishers[t] = connect_and_register(registration);
+    }
+    round->sockets = sessions + topics;
+    round->receive_buffer = receive_buffer_of(readers[0].socket);
+    
+    publish(publishers, 0, round, readers, sessions);
+    
+    for (int s = 0; s < sessions; s++) {
+        closesocket(readers[s].socket);
+        free(readers[s].buffer);
+    }
+    for (int t = 0; t < topics; t++) closesocket(publishers[t]);
+    free(readers);
+    free(publishers);
+}
+
+// Every publisher and subscriber is a session of one "MUX" connection: the
+// publishers are sessions 1 to topics, the subscribers the ones after them
+void run_multiplexed(Round* round) {
+    memset(round, 0, sizeof(Round));
+    Reader reader;
+    reader.socket = connect_and_register("MUX:bench");
+    reader.buffer = (char*)malloc(RECEIVE_BUFFER_SIZE);
+    reader.used = 0;
+    char* frames = (char*)malloc((topics + sessions) * (sizeof(WireHeader) + 64));
+    if (reader.buffer == NULL || frames == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    
+    // All sessions are opened with one write, and their replies read after
+    int used = 0;
+    char registration[64];
+    for (int t = 0; t < topics; t++) {
+        int length = snprintf(registration, sizeof(registration), "PUBLISHER:MUXBENCH%d", t);
+        put_frame(frames, &used, WIRE_FLAG_SESSION, t + 1, registration, length);
+    }
+    for (int s = 0; s < sessions; s++) {
+        int length = snprintf(registration, sizeof(registration), "SUBSCRIBER:MUXBENCH%d", s % topics);
+        put_frame(frames, &used, WIRE_FLAG_SESSION, topics + 1 + s, registration, length);
+    }
+    send(reader.socket, frames, used, 0);
+    memset(topic_counts, 0, sizeof(topic_counts));
+    for (int n = 0; n < topics + sessions; n++) {
+        UINT32 session;
+        int topic_id;
+        read_session_reply(&reader, &session, &topic_id);
+        if (session > (UINT32)topics) topic_counts[topic_id & 0xFFFF]++;
+    }
+    round->sockets = 1;
+    round->receive_buffer = receive_buffer_of(reader.socket);
+    
+    publish(&reader.socket, 1, round, &reader, 1);
+    
+    closesocket(reader.socket);
+    free(reader.buffer);
+    free(frames);
+}
+
+// Publishes the messages in bursts, round-robin over the topics, and waits
+// for every delivery of a burst before the next. A burst goes out with one
+// write per publisher connection, or one write in all when multiplexed.
+void publish(SOCKET* publishers, int multiplexed, Round* round, Reader* readers, int reader_count) {
+    int per_socket = multiplexed ? burst : (burst + topics - 1) / topics;
+    int sockets = multiplexed ? 1 : topics;
+    char** out = (char**)malloc(sockets * sizeof(char*));
+    int* used = (int*)malloc(sockets * sizeof(int));
+    char* payload = (char*)malloc(message_size);
+    if (out == NULL || used == NULL || payload == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    for (int p = 0; p < sockets; p++) {
+        out[p] = (char*)malloc(per_socket * (sizeof(WireHeader) + message_size));
+        if (out[p] == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    memset(payload, 'x', message_size);
+    
+    LONGLONG start = now_ticks();
+    for (int sent = 0; sent < messages; ) {
+        int count = (messages - sent < burst) ? messages - sent : burst;
+        LONG64 expected = 0;
+        for (int p = 0; p < sockets; p++) used[p] = 0;
+        for (int m = 0; m < count; m++) {
+            int topic = (sent + m) % topics;
+            int p = multiplexed ? 0 : topic;
+            put_frame(out[p], &used[p], 0, multiplexed ? (UINT32)topic + 1 : 0, payload, message_size);
+            expected += subscribers_of[topic];
+        }
+        for (int p = 0; p < sockets; p++) {
+            if (used[p] == 0) continue;
+            send(publishers[p], out[p], used[p], 0);
+            round->send_calls++;
+        }
+        round->deliveries += receive_burst(readers, reader_count, multiplexed, expected, round);
+        sent += count;
+    }
+    round->seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    for (int p = 0; p < sockets; p++) free(out[p]);
+    free(out);
+    free(used);
+    free(payload);
+}
+
+// Reads frames from every reader until the burst's deliveries are in. On a
+// multiplexed connection a frame counts once for every subscriber session
+// of its topic, which the agent would hand it to.
+LONG64 receive_burst(Reader* readers, int count, int multiplexed, LONG64 expected, Round* round) {
+    static WSAPOLLFD* fds = NULL;
+    static int fds_count = 0;
+    if (fds_count < count) {
+        free(fds);
+        fds = (WSAPOLLFD*)malloc(count * sizeof(WSAPOLLFD));
+        fds_count = count;
+        if (fds == NULL) {
+            printf("Out of memory\n");
+            exit(1);
+        }
+    }
+    
+    LONG64 delivered = 0;
+    while (delivered < expected) {
+        for (int r = 0; r < count; r++) {
+            fds[r].fd = readers[r].socket;
+            fds[r].events = POLLRDNORM;
+            fds[r].revents = 0;
+        }
+        if (WSAPoll(fds, count, 5000) <= 0) {
+            printf("Timed out with %lld of %lld deliveries of a burst\n", (long long)delivered, (long long)expected);
+            exit(1);
+        }
+        
+        for (int r = 0; r < count; r++) {
+            if (fds[r].revents == 0) continue;
+            Reader* reader = &readers[r];
+            int received = recv(reader->socket, reader->buffer + reader->used, RECEIVE_BUFFER_SIZE - reader->used, 0);
+            if (received <= 0) {
+                printf("Server closed a connection\n");
+                exit(1);
+            }
+            round->recv_calls++;
+            round->bytes += received;
+            reader->used += received;
+            
+            int pos = 0;
+            while (reader->used - pos >= (int)sizeof(WireHeader)) {
+                const WireHeader* header = (const WireHeader*)(reader->buffer + pos);
+                int size = (int)sizeof(WireHeader) + (int)header->length;
+                if (reader->used - pos < size) break;
+                if ((header->flags & (WIRE_FLAG_NOTICE | WIRE_FLAG_SESSION)) == 0) {
+                    round->frames++;
+                    delivered += multiplexed ? topic_counts[header->topic_id & 0xFFFF] : 1;
+                }
+                pos += size;
+            }
+            memmove(reader->buffer, reader->buffer + pos, reader->used - pos);
+            reader->used -= pos;
+        }
+    }
+    return delivered;
+}
+
+void put_frame(char* out, int* used, UINT8 flags, UINT32 session, const char* payload, int length) {
+    WireHeader* header = (WireHeader*)(out + *used);
+    memset(header, 0, sizeof(WireHeader));
+    header->magic = WIRE_MAGIC;
+    header->version = WIRE_VERSION;
+    header->flags = flags;
+    header->length = length;
+    header->session = session;
+    memcpy(out + *used + sizeof(WireHeader), payload, length);
+    *used += (int)sizeof(WireHeader) + length;
+}
+
+// Connects and registers, failing on anything but an "OK" reply
+SOCKET connect_and_register(const char* registration) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    // Bursts are written whole, so nothing is gained by holding them back
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    
+    char reply[64];
+    int len = 0;
+    do {
+        if (recv(sock, reply + len, 1, 0) <= 0 || len == (int)sizeof(reply) - 2) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (reply[len++] != '\n');
+    reply[len] = '\0';
+    
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration as %s failed: %s", registration, reply);
+        exit(1);
+    }
+    return sock;
+}
+
+// Reads the "OK <ID> <TOPIC_ID>" session frame that answers a session opened
+void read_session_reply(Reader* reader, UINT32* session, int* topic_id) {
+    while (1) {
+        if (reader->used >= (int)sizeof(WireHeader)) {
+            const WireHeader* header = (const WireHeader*)reader->buffer;
+            int size = (int)sizeof(WireHeader) + (int)header->length;
+            if (reader->used >= size) {
+                char reply[64];
+                snprintf(reply, sizeof(reply), "%.*s", (int)header->length, reader->buffer + sizeof(WireHeader));
+                int id;
+                *session = header->session;
+                if (!(header->flags & WIRE_FLAG_SESSION) || sscanf(reply, "OK %d %d", &id, topic_id) != 2) {
+                    printf("Session %u was refused: %s", header->session, reply);
+                    exit(1);
+                }
+                memmove(reader->buffer, reader->buffer + size, reader->used - size);
+                reader->used -= size;
+                return;
+            }
+        }
+        int received = recv(reader->socket, reader->buffer + reader->used, RECEIVE_BUFFER_SIZE - reader->used, 0);
+        if (received <= 0) {
+            printf("Server closed the multiplexed connection\n");
+            exit(1);
+        }
+        reader->used += received;
+    }
+}
+
+int receive_buffer_of(SOCKET sock) {
+    int size = 0;
+    int length = sizeof(size);
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&size, &length);
+    return size;
+}
+
+// Reads a STATS report into out. Returns its length, 0 if there is none.
+int fetch_report(const char* name, char* out, int size) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        return 0;
+    }
+    
+    char request[64];
+    snprintf(request, sizeof(request), "STATS:%s\n", name);
+    send(sock, request, strlen(request), 0);
+    
+    int len = 0, received;
+    while (len < size - 1 && (received = recv(sock, out + len, size - 1 - len, 0)) > 0) len += received;
+    out[len] = '\0';
+    closesocket(sock);
+    return (strncmp(out, "Unknown report", 14) == 0) ? 0 : len;
+}
+
+// Receive buffers are the kernel memory the client side reserves for its
+// sockets; the server has as many
+void print_round(const char* name, const Round* round) {
+    printf("%-26s %8d %10lld %14.0f %12.1f %12lld %12lld\n", name, round->sockets,
+           (long long)round->sockets * round->receive_buffer / 1024, round->deliveries / round->seconds,
+           round->recv_calls > 0 ? round->frames / (double)round->recv_calls : 0.0,
+           (long long)round->recv_calls, (long long)round->send_calls);
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--sessions N] [--topics N] [--messages N] [--burst N] [--size BYTES]\n", program_name);
+    printf("Runs --sessions subscribers spread over --topics topics, with one publisher per\n");
+    printf("topic, first on a binary connection each and then as sessions of a single\n");
+    printf("MUX connection. Publishes --messages messages in bursts, waiting for every\n");
+    printf("delivery of a burst before the next, and reports the sockets and receive\n");
+    printf("buffers each way takes, deliveries per second and frames read per recv.\n");
+    printf("Examples:\n");
+    printf("  server.exe 5000 --quiet\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --sessions 1000 --topics 100 --messages 50000\n", program_name);
+}
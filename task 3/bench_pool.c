@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <process.h>
+#include "pool.h"
+
+#define MAX_THREADS 64
+#define MAX_COUNTS 16
+#define RING_SIZE 4096             // Power of two
+#define LOCAL_BATCH 64
+
+// Messages handed from a publisher thread to the thread that frees them,
+// like a worker flushing the last subscriber's copy
+typedef struct {
+    void* volatile slots[RING_SIZE];
+    volatile LONG head;            // Next slot to take, written by the consumer
+    volatile LONG tail;            // Next slot to fill, written by the producer
+    volatile LONG done;
+} Ring;
+
+typedef struct {
+    Ring* ring;
+    unsigned int seed;
+} Worker;
+
+// Global variables
+int messages = 1000000;            // Per publisher thread
+int counts[MAX_COUNTS] = { 1, 2, 4, 8 };
+int count_total = 4;
+int cross_thread = 0;
+
+double us_per_tick;
+
+// Function prototypes
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall consumer_thread(void* arg);
+double run(int threads);
+int message_size(unsigned int* seed);
+int parse_counts(const char* list);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if (parse_counts(argv[++i]) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (messages < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    pool_init();
+    
+    printf("%d messages per publisher thread, 64 to 1200 bytes with an occasional 64 KB chunk\n", messages);
+    printf("publishers  freed by          system Mmsg/s   pool Mmsg/s   speedup\n");
+    for (cross_thread = 0; cross_thread <= 1; cross_thread++) {
+        for (int c = 0; c < count_total; c++) {
+            pool_enabled = 0;
+            double system_rate = run(counts[c]);
+            pool_enabled = 1;
+            double pool_rate = run(counts[c]);
+            printf("%10d  %-16s %13.2f %13.2f %8.2fx\n", counts[c],
+                   cross_thread ? "another thread" : "same thread",
+                   system_rate / 1e6, pool_rate / 1e6, pool_rate / system_rate);
+        }
+    }
+    
+    char report[4096];
+    pool_report(report, sizeof(report));
+    printf("\n%s", report);
+    return 0;
+}
+
+// Accepts a comma separated list such as "1,2,4,8"
+int parse_counts(const char* list) {
+    count_total = 0;
+    while (*list && count_total < MAX_COUNTS) {
+        int threads = atoi(list);
+        if (threads < 1 || threads > MAX_THREADS) return -1;
+        counts[count_total++] = threads;
+        list = strchr(list, ',');
+        if (list == NULL) break;
+        list++;
+    }
+    return count_total > 0 ? 0 : -1;
+}
+
+// Mostly small formatted messages, one in a thousand a large message chunk
+int message_size(unsigned int* seed) {
+    *seed = *seed * 1103515245 + 12345;
+    unsigned int r = *seed >> 8;
+    if (r % 1000 == 0) return 65536 + 256;
+    return 64 + (int)(r % 1137);
+}
+
+// Allocates and fills messages. Same-thread runs free them in small
+// batches, cross-thread runs pass them to the paired consumer.
+unsigned __stdcall publisher_thread(void* arg) {
+    Worker* worker = (Worker*)arg;
+    void* batch[LOCAL_BATCH];
+    int batched = 0;
+    
+    for (int i = 0; i < messages; i++) {
+        int size = message_size(&worker->seed);
+        char* message = (char*)pool_alloc(size);
+        if (message == NULL) {
+            printf("Allocation of %d bytes failed\n", size);
+            exit(1);
+        }
+        memset(message, 'x', size < 256 ? size : 256);
+        
+        if (!cross_thread) {
+            batch[batched++] = message;
+            if (batched == LOCAL_BATCH) {
+                while (batched > 0) pool_free(batch[--batched]);
+            }
+            continue;
+        }
+        
+        Ring* ring = worker->ring;
+        while (ring->tail - ring->head == RING_SIZE) SwitchToThread();
+        ring->slots[ring->tail & (RING_SIZE - 1)] = message;
+        MemoryBarrier();
+        ring->tail++;
+    }
+    while (batched > 0) pool_free(batch[--batched]);
+    
+    if (worker->ring != NULL) worker->ring->done = 1;
+    pool_thread_release();
+    return 0;
+}
+
+unsigned __stdcall consumer_thread(void* arg) {
+    Ring* ring = (Ring*)arg;
+    
+    while (1) {
+        LONG tail = ring->tail;
+        if (ring->head == tail) {
+            if (ring->done && ring->head == ring->tail) break;
+            SwitchToThread();
+            continue;
+        }
+        MemoryBarrier();
+        while (ring->head != tail) {
+            pool_free(ring->slots[ring->head & (RING_SIZE - 1)]);
+            ring->head++;
+        }
+    }
+    pool_thread_release();
+    return 0;
+}
+
+// Messages per second over all publisher threads
+double run(int threads) {
+    Worker workers[MAX_THREADS];
+    HANDLE handles[2 * MAX_THREADS];
+    int handle_count = 0;
+    
+    LONGLONG start = now_ticks();
+    for (int t = 0; t < threads; t++) {
+        workers[t].seed = 12345 + t;
+        workers[t].ring = NULL;
+        if (cross_thread) {
+            workers[t].ring = (Ring*)calloc(1, sizeof(Ring));
+            if (workers[t].ring == NULL) exit(1);
+            handles[handle_count++] = (HANDLE)_beginthreadex(NULL, 0, consumer_thread, workers[t].ring, 0, NULL);
+        }
+        handles[handle_count++] = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, &workers[t], 0, NULL);
+    }
+    for (int h = 0; h < handle_count; h++) {
+        WaitForSingleObject(handles[h], INFINITE);
+        CloseHandle(handles[h]);
+    }
+    double seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    for (int t = 0; t < threads; t++) free(workers[t].ring);
+    return (double)messages * threads / seconds;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [--messages N] [--threads 1,2,4,8]\n", program_name);
+    printf("Allocates and frees broker-sized messages from several publisher threads,\n");
+    printf("first with the system allocator and then with the message buffer pool,\n");
+    printf("once freeing on the allocating thread and once handing every message to\n");
+    printf("another thread to free, as fan-out does.\n");
+    printf("Examples:\n");
+    printf("  %s\n", program_name);
+    printf("  %s --messages 5000000 --threads 1,4,16\n", program_name);
+}
@@ -0,0 +1,275 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_SECONDS 120
+#define MAX_PINGS_PER_SECOND 1000
+
+// Ping latencies and bulk volume observed in one second of the run
+typedef struct {
+    double latencies_ms[MAX_PINGS_PER_SECOND];
+    int pings;
+    LONG64 bulk_bytes;
+} SecondStats;
+
+// Global variables
+const char* server_ip;
+int port;
+const char* topic = "BULK";
+int seconds = 10;
+int bulk_size = 200;
+double drain_rate = 2.0;           // MB/s the subscriber reads, i.e. the saturated link
+double bulk_rate = 2.5;            // MB/s the bulk publisher offers
+int ping_interval_ms = 10;
+int fifo = 0;                      // Send pings without the !HIGH override
+volatile int running = 1;
+
+LONGLONG start_ticks;
+double ms_per_tick;
+SecondStats stats[MAX_SECONDS];
+
+// Function prototypes
+SOCKET connect_and_register(const char* type);
+unsigned __stdcall bulk_thread(void* arg);
+unsigned __stdcall ping_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+void record_line(const char* line, int length, LONGLONG now);
+LONGLONG now_ticks();
+int compare_doubles(const void* a, const void* b);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            topic = argv[++i];
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            bulk_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--drain") == 0 && i + 1 < argc) {
+            drain_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--offer") == 0 && i + 1 < argc) {
+            bulk_rate = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--ping-interval") == 0 && i + 1 < argc) {
+            ping_interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--fifo") == 0) {
+            fifo = 1;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (seconds < 1 || seconds > MAX_SECONDS || bulk_size < 16 || bulk_size >= BUFFER_SIZE - 100 ||
+        drain_rate <= 0 || bulk_rate <= 0 || ping_interval_ms < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ms_per_tick = 1000.0 / (double)frequency.QuadPart;
+    
+    // The subscriber registers first so it sees every message
+    SOCKET subscriber = connect_and_register("SUBSCRIBER");
+    SOCKET bulk = connect_and_register("PUBLISHER");
+    SOCKET ping = connect_and_register("PUBLISHER");
+    
+    printf("topic=%s size=%d offer=%.1f MB/s drain=%.1f MB/s ping every %d ms, %s\n",
+           topic, bulk_size, bulk_rate, drain_rate, ping_interval_ms,
+           fifo ? "pings in the bulk lane (--fifo)" : "pings marked !HIGH");
+    
+    start_ticks = now_ticks();
+    HANDLE threads[3];
+    threads[0] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &subscriber, 0, NULL);
+    threads[1] = (HANDLE)_beginthreadex(NULL, 0, bulk_thread, &bulk, 0, NULL);
+    threads[2] = (HANDLE)_beginthreadex(NULL, 0, ping_thread, &ping, 0, NULL);
+    
+    Sleep(seconds * 1000);
+    running = 0;
+    
+    // Closing the sockets ends any recv or send still in progress
+    closesocket(bulk);
+    closesocket(ping);
+    closesocket(subscriber);
+    for (int t = 0; t < 3; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+    
+    printf("second  bulk MB/s  pings   p50 ms   p99 ms   max ms\n");
+    for (int s = 0; s < seconds; s++) {
+        SecondStats* second = &stats[s];
+        printf("%6d  %9.2f  %5d", s + 1, second->bulk_bytes / (1024.0 * 1024.0), second->pings);
+        if (second->pings > 0) {
+            qsort(second->latencies_ms, second->pings, sizeof(double), compare_doubles);
+            printf("  %7.2f  %7.2f  %7.2f",
+                   second->latencies_ms[second->pings / 2],
+                   second->latencies_ms[(int)(second->pings * 0.99)],
+                   second->latencies_ms[second->pings - 1]);
+        }
+        printf("\n");
+    }
+    
+    WSACleanup();
+    return 0;
+}
+
+SOCKET connect_and_register(const char* type) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    // A small receive window keeps the link, not the kernel, the bottleneck
+    int receive_buffer = 16384;
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (char*)&receive_buffer, sizeof(receive_buffer));
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, topic);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Offers bulk lines at bulk_rate, faster than the subscriber drains them
+unsigned __stdcall bulk_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char line[BUFFER_SIZE];
+    
+    memset(line, 'x', bulk_size - 1);
+    memcpy(line, "BULK ", 5);
+    line[bulk_size - 1] = '\n';
+    
+    double bytes_per_ms = bulk_rate * 1024.0 * 1024.0 / 1000.0;
+    LONG64 sent = 0;
+    while (running) {
+        double elapsed_ms = (now_ticks() - start_ticks) * ms_per_tick;
+        if (sent >= elapsed_ms * bytes_per_ms) {
+            Sleep(1);
+            continue;
+        }
+        if (send(sock, line, bulk_size, 0) == SOCKET_ERROR) break;
+        sent += bulk_size;
+    }
+    return 0;
+}
+
+// Publishes a timestamped ping every ping_interval_ms
+unsigned __stdcall ping_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char line[128];
+    
+    while (running) {
+        int len = snprintf(line, sizeof(line), "%sPING %lld\n", fifo ? "" : "!HIGH ", (long long)now_ticks());
+        if (send(sock, line, len, 0) == SOCKET_ERROR) break;
+        Sleep(ping_interval_ms);
+    }
+    return 0;
+}
+
+// Reads no faster than drain_rate, emulating a saturated link
+unsigned __stdcall subscriber_thread(void* arg) {
+    SOCKET sock = *(SOCKET*)arg;
+    char buffer[4 * BUFFER_SIZE];
+    char line[2 * BUFFER_SIZE];
+    int line_len = 0;
+    
+    double bytes_per_ms = drain_rate * 1024.0 * 1024.0 / 1000.0;
+    LONG64 received = 0;
+    while (running) {
+        double elapsed_ms = (now_ticks() - start_ticks) * ms_per_tick;
+        LONG64 budget = (LONG64)(elapsed_ms * bytes_per_ms) - received;
+        if (budget <= 0) {
+            Sleep(1);
+            continue;
+        }
+        
+        int bytes_received = recv(sock, buffer, budget < (LONG64)sizeof(buffer) ? (int)budget : (int)sizeof(buffer), 0);
+        if (bytes_received <= 0) break;
+        received += bytes_received;
+        
+        LONGLONG now = now_ticks();
+        for (int i = 0; i < bytes_received; i++) {
+            if (line_len < (int)sizeof(line)) line[line_len++] = buffer[i];
+            if (buffer[i] == '\n') {
+                record_line(line, line_len, now);
+                line_len = 0;
+            }
+        }
+    }
+    return 0;
+}
+
+// Lines look like "[TOPIC] Publisher X: PING <ticks>" or "... BULK xxx"
+void record_line(const char* line, int length, LONGLONG now) {
+    int second = (int)((now - start_ticks) * ms_per_tick / 1000.0);
+    if (second >= MAX_SECONDS) return;
+    SecondStats* stats_now = &stats[second];
+    
+    const char* ping = strstr(line, ": PING ");
+    if (ping != NULL && ping < line + length) {
+        LONGLONG sent = _atoi64(ping + 7);
+        if (stats_now->pings < MAX_PINGS_PER_SECOND) {
+            stats_now->latencies_ms[stats_now->pings++] = (now - sent) * ms_per_tick;
+        }
+    } else {
+        stats_now->bulk_bytes += length;
+    }
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--topic T] [--seconds N] [--size BYTES]\n", program_name);
+    printf("          [--offer MB/s] [--drain MB/s] [--ping-interval MS] [--fifo]\n");
+    printf("Floods a topic with bulk messages faster than its subscriber drains them\n");
+    printf("and reports, per second, the latency of !HIGH pings sent on the same topic.\n");
+    printf("--fifo sends the pings without the override, queued behind the bulk.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --fifo\n", program_name);
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define RECEIVE_BUFFER_SIZE 65536
+#define SEND_BATCH_SIZE 65536
+#define REPORT_SIZE 4096
+#define MAX_ROUNDS 16
+#define MAX_THREADS 64             // Readers and publishers each
+#define MAX_LINE 512
+#define STARTUP_TIMEOUT_MS 5000
+#define STALL_TIMEOUT_MS 5000
+
+// A subscriber connection and the newest message it got of each publisher
+// and key, to check that every key arrives in order
+typedef struct {
+    SOCKET socket;
+    char line[MAX_LINE];           // Start of a line the last recv cut off
+    int line_used;
+    int* last;                     // [publisher * key_count + key]
+} Subscriber;
+
+// Results of one round
+typedef struct {
+    int threads;                   // --route-threads, 0 = the topic is not partitioned
+    double seconds;
+    LONG64 deliveries;
+    LONG64 out_of_order;
+} Round;
+
+// Global variables
+int port;
+const char* server_program = "server.exe";
+int thread_counts[MAX_ROUNDS] = {0, 1, 2, 4, 8};
+int round_count = 5;
+int subscriber_count = 200;
+int publisher_count = 4;
+int key_count = 64;
+int messages = 20000;
+int message_size = 64;
+int reader_count = 4;
+Subscriber* subscribers;
+SOCKET* publishers;
+volatile LONG64 delivered;
+volatile LONG64 out_of_order;
+volatile int stop_reading;
+char routes_report[REPORT_SIZE];
+
+double us_per_tick;
+
+// Function prototypes
+int parse_thread_counts(const char* list);
+int run_round(Round* round);
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall reader_thread(void* arg);
+void receive_lines(Subscriber* subscriber, const char* data, int length, LONG64* count);
+void check_line(Subscriber* subscriber, const char* line, int length);
+SOCKET connect_and_register(const char* registration, int wait_ms);
+int send_all(SOCKET sock, const char* data, int len);
+int fetch_report(const char* name, char* out, int size);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            if (parse_thread_counts(argv[++i]) != 0) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--subscribers") == 0 && i + 1 < argc) {
+            subscriber_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--publishers") == 0 && i + 1 < argc) {
+            publisher_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--keys") == 0 && i + 1 < argc) {
+            key_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+            reader_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_program = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (port <= 0 || subscriber_count < 1 || publisher_count < 1 || key_count < 1 || messages < publisher_count ||
+        message_size < 1 || message_size > MAX_LINE - 64 || reader_count < 1 || reader_count > MAX_THREADS ||
+        publisher_count > MAX_THREADS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (reader_count > subscriber_count) reader_count = subscriber_count;
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    subscribers = (Subscriber*)calloc(subscriber_count, sizeof(Subscriber));
+    publishers = (SOCKET*)calloc(publisher_count, sizeof(SOCKET));
+    if (subscribers == NULL || publishers == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    for (int s = 0; s < subscriber_count; s++) {
+        subscribers[s].last = (int*)malloc(publisher_count * key_count * sizeof(int));
+        if (subscribers[s].last == NULL) {
+            printf("Out of memory\n");
+            return 1;
+        }
+    }
+    
+    printf("One hot topic: %d subscribers, %d publishers over %d keys, %d messages of %d bytes per round\n\n",
+           subscriber_count, publisher_count, key_count, messages, message_size);
+    
+    Round rounds[MAX_ROUNDS];
+    for (int r = 0; r < round_count; r++) {
+        rounds[r].threads = thread_counts[r];
+        if (run_round(&rounds[r]) != 0) return 1;
+    }
+    
+    printf("%-14s %8s %12s %14s %8s %13s\n", "router threads", "seconds", "messages/s", "deliveries/s", "speedup",
+           "out of order");
+    for (int r = 0; r < round_count; r++) {
+        char name[16];
+        if (rounds[r].threads > 0) {
+            snprintf(name, sizeof(name), "%d", rounds[r].threads);
+        } else {
+            snprintf(name, sizeof(name), "off");
+        }
+        printf("%-14s %8.2f %12.0f %14.0f %7.2fx %13lld\n", name, rounds[r].seconds, messages / rounds[r].seconds,
+               rounds[r].deliveries / rounds[r].seconds, rounds[0].seconds / rounds[r].seconds,
+               (long long)rounds[r].out_of_order);
+    }
+    if (routes_report[0] != '\0') printf("\nLast round:\n%s", routes_report);
+    
+    WSACleanup();
+    return 0;
+}
+
+// Reads a comma-separated list of router thread counts, 0 for a round
+// without --partition
+int parse_thread_counts(const char* list) {
+    round_count = 0;
+    const char* p = list;
+    while (*p != '\0') {
+        if (round_count == MAX_ROUNDS || *p < '0' || *p > '9') return -1;
+        thread_counts[round_count++] = atoi(p);
+        while (*p >= '0' && *p <= '9') p++;
+        if (*p == ',') p++;
+    }
+    return round_count > 0 ? 0 : -1;
+}
+
+// Starts a server with the round's router threads, publishes every message
+// once the subscribers are in, and times until each subscriber has them all
+int run_round(Round* round) {
+    char command[512];
+    if (round->threads > 0) {
+        snprintf(command, sizeof(command), "%s %d --quiet --no-trace --max-queue %d --partition HOT --route-threads %d",
+                 server_program, port, messages, round->threads);
+    } else {
+        snprintf(command, sizeof(command), "%s %d --quiet --no-trace --max-queue %d", server_program, port, messages);
+    }
+    printf("Starting: %s\n", command);
+    
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) {
+        printf("Failed to start the server. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    
+    int failed = 0;
+    for (int s = 0; s < subscriber_count && !failed; s++) {
+        subscribers[s].socket = connect_and_register("SUBSCRIBER:HOT", s == 0 ? STARTUP_TIMEOUT_MS : 0);
+        subscribers[s].line_used = 0;
+        memset(subscribers[s].last, 0xff, publisher_count * key_count * sizeof(int));
+        if (subscribers[s].socket == INVALID_SOCKET) failed = 1;
+    }
+    for (int p = 0; p < publisher_count && !failed; p++) {
+        publishers[p] = connect_and_register("PUBLISHER:HOT", 0);
+        if (publishers[p] == INVALID_SOCKET) failed = 1;
+    }
+    
+    delivered = 0;
+    out_of_order = 0;
+    stop_reading = 0;
+    HANDLE readers[MAX_THREADS];
+    HANDLE senders[MAX_THREADS];
+    int reader_started = 0, sender_started = 0;
+    LONG64 expected = (LONG64)messages * subscriber_count;
+    LONGLONG start = now_ticks();
+    LONGLONG last_progress = start;
+    LONGLONG finished = start;
+    
+    if (!failed) {
+        for (int r = 0; r < reader_count; r++) {
+            readers[reader_started++] = (HANDLE)_beginthreadex(NULL, 0, reader_thread, (void*)(ULONG_PTR)r, 0, NULL);
+        }
+        for (int p = 0; p < publisher_count; p++) {
+            senders[sender_started++] = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, (void*)(ULONG_PTR)p, 0, NULL);
+        }
+        
+        // Done when every delivery is in, or when they stopped coming
+        LONG64 seen = 0;
+        while (1) {
+            LONGLONG now = now_ticks();
+            LONG64 count = delivered;
+            if (count != seen) {
+                seen = count;
+                last_progress = now;
+                finished = now;
+            }
+            if (count >= expected || (now - last_progress) * us_per_tick > STALL_TIMEOUT_MS * 1000.0) break;
+            Sleep(1);
+        }
+        for (int p = 0; p < sender_started; p++) {
+            WaitForSingleObject(senders[p], INFINITE);
+            CloseHandle(senders[p]);
+        }
+    }
+    
+    stop_reading = 1;
+    for (int r = 0; r < reader_started; r++) {
+        WaitForSingleObject(readers[r], INFINITE);
+        CloseHandle(readers[r]);
+    }
+    if (!failed && round->threads > 0) fetch_report("ROUTES", routes_report, sizeof(routes_report));
+    
+    for (int s = 0; s < subscriber_count; s++) {
+        if (subscribers[s].socket != INVALID_SOCKET) closesocket(subscribers[s].socket);
+        subscribers[s].socket = INVALID_SOCKET;
+    }
+    for (int p = 0; p < publisher_count; p++) {
+        if (publishers[p] != INVALID_SOCKET) closesocket(publishers[p]);
+        publishers[p] = INVALID_SOCKET;
+    }
+    TerminateProcess(process.hProcess, 0);
+    WaitForSingleObject(process.hProcess, INFINITE);
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    if (failed) return -1;
+    
+    round->seconds = (finished - start) * us_per_tick / 1e6;
+    round->deliveries = delivered;
+    round->out_of_order = out_of_order;
+    if (delivered < expected) {
+        printf("  only %lld of %lld deliveries arrived\n", (long long)delivered, (long long)expected);
+    }
+    return 0;
+}
+
+// Sends a publisher's share of the messages in large writes. Each carries
+// its key and the publisher's message number: "#K<KEY> <PUBLISHER>:<N> xxx".
+unsigned __stdcall publisher_thread(void* arg) {
+    int p = (int)(ULONG_PTR)arg;
+    char* batch = (char*)malloc(SEND_BATCH_SIZE);
+    if (batch == NULL) return 1;
+    
+    int share = messages / publisher_count + (p < messages % publisher_count ? 1 : 0);
+    int used = 0;
+    for (int n = 0; n < share; n++) {
+        int key = (n + p * 7) % key_count;
+        int length = snprintf(batch + used, MAX_LINE, "#k%d %d:%d ", key, p, n);
+        while (length < message_size) batch[used + length++] = 'x';
+        batch[used + length++] = '\n';
+        used += length;
+        if (used > SEND_BATCH_SIZE - MAX_LINE || n == share - 1) {
+            if (send_all(publishers[p], batch, used) != 0) break;
+            used = 0;
+        }
+    }
+    free(batch);
+    return 0;
+}
+
+// Polls every reader_count-th subscriber and counts the lines it receives
+unsigned __stdcall reader_thread(void* arg) {
+    int first = (int)(ULONG_PTR)arg;
+    int count = 0;
+    WSAPOLLFD* fds = (WSAPOLLFD*)malloc((subscriber_count / reader_count + 1) * sizeof(WSAPOLLFD));
+    int* owners = (int*)malloc((subscriber_count / reader_count + 1) * sizeof(int));
+    char* buffer = (char*)malloc(RECEIVE_BUFFER_SIZE);
+    if (fds == NULL || owners == NULL || buffer == NULL) return 1;
+    
+    for (int s = first; s < subscriber_count; s += reader_count) {
+        fds[count].fd = subscribers[s].socket;
+        fds[count].events = POLLRDNORM;
+        owners[count++] = s;
+    }
+    
+    while (!stop_reading && count > 0) {
+        if (WSAPoll(fds, count, 50) <= 0) continue;
+        LONG64 lines = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (fds[i].revents == 0) continue;
+            int received = recv(fds[i].fd, buffer, RECEIVE_BUFFER_SIZE, 0);
+            if (received > 0) {
+                receive_lines(&subscribers[owners[i]], buffer, received, &lines);
+            } else {
+                // The server dropped it; poll the others
+                fds[i] = fds[--count];
+                owners[i] = owners[count];
+            }
+        }
+        if (lines > 0) InterlockedAdd64(&delivered, lines);
+    }
+    free(fds);
+    free(owners);
+    free(buffer);
+    return 0;
+}
+
+// Checks each complete line, keeping a cut-off one for the next recv
+void receive_lines(Subscriber* subscriber, const char* data, int length, LONG64* count) {
+    int start = 0;
+    const char* end;
+    while ((end = (const char*)memchr(data + start, '\n', length - start)) != NULL) {
+        int line_length = (int)(end - data) - start;
+        if (subscriber->line_used > 0) {
+            int take = (subscriber->line_used + line_length < MAX_LINE - 1) ? line_length : MAX_LINE - 1 - subscriber->line_used;
+            memcpy(subscriber->line + subscriber->line_used, data + start, take);
+            subscriber->line[subscriber->line_used + take] = '\0';
+            check_line(subscriber, subscriber->line, subscriber->line_used + take);
+            subscriber->line_used = 0;
+        } else {
+            check_line(subscriber, data + start, line_length);
+        }
+        (*count)++;
+        start += line_length + 1;
+    }
+    
+    int rest = length - start;
+    if (subscriber->line_used + rest > MAX_LINE - 1) rest = MAX_LINE - 1 - subscriber->line_used;
+    memcpy(subscriber->line + subscriber->line_used, data + start, rest);
+    subscriber->line_used += rest;
+}
+
+// Every message of a publisher and key must come after the one before it.
+// The line is "[HOT] Publisher ID: #K<KEY> <PUBLISHER>:<N> ...", ended by a
+// newline or a terminating zero.
+void check_line(Subscriber* subscriber, const char* line, int length) {
+    const char* mark = (const char*)memchr(line, '#', length);
+    if (mark == NULL) return;
+    
+    char* next;
+    int key = (int)strtol(mark + 2, &next, 10);
+    int publisher = (int)strtol(next + 1, &next, 10);
+    int n = (int)strtol(next + 1, NULL, 10);
+    if (key < 0 || key >= key_count || publisher < 0 || publisher >= publisher_count) return;
+    
+    int* last = &subscriber->last[publisher * key_count + key];
+    if (n <= *last) InterlockedIncrement64(&out_of_order);
+    *last = n;
+}
+
+// Connects and registers, retrying for wait_ms while the server starts.
+// Returns INVALID_SOCKET on failure.
+SOCKET connect_and_register(const char* registration, int wait_ms) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    ULONGLONG deadline = GetTickCount64() + wait_ms;
+    SOCKET sock;
+    while (1) {
+        sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0) break;
+        closesocket(sock);
+        if (GetTickCount64() >= deadline) {
+            printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+            return INVALID_SOCKET;
+        }
+        Sleep(50);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s\n", registration);
+    send(sock, message, strlen(message), 0);
+    
+    char reply[64];
+    int len = 0;
+    do {
+        if (recv(sock, reply + len, 1, 0) <= 0 || len == (int)sizeof(reply) - 2) {
+            printf("Registration on port %d failed\n", port);
+            closesocket(sock);
+            return INVALID_SOCKET;
+        }
+    } while (reply[len++] != '\n');
+    reply[len] = '\0';
+    
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration as %s failed: %s", registration, reply);
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    return sock;
+}
+
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Reads a STATS report into out. Returns its length, 0 if there is none.
+int fetch_report(const char* name, char* out, int size) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        if (sock != INVALID_SOCKET) closesocket(sock);
+        out[0] = '\0';
+        return 0;
+    }
+    
+    char request[64];
+    snprintf(request, sizeof(request), "STATS:%s\n", name);
+    send(sock, request, strlen(request), 0);
+    
+    int len = 0, received;
+    while (len < size - 1 && (received = recv(sock, out + len, size - 1 - len, 0)) > 0) len += received;
+    out[len] = '\0';
+    closesocket(sock);
+    return (strncmp(out, "Unknown report", 14) == 0) ? 0 : len;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <PORT> [--threads LIST] [--subscribers N] [--publishers N] [--keys N]\n", program_name);
+    printf("       [--messages N] [--size BYTES] [--readers N] [--server PATH]\n");
+    printf("Starts the server once per entry of --threads (default: 0,1,2,4,8) with the\n");
+    printf("topic HOT partitioned over that many router threads, 0 meaning not\n");
+    printf("partitioned, so each publisher's worker fans its messages out. --publishers\n");
+    printf("send --messages messages spread over --keys keys to --subscribers\n");
+    printf("subscribers, and the round is timed until every subscriber has every\n");
+    printf("message. Reports fan-out throughput per router thread count and messages\n");
+    printf("that arrived before an earlier one of the same publisher and key.\n");
+    printf("Examples:\n");
+    printf("  %s 5000\n", program_name);
+    printf("  %s 5000 --threads 1,2,4,8,16 --subscribers 1000 --messages 50000\n", program_name);
+}
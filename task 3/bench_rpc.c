@@ -0,0 +1,318 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define READ_BUFFER_SIZE 65536
+
+// Buffered line reader over a blocking socket
+typedef struct {
+    SOCKET socket;
+    char data[READ_BUFFER_SIZE];
+    int length;
+    int pos;
+} LineReader;
+
+// Connections of one benchmark mode
+typedef struct {
+    SOCKET request_out;            // Requester sends requests here
+    SOCKET reply_in;               // Requester reads replies here
+    SOCKET request_in;             // Responder reads requests here
+    SOCKET reply_out;              // Responder sends replies here
+    int connections;
+} RpcLinks;
+
+// Global variables
+const char* server_ip;
+int port;
+const char* topic = "RPC";
+int request_count = 20000;
+int outstanding = 1;
+int payload_size = 64;
+
+double us_per_tick;
+LONGLONG* send_ticks = NULL;
+double* rtt_us = NULL;
+
+// Function prototypes
+SOCKET connect_and_register(const char* type, const char* register_topic);
+int read_line(LineReader* reader, char* line, int size);
+unsigned __stdcall native_responder(void* arg);
+unsigned __stdcall pubsub_responder(void* arg);
+void run_mode(const char* name, int native);
+const char* after_prefix(const char* line, int native);
+LONGLONG now_ticks();
+int compare_doubles(const void* a, const void* b);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    const char* mode = "both";
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--topic") == 0 && i + 1 < argc) {
+            topic = argv[++i];
+        } else if (strcmp(argv[i], "--requests") == 0 && i + 1 < argc) {
+            request_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--outstanding") == 0 && i + 1 < argc) {
+            outstanding = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            payload_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mode") == 0 && i + 1 < argc) {
+            mode = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (request_count < 1 || outstanding < 1 || payload_size < 1 || payload_size > BUFFER_SIZE - 200 ||
+        (strcmp(mode, "native") != 0 && strcmp(mode, "pubsub") != 0 && strcmp(mode, "both") != 0)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    send_ticks = (LONGLONG*)malloc(request_count * sizeof(LONGLONG));
+    rtt_us = (double*)malloc(request_count * sizeof(double));
+    if (send_ticks == NULL || rtt_us == NULL) return 1;
+    
+    printf("%d requests, %d outstanding, %d byte payload\n", request_count, outstanding, payload_size);
+    printf("mode      conns   seconds    req/s    p50 us    p90 us    p99 us    max us\n");
+    if (strcmp(mode, "pubsub") != 0) run_mode("native", 1);
+    if (strcmp(mode, "native") != 0) run_mode("pubsub", 0);
+    
+    WSACleanup();
+    return 0;
+}
+
+SOCKET connect_and_register(const char* type, const char* register_topic) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    // Round trips are latency bound; do not let Nagle hold requests back
+    int nodelay = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s:%s\n", type, register_topic);
+    send(sock, message, strlen(message), 0);
+    
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (c != '\n');
+    return sock;
+}
+
+// Returns the length of the next line without its newline, or -1 once the
+// socket is closed
+int read_line(LineReader* reader, char* line, int size) {
+    int length = 0;
+    while (1) {
+        if (reader->pos == reader->length) {
+            reader->length = recv(reader->socket, reader->data, READ_BUFFER_SIZE, 0);
+            reader->pos = 0;
+            if (reader->length <= 0) {
+                reader->length = 0;
+                return -1;
+            }
+        }
+        char c = reader->data[reader->pos++];
+        if (c == '\n') break;
+        if (length < size - 1) line[length++] = c;
+    }
+    line[length] = '\0';
+    return length;
+}
+
+// Answers "REQ <handle> <payload>" with "<handle> <payload>"
+unsigned __stdcall native_responder(void* arg) {
+    RpcLinks* links = (RpcLinks*)arg;
+    LineReader* reader = (LineReader*)malloc(sizeof(LineReader));
+    char line[BUFFER_SIZE];
+    if (reader == NULL) return 1;
+    reader->socket = links->request_in;
+    reader->length = reader->pos = 0;
+    
+    int length;
+    while ((length = read_line(reader, line, sizeof(line) - 1)) >= 0) {
+        if (length < 4 || strncmp(line, "REQ ", 4) != 0) continue;
+        line[length++] = '\n';
+        if (send(links->reply_out, line + 4, length - 4, 0) == SOCKET_ERROR) break;
+    }
+    free(reader);
+    return 0;
+}
+
+// Emulation: requests arrive as "[T.REQ] Publisher X: <REPLY_TOPIC> <id> <payload>"
+// and the reply is published on the requester's reply topic as "<id> <payload>"
+unsigned __stdcall pubsub_responder(void* arg) {
+    RpcLinks* links = (RpcLinks*)arg;
+    LineReader* reader = (LineReader*)malloc(sizeof(LineReader));
+    char line[BUFFER_SIZE];
+    if (reader == NULL) return 1;
+    reader->socket = links->request_in;
+    reader->length = reader->pos = 0;
+    
+    int length;
+    while ((length = read_line(reader, line, sizeof(line) - 1)) >= 0) {
+        const char* body = after_prefix(line, 0);
+        const char* reply = (body != NULL) ? strchr(body, ' ') : NULL;
+        if (reply == NULL) continue;
+        reply++;
+        
+        // One reply publisher per requester; this benchmark has a single one
+        line[length++] = '\n';
+        if (send(links->reply_out, reply, (int)(line + length - reply), 0) == SOCKET_ERROR) break;
+    }
+    free(reader);
+    return 0;
+}
+
+// Start of "<id> ..." in a reply line
+const char* after_prefix(const char* line, int native) {
+    if (native) return (strncmp(line, "REP ", 4) == 0) ? line + 4 : NULL;
+    const char* colon = strstr(line, ": ");
+    return colon ? colon + 2 : NULL;
+}
+
+// Runs request_count round trips with up to `outstanding` in flight and
+// prints the round-trip time distribution
+void run_mode(const char* name, int native) {
+    RpcLinks links;
+    char request_topic[128];
+    char reply_topic[128];
+    snprintf(request_topic, sizeof(request_topic), "%s.REQ", topic);
+    snprintf(reply_topic, sizeof(reply_topic), "%s.REPLY.%lu", topic, (unsigned long)GetCurrentProcessId());
+    
+    // Readers register first so no request or reply is published into a void
+    if (native) {
+        links.request_in = connect_and_register("RESPONDER", topic);
+        links.reply_out = links.request_in;
+        links.request_out = connect_and_register("REQUESTER", topic);
+        links.reply_in = links.request_out;
+        links.connections = 2;
+    } else {
+        links.reply_in = connect_and_register("SUBSCRIBER", reply_topic);
+        links.request_in = connect_and_register("SUBSCRIBER", request_topic);
+        links.reply_out = connect_and_register("PUBLISHER", reply_topic);
+        links.request_out = connect_and_register("PUBLISHER", request_topic);
+        links.connections = 4;
+    }
+    
+    HANDLE responder = (HANDLE)_beginthreadex(NULL, 0, native ? native_responder : pubsub_responder, &links, 0, NULL);
+    LineReader* reader = (LineReader*)malloc(sizeof(LineReader));
+    if (responder == NULL || reader == NULL) exit(1);
+    reader->socket = links.reply_in;
+    reader->length = reader->pos = 0;
+    
+    char payload[BUFFER_SIZE];
+    memset(payload, 'x', payload_size);
+    payload[payload_size] = '\0';
+    
+    char request[2 * BUFFER_SIZE];
+    char line[2 * BUFFER_SIZE];
+    int sent = 0;
+    int answered = 0;
+    LONGLONG start = now_ticks();
+    
+    while (answered < request_count) {
+        // Keep the window full
+        while (sent < request_count && sent - answered < outstanding) {
+            int len = native ? snprintf(request, sizeof(request), "%d %s\n", sent, payload)
+                             : snprintf(request, sizeof(request), "%s %d %s\n", reply_topic, sent, payload);
+            send_ticks[sent] = now_ticks();
+            if (send(links.request_out, request, len, 0) == SOCKET_ERROR) {
+                printf("Send failed. Error: %d\n", WSAGetLastError());
+                exit(1);
+            }
+            sent++;
+        }
+        
+        if (read_line(reader, line, sizeof(line)) < 0) {
+            printf("%s: server closed the connection after %d replies\n", name, answered);
+            exit(1);
+        }
+        const char* body = after_prefix(line, native);
+        if (body == NULL) {
+            printf("%s: unexpected reply '%s'\n", name, line);
+            exit(1);
+        }
+        int id = atoi(body);
+        if (id < 0 || id >= sent) continue;
+        rtt_us[answered++] = (now_ticks() - send_ticks[id]) * us_per_tick;
+    }
+    double seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    // Shutting the responder's socket down ends its blocking recv
+    shutdown(links.request_in, SD_BOTH);
+    closesocket(links.request_out);
+    closesocket(links.request_in);
+    if (!native) {
+        closesocket(links.reply_out);
+        closesocket(links.reply_in);
+    }
+    WaitForSingleObject(responder, INFINITE);
+    CloseHandle(responder);
+    free(reader);
+    
+    qsort(rtt_us, request_count, sizeof(double), compare_doubles);
+    printf("%-8s %6d  %8.3f  %7.0f  %8.1f  %8.1f  %8.1f  %8.1f\n",
+           name, links.connections, seconds, request_count / seconds,
+           rtt_us[request_count / 2], rtt_us[(int)(request_count * 0.90)],
+           rtt_us[(int)(request_count * 0.99)], rtt_us[request_count - 1]);
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--mode native|pubsub|both] [--requests N]\n", program_name);
+    printf("          [--outstanding N] [--size BYTES] [--topic T]\n");
+    printf("Measures request/reply round trips through the broker, natively with\n");
+    printf("REQUESTER/RESPONDER connections and emulated with a request topic plus a\n");
+    printf("per-requester reply topic. --outstanding sets how many requests are in flight.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --outstanding 32 --requests 100000\n", program_name);
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define MAX_THREADS 256
+
+// One connecting thread and the connections it holds open
+typedef struct {
+    int first;                     // Index of its first connection
+    int count;
+    int failures;
+    HANDLE thread;
+} StormThread;
+
+// Global variables
+const char* server_ip;
+int port;
+int connection_count = 2000;
+int thread_count = 32;
+int rounds = 3;
+
+SOCKET* sockets;
+double* latencies_us;              // Handshake completion time per connection
+double us_per_tick;
+
+// Function prototypes
+unsigned __stdcall storm_thread(void* arg);
+LONGLONG now_ticks();
+int compare_doubles(const void* a, const void* b);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connection_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--rounds") == 0 && i + 1 < argc) {
+            rounds = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (connection_count < 1 || thread_count < 1 || thread_count > MAX_THREADS || rounds < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (thread_count > connection_count) thread_count = connection_count;
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    sockets = (SOCKET*)malloc(connection_count * sizeof(SOCKET));
+    latencies_us = (double*)malloc(connection_count * sizeof(double));
+    if (sockets == NULL || latencies_us == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    
+    printf("connections=%d threads=%d rounds=%d\n", connection_count, thread_count, rounds);
+    
+    StormThread threads[MAX_THREADS];
+    for (int round = 1; round <= rounds; round++) {
+        // Every thread connects its share as fast as it can, all at once
+        LONGLONG start = now_ticks();
+        for (int t = 0; t < thread_count; t++) {
+            threads[t].first = (int)((LONGLONG)connection_count * t / thread_count);
+            threads[t].count = (int)((LONGLONG)connection_count * (t + 1) / thread_count) - threads[t].first;
+            threads[t].failures = 0;
+            threads[t].thread = (HANDLE)_beginthreadex(NULL, 0, storm_thread, &threads[t], 0, NULL);
+        }
+        
+        int failures = 0;
+        for (int t = 0; t < thread_count; t++) {
+            WaitForSingleObject(threads[t].thread, INFINITE);
+            CloseHandle(threads[t].thread);
+            failures += threads[t].failures;
+        }
+        double elapsed = (now_ticks() - start) * us_per_tick / 1e6;
+        
+        // Latencies of successful handshakes, failed ones are marked negative
+        int completed = 0;
+        for (int i = 0; i < connection_count; i++) {
+            if (latencies_us[i] >= 0) latencies_us[completed++] = latencies_us[i];
+        }
+        qsort(latencies_us, completed, sizeof(double), compare_doubles);
+        
+        printf("round %d: %d/%d handshakes in %.3f s, %.0f accepts/s, %d failed\n",
+               round, completed, connection_count, elapsed, completed / elapsed, failures);
+        if (completed > 0) {
+            printf("  handshake latency (ms): p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+                   latencies_us[completed / 2] / 1000.0,
+                   latencies_us[(int)(completed * 0.90)] / 1000.0,
+                   latencies_us[(int)(completed * 0.99)] / 1000.0,
+                   latencies_us[completed - 1] / 1000.0);
+        }
+        
+        // Drop everything, which is what a broker restart does to its clients
+        for (int i = 0; i < connection_count; i++) {
+            if (sockets[i] != INVALID_SOCKET) closesocket(sockets[i]);
+        }
+        Sleep(500);
+    }
+    
+    free(sockets);
+    free(latencies_us);
+    WSACleanup();
+    return 0;
+}
+
+// Connects, registers as a subscriber and waits for the "OK" line; the
+// elapsed time is the handshake completion latency the client observes
+unsigned __stdcall storm_thread(void* arg) {
+    StormThread* storm = (StormThread*)arg;
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    const char* registration = "SUBSCRIBER:STORM\n";
+    
+    for (int i = storm->first; i < storm->first + storm->count; i++) {
+        LONGLONG start = now_ticks();
+        latencies_us[i] = -1;
+        
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        sockets[i] = sock;
+        if (sock == INVALID_SOCKET) {
+            storm->failures++;
+            continue;
+        }
+        
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0 ||
+            send(sock, registration, strlen(registration), 0) == SOCKET_ERROR) {
+            storm->failures++;
+            continue;
+        }
+        
+        char c = 0;
+        int ok = 0;
+        char first = 0;
+        while (recv(sock, &c, 1, 0) == 1) {
+            if (first == 0) first = c;
+            if (c == '\n') {
+                ok = (first == 'O');
+                break;
+            }
+        }
+        
+        if (!ok) {
+            storm->failures++;
+            continue;
+        }
+        latencies_us[i] = (now_ticks() - start) * us_per_tick;
+    }
+    
+    return 0;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--connections N] [--threads N] [--rounds N]\n", program_name);
+    printf("Opens N subscriber connections at once, reports accepts per second and\n");
+    printf("handshake completion latency, then drops them and repeats.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --connections 10000 --threads 64 --rounds 5\n", program_name);
+}
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "server.h"
+
+#define REPORT_SIZE 4096
+#define LATE_BUCKETS 1000          // Milliseconds; later firings land in the last bucket
+
+// One timer of a simulated connection, re-armed each time it fires like a
+// heartbeat check
+typedef struct {
+    Timer timer;
+    ULONGLONG due;                 // GetTickCount64() it was set for
+} Entry;
+
+// Global variables
+int connections = 100000;
+int timers_per_connection = 3;
+int interval_ms = 10000;
+int reset_rate = 100000;           // Timers pushed back per second, as traffic does
+int seconds = 5;
+Entry* entries;
+int total;
+volatile int rearming = 1;
+volatile LONG64 fired = 0;
+LONG64 late_counts[LATE_BUCKETS];
+
+double us_per_tick;
+
+// Function prototypes
+void on_timer(Timer* timer);
+double sweep_us(int rounds);
+double percentile(const LONG64* counts, LONG64 count, double fraction);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--connections") == 0 && i + 1 < argc) {
+            connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--timers") == 0 && i + 1 < argc) {
+            timers_per_connection = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+            interval_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--resets") == 0 && i + 1 < argc) {
+            reset_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (connections < 1 || timers_per_connection < 1 || interval_ms < TIMER_TICK_MS || reset_rate < 0 || seconds < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    total = connections * timers_per_connection;
+    entries = (Entry*)calloc(total, sizeof(Entry));
+    if (entries == NULL || start_timers() != 0) {
+        printf("Cannot set up %d timers\n", total);
+        return 1;
+    }
+    for (int i = 0; i < total; i++) timer_init(&entries[i].timer, on_timer, &entries[i]);
+    printf("%d connections with %d timers each (%d timers), re-armed every %d ms, %d pushed back per second, %d s\n",
+           connections, timers_per_connection, total, interval_ms, reset_rate, seconds);
+    
+    // Insert and cancel, with the timers spread over one interval
+    srand(1);
+    LONGLONG start = now_ticks();
+    for (int i = 0; i < total; i++) {
+        int delay = interval_ms + rand() % interval_ms;
+        timer_set(&entries[i].timer, delay);
+    }
+    double set_ns = (now_ticks() - start) * us_per_tick * 1000.0 / total;
+    
+    start = now_ticks();
+    for (int i = 0; i < total; i++) timer_cancel(&entries[i].timer);
+    double cancel_ns = (now_ticks() - start) * us_per_tick * 1000.0 / total;
+    printf("timer_set:    %6.0f ns per timer\n", set_ns);
+    printf("timer_cancel: %6.0f ns per timer\n", cancel_ns);
+    
+    // Every timer fires once per interval and sets itself again, unless
+    // traffic on its connection pushes it back first
+    ULONGLONG now;
+    for (int i = 0; i < total; i++) {
+        int delay = rand() % interval_ms;
+        entries[i].due = GetTickCount64() + delay;
+        timer_set(&entries[i].timer, delay);
+    }
+    LONG64 resets = 0;
+    ULONGLONG begin = GetTickCount64();
+    while ((now = GetTickCount64()) - begin < (ULONGLONG)seconds * 1000) {
+        LONG64 target = (LONG64)(now - begin) * reset_rate / 1000;
+        for (; resets < target; resets++) {
+            Entry* entry = &entries[((unsigned)rand() * 32768u + (unsigned)rand()) % total];
+            entry->due = now + interval_ms;
+            timer_set(&entry->timer, interval_ms);
+        }
+        Sleep(1);
+    }
+    rearming = 0;
+    
+    LONG64 count = 0;
+    for (int b = 0; b < LATE_BUCKETS; b++) count += late_counts[b];
+    printf("Pushed back: %lld\n", (long long)resets);
+    printf("Fired: %lld (%.0f per second); lateness p50 %.0f ms, p99 %.0f ms, p99.9 %.0f ms\n",
+           (long long)fired, fired / (double)seconds, percentile(late_counts, count, 0.50),
+           percentile(late_counts, count, 0.99), percentile(late_counts, count, 0.999));
+    
+    char report[REPORT_SIZE];
+    timer_report(report, sizeof(report));
+    printf("%s", report);
+    printf("For comparison, a sweep checking every timer's deadline each tick: %.0f us per tick\n", sweep_us(20));
+    
+    stop_timers();
+    free(entries);
+    return 0;
+}
+
+// Runs on the timer thread; the lateness is against the time asked for,
+// so it includes the rounding up to whole ticks
+void on_timer(Timer* timer) {
+    Entry* entry = (Entry*)timer->context;
+    ULONGLONG now = GetTickCount64();
+    LONG64 late = (now > entry->due) ? (LONG64)(now - entry->due) : 0;
+    late_counts[late < LATE_BUCKETS ? late : LATE_BUCKETS - 1]++;
+    fired++;
+    
+    if (rearming) {
+        entry->due = now + interval_ms;
+        timer_set(timer, interval_ms);
+    }
+}
+
+// Time of one pass over all timers comparing each deadline with the clock,
+// what a timer thread without the wheel would do every tick
+double sweep_us(int rounds) {
+    LONGLONG best = 0;
+    volatile LONG64 due = 0;
+    for (int r = 0; r < rounds; r++) {
+        ULONGLONG now = GetTickCount64();
+        LONGLONG start = now_ticks();
+        for (int i = 0; i < total; i++) {
+            if (entries[i].due <= now) due++;
+        }
+        LONGLONG elapsed = now_ticks() - start;
+        if (r == 0 || elapsed < best) best = elapsed;
+    }
+    return best * us_per_tick;
+}
+
+// Upper edge of the millisecond bucket holding the given fraction of all samples
+double percentile(const LONG64* counts, LONG64 count, double fraction) {
+    LONG64 target = (LONG64)(count * fraction);
+    LONG64 seen = 0;
+    for (int b = 0; b < LATE_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > target) return b + 1;
+    }
+    return LATE_BUCKETS;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s [--connections N] [--timers N] [--interval MS] [--resets N] [--seconds N]\n", program_name);
+    printf("Drives the server's timer wheel (timer.c) with --timers timers for each of\n");
+    printf("--connections connections: the cost of setting and cancelling one, then\n");
+    printf("--seconds of every timer firing and setting itself again each --interval,\n");
+    printf("as heartbeat and idle checks do, while --resets random timers per second\n");
+    printf("are pushed back a full interval. Reports how late timers fire and the time\n");
+    printf("the timer thread spends per tick, next to a sweep over all timers.\n");
+    printf("Examples:\n");
+    printf("  %s\n", program_name);
+    printf("  %s --connections 1000000 --timers 1 --interval 15000 --resets 0 --seconds 10\n", program_name);
+}
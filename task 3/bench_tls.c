@@ -0,0 +1,433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#pragma comment(lib, "ws2_32.lib")
+#pragma comment(lib, "libssl.lib")
+#pragma comment(lib, "libcrypto.lib")
+
+#define RECEIVE_BUFFER_SIZE 65536
+#define SEND_BATCH_SIZE 65536
+#define MAX_THREADS 64
+#define MAX_LINE 4096
+#define STARTUP_TIMEOUT_MS 5000
+#define STALL_TIMEOUT_MS 5000
+
+#define ROUND_COUNT 2
+
+typedef enum {
+    MODE_PLAINTEXT,
+    MODE_TLS                       // The server encrypts every record; Winsock has no kernel TLS offload
+} Mode;
+
+// A subscriber connection, with its TLS session in the TLS rounds
+typedef struct {
+    SOCKET socket;
+    SSL* ssl;
+} Subscriber;
+
+// Results of one round
+typedef struct {
+    Mode mode;
+    double seconds;
+    LONG64 deliveries;
+    double server_cpu;             // Seconds of server CPU while fanning out
+} Round;
+
+// Global variables
+int port;
+const char* server_program = "server.exe";
+const char* cert_file = "server.crt";
+const char* key_file = "server.key";
+int subscriber_count = 100;
+int messages = 20000;
+int message_size = 256;
+int reader_count = 4;
+Subscriber* subscribers;
+SSL_CTX* context;
+volatile LONG64 delivered;
+volatile int stop_reading;
+
+double us_per_tick;
+
+// Function prototypes
+int run_round(Round* round);
+unsigned __stdcall reader_thread(void* arg);
+int connect_subscriber(Subscriber* subscriber, int tls, int wait_ms);
+int read_reply(Subscriber* subscriber, char* reply, int size);
+int publish(SOCKET publisher);
+SOCKET connect_to(int to_port, int wait_ms);
+int send_all(SOCKET sock, const char* data, int len);
+double process_cpu_seconds(HANDLE process);
+LONGLONG now_ticks();
+const char* mode_name(Mode mode);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--subscribers") == 0 && i + 1 < argc) {
+            subscriber_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--messages") == 0 && i + 1 < argc) {
+            messages = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--readers") == 0 && i + 1 < argc) {
+            reader_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cert") == 0 && i + 1 < argc) {
+            cert_file = argv[++i];
+        } else if (strcmp(argv[i], "--key") == 0 && i + 1 < argc) {
+            key_file = argv[++i];
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_program = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (port <= 0 || subscriber_count < 1 || messages < 1 || message_size < 16 || message_size > MAX_LINE - 64 ||
+        reader_count < 1 || reader_count > MAX_THREADS) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (reader_count > subscriber_count) reader_count = subscriber_count;
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    // The subscribers trust the server's certificate itself
+    context = SSL_CTX_new(TLS_client_method());
+    if (context == NULL || SSL_CTX_load_verify_locations(context, cert_file, NULL) != 1) {
+        printf("Cannot load %s\n", cert_file);
+        ERR_print_errors_fp(stdout);
+        return 1;
+    }
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    subscribers = (Subscriber*)calloc(subscriber_count, sizeof(Subscriber));
+    if (subscribers == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    
+    printf("One topic: %d subscribers, %d messages of %d bytes per round\n\n", subscriber_count, messages, message_size);
+    
+    Round rounds[ROUND_COUNT];
+    for (int r = 0; r < ROUND_COUNT; r++) {
+        rounds[r].mode = (Mode)r;
+        if (run_round(&rounds[r]) != 0) return 1;
+    }
+    
+    printf("%-15s %8s %14s %10s %12s %14s\n", "subscribers on", "seconds", "deliveries/s", "MB/s",
+           "server CPU", "us/delivery");
+    for (int r = 0; r < ROUND_COUNT; r++) {
+        printf("%-15s %8.2f %14.0f %10.1f %11.2fs %14.2f\n", mode_name(rounds[r].mode), rounds[r].seconds,
+               rounds[r].deliveries / rounds[r].seconds,
+               (double)rounds[r].deliveries * message_size / rounds[r].seconds / (1024.0 * 1024.0),
+               rounds[r].server_cpu, rounds[r].server_cpu * 1e6 / (rounds[r].deliveries ? rounds[r].deliveries : 1));
+    }
+    
+    SSL_CTX_free(context);
+    WSACleanup();
+    return 0;
+}
+
+// Starts a server with a TLS port, connects the subscribers to the port
+// of the round, publishes every message in plaintext and times until each
+// subscriber has them all
+int run_round(Round* round) {
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %d --quiet --no-trace --max-queue %d --tls-port %d --tls-cert %s --tls-key %s",
+             server_program, port, messages, port + 1, cert_file, key_file);
+    printf("Starting: %s\n", command);
+    
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) {
+        printf("Failed to start the server. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    
+    int failed = 0;
+    int tls = (round->mode != MODE_PLAINTEXT);
+    for (int s = 0; s < subscriber_count && !failed; s++) {
+        if (connect_subscriber(&subscribers[s], tls, s == 0 ? STARTUP_TIMEOUT_MS : 0) != 0) failed = 1;
+    }
+    SOCKET publisher = failed ? INVALID_SOCKET : connect_to(port, 0);
+    char reply[64];
+    if (publisher == INVALID_SOCKET || send_all(publisher, "PUBLISHER:BENCH\n", 16) != 0 ||
+        recv(publisher, reply, sizeof(reply), 0) <= 0) {
+        failed = 1;
+    }
+    
+    delivered = 0;
+    stop_reading = 0;
+    HANDLE readers[MAX_THREADS];
+    int reader_started = 0;
+    LONG64 expected = (LONG64)messages * subscriber_count;
+    double cpu_before = process_cpu_seconds(process.hProcess);
+    LONGLONG start = now_ticks();
+    LONGLONG last_progress = start;
+    LONGLONG finished = start;
+    
+    if (!failed) {
+        for (int r = 0; r < reader_count; r++) {
+            readers[reader_started++] = (HANDLE)_beginthreadex(NULL, 0, reader_thread, (void*)(ULONG_PTR)r, 0, NULL);
+        }
+        publish(publisher);
+        
+        // Done when every delivery is in, or when they stopped coming
+        LONG64 seen = 0;
+        while (1) {
+            LONGLONG now = now_ticks();
+            LONG64 count = delivered;
+            if (count != seen) {
+                seen = count;
+                last_progress = now;
+                finished = now;
+            }
+            if (count >= expected || (now - last_progress) * us_per_tick > STALL_TIMEOUT_MS * 1000.0) break;
+            Sleep(1);
+        }
+    }
+    
+    stop_reading = 1;
+    for (int r = 0; r < reader_started; r++) {
+        WaitForSingleObject(readers[r], INFINITE);
+        CloseHandle(readers[r]);
+    }
+    round->server_cpu = process_cpu_seconds(process.hProcess) - cpu_before;
+    
+    for (int s = 0; s < subscriber_count; s++) {
+        if (subscribers[s].ssl != NULL) SSL_free(subscribers[s].ssl);
+        if (subscribers[s].socket != INVALID_SOCKET) closesocket(subscribers[s].socket);
+        subscribers[s].ssl = NULL;
+        subscribers[s].socket = INVALID_SOCKET;
+    }
+    if (publisher != INVALID_SOCKET) closesocket(publisher);
+    TerminateProcess(process.hProcess, 0);
+    WaitForSingleObject(process.hProcess, INFINITE);
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    if (failed) return -1;
+    
+    round->seconds = (finished - start) * us_per_tick / 1e6;
+    round->deliveries = delivered;
+    if (delivered < expected) {
+        printf("  only %lld of %lld deliveries arrived\n", (long long)delivered, (long long)expected);
+    }
+    return 0;
+}
+
+// Sends the messages in large writes: "<N> xxx...\n"
+int publish(SOCKET publisher) {
+    char* batch = (char*)malloc(SEND_BATCH_SIZE);
+    if (batch == NULL) return -1;
+    
+    int used = 0;
+    int result = 0;
+    for (int n = 0; n < messages && result == 0; n++) {
+        int length = snprintf(batch + used, MAX_LINE, "%d ", n);
+        while (length < message_size) batch[used + length++] = 'x';
+        batch[used + length++] = '\n';
+        used += length;
+        if (used > SEND_BATCH_SIZE - MAX_LINE || n == messages - 1) {
+            result = send_all(publisher, batch, used);
+            used = 0;
+        }
+    }
+    free(batch);
+    return result;
+}
+
+// Polls every reader_count-th subscriber and counts the lines it receives.
+// A TLS subscriber is read until OpenSSL has no record left, since the
+// poll does not see plaintext it already decrypted.
+unsigned __stdcall reader_thread(void* arg) {
+    int first = (int)(ULONG_PTR)arg;
+    int count = 0;
+    WSAPOLLFD* fds = (WSAPOLLFD*)malloc((subscriber_count / reader_count + 1) * sizeof(WSAPOLLFD));
+    int* owners = (int*)malloc((subscriber_count / reader_count + 1) * sizeof(int));
+    char* buffer = (char*)malloc(RECEIVE_BUFFER_SIZE);
+    if (fds == NULL || owners == NULL || buffer == NULL) return 1;
+    
+    for (int s = first; s < subscriber_count; s += reader_count) {
+        fds[count].fd = subscribers[s].socket;
+        fds[count].events = POLLRDNORM;
+        owners[count++] = s;
+    }
+    
+    while (!stop_reading && count > 0) {
+        if (WSAPoll(fds, count, 50) <= 0) continue;
+        LONG64 lines = 0;
+        for (int i = count - 1; i >= 0; i--) {
+            if (fds[i].revents == 0) continue;
+            Subscriber* subscriber = &subscribers[owners[i]];
+            
+            int open = 1;
+            while (1) {
+                int received;
+                if (subscriber->ssl != NULL) {
+                    received = SSL_read(subscriber->ssl, buffer, RECEIVE_BUFFER_SIZE);
+                    if (received <= 0) {
+                        open = (SSL_get_error(subscriber->ssl, received) == SSL_ERROR_WANT_READ);
+                        break;
+                    }
+                } else {
+                    received = recv(fds[i].fd, buffer, RECEIVE_BUFFER_SIZE, 0);
+                    open = (received > 0);
+                    if (!open) break;
+                }
+                for (const char* p = buffer; (p = (const char*)memchr(p, '\n', buffer + received - p)) != NULL; p++) {
+                    lines++;
+                }
+                if (subscriber->ssl == NULL) break;
+            }
+            if (!open) {
+                // The server dropped it; poll the others
+                fds[i] = fds[--count];
+                owners[i] = owners[count];
+            }
+        }
+        if (lines > 0) InterlockedAdd64(&delivered, lines);
+    }
+    free(fds);
+    free(owners);
+    free(buffer);
+    return 0;
+}
+
+// Connects a subscriber to the plaintext or the TLS port and registers it.
+// Its socket is non-blocking afterwards, for the reader threads.
+int connect_subscriber(Subscriber* subscriber, int tls, int wait_ms) {
+    subscriber->ssl = NULL;
+    subscriber->socket = connect_to(tls ? port + 1 : port, wait_ms);
+    if (subscriber->socket == INVALID_SOCKET) return -1;
+    
+    if (tls) {
+        subscriber->ssl = SSL_new(context);
+        if (subscriber->ssl == NULL || SSL_set_fd(subscriber->ssl, (int)subscriber->socket) != 1 ||
+            X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(subscriber->ssl), "127.0.0.1") != 1 ||
+            SSL_connect(subscriber->ssl) != 1 || SSL_write(subscriber->ssl, "SUBSCRIBER:BENCH\n", 17) != 17) {
+            printf("TLS handshake with the server failed\n");
+            ERR_print_errors_fp(stdout);
+            return -1;
+        }
+    } else if (send_all(subscriber->socket, "SUBSCRIBER:BENCH\n", 17) != 0) {
+        return -1;
+    }
+    
+    char reply[64];
+    if (read_reply(subscriber, reply, sizeof(reply)) != 0 || strncmp(reply, "OK", 2) != 0) {
+        printf("Subscriber not accepted\n");
+        return -1;
+    }
+    
+    u_long nonblocking = 1;
+    ioctlsocket(subscriber->socket, FIONBIO, &nonblocking);
+    return 0;
+}
+
+// Reads the registration reply up to its newline; nothing follows it
+// before the round publishes
+int read_reply(Subscriber* subscriber, char* reply, int size) {
+    int len = 0;
+    while (len < size - 1) {
+        int received = subscriber->ssl ? SSL_read(subscriber->ssl, reply + len, size - 1 - len)
+                                       : recv(subscriber->socket, reply + len, size - 1 - len, 0);
+        if (received <= 0) return -1;
+        len += received;
+        if (reply[len - 1] == '\n') break;
+    }
+    reply[len] = '\0';
+    return 0;
+}
+
+// Connects to a port of the server, retrying while it starts up
+SOCKET connect_to(int to_port, int wait_ms) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(to_port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    int waited = 0;
+    while (1) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0) return sock;
+        closesocket(sock);
+        if (waited >= wait_ms) {
+            printf("Cannot connect to port %d. Error: %d\n", to_port, WSAGetLastError());
+            return INVALID_SOCKET;
+        }
+        Sleep(50);
+        waited += 50;
+    }
+}
+
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// User and kernel CPU time the process used so far
+double process_cpu_seconds(HANDLE process) {
+    FILETIME created, exited, kernel, user;
+    if (!GetProcessTimes(process, &created, &exited, &kernel, &user)) return 0;
+    ULONGLONG total = ((ULONGLONG)kernel.dwHighDateTime << 32 | kernel.dwLowDateTime) +
+                      ((ULONGLONG)user.dwHighDateTime << 32 | user.dwLowDateTime);
+    return total / 1e7;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+const char* mode_name(Mode mode) {
+    switch (mode) {
+        case MODE_PLAINTEXT: return "plaintext";
+        default: return "TLS";
+    }
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <PORT> [--subscribers N] [--messages N] [--size BYTES] [--readers N]\n", program_name);
+    printf("       [--cert FILE] [--key FILE] [--server PATH]\n");
+    printf("Starts the server twice with a TLS port at PORT + 1 and the given\n");
+    printf("certificate and key (default: server.crt and server.key). The subscribers\n");
+    printf("connect to the plaintext port, then to the TLS port, where the server\n");
+    printf("encrypts every record itself. One plaintext publisher sends --messages\n");
+    printf("messages, and each round is timed until every subscriber has every\n");
+    printf("message. Reports throughput and the server's CPU time while fanning out.\n");
+    printf("Needs a server built with -DWITH_TLS.\n");
+    printf("Examples:\n");
+    printf("  %s 5000\n", program_name);
+    printf("  %s 5000 --subscribers 500 --size 1024 --cert server.crt --key server.key\n", program_name);
+}
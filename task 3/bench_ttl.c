@@ -0,0 +1,382 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+
+#define RECEIVE_BUFFER_SIZE 65536
+#define SUBSCRIBER_SOCKET_BUFFER 16384
+#define SEND_BUFFER_SIZE 16384
+#define MAX_LINE 4096
+#define MAX_AGE_MS 60000           // Ages are counted per millisecond up to here
+#define REPORT_SIZE 4096
+#define STARTUP_TIMEOUT_MS 5000
+
+// Results of one round
+typedef struct {
+    int ttl_ms;                    // 0 for the round without one
+    LONG64 published;
+    LONG64 delivered;
+    LONG64 expired;                // Skipped and reaped, from the TTL report
+    int age_p50;
+    int age_p99;
+    int age_max;
+} Round;
+
+// Global variables
+int port;
+const char* server_program = "server.exe";
+int offer_rate = 10000;            // Messages per second
+int message_size = 256;
+double drain_mb = 1.0;             // What the subscriber reads per second
+int seconds = 5;
+int ttl_ms = 100;
+volatile int stop_publishing;
+volatile LONG64 published;
+LONG64* ages;                      // Deliveries per millisecond of age
+
+double us_per_tick;
+
+// Function prototypes
+int run_round(Round* round);
+unsigned __stdcall publisher_thread(void* arg);
+void read_slowly(SOCKET subscriber, Round* round);
+void count_line(const char* line, int length, LONGLONG now_us, Round* round);
+SOCKET connect_to(int to_port, int wait_ms, int receive_buffer);
+int register_as(SOCKET sock, const char* registration);
+int send_all(SOCKET sock, const char* data, int len);
+int fetch_report(const char* name, char* out, int size);
+LONGLONG now_us();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    port = atoi(argv[1]);
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--offer") == 0 && i + 1 < argc) {
+            offer_rate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--drain") == 0 && i + 1 < argc) {
+            drain_mb = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            ttl_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_program = argv[++i];
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (port <= 0 || offer_rate < 1000 || message_size < 32 || message_size > MAX_LINE - 64 || drain_mb <= 0 ||
+        seconds < 1 || ttl_ms < 1) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    ages = (LONG64*)malloc((MAX_AGE_MS + 1) * sizeof(LONG64));
+    if (ages == NULL) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    
+    printf("One topic: %d messages/s of %d bytes offered for %d s, the subscriber reads %.1f MB/s\n\n",
+           offer_rate, message_size, seconds, drain_mb);
+    
+    Round rounds[2];
+    rounds[0].ttl_ms = 0;
+    rounds[1].ttl_ms = ttl_ms;
+    for (int r = 0; r < 2; r++) {
+        if (run_round(&rounds[r]) != 0) return 1;
+    }
+    
+    printf("%-12s %10s %10s %10s %10s %10s %10s\n", "round", "published", "delivered", "expired",
+           "age p50", "age p99", "age max");
+    for (int r = 0; r < 2; r++) {
+        char name[32];
+        if (rounds[r].ttl_ms > 0) {
+            snprintf(name, sizeof(name), "TTL %d ms", rounds[r].ttl_ms);
+        } else {
+            snprintf(name, sizeof(name), "no TTL");
+        }
+        printf("%-12s %10lld %10lld %10lld %7d ms %7d ms %7d ms\n", name, (long long)rounds[r].published,
+               (long long)rounds[r].delivered, (long long)rounds[r].expired,
+               rounds[r].age_p50, rounds[r].age_p99, rounds[r].age_max);
+    }
+    
+    free(ages);
+    WSACleanup();
+    return 0;
+}
+
+// Starts a server, with the TTL of the round on the topic, and lets the
+// publisher outpace the subscriber for the given time. Every delivery's
+// age is measured from the timestamp the publisher put in it.
+int run_round(Round* round) {
+    char command[512];
+    int length = snprintf(command, sizeof(command), "%s %d --quiet --no-trace --send-buffer %d",
+                          server_program, port, SEND_BUFFER_SIZE);
+    if (round->ttl_ms > 0) snprintf(command + length, sizeof(command) - length, " --ttl BENCH=%d", round->ttl_ms);
+    printf("Starting: %s\n", command);
+    
+    STARTUPINFOA startup;
+    PROCESS_INFORMATION process;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    if (!CreateProcessA(NULL, command, NULL, NULL, FALSE, 0, NULL, NULL, &startup, &process)) {
+        printf("Failed to start the server. Error: %lu\n", (unsigned long)GetLastError());
+        return -1;
+    }
+    
+    int failed = 0;
+    SOCKET subscriber = connect_to(port, STARTUP_TIMEOUT_MS, SUBSCRIBER_SOCKET_BUFFER);
+    SOCKET publisher = (subscriber != INVALID_SOCKET) ? connect_to(port, 0, 0) : INVALID_SOCKET;
+    if (publisher == INVALID_SOCKET || register_as(subscriber, "SUBSCRIBER:BENCH\n") != 0 ||
+        register_as(publisher, "PUBLISHER:BENCH\n") != 0) {
+        failed = 1;
+    }
+    
+    memset(ages, 0, (MAX_AGE_MS + 1) * sizeof(LONG64));
+    round->delivered = 0;
+    round->expired = 0;
+    published = 0;
+    stop_publishing = 0;
+    if (!failed) {
+        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, (void*)(ULONG_PTR)publisher, 0, NULL);
+        read_slowly(subscriber, round);
+        stop_publishing = 1;
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+        
+        // "Expired: N skipped ..., M reaped" of the TTL report
+        char report[REPORT_SIZE];
+        if (fetch_report("TTL", report, sizeof(report)) > 0) {
+            const char* expired = strstr(report, "Expired: ");
+            const char* reaped = strstr(report, "flushed, ");
+            if (expired != NULL) round->expired += _atoi64(expired + 9);
+            if (reaped != NULL) round->expired += _atoi64(reaped + 9);
+        }
+    }
+    round->published = published;
+    
+    if (subscriber != INVALID_SOCKET) closesocket(subscriber);
+    if (publisher != INVALID_SOCKET) closesocket(publisher);
+    TerminateProcess(process.hProcess, 0);
+    WaitForSingleObject(process.hProcess, INFINITE);
+    CloseHandle(process.hProcess);
+    CloseHandle(process.hThread);
+    if (failed) return -1;
+    
+    // Percentiles of the deliveries by age
+    LONG64 seen = 0;
+    round->age_p50 = round->age_p99 = round->age_max = 0;
+    for (int ms = 0; ms <= MAX_AGE_MS; ms++) {
+        if (ages[ms] == 0) continue;
+        if (seen < round->delivered / 2 && seen + ages[ms] >= round->delivered / 2) round->age_p50 = ms;
+        if (seen < round->delivered * 99 / 100 && seen + ages[ms] >= round->delivered * 99 / 100) round->age_p99 = ms;
+        seen += ages[ms];
+        round->age_max = ms;
+    }
+    return 0;
+}
+
+// Publishes "<timestamp in us> xxx...\n" at offer_rate, a millisecond's
+// worth at a time
+unsigned __stdcall publisher_thread(void* arg) {
+    SOCKET publisher = (SOCKET)(ULONG_PTR)arg;
+    char* batch = (char*)malloc(MAX_LINE * 64);
+    if (batch == NULL) return 1;
+    
+    LONGLONG start = now_us();
+    while (!stop_publishing) {
+        LONG64 due = (now_us() - start) * offer_rate / 1000000;
+        if (due <= published) {
+            Sleep(1);
+            continue;
+        }
+        
+        int used = 0;
+        int lines = 0;
+        while (published + lines < due && lines < 64) {
+            int length = snprintf(batch + used, MAX_LINE, "%lld ", (long long)now_us());
+            while (length < message_size) batch[used + length++] = 'x';
+            batch[used + length++] = '\n';
+            used += length;
+            lines++;
+        }
+        if (send_all(publisher, batch, used) != 0) break;
+        published += lines;
+    }
+    free(batch);
+    return 0;
+}
+
+// Reads no faster than drain_mb per second for the length of the round
+void read_slowly(SOCKET subscriber, Round* round) {
+    char* buffer = (char*)malloc(RECEIVE_BUFFER_SIZE + MAX_LINE);
+    if (buffer == NULL) return;
+    
+    DWORD timeout = 100;
+    setsockopt(subscriber, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+    
+    double bytes_per_us = drain_mb * 1024.0 * 1024.0 / 1e6;
+    LONGLONG start = now_us();
+    LONGLONG consumed = 0;
+    int kept = 0;                  // Start of a line that was split across reads
+    while (1) {
+        LONGLONG now = now_us();
+        if (now - start >= (LONGLONG)seconds * 1000000) break;
+        
+        LONGLONG allowed = (LONGLONG)((now - start) * bytes_per_us) - consumed;
+        if (allowed <= 0) {
+            Sleep(1);
+            continue;
+        }
+        if (allowed > RECEIVE_BUFFER_SIZE) allowed = RECEIVE_BUFFER_SIZE;
+        
+        int received = recv(subscriber, buffer + kept, (int)allowed, 0);
+        if (received == 0) break;
+        if (received < 0) continue;
+        consumed += received;
+        
+        int end = kept + received;
+        int line = 0;
+        now = now_us();
+        for (int i = 0; i < end; i++) {
+            if (buffer[i] != '\n') continue;
+            count_line(buffer + line, i - line, now, round);
+            line = i + 1;
+        }
+        kept = end - line;
+        memmove(buffer, buffer + line, kept);
+    }
+    free(buffer);
+}
+
+// "[BENCH] Publisher N: <timestamp> xxx..."
+void count_line(const char* line, int length, LONGLONG now, Round* round) {
+    const char* colon = (const char*)memchr(line, ':', length);
+    if (colon == NULL) return;
+    
+    LONGLONG stamp = _atoi64(colon + 2);
+    int age = (int)((now - stamp) / 1000);
+    if (age < 0) age = 0;
+    if (age > MAX_AGE_MS) age = MAX_AGE_MS;
+    ages[age]++;
+    round->delivered++;
+}
+
+// Connects to the server, retrying while it starts up; a receive buffer
+// of 0 keeps the system default
+SOCKET connect_to(int to_port, int wait_ms, int receive_buffer) {
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(to_port);
+    inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr);
+    
+    int waited = 0;
+    while (1) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+        if (receive_buffer > 0) {
+            setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char*)&receive_buffer, sizeof(receive_buffer));
+        }
+        if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) == 0) return sock;
+        closesocket(sock);
+        if (waited >= wait_ms) {
+            printf("Cannot connect to port %d. Error: %d\n", to_port, WSAGetLastError());
+            return INVALID_SOCKET;
+        }
+        Sleep(50);
+        waited += 50;
+    }
+}
+
+// Sends a registration and reads its "OK" reply up to the newline
+int register_as(SOCKET sock, const char* registration) {
+    if (send_all(sock, registration, (int)strlen(registration)) != 0) return -1;
+    
+    char reply[64];
+    int len = 0;
+    while (len < (int)sizeof(reply) - 1) {
+        int received = recv(sock, reply + len, 1, 0);
+        if (received <= 0) return -1;
+        if (reply[len++] == '\n') break;
+    }
+    reply[len] = '\0';
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration refused: %s", reply);
+        return -1;
+    }
+    return 0;
+}
+
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Reads a STATS report into out. Returns its length, 0 if there is none.
+int fetch_report(const char* name, char* out, int size) {
+    SOCKET sock = connect_to(port, 0, 0);
+    if (sock == INVALID_SOCKET) {
+        out[0] = '\0';
+        return 0;
+    }
+    
+    char request[64];
+    snprintf(request, sizeof(request), "STATS:%s\n", name);
+    send(sock, request, strlen(request), 0);
+    
+    int len = 0, received;
+    while (len < size - 1 && (received = recv(sock, out + len, size - 1 - len, 0)) > 0) len += received;
+    out[len] = '\0';
+    closesocket(sock);
+    return (strncmp(out, "Unknown report", 14) == 0) ? 0 : len;
+}
+
+// Microseconds on the performance counter, which the publisher and the
+// subscriber share
+LONGLONG now_us() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (LONGLONG)(now.QuadPart * us_per_tick);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <PORT> [--offer MSGS] [--size BYTES] [--drain MB] [--seconds S] [--ttl MS] [--server PATH]\n", program_name);
+    printf("Starts the server twice, without and with --ttl BENCH=MS (default: 100). A\n");
+    printf("publisher offers --offer messages per second (default: 10000) of --size bytes\n");
+    printf("(default: 256) while the subscriber reads only --drain MB per second (default:\n");
+    printf("1.0), for --seconds (default: 5). Each message carries the time it was\n");
+    printf("published; reports how many were delivered and expired, and how old the\n");
+    printf("delivered ones were when they arrived.\n");
+    printf("Examples:\n");
+    printf("  %s 5000\n", program_name);
+    printf("  %s 5000 --offer 20000 --drain 2 --ttl 50\n", program_name);
+}
@@ -0,0 +1,317 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#include "wire.h"
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define MAX_TOPICS 64
+#define BUCKET_US 10               // Histogram resolution
+#define BUCKETS 20000              // Up to 200 ms; slower messages land in the last bucket
+#define BATCH 64                   // Messages per send at most
+
+// One publisher and its subscriber on a topic of their own. The publisher
+// keeps at most window messages on their way, so the broker is never
+// overloaded and latency is not just queueing.
+typedef struct {
+    SOCKET publisher;
+    SOCKET subscriber;
+    volatile LONG64 sent;
+    volatile LONG64 received;
+    LONG64 bytes;                  // Received by the subscriber while measuring
+    LONG64 measured;               // Messages received while measuring
+    LONG64 counts[BUCKETS];
+} Pair;
+
+// Global variables
+const char* server_ip;
+int port;
+int seconds = 3;
+int topics = 4;
+int message_size = 64;
+int window = 256;
+volatile int running = 1;
+volatile int measuring = 0;
+int publish_binary;
+int subscribe_binary;
+
+double us_per_tick;
+
+// Function prototypes
+void run_round(int round, int publisher_binary, int subscriber_binary);
+SOCKET connect_and_register(const char* type, int binary, const char* topic);
+unsigned __stdcall publisher_thread(void* arg);
+unsigned __stdcall subscriber_thread(void* arg);
+void record(Pair* pair, const char* stamp, int bytes, LONGLONG now);
+double percentile(const LONG64* counts, LONG64 total, double fraction);
+LONGLONG now_ticks();
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--seconds") == 0 && i + 1 < argc) {
+            seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--topics") == 0 && i + 1 < argc) {
+            topics = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            message_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            window = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (seconds < 1 || topics < 1 || topics > MAX_TOPICS || window < 1 ||
+        message_size < 24 || message_size > MAX_WIRE_PAYLOAD) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    printf("%d topics, one publisher and one subscriber each, %d byte payloads, window %d, %d s per round\n",
+           topics, message_size, window, seconds);
+    printf("publisher  subscriber   messages/s   bytes/msg   p50 us   p99 us  p99.9 us\n");
+    run_round(0, 0, 0);
+    run_round(1, 1, 1);
+    run_round(2, 1, 0);
+    run_round(3, 0, 1);
+    
+    WSACleanup();
+    return 0;
+}
+
+// Measures one combination of encodings, on topics no other round uses
+void run_round(int round, int publisher_binary, int subscriber_binary) {
+    publish_binary = publisher_binary;
+    subscribe_binary = subscriber_binary;
+    running = 1;
+    measuring = 0;
+    
+    Pair* pairs = (Pair*)calloc(topics, sizeof(Pair));
+    HANDLE* threads = (HANDLE*)malloc(2 * topics * sizeof(HANDLE));
+    if (pairs == NULL || threads == NULL) {
+        printf("Out of memory\n");
+        exit(1);
+    }
+    
+    char topic[32];
+    for (int t = 0; t < topics; t++) {
+        snprintf(topic, sizeof(topic), "WIRE%d_%d", round, t);
+        pairs[t].subscriber = connect_and_register("SUBSCRIBER", subscriber_binary, topic);
+        pairs[t].publisher = connect_and_register("PUBLISHER", publisher_binary, topic);
+    }
+    for (int t = 0; t < topics; t++) {
+        threads[2 * t] = (HANDLE)_beginthreadex(NULL, 0, subscriber_thread, &pairs[t], 0, NULL);
+        threads[2 * t + 1] = (HANDLE)_beginthreadex(NULL, 0, publisher_thread, &pairs[t], 0, NULL);
+    }
+    
+    // The first half second warms up
+    Sleep(500);
+    measuring = 1;
+    LONGLONG measure_start = now_ticks();
+    Sleep(seconds * 1000);
+    measuring = 0;
+    double measured_s = (now_ticks() - measure_start) * us_per_tick / 1e6;
+    running = 0;
+    
+    // Closing the sockets ends any recv or send still in progress
+    for (int t = 0; t < topics; t++) {
+        closesocket(pairs[t].publisher);
+        closesocket(pairs[t].subscriber);
+    }
+    for (int t = 0; t < 2 * topics; t++) {
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+    }
+    
+    static LONG64 merged[BUCKETS];
+    memset(merged, 0, sizeof(merged));
+    LONG64 total = 0, bytes = 0;
+    for (int t = 0; t < topics; t++) {
+        for (int b = 0; b < BUCKETS; b++) merged[b] += pairs[t].counts[b];
+        total += pairs[t].measured;
+        bytes += pairs[t].bytes;
+    }
+    
+    printf("%-9s  %-10s  %11.0f  %10.1f", publisher_binary ? "binary" : "text", subscriber_binary ? "binary" : "text",
+           total / measured_s, total > 0 ? (double)bytes / total : 0.0);
+    if (total > 0) {
+        printf("  %7.0f  %7.0f  %8.0f", percentile(merged, total, 0.50), percentile(merged, total, 0.99),
+               percentile(merged, total, 0.999));
+    }
+    printf("\n");
+    
+    free(pairs);
+    free(threads);
+}
+
+SOCKET connect_and_register(const char* type, int binary, const char* topic) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[128];
+    snprintf(message, sizeof(message), "%s%s:%s\n", type, binary ? "/BINARY" : "", topic);
+    send(sock, message, strlen(message), 0);
+    
+    char reply[128];
+    int len = 0;
+    do {
+        if (len == (int)sizeof(reply) - 1 || recv(sock, &reply[len], 1, 0) <= 0) {
+            printf("Registration on port %d failed\n", port);
+            exit(1);
+        }
+    } while (reply[len++] != '\n');
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration rejected: %.*s", len, reply);
+        exit(1);
+    }
+    return sock;
+}
+
+// Sends batches of messages whose payload starts with the send time in
+// ticks, as text, so every round's subscriber reads the same stamp
+unsigned __stdcall publisher_thread(void* arg) {
+    Pair* pair = (Pair*)arg;
+    int frame_size = publish_binary ? (int)sizeof(WireHeader) + message_size : message_size;
+    char* batch = (char*)malloc(BATCH * frame_size);
+    if (batch == NULL) return 0;
+    
+    while (running) {
+        int due = window - (int)(pair->sent - pair->received);
+        if (due <= 0) {
+            Sleep(0);
+            continue;
+        }
+        if (due > BATCH) due = BATCH;
+        
+        LONGLONG now = now_ticks();
+        for (int m = 0; m < due; m++) {
+            char* frame = batch + m * frame_size;
+            char* payload = frame;
+            if (publish_binary) {
+                WireHeader* header = (WireHeader*)frame;
+                memset(header, 0, sizeof(WireHeader));
+                header->magic = WIRE_MAGIC;
+                header->version = WIRE_VERSION;
+                header->length = message_size;
+                payload = frame + sizeof(WireHeader);
+            }
+            int stamp_len = snprintf(payload, message_size, "%lld ", (long long)now);
+            memset(payload + stamp_len, 'x', message_size - stamp_len - 1);
+            payload[message_size - 1] = '\n';
+        }
+        pair->sent += due;
+        if (send(pair->publisher, batch, due * frame_size, 0) == SOCKET_ERROR) break;
+    }
+    free(batch);
+    return 0;
+}
+
+// A text subscriber finds the payload after "[TOPIC] Publisher X: " in
+// every line; a binary one reads the frame's length and payload in place
+unsigned __stdcall subscriber_thread(void* arg) {
+    Pair* pair = (Pair*)arg;
+    char buffer[16 * BUFFER_SIZE];
+    int used = 0;
+    
+    while (running) {
+        int bytes_received = recv(pair->subscriber, buffer + used, sizeof(buffer) - used, 0);
+        if (bytes_received <= 0) break;
+        used += bytes_received;
+        
+        LONGLONG now = now_ticks();
+        int pos = 0;
+        if (subscribe_binary) {
+            while (used - pos >= (int)sizeof(WireHeader)) {
+                const WireHeader* header = (const WireHeader*)(buffer + pos);
+                int size = (int)sizeof(WireHeader) + (int)header->length;
+                if (used - pos < size) break;
+                record(pair, buffer + pos + sizeof(WireHeader), size, now);
+                pos += size;
+            }
+        } else {
+            char* newline;
+            while ((newline = (char*)memchr(buffer + pos, '\n', used - pos)) != NULL) {
+                *newline = '\0';
+                const char* payload = strstr(buffer + pos, ": ");
+                if (payload != NULL) record(pair, payload + 2, (int)(newline - (buffer + pos)) + 1, now);
+                pos = (int)(newline - buffer) + 1;
+            }
+        }
+        memmove(buffer, buffer + pos, used - pos);
+        used -= pos;
+    }
+    return 0;
+}
+
+void record(Pair* pair, const char* stamp, int bytes, LONGLONG now) {
+    pair->received++;
+    if (!measuring) return;
+    
+    double latency_us = (now - _atoi64(stamp)) * us_per_tick;
+    int bucket = (int)(latency_us / BUCKET_US);
+    if (bucket < 0) bucket = 0;
+    if (bucket >= BUCKETS) bucket = BUCKETS - 1;
+    pair->counts[bucket]++;
+    pair->measured++;
+    pair->bytes += bytes;
+}
+
+// Upper edge of the bucket holding the given fraction of all samples
+double percentile(const LONG64* counts, LONG64 total, double fraction) {
+    LONG64 target = (LONG64)(total * fraction);
+    LONG64 seen = 0;
+    for (int b = 0; b < BUCKETS; b++) {
+        seen += counts[b];
+        if (seen > target) return (b + 1) * (double)BUCKET_US;
+    }
+    return BUCKETS * (double)BUCKET_US;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> [--seconds N] [--topics N] [--size BYTES] [--window N]\n", program_name);
+    printf("Publishes timestamped messages through the server in four rounds: text to text,\n");
+    printf("binary to binary, binary to text and text to binary subscribers. Each publisher\n");
+    printf("keeps at most --window messages in flight. Reports deliveries per second, bytes\n");
+    printf("on the subscriber's wire per message and the end-to-end latency percentiles.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000\n", program_name);
+    printf("  %s 127.0.0.1 5000 --topics 8 --size 256 --window 64\n", program_name);
+}
@@ -0,0 +1,119 @@
+#include "server.h"
+
+// Spin state of one busy-poll worker. Written by the worker only; reports
+// read it without a lock.
+typedef struct BusyPoll {
+    LONGLONG last_active;          // trace_now() of the last poll that found a socket ready
+    LONGLONG average_gap;          // Between such polls, in ticks; a moving average over about 8
+    LONGLONG last_poll;            // trace_now() of the last poll
+    int spinning;                  // That poll did not block
+    LONGLONG spin_ticks;           // Spent polling without blocking
+    LONG64 polls;
+    LONG64 empty_polls;            // Found no socket ready
+    LONG64 sleeps;                 // Gave up spinning and blocked
+} BusyPoll;
+
+// Global variables
+int busy_poll_cpus[MAX_WORKER_CPUS];   // --busy-poll-cpus, one busy-poll worker each
+int busy_poll_cpu_count = 0;
+int busy_poll_us = DEFAULT_BUSY_POLL_US;
+int busy_poll_workers = 0;
+
+static BusyPoll* states = NULL;
+static double ticks_per_us = 1.0;
+static LONGLONG started = 0;
+
+// Decides the number of busy-poll workers: one per CPU of --busy-poll-cpus,
+// else one, and none if no topic is busy-polled
+int busy_poll_init() {
+    int topics = 0;
+    for (int i = 0; i < topic_policy_count; i++) {
+        if (topic_policies[i].busy_poll) topics++;
+    }
+    if (topics == 0) return 0;
+    
+    busy_poll_workers = (busy_poll_cpu_count > 0) ? busy_poll_cpu_count : 1;
+    states = (BusyPoll*)calloc(busy_poll_workers, sizeof(BusyPoll));
+    if (states == NULL) return -1;
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ticks_per_us = (double)frequency.QuadPart / 1e6;
+    started = trace_now();
+    return 0;
+}
+
+struct BusyPoll* busy_poll_state(int index) {
+    return &states[index];
+}
+
+// Returns the timeout of a busy-poll worker's next WSAPoll, given how many
+// sockets the last one found ready and the timeout an ordinary worker would
+// use. The worker keeps polling without blocking for twice the average gap
+// between ready polls, from BUSY_POLL_MIN_SPIN_US up to --busy-poll-us after
+// the last one, so a steady feed never waits for a thread wake-up. Once the
+// topics are quiet for longer than that it blocks like any worker, and the
+// next message wakes it.
+int busy_poll_wait(struct BusyPoll* poll, int ready, int timeout) {
+    LONGLONG now = trace_now();
+    if (poll->spinning) poll->spin_ticks += now - poll->last_poll;
+    poll->last_poll = now;
+    poll->polls++;
+    
+    if (ready > 0) {
+        if (poll->last_active != 0) poll->average_gap += (now - poll->last_active - poll->average_gap) / 8;
+        poll->last_active = now;
+        poll->spinning = 1;
+        return 0;
+    }
+    poll->empty_polls++;
+    
+    LONGLONG spin = 2 * poll->average_gap;
+    LONGLONG shortest = (LONGLONG)(BUSY_POLL_MIN_SPIN_US * ticks_per_us);
+    LONGLONG longest = (LONGLONG)(busy_poll_us * ticks_per_us);
+    if (spin < shortest) spin = shortest;
+    if (spin > longest) spin = longest;
+    if (now - poll->last_active < spin) {
+        // Lets another thread on this CPU run; returns at once on a CPU of its own
+        SwitchToThread();
+        poll->spinning = 1;
+        return 0;
+    }
+    
+    poll->sleeps++;
+    poll->spinning = 0;
+    return timeout;
+}
+
+int busy_poll_report(char* out, int size) {
+    if (busy_poll_workers == 0) {
+        return snprintf(out, size, "Busy-poll: off; no topic is named by --busy-poll\n");
+    }
+    
+    int len = snprintf(out, size, "Busy-poll: %d worker(s), spinning up to %d us after the last message; topics:",
+                       busy_poll_workers, busy_poll_us);
+    for (int i = 0; i < topic_policy_count && len < size; i++) {
+        if (topic_policies[i].busy_poll) len += snprintf(out + len, size - len, " %s", topic_policies[i].topic);
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "\n%8s %6s %12s %12s %12s %8s %10s %9s\n",
+                        "worker", "cpu", "connections", "polls", "empty", "sleeps", "spin us", "spinning");
+    }
+    
+    double elapsed = (trace_now() - started) / ticks_per_us;
+    for (int n = 0; n < busy_poll_workers && len < size; n++) {
+        const BusyPoll* poll = &states[n];
+        int index = worker_count + n;
+        char cpu[16] = "-";
+        if (worker_cpu_of(index) >= 0) snprintf(cpu, sizeof(cpu), "%d", worker_cpu_of(index));
+        
+        double spin_us = 2 * poll->average_gap / ticks_per_us;
+        if (spin_us < BUSY_POLL_MIN_SPIN_US) spin_us = BUSY_POLL_MIN_SPIN_US;
+        if (spin_us > busy_poll_us) spin_us = busy_poll_us;
+        len += snprintf(out + len, size - len, "%8d %6s %12d %12lld %12lld %8lld %10.0f %8.1f%%\n",
+                        index, cpu, worker_connections(index), (long long)poll->polls, (long long)poll->empty_polls,
+                        (long long)poll->sleeps, spin_us,
+                        elapsed > 0 ? 100.0 * poll->spin_ticks / ticks_per_us / elapsed : 0.0);
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <winsock2.h>
+#include <process.h>
+#include "capture.h"
+
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+#define CAPTURE_FLUSH_MS 1000
+
+// Publish paths append records to the active buffer under a short lock; a
+// writer thread swaps it with the spare buffer and writes it to disk, so
+// file I/O never runs on a worker. When the writer falls a full buffer
+// behind, records are dropped and counted instead of stalling the broker.
+static FILE* capture_file = NULL;
+static CRITICAL_SECTION capture_lock;
+static CONDITION_VARIABLE capture_ready;
+static char* active = NULL;
+static int active_used = 0;
+static char* spare = NULL;
+static int spare_full = 0;         // Spare holds a buffer the writer has not taken yet
+static volatile int stopping = 0;
+static HANDLE writer = NULL;
+
+static LONGLONG start_ticks;
+static double ns_per_tick;
+static LONGLONG records_written = 0;
+static LONGLONG bytes_written = 0;
+static LONGLONG records_dropped = 0;
+
+static unsigned __stdcall capture_writer(void* arg);
+
+int capture_open(const char* path) {
+    capture_file = fopen(path, "wb");
+    active = (char*)malloc(CAPTURE_BUFFER_SIZE);
+    spare = (char*)malloc(CAPTURE_BUFFER_SIZE);
+    if (capture_file == NULL || active == NULL || spare == NULL) {
+        printf("Cannot open capture file '%s'\n", path);
+        return -1;
+    }
+    
+    CaptureHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.start_unix_ms = (long long)time(NULL) * 1000;
+    fwrite(&header, sizeof(header), 1, capture_file);
+    
+    LARGE_INTEGER frequency, now;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&now);
+    ns_per_tick = 1e9 / (double)frequency.QuadPart;
+    start_ticks = now.QuadPart;
+    
+    InitializeCriticalSection(&capture_lock);
+    InitializeConditionVariable(&capture_ready);
+    writer = (HANDLE)_beginthreadex(NULL, 0, capture_writer, NULL, 0, NULL);
+    if (writer == NULL) {
+        printf("Failed to create capture writer thread\n");
+        return -1;
+    }
+    
+    printf("Capturing publishes and subscriptions to '%s'\n", path);
+    return 0;
+}
+
+// Appends one record. Called from the publish and registration paths.
+void capture_event(CaptureType type, int client_id, const char* topic, const char* payload, int length) {
+    if (writer == NULL) return;
+    
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    
+    CaptureRecord record;
+    int topic_length = (int)strlen(topic);
+    if (topic_length > 255) topic_length = 255;
+    if (length > 65535) length = 65535;
+    record.time_ns = (unsigned long long)((now.QuadPart - start_ticks) * ns_per_tick);
+    record.client_id = client_id;
+    record.payload_length = (unsigned short)length;
+    record.type = (unsigned char)type;
+    record.topic_length = (unsigned char)topic_length;
+    int size = (int)sizeof(record) + topic_length + length;
+    
+    EnterCriticalSection(&capture_lock);
+    if (active_used + size > CAPTURE_BUFFER_SIZE) {
+        if (spare_full) {
+            records_dropped++;
+            LeaveCriticalSection(&capture_lock);
+            return;
+        }
+        char* full = active;
+        active = spare;
+        spare = full;
+        spare_full = active_used;
+        active_used = 0;
+        WakeConditionVariable(&capture_ready);
+    }
+    char* out = active + active_used;
+    memcpy(out, &record, sizeof(record));
+    memcpy(out + sizeof(record), topic, topic_length);
+    if (length > 0) memcpy(out + sizeof(record) + topic_length, payload, length);
+    active_used += size;
+    LeaveCriticalSection(&capture_lock);
+}
+
+// Writes full buffers as they come and a partial one at least every
+// CAPTURE_FLUSH_MS, so the file is never more than a second behind
+static unsigned __stdcall capture_writer(void* arg) {
+    (void)arg;
+    char* buffer = (char*)malloc(CAPTURE_BUFFER_SIZE);
+    if (buffer == NULL) return 1;
+    
+    EnterCriticalSection(&capture_lock);
+    while (1) {
+        if (!spare_full && !stopping) {
+            SleepConditionVariableCS(&capture_ready, &capture_lock, CAPTURE_FLUSH_MS);
+        }
+        
+        // Take the full spare, or else whatever the active buffer holds
+        int used;
+        if (spare_full) {
+            used = spare_full;
+            char* full = spare;
+            spare = buffer;
+            buffer = full;
+            spare_full = 0;
+        } else {
+            used = active_used;
+            char* full = active;
+            active = buffer;
+            buffer = full;
+            active_used = 0;
+        }
+        int stop = stopping && used == 0 && !spare_full;
+        LeaveCriticalSection(&capture_lock);
+        
+        if (stop) break;
+        if (used > 0) {
+            fwrite(buffer, 1, used, capture_file);
+            fflush(capture_file);
+        }
+        
+        EnterCriticalSection(&capture_lock);
+        bytes_written += used;
+        for (int pos = 0; pos < used; ) {
+            CaptureRecord record;
+            memcpy(&record, buffer + pos, sizeof(record));  // Records are not aligned
+            pos += (int)sizeof(record) + record.topic_length + record.payload_length;
+            records_written++;
+        }
+    }
+    
+    free(buffer);
+    return 0;
+}
+
+int capture_report(char* out, int size) {
+    if (writer == NULL) {
+        return snprintf(out, size, "Capture is disabled (start the server with --capture <FILE>)\n");
+    }
+    
+    EnterCriticalSection(&capture_lock);
+    int len = snprintf(out, size, "Capture: %lld records written (%lld bytes), %lld dropped, %d bytes buffered\n",
+                       (long long)records_written, (long long)bytes_written,
+                       (long long)records_dropped, active_used + spare_full);
+    LeaveCriticalSection(&capture_lock);
+    return len;
+}
+
+// Writes everything still buffered and closes the file
+void capture_close() {
+    if (writer == NULL) return;
+    
+    EnterCriticalSection(&capture_lock);
+    stopping = 1;
+    WakeConditionVariable(&capture_ready);
+    LeaveCriticalSection(&capture_lock);
+    
+    WaitForSingleObject(writer, INFINITE);
+    CloseHandle(writer);
+    writer = NULL;
+    fclose(capture_file);
+    printf("Capture closed: %lld records, %lld dropped\n", (long long)records_written, (long long)records_dropped);
+}
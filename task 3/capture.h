@@ -0,0 +1,40 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// Binary capture file written by "server.exe --capture <FILE>" and read by
+// replay.exe. All fields are little-endian.
+//
+//   file:   CaptureHeader, then records until the end of the file
+//   record: CaptureRecord, topic_length topic bytes, payload_length payload bytes
+
+#define CAPTURE_MAGIC "PSCAPTR1"
+#define CAPTURE_VERSION 1
+
+typedef enum {
+    CAPTURE_PUBLISH = 1,           // A publisher's message as received
+    CAPTURE_SUBSCRIBE = 2,         // A subscriber registered (or was connected when capture started)
+    CAPTURE_UNSUBSCRIBE = 3        // A subscriber disconnected
+} CaptureType;
+
+typedef struct {
+    char magic[8];
+    unsigned int version;
+    unsigned int reserved;
+    long long start_unix_ms;       // Wall clock time the capture started
+} CaptureHeader;
+
+typedef struct {
+    unsigned long long time_ns;    // Since the capture started
+    int client_id;                 // Publisher or subscriber id on the capturing server
+    unsigned short payload_length;
+    unsigned char type;            // CaptureType
+    unsigned char topic_length;
+} CaptureRecord;
+
+// Server side (capture.c)
+int capture_open(const char* path);
+void capture_event(CaptureType type, int client_id, const char* topic, const char* payload, int length);
+int capture_report(char* out, int size);
+void capture_close();
+
+#endif
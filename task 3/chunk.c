@@ -0,0 +1,374 @@
+#include "server.h"
+
+#define MAX_OPEN_STREAMS 16
+
+// Flow control shared by a publisher connection and its chunks in flight.
+// It outlives the connection until the last of those chunks is written out.
+typedef struct {
+    volatile LONG refs;            // The connection plus every chunk in flight
+    volatile LONG in_flight;       // Chunks not yet written to every subscriber
+    volatile LONG client_id;       // Publisher connection, -1 once it is gone
+    LONG generation;               // Of the publisher's slot, which may be reused once it is gone
+} ChunkWindow;
+
+// Large-message state of a publisher connection, allocated by its first
+// chunk. Only the owning worker touches it.
+typedef struct ChunkState {
+    ChunkWindow* window;
+    Message* current;              // Chunk being received, NULL between chunks
+    int header_length;             // Subscriber header at the start of current
+    int length;                    // Payload bytes of current
+    int filled;                    // Payload bytes received so far
+    int last;                      // current ends its stream
+    char stream[MAX_STREAM_LENGTH];
+    char open[MAX_OPEN_STREAMS][MAX_STREAM_LENGTH];   // Streams started but not ended
+    int open_count;
+} ChunkState;
+
+// Global variables
+int chunk_window = DEFAULT_CHUNK_WINDOW;
+
+static volatile LONG64 streams_started = 0;
+static volatile LONG64 streams_completed = 0;
+static volatile LONG64 streams_aborted = 0;
+static volatile LONG64 chunks_forwarded = 0;
+static volatile LONG64 chunk_bytes = 0;
+static volatile LONG64 bytes_in_flight = 0;
+static volatile LONG64 peak_in_flight = 0;
+static volatile LONG64 read_pauses = 0;
+
+static const char* chunk_flags[] = { "MORE", "END", "ABORT" };
+
+// Function prototypes
+static void finish_chunk(Client* client);
+static void chunk_released(Message* message);
+
+// Formats "[TOPIC] Publisher ID CHUNK STREAM LENGTH FLAG\n" (or "ID@NODE"
+// for a chunk from another broker) and leaves room for the payload after it
+Message* create_chunk_message(const char* topic, int publisher_id, int origin, const char* stream,
+                              int length, ChunkFlag flag, int* header_length) {
+    int capacity = length + MAX_TOPIC_LENGTH + MAX_STREAM_LENGTH + 64;
+    Message* message = message_create(capacity);
+    if (message == NULL) return NULL;
+    
+    char sender[32];
+    if (origin > 0) {
+        snprintf(sender, sizeof(sender), "%d@%d", publisher_id, origin);
+    } else {
+        snprintf(sender, sizeof(sender), "%d", publisher_id);
+    }
+    *header_length = snprintf(message->data, capacity, "[%s] Publisher %s CHUNK %s %d %s\n",
+                              topic, sender, stream, length, chunk_flags[flag]);
+    message->length = *header_length + length;
+    
+    TopicPolicy* policy = find_topic_policy(topic);
+    message->priority = policy ? policy->priority : PRIORITY_NORMAL;
+    message->chunk = 1;
+    
+    // A binary subscriber gets the whole frame as the payload of a chunk frame
+    WireHeader* wire = &message->wire;
+    memset(wire, 0, sizeof(WireHeader));
+    wire->magic = WIRE_MAGIC;
+    wire->version = WIRE_VERSION;
+    wire->flags = (UINT8)(WIRE_FLAG_CHUNK | (message->priority + 1));
+    wire->topic_id = wire_topic_id(topic);
+    wire->publisher_id = publisher_id;
+    wire->origin = (UINT16)origin;
+    wire->timestamp = wire_now();
+    
+    // Every chunk counts towards the bytes held in memory until it is out
+    message->on_free = chunk_released;
+    LONGLONG held = InterlockedAdd64(&bytes_in_flight, message->length);
+    if (held > peak_in_flight) peak_in_flight = held;
+    return message;
+}
+
+int parse_chunk_flag(const char* name, ChunkFlag* flag) {
+    for (int f = CHUNK_MORE; f <= CHUNK_ABORT; f++) {
+        if (strcmp(name, chunk_flags[f]) == 0) {
+            *flag = (ChunkFlag)f;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void release_window(ChunkWindow* window) {
+    if (InterlockedDecrement(&window->refs) == 0) free(window);
+}
+
+// Last reference to a chunk dropped: the memory is given back, and the
+// publisher may send again once it is back under its window. It may be
+// gone by now; its worker drops the request then, by the generation.
+static void chunk_released(Message* message) {
+    InterlockedAdd64(&bytes_in_flight, -(LONGLONG)message->length);
+    
+    ChunkWindow* window = (ChunkWindow*)message->free_context;
+    if (window == NULL) return;
+    if (InterlockedDecrement(&window->in_flight) == chunk_window - 1) {
+        LONG client_id = window->client_id;
+        if (client_id >= 0) request_read(&clients[client_id], window->generation);
+    }
+    release_window(window);
+}
+
+static int find_open_stream(ChunkState* state, const char* stream) {
+    for (int i = 0; i < state->open_count; i++) {
+        if (strcmp(state->open[i], stream) == 0) return i;
+    }
+    return -1;
+}
+
+static int reject_chunk(Client* client, const char* reason) {
+    char error[64];
+    int len = snprintf(error, sizeof(error), "ERROR %s\n", reason);
+    printf("Client %d (%s) sent a bad chunk: %s\n", client->id, client_ip(client), reason);
+    send_to_client(client, error, len);
+    remove_client(client->id);
+    return 0;
+}
+
+// Large-message state of a publisher connection as it is passed to the
+// process taking it over, followed by the payload received of current
+typedef struct {
+    int open_count;
+    char open[MAX_OPEN_STREAMS][MAX_STREAM_LENGTH];
+    int receiving;                 // A chunk was partly received
+    char stream[MAX_STREAM_LENGTH];
+    int length;
+    int filled;
+    int last;
+} ChunkHandoff;
+
+// State of a publisher, allocated with its first chunk
+static ChunkState* create_state(Client* client) {
+    if (client->chunks != NULL) return client->chunks;
+    
+    ChunkState* state = (ChunkState*)calloc(1, sizeof(ChunkState));
+    ChunkWindow* window = (ChunkWindow*)calloc(1, sizeof(ChunkWindow));
+    if (state == NULL || window == NULL) {
+        free(state);
+        free(window);
+        return NULL;
+    }
+    window->refs = 1;
+    window->client_id = client->id;
+    window->generation = client->generation;
+    state->window = window;
+    client->chunks = state;
+    return state;
+}
+
+// Handles a publisher's "CHUNK <STREAM> <LENGTH> MORE|END" header. The
+// payload that follows is received into the chunk's message, which is
+// forwarded as soon as it is complete. Returns 0 once the client was removed.
+int chunk_begin(Client* client, const char* line, int length) {
+    char header[128];
+    if (length >= (int)sizeof(header)) return reject_chunk(client, "bad chunk header");
+    memcpy(header, line, length);
+    header[length] = '\0';
+    
+    char stream[MAX_STREAM_LENGTH + 1];
+    char flag_name[8];
+    int payload_length;
+    ChunkFlag flag;
+    if (sscanf(header, "CHUNK %32s %d %7s", stream, &payload_length, flag_name) != 3 ||
+        strlen(stream) >= MAX_STREAM_LENGTH || parse_chunk_flag(flag_name, &flag) != 0 || flag == CHUNK_ABORT) {
+        return reject_chunk(client, "bad chunk header");
+    }
+    if (payload_length < 0 || payload_length > MAX_CHUNK_SIZE) return reject_chunk(client, "chunk too large");
+    
+    ChunkState* state = create_state(client);
+    if (state == NULL) return reject_chunk(client, "out of memory");
+    
+    // Streams of one connection interleave chunk by chunk
+    if (find_open_stream(state, stream) < 0) {
+        if (state->open_count == MAX_OPEN_STREAMS) return reject_chunk(client, "too many open streams");
+        strcpy(state->open[state->open_count++], stream);
+        InterlockedIncrement64(&streams_started);
+    }
+    
+    state->current = create_chunk_message(client->topic, client->id, 0, stream, payload_length, flag, &state->header_length);
+    if (state->current == NULL) return reject_chunk(client, "out of memory");
+    rate_publish(client, payload_length);
+    state->length = payload_length;
+    state->filled = 0;
+    state->last = (flag == CHUNK_END);
+    strcpy(state->stream, stream);
+    
+    if (payload_length == 0) finish_chunk(client);
+    return 1;
+}
+
+int chunk_pending(Client* client) {
+    return client->chunks != NULL && client->chunks->current != NULL;
+}
+
+// Whether a publisher is paused until one of its chunks is written out
+int chunk_window_full(Client* client) {
+    return client->chunks != NULL && client->chunks->window->in_flight >= chunk_window;
+}
+
+// Copies payload bytes that arrived together with other data. Returns the
+// number of bytes taken.
+int chunk_fill(Client* client, const char* data, int available) {
+    ChunkState* state = client->chunks;
+    int take = state->length - state->filled;
+    if (take > available) take = available;
+    
+    memcpy(state->current->data + state->header_length + state->filled, data, take);
+    state->filled += take;
+    if (state->filled == state->length) finish_chunk(client);
+    return take;
+}
+
+// Receives the rest of a chunk's payload straight into its message.
+// Returns 0 once the client was removed.
+int chunk_receive(Client* client) {
+    ChunkState* state = client->chunks;
+    char* into = state->current->data + state->header_length + state->filled;
+    
+    int wanted = state->length - state->filled;
+    int bytes_received = receive_from_client(client, into, wanted);
+    if (bytes_received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) return 1;
+    if (bytes_received <= 0) {
+        if (verbose) print_client_info(client, "Disconnected (in the middle of a chunk)");
+        remove_client(client->id);
+        return 0;
+    }
+    
+    client->ingress_bytes = bytes_received;
+    client->ingress_drained = bytes_received < wanted;
+    state->filled += bytes_received;
+    if (state->filled == state->length) finish_chunk(client);
+    return 1;
+}
+
+// Forwards a complete chunk. A publisher with a full window of chunks not
+// yet written to every subscriber is not read from until one is.
+static void finish_chunk(Client* client) {
+    ChunkState* state = client->chunks;
+    Message* message = state->current;
+    state->current = NULL;
+    
+    ChunkWindow* window = state->window;
+    InterlockedIncrement(&window->refs);
+    InterlockedIncrement(&window->in_flight);
+    message->free_context = window;
+    
+    InterlockedIncrement64(&chunks_forwarded);
+    InterlockedAdd64(&chunk_bytes, state->length);
+    ChunkFlag flag = state->last ? CHUNK_END : CHUNK_MORE;
+    forward_chunk_to_peers(client->topic, client->id, state->stream,
+                           message->data + state->header_length, state->length, chunk_flags[flag]);
+    
+    MessageTrace trace;
+    latency_begin(&trace, client->topic, client->topic_id);
+    broadcast_to_topic_subscribers(message, client->topic, client->id, &trace);
+    
+    if (state->last) {
+        int index = find_open_stream(state, state->stream);
+        if (index >= 0) strcpy(state->open[index], state->open[--state->open_count]);
+        InterlockedIncrement64(&streams_completed);
+    }
+    
+    if (window->in_flight >= chunk_window) {
+        set_reading(client, 0);
+        InterlockedIncrement64(&read_pauses);
+        
+        // A release in between would have found reading still enabled
+        if (window->in_flight < chunk_window) set_reading(client, 1);
+    }
+}
+
+// Ends every stream a departing publisher left open with an ABORT chunk,
+// so subscribers can discard what they received of it. Called by
+// remove_client before any lock is taken.
+void chunk_client_gone(Client* client) {
+    ChunkState* state = client->chunks;
+    if (state == NULL) return;
+    client->chunks = NULL;
+    
+    if (state->current != NULL) message_release(state->current);
+    for (int i = 0; i < state->open_count; i++) {
+        int header_length;
+        Message* message = create_chunk_message(client->topic, client->id, 0, state->open[i], 0, CHUNK_ABORT, &header_length);
+        if (message == NULL) continue;
+        forward_chunk_to_peers(client->topic, client->id, state->open[i], "", 0, chunk_flags[CHUNK_ABORT]);
+        broadcast_to_topic_subscribers(message, client->topic, client->id, NULL);
+        InterlockedIncrement64(&streams_aborted);
+    }
+    
+    InterlockedExchange(&state->window->client_id, -1);
+    release_window(state->window);
+    free(state);
+}
+
+// Serializes the streams a publisher has open for a hot restart. Returns
+// the number of bytes in *data, which the caller frees, 0 if there is
+// nothing to hand over, or -1.
+int chunk_export(Client* client, char** data) {
+    ChunkState* state = client->chunks;
+    *data = NULL;
+    if (state == NULL || (state->open_count == 0 && state->current == NULL)) return 0;
+    
+    int payload = state->current ? state->filled : 0;
+    ChunkHandoff* handoff = (ChunkHandoff*)calloc(1, sizeof(ChunkHandoff) + payload);
+    if (handoff == NULL) return -1;
+    
+    handoff->open_count = state->open_count;
+    memcpy(handoff->open, state->open, sizeof(state->open));
+    if (state->current != NULL) {
+        handoff->receiving = 1;
+        strcpy(handoff->stream, state->stream);
+        handoff->length = state->length;
+        handoff->filled = state->filled;
+        handoff->last = state->last;
+        memcpy(handoff + 1, state->current->data + state->header_length, payload);
+    }
+    *data = (char*)handoff;
+    return (int)sizeof(ChunkHandoff) + payload;
+}
+
+// Restores what chunk_export saved on the connection's new client, so the
+// publisher carries on with the chunk it was sending. Returns 0 on success.
+int chunk_import(Client* client, const char* data, int length) {
+    ChunkHandoff handoff;
+    if (length < (int)sizeof(handoff)) return -1;
+    memcpy(&handoff, data, sizeof(handoff));
+    handoff.stream[MAX_STREAM_LENGTH - 1] = '\0';
+    if (handoff.open_count < 0 || handoff.open_count > MAX_OPEN_STREAMS) return -1;
+    if (handoff.receiving && (handoff.length < 0 || handoff.length > MAX_CHUNK_SIZE || handoff.filled < 0 ||
+                              handoff.filled > handoff.length || length != (int)sizeof(handoff) + handoff.filled)) {
+        return -1;
+    }
+    
+    ChunkState* state = create_state(client);
+    if (state == NULL) return -1;
+    state->open_count = handoff.open_count;
+    memcpy(state->open, handoff.open, sizeof(state->open));
+    if (!handoff.receiving) return 0;
+    
+    ChunkFlag flag = handoff.last ? CHUNK_END : CHUNK_MORE;
+    state->current = create_chunk_message(client->topic, client->id, 0, handoff.stream, handoff.length, flag, &state->header_length);
+    if (state->current == NULL) return -1;
+    memcpy(state->current->data + state->header_length, data + sizeof(handoff), handoff.filled);
+    state->length = handoff.length;
+    state->filled = handoff.filled;
+    state->last = handoff.last;
+    strcpy(state->stream, handoff.stream);
+    return 0;
+}
+
+int chunk_report(char* out, int size) {
+    return snprintf(out, size,
+                    "Large messages (chunks up to %d bytes, window %d chunks per publisher)\n"
+                    "  Streams: %lld started, %lld completed, %lld aborted\n"
+                    "  Chunks: %lld forwarded, %lld payload bytes\n"
+                    "  In memory: %lld bytes now, %lld peak\n"
+                    "  Publisher reads paused at a full window: %lld\n",
+                    MAX_CHUNK_SIZE, chunk_window,
+                    (long long)streams_started, (long long)streams_completed, (long long)streams_aborted,
+                    (long long)chunks_forwarded, (long long)chunk_bytes,
+                    (long long)bytes_in_flight, (long long)peak_in_flight, (long long)read_pauses);
+}
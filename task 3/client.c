@@ -4,21 +4,79 @@
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include <process.h>
+#include "wire.h"
 #pragma comment(lib, "ws2_32.lib")
 
+// --tls needs OpenSSL; build with -DWITH_TLS and -lssl -lcrypto
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#pragma comment(lib, "libssl.lib")
+#pragma comment(lib, "libcrypto.lib")
+#endif
+
 #define BUFFER_SIZE 1024
 #define MAX_TOPIC_LENGTH 64
+#define MAX_GROUP_LENGTH 32
+#define CHUNK_SIZE 65536
+#define MAX_STREAMS 16
+#define FRAME_BUFFER_SIZE (2 * CHUNK_SIZE)   // A chunk frame with its header line
+#define DELTA_MIN_MATCH 4
+#define MAX_SESSIONS 32
 
 typedef enum {
     CLIENT_PUBLISHER = 1,
-    CLIENT_SUBSCRIBER = 2
+    CLIENT_SUBSCRIBER = 2,
+    CLIENT_STATS = 3,
+    CLIENT_REQUESTER = 4,
+    CLIENT_RESPONDER = 5,
+    CLIENT_MUX = 6
 } ClientType;
 
+// A large message being received in chunks
+typedef struct {
+    char key[80];                  // "<PUBLISHER> <STREAM>"
+    long long bytes;
+} IncomingStream;
+
+// A publisher or subscriber session carried by a MUX connection, numbered
+// from 1 in the order given
+typedef struct {
+    char registration[BUFFER_SIZE / 8];    // "PUBLISHER:TOPIC" or "SUBSCRIBER:TOPIC"
+    const char* topic;             // Inside registration
+    int publisher;
+    int topic_id;                  // From the "OK <ID> <TOPIC_ID>" reply, 0 until then
+} MuxSession;
+
+// The payload of one key a delta subscriber holds
+typedef struct {
+    long version;
+    int length;
+    char* payload;
+} KeyPayload;
+
 // Global variables
 SOCKET client_socket;
 ClientType client_type;
 char client_topic[MAX_TOPIC_LENGTH];
+const char* client_group = NULL;   // Queue group of a subscriber
+int binary = 0;                    // "/BINARY": wire frames instead of text lines
+int topic_id = 0;                  // Wire id of the topic, from the registration reply
+int delta = 0;                     // "/DELTA": deltas against the last payload of each key
+KeyPayload* keys = NULL;           // By slot, as numbered by the server
+int key_capacity = 0;
+char frame_line[BUFFER_SIZE];      // Header of the delta frame being received
+char frame_body[BUFFER_SIZE];
+int frame_length = -1;             // Bytes of frame_body received, -1 between frames
 volatile int running = 1;
+IncomingStream streams[MAX_STREAMS];
+int file_count = 0;                // Large messages sent with /file
+MuxSession sessions[MAX_SESSIONS];
+int session_count = 0;
+#ifdef WITH_TLS
+SSL* tls = NULL;                   // --tls: session with the server's TLS port
+CRITICAL_SECTION tls_lock;         // The receive thread and user input share the session
+#endif
 
 // Function prototypes
 void initialize_client();
@@ -27,13 +85,47 @@ SOCKET connect_to_server(const char* server_ip, int port);
 ClientType parse_client_type(const char* type_str);
 const char* client_type_to_string(ClientType type);
 void send_client_info();
+void wait_for_registration();
 unsigned __stdcall receive_messages(void* arg);
+void receive_frames();
+void handle_frame(const WireHeader* header, const char* payload);
+void handle_line(const char* line, int length, long long* skip);
+void handle_delta_frame();
+int apply_delta(const char* base, int base_len, const char* ops, int ops_len, char* out, int capacity);
 void handle_user_input();
+void send_file(const char* path);
+void serve_requests();
+int is_ping(const char* line, int length);
+int parse_sessions(const char* list);
+void open_sessions();
+void handle_session_frame(const WireHeader* header, const char* payload);
+#ifdef WITH_TLS
+void start_tls(const char* server_ip, const char* ca_file);
+#endif
+int client_send(const char* data, int len);
+int client_recv(char* buffer, int len);
 void print_usage(const char* program_name);
 void display_client_info();
+void print_stats_report();
 
 int main(int argc, char *argv[]) {
-    if (argc != 5) {
+    // "--tls <CA_FILE>" may come first; the server's certificate must be
+    // signed by a CA of that file and name the server's IP address
+    const char* tls_ca = NULL;
+    if (argc > 2 && strcmp(argv[1], "--tls") == 0) {
+        tls_ca = argv[2];
+        argv[2] = argv[0];
+        argv += 2;
+        argc -= 2;
+    }
+#ifndef WITH_TLS
+    if (tls_ca != NULL) {
+        fprintf(stderr, "Error: --tls needs a client built with -DWITH_TLS (and -lssl -lcrypto)\n");
+        return 1;
+    }
+#endif
+    
+    if (argc != 5 && argc != 6) {
         print_usage(argv[0]);
         return 1;
     }
@@ -44,11 +136,21 @@ int main(int argc, char *argv[]) {
     const char* topic = argv[4];
     
     if (client_type == 0) {
-        fprintf(stderr, "Error: Client type must be either 'PUBLISHER' or 'SUBSCRIBER'\n");
+        fprintf(stderr, "Error: Client type must be 'PUBLISHER', 'SUBSCRIBER', 'REQUESTER', 'RESPONDER', 'STATS' or 'MUX',\n"
+                        "       or 'PUBLISHER/BINARY', 'SUBSCRIBER/BINARY' or 'SUBSCRIBER/DELTA'\n");
         print_usage(argv[0]);
         return 1;
     }
     
+    // The sessions a MUX connection carries are listed in place of the topic
+    if (client_type == CLIENT_MUX) {
+        if (argc != 5 || parse_sessions(topic) != 0) {
+            fprintf(stderr, "Error: MUX takes up to %d sessions as 'PUBLISHER:TOPIC,SUBSCRIBER:TOPIC,...'\n", MAX_SESSIONS);
+            return 1;
+        }
+        topic = "client";
+    }
+    
     if (strlen(topic) >= MAX_TOPIC_LENGTH) {
         fprintf(stderr, "Error: Topic name too long (max %d characters)\n", MAX_TOPIC_LENGTH - 1);
         return 1;
@@ -56,26 +158,63 @@ int main(int argc, char *argv[]) {
     
     strcpy(client_topic, topic);
     
+    if (argc == 6) {
+        client_group = argv[5];
+        if (client_type != CLIENT_SUBSCRIBER || binary || delta || strlen(client_group) >= MAX_GROUP_LENGTH) {
+            fprintf(stderr, "Error: Only subscribers can join a queue group (max %d characters)\n", MAX_GROUP_LENGTH - 1);
+            return 1;
+        }
+    }
+    
     initialize_client();
     
     client_socket = connect_to_server(server_ip, port);
+#ifdef WITH_TLS
+    if (tls_ca != NULL) start_tls(server_ip, tls_ca);
+#endif
+    
+    // Report requests print the server's answer and exit
+    if (client_type == CLIENT_STATS) {
+        send_client_info();
+        print_stats_report();
+        cleanup_client();
+        return 0;
+    }
     
     display_client_info();
     printf("Connected to server at %s:%d\n", server_ip, port);
     
     // Send client type and topic to server
     send_client_info();
+    wait_for_registration();
+    if (client_type == CLIENT_MUX) open_sessions();
+    
+    // An echo responder needs no input
+    if (client_type == CLIENT_RESPONDER) {
+        printf("Answering requests on topic '%s' with their own payload...\n", client_topic);
+        serve_requests();
+        cleanup_client();
+        return 0;
+    }
     
-    // Create thread to receive messages (for subscribers)
+    // Create thread to receive messages (for subscribers and requesters, and
+    // for publishers the THROTTLED notices of a rate-limited server)
     HANDLE receive_thread = NULL;
-    if (client_type == CLIENT_SUBSCRIBER) {
+    if (client_type == CLIENT_SUBSCRIBER || client_type == CLIENT_REQUESTER || client_type == CLIENT_PUBLISHER ||
+        client_type == CLIENT_MUX) {
         receive_thread = (HANDLE)_beginthreadex(NULL, 0, receive_messages, NULL, 0, NULL);
         if (receive_thread == NULL) {
             printf("Failed to create receive thread\n");
             cleanup_client();
             return 1;
         }
-        printf("Listening for messages on topic '%s'...\n", client_topic);
+        if (client_type == CLIENT_REQUESTER) {
+            printf("Send requests to topic '%s' as '<ID> <payload>'; replies arrive as 'REP <ID> ...'.\n", client_topic);
+        } else if (client_type == CLIENT_MUX) {
+            printf("Carrying %d sessions; publish as '<SESSION> <message>' from a PUBLISHER session.\n", session_count);
+        } else {
+            printf("Listening for messages on topic '%s'...\n", client_topic);
+        }
         printf("Type 'terminate' to exit.\n");
     } else {
         printf("You can now publish messages to topic '%s'. Type 'terminate' to exit.\n", client_topic);
@@ -106,6 +245,15 @@ void initialize_client() {
 }
 
 void cleanup_client() {
+    // The receive thread may still be waiting on the session, which is
+    // left to the process exit that follows
+#ifdef WITH_TLS
+    if (tls != NULL) {
+        EnterCriticalSection(&tls_lock);
+        SSL_shutdown(tls);
+        LeaveCriticalSection(&tls_lock);
+    }
+#endif
     if (client_socket != INVALID_SOCKET) {
         closesocket(client_socket);
     }
@@ -139,11 +287,111 @@ SOCKET connect_to_server(const char* server_ip, int port) {
     return sock;
 }
 
+#ifdef WITH_TLS
+// Runs the handshake on the connected socket. Afterwards the socket is
+// non-blocking, so the receive thread never holds tls_lock while it waits.
+void start_tls(const char* server_ip, const char* ca_file) {
+    SSL_CTX* context = SSL_CTX_new(TLS_client_method());
+    if (context == NULL || SSL_CTX_load_verify_locations(context, ca_file, NULL) != 1) {
+        printf("Cannot load the CA file %s\n", ca_file);
+        ERR_print_errors_fp(stdout);
+        cleanup_client();
+        exit(1);
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    SSL_CTX_set_verify(context, SSL_VERIFY_PEER, NULL);
+    
+    tls = SSL_new(context);
+    SSL_CTX_free(context);         // The session holds a reference
+    if (tls == NULL || SSL_set_fd(tls, (int)client_socket) != 1 ||
+        X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls), server_ip) != 1 || SSL_connect(tls) != 1) {
+        printf("TLS handshake failed\n");
+        ERR_print_errors_fp(stdout);
+        if (tls != NULL) SSL_free(tls);
+        tls = NULL;
+        cleanup_client();
+        exit(1);
+    }
+    
+    InitializeCriticalSection(&tls_lock);
+    u_long nonblocking = 1;
+    ioctlsocket(client_socket, FIONBIO, &nonblocking);
+    printf("TLS: %s, %s\n", SSL_get_version(tls), SSL_get_cipher_name(tls));
+}
+
+// Waits until the socket can be read or written, as the session asks
+static int wait_for_socket(int error) {
+    WSAPOLLFD pfd;
+    pfd.fd = client_socket;
+    pfd.events = (error == SSL_ERROR_WANT_WRITE) ? POLLWRNORM : POLLRDNORM;
+    pfd.revents = 0;
+    return WSAPoll(&pfd, 1, -1) == SOCKET_ERROR ? -1 : 0;
+}
+#endif
+
+// Sends everything like a blocking send, through the TLS session if any
+int client_send(const char* data, int len) {
+#ifdef WITH_TLS
+    if (tls == NULL) return send(client_socket, data, len, 0);
+    
+    while (1) {
+        EnterCriticalSection(&tls_lock);
+        int result = SSL_write(tls, data, len);
+        int error = (result > 0) ? SSL_ERROR_NONE : SSL_get_error(tls, result);
+        LeaveCriticalSection(&tls_lock);
+        
+        if (result > 0) return result;
+        if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || wait_for_socket(error) != 0) {
+            return SOCKET_ERROR;
+        }
+    }
+#else
+    return send(client_socket, data, len, 0);
+#endif
+}
+
+// Receives like a blocking recv, through the TLS session if any
+int client_recv(char* buffer, int len) {
+#ifdef WITH_TLS
+    if (tls == NULL) return recv(client_socket, buffer, len, 0);
+    
+    while (1) {
+        EnterCriticalSection(&tls_lock);
+        int result = SSL_read(tls, buffer, len);
+        int error = (result > 0) ? SSL_ERROR_NONE : SSL_get_error(tls, result);
+        LeaveCriticalSection(&tls_lock);
+        
+        if (result > 0) return result;
+        if (error == SSL_ERROR_ZERO_RETURN) return 0;
+        if ((error != SSL_ERROR_WANT_READ && error != SSL_ERROR_WANT_WRITE) || wait_for_socket(error) != 0) {
+            return SOCKET_ERROR;
+        }
+    }
+#else
+    return recv(client_socket, buffer, len, 0);
+#endif
+}
+
 ClientType parse_client_type(const char* type_str) {
-    if (strcmp(type_str, "PUBLISHER") == 0) {
+    if (strcmp(type_str, "PUBLISHER/BINARY") == 0 || strcmp(type_str, "SUBSCRIBER/BINARY") == 0) {
+        binary = 1;
+        return (type_str[0] == 'P') ? CLIENT_PUBLISHER : CLIENT_SUBSCRIBER;
+    } else if (strcmp(type_str, "SUBSCRIBER/DELTA") == 0) {
+        delta = 1;
+        return CLIENT_SUBSCRIBER;
+    } else if (strcmp(type_str, "PUBLISHER") == 0) {
         return CLIENT_PUBLISHER;
     } else if (strcmp(type_str, "SUBSCRIBER") == 0) {
         return CLIENT_SUBSCRIBER;
+    } else if (strcmp(type_str, "STATS") == 0) {
+        return CLIENT_STATS;
+    } else if (strcmp(type_str, "REQUESTER") == 0) {
+        return CLIENT_REQUESTER;
+    } else if (strcmp(type_str, "RESPONDER") == 0) {
+        return CLIENT_RESPONDER;
+    } else if (strcmp(type_str, "MUX") == 0) {
+        binary = 1;
+        return CLIENT_MUX;
     }
     return 0;
 }
@@ -152,15 +400,24 @@ const char* client_type_to_string(ClientType type) {
     switch (type) {
         case CLIENT_PUBLISHER: return "PUBLISHER";
         case CLIENT_SUBSCRIBER: return "SUBSCRIBER";
+        case CLIENT_STATS: return "STATS";
+        case CLIENT_REQUESTER: return "REQUESTER";
+        case CLIENT_RESPONDER: return "RESPONDER";
+        case CLIENT_MUX: return "MUX";
         default: return "UNKNOWN";
     }
 }
 
 void send_client_info() {
     char message[128];
-    snprintf(message, sizeof(message), "%s:%s\n", client_type_to_string(client_type), client_topic);
+    if (client_group != NULL) {
+        snprintf(message, sizeof(message), "%s:%s:%s\n", client_type_to_string(client_type), client_topic, client_group);
+    } else {
+        snprintf(message, sizeof(message), "%s%s:%s\n", client_type_to_string(client_type),
+                 binary ? "/BINARY" : (delta ? "/DELTA" : ""), client_topic);
+    }
     
-    int send_result = send(client_socket, message, strlen(message), 0);
+    int send_result = client_send(message, strlen(message));
     if (send_result == SOCKET_ERROR) {
         printf("Failed to send client info. Error: %d\n", WSAGetLastError());
         cleanup_client();
@@ -168,11 +425,51 @@ void send_client_info() {
     }
 }
 
+// Reads the server's "OK <id>" (binary clients: "OK <id> <topic id>") or
+// "ERROR <reason>" reply one byte at a time, so no message that follows it
+// is consumed here
+void wait_for_registration() {
+    char reply[128];
+    int len = 0;
+    
+    while (len < (int)sizeof(reply) - 1) {
+        int bytes_received = client_recv(reply + len, 1);
+        if (bytes_received <= 0) {
+            printf("Server closed the connection during registration.\n");
+            cleanup_client();
+            exit(1);
+        }
+        if (reply[len] == '\n') break;
+        len++;
+    }
+    reply[len] = '\0';
+    
+    if (strncmp(reply, "OK", 2) != 0) {
+        printf("Registration rejected: %s\n", reply);
+        cleanup_client();
+        exit(1);
+    }
+    int id;
+    if (binary && sscanf(reply, "OK %d %d", &id, &topic_id) == 2) {
+        printf("Registered as binary client %d (topic id %d)\n", id, topic_id);
+        return;
+    }
+    printf("Registered as client%s\n", reply + 2);
+}
+
 unsigned __stdcall receive_messages(void* arg) {
+    if (binary) {
+        receive_frames();
+        return 0;
+    }
+    
     char buffer[BUFFER_SIZE];
+    char line[BUFFER_SIZE];
+    int line_len = 0;
+    long long skip = 0;                // Payload bytes of a chunk still to come
     
     while (running) {
-        int bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+        int bytes_received = client_recv(buffer, BUFFER_SIZE - 1);
         if (bytes_received <= 0) {
             if (running) {
                 printf("\nServer disconnected.\n");
@@ -180,8 +477,27 @@ unsigned __stdcall receive_messages(void* arg) {
             break;
         }
         
-        buffer[bytes_received] = '\0';
-        printf("\n>>> %s", buffer);
+        printf("\n");
+        for (int i = 0; i < bytes_received; i++) {
+            if (skip > 0) {
+                // Chunk payload is counted, not printed; a delta frame's is collected
+                int take = (bytes_received - i < skip) ? bytes_received - i : (int)skip;
+                if (frame_length >= 0) {
+                    memcpy(frame_body + frame_length, buffer + i, take);
+                    frame_length += take;
+                }
+                skip -= take;
+                i += take - 1;
+                if (skip == 0 && frame_length >= 0) handle_delta_frame();
+                continue;
+            }
+            if (line_len < BUFFER_SIZE - 1) line[line_len++] = buffer[i];
+            if (buffer[i] != '\n' && line_len < BUFFER_SIZE - 1) continue;
+            
+            line[line_len] = '\0';
+            handle_line(line, line_len, &skip);
+            line_len = 0;
+        }
         
         // Re-prompt for user input if we're still running
         if (running) {
@@ -193,6 +509,283 @@ unsigned __stdcall receive_messages(void* arg) {
     return 0;
 }
 
+// Receives wire frames and reads each one in place in the receive buffer;
+// only the incomplete frame at its end is moved to the front
+void receive_frames() {
+    char* buffer = (char*)malloc(FRAME_BUFFER_SIZE);
+    int used = 0;
+    if (buffer == NULL) return;
+    
+    while (running) {
+        int bytes_received = client_recv(buffer + used, FRAME_BUFFER_SIZE - used);
+        if (bytes_received <= 0) {
+            if (running) printf("\nServer disconnected.\n");
+            break;
+        }
+        used += bytes_received;
+        
+        printf("\n");
+        int pos = 0;
+        while (used - pos >= (int)sizeof(WireHeader)) {
+            const WireHeader* header = (const WireHeader*)(buffer + pos);
+            int size = (int)sizeof(WireHeader) + (int)header->length;
+            if (header->magic != WIRE_MAGIC || size > FRAME_BUFFER_SIZE) {
+                printf("Server sent an invalid frame.\n");
+                running = 0;
+                break;
+            }
+            if (used - pos < size) break;
+            handle_frame(header, buffer + pos + sizeof(WireHeader));
+            pos += size;
+        }
+        memmove(buffer, buffer + pos, used - pos);
+        used -= pos;
+        
+        if (running) {
+            printf("You: ");
+            fflush(stdout);
+        }
+    }
+    free(buffer);
+}
+
+// Shows a received frame from its header fields; on a MUX connection, once
+// for every subscriber session of its topic
+void handle_frame(const WireHeader* header, const char* payload) {
+    int length = (int)header->length;
+    if (header->flags & WIRE_FLAG_SESSION) {
+        handle_session_frame(header, payload);
+    } else if ((header->flags & WIRE_FLAG_NOTICE) && is_ping(payload, length)) {
+        char frame[sizeof(WireHeader) + 8];
+        WireHeader* pong = (WireHeader*)frame;
+        memset(pong, 0, sizeof(WireHeader));
+        pong->magic = WIRE_MAGIC;
+        pong->version = WIRE_VERSION;
+        pong->flags = WIRE_FLAG_NOTICE;
+        pong->length = 5;
+        memcpy(frame + sizeof(WireHeader), "PONG\n", 5);
+        client_send(frame, sizeof(WireHeader) + 5);
+    } else if (header->flags & WIRE_FLAG_NOTICE) {
+        printf(">>> %.*s", length, payload);
+    } else if (header->flags & WIRE_FLAG_CHUNK) {
+        printf(">>> [topic %u] Publisher %u large message chunk (%d byte frame)\n",
+               header->topic_id, header->publisher_id, length);
+    } else {
+        long long age_us = (long long)(wire_now() - header->timestamp);
+        for (int s = 0; s < (client_type == CLIENT_MUX ? session_count : 1); s++) {
+            if (client_type == CLIENT_MUX) {
+                if (sessions[s].publisher || sessions[s].topic_id != (int)header->topic_id) continue;
+                printf(">>> session %d [%s] Publisher %u", s + 1, sessions[s].topic, header->publisher_id);
+            } else {
+                printf(">>> [topic %u] Publisher %u", header->topic_id, header->publisher_id);
+            }
+            if (header->origin != 0) printf("@%u", header->origin);
+            printf(" #%llu, %lld us ago: %.*s", (unsigned long long)header->sequence, age_us, length, payload);
+            if (length == 0 || payload[length - 1] != '\n') printf("\n");
+        }
+    }
+}
+
+// Reads the "PUBLISHER:TOPIC,SUBSCRIBER:TOPIC,..." list of a MUX connection
+int parse_sessions(const char* list) {
+    while (*list != '\0') {
+        if (session_count == MAX_SESSIONS) return -1;
+        MuxSession* session = &sessions[session_count];
+        int length = (int)strcspn(list, ",");
+        if (length >= (int)sizeof(session->registration)) return -1;
+        memcpy(session->registration, list, length);
+        session->registration[length] = '\0';
+        
+        char* colon = strchr(session->registration, ':');
+        if (colon == NULL || colon[1] == '\0' || strlen(colon + 1) >= MAX_TOPIC_LENGTH) return -1;
+        session->topic = colon + 1;
+        session->publisher = (strncmp(session->registration, "PUBLISHER:", 10) == 0);
+        if (!session->publisher && strncmp(session->registration, "SUBSCRIBER:", 11) != 0) return -1;
+        session_count++;
+        
+        list += length;
+        if (*list == ',') list++;
+    }
+    return session_count > 0 ? 0 : -1;
+}
+
+// Opens every session with a session frame carrying its registration; the
+// server answers each in a session frame of its own
+void open_sessions() {
+    for (int s = 0; s < session_count; s++) {
+        char frame[sizeof(WireHeader) + sizeof(sessions[s].registration)];
+        WireHeader* header = (WireHeader*)frame;
+        int length = (int)strlen(sessions[s].registration);
+        memset(header, 0, sizeof(WireHeader));
+        header->magic = WIRE_MAGIC;
+        header->version = WIRE_VERSION;
+        header->flags = WIRE_FLAG_SESSION;
+        header->length = length;
+        header->session = s + 1;
+        memcpy(frame + sizeof(WireHeader), sessions[s].registration, length);
+        if (client_send(frame, sizeof(WireHeader) + length) == SOCKET_ERROR) {
+            printf("Failed to open session %d. Error: %d\n", s + 1, WSAGetLastError());
+            return;
+        }
+    }
+}
+
+// The server's "OK <ID> <TOPIC_ID>" or "ERROR <reason>" for one session
+void handle_session_frame(const WireHeader* header, const char* payload) {
+    int length = (int)header->length;
+    int s = (int)header->session - 1;
+    if (s < 0 || s >= session_count) return;
+    
+    int id;
+    char reply[BUFFER_SIZE / 8];
+    snprintf(reply, sizeof(reply), "%.*s", length, payload);
+    if (sscanf(reply, "OK %d %d", &id, &sessions[s].topic_id) == 2) {
+        printf(">>> Session %d registered as %s client %d (topic id %d)\n", s + 1, sessions[s].registration, id,
+               sessions[s].topic_id);
+    } else {
+        printf(">>> Session %d (%s) rejected: %s", s + 1, sessions[s].registration, reply);
+    }
+}
+
+// Shows a received line. Queue group messages are acknowledged once shown;
+// the chunks of a large message are summed up and reported when it ends,
+// and the body of a delta frame is collected first.
+void handle_line(const char* line, int length, long long* skip) {
+    char publisher[32], stream[40], flag[8], kind[16];
+    int chunk_length;
+    if (delta && sscanf(line, "[%*[^]]] Publisher %31s %15s %*d %*d %d", publisher, kind, &chunk_length) == 3 &&
+        publisher[strlen(publisher) - 1] != ':' && (strcmp(kind, "DELTA") == 0 || strcmp(kind, "KEYFRAME") == 0)) {
+        if (chunk_length < 0 || chunk_length > (int)sizeof(frame_body)) {
+            printf("Server sent an invalid delta frame.\n");
+            return;
+        }
+        memcpy(frame_line, line, length + 1);
+        frame_length = 0;
+        *skip = chunk_length;
+        if (chunk_length == 0) handle_delta_frame();
+        return;
+    }
+    
+    if (sscanf(line, "[%*[^]]] Publisher %31s CHUNK %39s %d %7s", publisher, stream, &chunk_length, flag) == 4) {
+        char key[80];
+        snprintf(key, sizeof(key), "%s %s", publisher, stream);
+        IncomingStream* incoming = NULL;
+        for (int s = 0; s < MAX_STREAMS && incoming == NULL; s++) {
+            if (strcmp(streams[s].key, key) == 0) incoming = &streams[s];
+        }
+        for (int s = 0; s < MAX_STREAMS && incoming == NULL; s++) {
+            if (streams[s].key[0] == '\0') {
+                incoming = &streams[s];
+                strcpy(incoming->key, key);
+                incoming->bytes = 0;
+            }
+        }
+        
+        *skip = chunk_length;
+        if (incoming == NULL) return;
+        incoming->bytes += chunk_length;
+        if (strcmp(flag, "MORE") != 0) {
+            printf(">>> %.*s%s large message '%s' from publisher %s (%lld bytes)\n",
+                   (int)(strchr(line, ']') - line + 1), line,
+                   strcmp(flag, "END") == 0 ? " Received" : " Aborted", stream, publisher, incoming->bytes);
+            incoming->key[0] = '\0';
+        }
+        return;
+    }
+    
+    // The server's heartbeat is answered, not shown
+    if (is_ping(line, length)) {
+        client_send("PONG\n", 5);
+        return;
+    }
+    
+    printf(">>> %.*s", length, line);
+    if (client_group != NULL && line[0] == '#') {
+        char ack[32];
+        int len = snprintf(ack, sizeof(ack), "ACK %lld\n", atoll(line + 1));
+        client_send(ack, len);
+    }
+}
+
+// Rebuilds the payload of a delta or keyframe and shows it as the line a
+// plain subscriber would have received
+void handle_delta_frame() {
+    char publisher[32], kind[16];
+    int slot, length;
+    long version;
+    sscanf(frame_line, "[%*[^]]] Publisher %31s %15s %d %ld %d", publisher, kind, &slot, &version, &length);
+    int body_length = frame_length;
+    frame_length = -1;
+    
+    if (slot >= key_capacity) {
+        int capacity = key_capacity ? key_capacity : 64;
+        while (capacity <= slot) capacity *= 2;
+        KeyPayload* grown = (KeyPayload*)realloc(keys, capacity * sizeof(KeyPayload));
+        if (grown == NULL) return;
+        memset(grown + key_capacity, 0, (capacity - key_capacity) * sizeof(KeyPayload));
+        keys = grown;
+        key_capacity = capacity;
+    }
+    KeyPayload* key = &keys[slot];
+    if (key->payload == NULL && (key->payload = (char*)malloc(BUFFER_SIZE)) == NULL) return;
+    
+    if (strcmp(kind, "KEYFRAME") == 0) {
+        memcpy(key->payload, frame_body, body_length);
+        key->length = body_length;
+    } else {
+        char payload[BUFFER_SIZE];
+        int payload_length = -1;
+        if (key->version == version - 1) {
+            payload_length = apply_delta(key->payload, key->length, frame_body, body_length, payload, sizeof(payload));
+        }
+        if (payload_length < 0) {
+            printf(">>> Cannot apply delta %ld of key %d to version %ld\n", version, slot, key->version);
+            return;
+        }
+        memcpy(key->payload, payload, payload_length);
+        key->length = payload_length;
+    }
+    key->version = version;
+    
+    printf(">>> %.*s Publisher %s: %.*s", (int)(strchr(frame_line, ']') - frame_line + 1), frame_line,
+           publisher, key->length, key->payload);
+    if (key->length == 0 || key->payload[key->length - 1] != '\n') printf("\n");
+}
+
+// Op bytes below 0x80 are followed by op + 1 literal bytes; the others copy
+// (op & 0x7F) + DELTA_MIN_MATCH bytes of the base from the varint offset
+// that follows. Returns the rebuilt length, or -1 for a broken delta.
+int apply_delta(const char* base, int base_len, const char* ops, int ops_len, char* out, int capacity) {
+    int pos = 0, len = 0;
+    while (pos < ops_len) {
+        unsigned char op = (unsigned char)ops[pos++];
+        if (op < 0x80) {
+            int n = op + 1;
+            if (pos + n > ops_len || len + n > capacity) return -1;
+            memcpy(out + len, ops + pos, n);
+            pos += n;
+            len += n;
+            continue;
+        }
+        
+        unsigned int offset = 0;
+        int shift = 0;
+        unsigned char byte;
+        do {
+            if (pos == ops_len || shift > 28) return -1;
+            byte = (unsigned char)ops[pos++];
+            offset |= (unsigned int)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        
+        int n = (op & 0x7F) + DELTA_MIN_MATCH;
+        if (offset + n > (unsigned int)base_len || len + n > capacity) return -1;
+        memcpy(out + len, base + offset, n);
+        len += n;
+    }
+    return len;
+}
+
 void handle_user_input() {
     char buffer[BUFFER_SIZE];
     
@@ -206,12 +799,48 @@ void handle_user_input() {
         // Check for terminate command
         if (strncmp(buffer, "terminate", 9) == 0) {
             printf("Terminating connection...\n");
-            send(client_socket, buffer, strlen(buffer), 0);
+            if (!binary) client_send(buffer, strlen(buffer));
             break;
         }
         
-        // Send message to server
-        int send_result = send(client_socket, buffer, strlen(buffer), 0);
+        // Publishers can send a whole file as one large message
+        if (client_type == CLIENT_PUBLISHER && !binary && strncmp(buffer, "/file ", 6) == 0) {
+            buffer[strcspn(buffer, "\r\n")] = '\0';
+            send_file(buffer + 6);
+            continue;
+        }
+        
+        // A MUX connection publishes as the session the line starts with
+        char* text = buffer;
+        int session = 0;
+        if (client_type == CLIENT_MUX) {
+            session = (int)strtol(buffer, &text, 10);
+            if (text == buffer || session < 1 || session > session_count || !sessions[session - 1].publisher) {
+                printf("Publish as '<SESSION> <message>' with the number of a PUBLISHER session\n");
+                continue;
+            }
+            if (*text == ' ') text++;
+        }
+        
+        // Send message to server; a binary publisher puts a header in front
+        // and lets the server fill in everything but the payload
+        int send_result;
+        if (binary) {
+            char frame[sizeof(WireHeader) + BUFFER_SIZE];
+            WireHeader* header = (WireHeader*)frame;
+            int length = (int)strlen(text);
+            if (length > MAX_WIRE_PAYLOAD) length = MAX_WIRE_PAYLOAD;
+            memset(header, 0, sizeof(WireHeader));
+            header->magic = WIRE_MAGIC;
+            header->version = WIRE_VERSION;
+            header->length = length;
+            header->content_type = WIRE_CONTENT_TEXT;
+            header->session = session;
+            memcpy(frame + sizeof(WireHeader), text, length);
+            send_result = client_send(frame, sizeof(WireHeader) + length);
+        } else {
+            send_result = client_send(buffer, strlen(buffer));
+        }
         if (send_result == SOCKET_ERROR) {
             printf("Failed to send message. Error: %d\n", WSAGetLastError());
             break;
@@ -220,7 +849,111 @@ void handle_user_input() {
         // For publishers, show confirmation
         if (client_type == CLIENT_PUBLISHER) {
             printf("Message published to topic '%s'\n", client_topic);
+        } else if (client_type == CLIENT_MUX) {
+            printf("Message published to topic '%s' by session %d\n", sessions[session - 1].topic, session);
+        }
+    }
+}
+
+// Streams a file as "CHUNK <STREAM> <LENGTH> MORE|END" frames; subscribers
+// receive each chunk while the rest is still being read
+void send_file(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open '%s'\n", path);
+        return;
+    }
+    
+    // Two buffers, so the next chunk is read before this one is sent and
+    // the last chunk can be marked END. The header goes in front of the data.
+    char* chunk = (char*)malloc(CHUNK_SIZE + 64);
+    char* next = (char*)malloc(CHUNK_SIZE + 64);
+    if (chunk == NULL || next == NULL) {
+        free(chunk);
+        free(next);
+        fclose(file);
+        return;
+    }
+    
+    char stream[32];
+    snprintf(stream, sizeof(stream), "file%d", ++file_count);
+    long long total = 0;
+    int length = (int)fread(chunk + 64, 1, CHUNK_SIZE, file);
+    while (1) {
+        int next_length = (int)fread(next + 64, 1, CHUNK_SIZE, file);
+        int last = (next_length == 0);
+        
+        char header[64];
+        int header_len = snprintf(header, sizeof(header), "CHUNK %s %d %s\n", stream, length, last ? "END" : "MORE");
+        memcpy(chunk + 64 - header_len, header, header_len);
+        if (client_send(chunk + 64 - header_len, header_len + length) == SOCKET_ERROR) {
+            printf("Failed to send '%s'. Error: %d\n", path, WSAGetLastError());
+            break;
+        }
+        total += length;
+        if (last) {
+            printf("Sent '%s' to topic '%s' as large message '%s' (%lld bytes)\n", path, client_topic, stream, total);
+            break;
         }
+        
+        char* sent = chunk;
+        chunk = next;
+        next = sent;
+        length = next_length;
+    }
+    free(chunk);
+    free(next);
+    fclose(file);
+}
+
+// Answers every "REQ <handle> <payload>" line with "<handle> <payload>"
+void serve_requests() {
+    char buffer[BUFFER_SIZE];
+    char line[BUFFER_SIZE];
+    int line_len = 0;
+    
+    while (1) {
+        int bytes_received = client_recv(buffer, BUFFER_SIZE);
+        if (bytes_received <= 0) {
+            printf("Server disconnected.\n");
+            break;
+        }
+        
+        for (int i = 0; i < bytes_received; i++) {
+            if (line_len < BUFFER_SIZE - 1) line[line_len++] = buffer[i];
+            if (buffer[i] != '\n') continue;
+            
+            line[line_len] = '\0';
+            if (is_ping(line, line_len)) {
+                client_send("PONG\n", 5);
+                line_len = 0;
+                continue;
+            }
+            line_len = 0;
+            if (strncmp(line, "REQ ", 4) != 0) continue;
+            
+            printf(">>> %s", line);
+            if (client_send(line + 4, strlen(line + 4)) == SOCKET_ERROR) {
+                printf("Failed to send reply. Error: %d\n", WSAGetLastError());
+                return;
+            }
+        }
+    }
+}
+
+// A heartbeat line of a server started with --heartbeat
+int is_ping(const char* line, int length) {
+    return (length == 5 && strncmp(line, "PING\n", 5) == 0) || (length == 6 && strncmp(line, "PING\r\n", 6) == 0);
+}
+
+void print_stats_report() {
+    char buffer[BUFFER_SIZE];
+    
+    while (1) {
+        int bytes_received = client_recv(buffer, BUFFER_SIZE - 1);
+        if (bytes_received <= 0) break;
+        buffer[bytes_received] = '\0';
+        printf("%s", buffer);
     }
 }
 
@@ -231,12 +964,30 @@ void display_client_info() {
 }
 
 void print_usage(const char* program_name) {
-    printf("Usage: %s <SERVER_IP> <PORT> <CLIENT_TYPE> <TOPIC>\n", program_name);
+    printf("Usage: %s [--tls <CA_FILE>] <SERVER_IP> <PORT> <CLIENT_TYPE> <TOPIC> [GROUP]\n", program_name);
     printf("CLIENT_TYPE must be either 'PUBLISHER' or 'SUBSCRIBER'\n");
+    printf("CLIENT_TYPE 'PUBLISHER/BINARY' or 'SUBSCRIBER/BINARY' exchanges wire frames (wire.h) instead of text lines\n");
+    printf("CLIENT_TYPE 'SUBSCRIBER/DELTA' receives each message as a difference to the last one of its key\n");
+    printf("CLIENT_TYPE 'REQUESTER' sends requests to the topic's responders; 'RESPONDER' echoes them back\n");
     printf("TOPIC is the subject/topic for message filtering\n");
+    printf("GROUP makes a subscriber a member of a queue group: each message goes to one member\n");
+    printf("TOPIC@OFFSET makes a subscriber replay the topic log from that byte offset first (server --log-dir)\n");
+    printf("CLIENT_TYPE 'MUX' carries many sessions over one connection; TOPIC lists them as 'PUBLISHER:A,SUBSCRIBER:B,...'\n");
+    printf("CLIENT_TYPE 'STATS' prints a server report instead (TOPIC: LATENCY, QUEUES, CAPTURE, REQUESTS, GROUPS, LOG, CHUNKS, POOL, HANDOFF, RATES, CPU, WIRE, DELTA, BUSY, TIMERS, MUX, ROUTES, DEDUP, TLS or TTL)\n");
+    printf("A publisher sends a file of any size as one large message with '/file <PATH>'\n");
+    printf("--tls connects to the server's --tls-port, trusting the certificates of CA_FILE (builds with -DWITH_TLS)\n");
     printf("Examples:\n");
     printf("  %s 192.168.10.2 5000 PUBLISHER TOPIC_A\n", program_name);
     printf("  %s 192.168.10.2 5000 SUBSCRIBER TOPIC_A\n", program_name);
     printf("  %s 127.0.0.1 5000 PUBLISHER SPORTS\n", program_name);
     printf("  %s 127.0.0.1 5000 SUBSCRIBER NEWS\n", program_name);
+    printf("  %s 127.0.0.1 5000 SUBSCRIBER/BINARY NEWS\n", program_name);
+    printf("  %s 127.0.0.1 5000 SUBSCRIBER/DELTA SNAPSHOTS\n", program_name);
+    printf("  %s 127.0.0.1 5000 SUBSCRIBER JOBS WORKERS\n", program_name);
+    printf("  %s 127.0.0.1 5000 SUBSCRIBER NEWS@0\n", program_name);
+    printf("  %s 127.0.0.1 5000 RESPONDER ECHO\n", program_name);
+    printf("  %s 127.0.0.1 5000 REQUESTER ECHO\n", program_name);
+    printf("  %s 127.0.0.1 5000 MUX PUBLISHER:NEWS,SUBSCRIBER:NEWS,SUBSCRIBER:SPORTS\n", program_name);
+    printf("  %s 127.0.0.1 5000 STATS LATENCY\n", program_name);
+    printf("  %s --tls server.crt 127.0.0.1 5443 SUBSCRIBER ORDERS\n", program_name);
 }
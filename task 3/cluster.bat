@@ -0,0 +1,26 @@
+@echo off
+setlocal EnableDelayedExpansion
+rem Starts a full-mesh federation of NODES brokers on loopback.
+rem Node i listens on BASE_PORT+i-1 and peers with every other node.
+
+if "%~2"=="" (
+    echo Usage: cluster.bat ^<NODES^> ^<BASE_PORT^> [extra server options]
+    echo Example: cluster.bat 4 5000 --quiet
+    exit /b 1
+)
+
+set NODES=%1
+set BASE=%2
+
+for /L %%i in (1,1,%NODES%) do (
+    set PEERS=
+    for /L %%j in (1,1,%NODES%) do (
+        if not %%i==%%j (
+            set /A PEER_PORT=BASE+%%j-1
+            set PEERS=!PEERS! --peer %%j@127.0.0.1:!PEER_PORT!
+        )
+    )
+    set /A NODE_PORT=BASE+%%i-1
+    echo Starting node %%i on port !NODE_PORT!
+    start "node %%i" /B server.exe !NODE_PORT! --node-id %%i !PEERS! %3 %4 %5 %6
+)
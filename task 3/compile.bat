@@ -1,8 +1,17 @@
 @echo off
 echo Compiling Topic-Based Publisher-Subscriber System...
 
+rem "compile.bat tls" builds the TLS port and client --tls, which need OpenSSL 3
+set TLS_FLAGS=
+set TLS_LIBS=
+if /i "%~1"=="tls" (
+    set TLS_FLAGS=-DWITH_TLS
+    set TLS_LIBS=-lssl -lcrypto
+    echo Building with TLS
+)
+
 echo Compiling server...
-gcc server.c -o server -lws2_32
+gcc server.c workers.c federation.c outbound.c latency.c capture.c request.c group.c log.c chunk.c pool.c handoff.c rate.c affinity.c wire.c delta.c busypoll.c timer.c heartbeat.c mux.c route.c dedup.c tls.c ttl.c -o server %TLS_FLAGS% -lws2_32 -lmswsock -ladvapi32 %TLS_LIBS%
 if %errorlevel% neq 0 (
     echo Failed to compile server
     pause
@@ -10,14 +19,190 @@ if %errorlevel% neq 0 (
 )
 
 echo Compiling client...
-gcc client.c -o client -lws2_32
+gcc client.c -o client %TLS_FLAGS% -lws2_32 %TLS_LIBS%
 if %errorlevel% neq 0 (
     echo Failed to compile client
     pause
     exit /b 1
 )
 
+echo Compiling federation benchmark...
+gcc bench_federation.c -o bench_federation -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_federation
+    pause
+    exit /b 1
+)
+
+echo Compiling connect-storm benchmark...
+gcc bench_storm.c -o bench_storm -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_storm
+    pause
+    exit /b 1
+)
+
+echo Compiling priority benchmark...
+gcc bench_priority.c -o bench_priority -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_priority
+    pause
+    exit /b 1
+)
+
+echo Compiling request/reply benchmark...
+gcc bench_rpc.c -o bench_rpc -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_rpc
+    pause
+    exit /b 1
+)
+
+echo Compiling queue group benchmark...
+gcc bench_group.c -o bench_group -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_group
+    pause
+    exit /b 1
+)
+
+echo Compiling catch-up benchmark...
+gcc bench_catchup.c -o bench_catchup -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_catchup
+    pause
+    exit /b 1
+)
+
+echo Compiling large message benchmark...
+gcc bench_large.c -o bench_large -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_large
+    pause
+    exit /b 1
+)
+
+echo Compiling buffer pool benchmark...
+gcc bench_pool.c pool.c -o bench_pool
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_pool
+    pause
+    exit /b 1
+)
 
+echo Compiling hot restart benchmark...
+gcc bench_handoff.c -o bench_handoff -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_handoff
+    pause
+    exit /b 1
+)
+
+echo Compiling ingress benchmark...
+gcc bench_ingress.c -o bench_ingress -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_ingress
+    pause
+    exit /b 1
+)
+
+echo Compiling CPU placement benchmark...
+gcc bench_affinity.c -o bench_affinity -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_affinity
+    pause
+    exit /b 1
+)
+
+echo Compiling wire format benchmark...
+gcc bench_wire.c -o bench_wire -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_wire
+    pause
+    exit /b 1
+)
+
+echo Compiling delta encoding benchmark...
+gcc bench_delta.c -o bench_delta -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_delta
+    pause
+    exit /b 1
+)
+
+echo Compiling busy-poll benchmark...
+gcc bench_busypoll.c -o bench_busypoll -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_busypoll
+    pause
+    exit /b 1
+)
+
+echo Compiling timer wheel benchmark...
+gcc bench_timer.c timer.c -o bench_timer -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_timer
+    pause
+    exit /b 1
+)
+
+echo Compiling multiplexing benchmark...
+gcc bench_mux.c -o bench_mux -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_mux
+    pause
+    exit /b 1
+)
+
+echo Compiling partitioned routing benchmark...
+gcc bench_route.c -o bench_route -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_route
+    pause
+    exit /b 1
+)
+
+echo Compiling idle connection benchmark...
+gcc bench_idle.c -o bench_idle -lws2_32 -lpsapi
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_idle
+    pause
+    exit /b 1
+)
+
+if defined TLS_FLAGS (
+    echo Compiling TLS benchmark...
+    gcc bench_tls.c -o bench_tls -lws2_32 -lssl -lcrypto
+    if errorlevel 1 (
+        echo Failed to compile bench_tls
+        pause
+        exit /b 1
+    )
+)
+
+echo Compiling message expiry benchmark...
+gcc bench_ttl.c -o bench_ttl -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_ttl
+    pause
+    exit /b 1
+)
+
+echo Compiling routing core microbenchmarks...
+gcc bench_core.c workers.c federation.c outbound.c latency.c capture.c request.c group.c log.c chunk.c pool.c handoff.c rate.c affinity.c wire.c delta.c busypoll.c timer.c heartbeat.c mux.c route.c dedup.c tls.c ttl.c -o bench_core %TLS_FLAGS% -lws2_32 -lmswsock -ladvapi32 %TLS_LIBS% -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc,--wrap=pool_alloc
+if %errorlevel% neq 0 (
+    echo Failed to compile bench_core
+    pause
+    exit /b 1
+)
+
+echo Compiling replay tool...
+gcc replay.c -o replay -lws2_32
+if %errorlevel% neq 0 (
+    echo Failed to compile replay
+    pause
+    exit /b 1
+)
 
 echo.
 echo All files compiled successfully!
@@ -25,6 +210,28 @@ echo.
 echo Executables created:
 echo   - server.exe
 echo   - client.exe
+echo   - bench_federation.exe
+echo   - bench_storm.exe
+echo   - bench_priority.exe
+echo   - bench_rpc.exe
+echo   - bench_group.exe
+echo   - bench_catchup.exe
+echo   - bench_large.exe
+echo   - bench_pool.exe
+echo   - bench_handoff.exe
+echo   - bench_ingress.exe
+echo   - bench_affinity.exe
+echo   - bench_wire.exe
+echo   - bench_delta.exe
+echo   - bench_busypoll.exe
+echo   - bench_timer.exe
+echo   - bench_mux.exe
+echo   - bench_route.exe
+echo   - bench_idle.exe
+if defined TLS_FLAGS echo   - bench_tls.exe
+echo   - bench_ttl.exe
+echo   - bench_core.exe
+echo   - replay.exe
 echo.
 echo Example usage:
 echo   1. Start server: server.exe 5000
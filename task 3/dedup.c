@@ -0,0 +1,303 @@
+#include "server.h"
+
+#define PRODUCER_INITIAL_CAPACITY 64   // Power of two, grown to stay at most half full
+
+// The sequences of one producer on one topic that were published lately.
+// Sequence s is bit s % dedup_window of the ring, which covers the window
+// below the highest sequence accepted; anything older is taken as a
+// retransmission. Producers outlive their connections, so a publisher
+// that reconnects under the same name finds its window again.
+typedef struct Producer {
+    char topic[MAX_TOPIC_LENGTH];
+    char name[MAX_PRODUCER_LENGTH];
+    unsigned int hash;
+    CRITICAL_SECTION lock;         // Two connections may briefly share a name while one reconnects
+    UINT64 highest;                // 0 until the first sequence
+    LONG64 accepted;
+    LONG64 duplicates;
+    LONG64 too_old;                // Of the duplicates, those below the window
+    UINT64 bits[1];                // dedup_window / 64 words
+} Producer;
+
+// One producer in a handoff, followed by dedup_window / 8 bytes of its ring
+typedef struct {
+    char topic[MAX_TOPIC_LENGTH];
+    char name[MAX_PRODUCER_LENGTH];
+    UINT64 highest;
+    LONG64 accepted;
+    LONG64 duplicates;
+    LONG64 too_old;
+    int window;
+} ProducerHandoff;
+
+// Global variables
+int dedup_window = DEFAULT_DEDUP_WINDOW;   // --dedup-window, a multiple of 64
+int max_producers = DEFAULT_MAX_PRODUCERS; // --max-producers
+
+// Taken to find or add a producer, once per registration
+static CRITICAL_SECTION producers_lock;
+static Producer** producers = NULL;        // Open addressing on the hash of topic and name
+static int capacity = 0;
+static int producer_count = 0;
+static LONG64 refused = 0;                 // Registrations beyond --max-producers
+
+void dedup_init() {
+    InitializeCriticalSection(&producers_lock);
+}
+
+static unsigned int hash_producer(const char* topic, const char* name) {
+    unsigned int hash = 2166136261u;   // FNV-1a over both, with the terminator between
+    for (const char* c = topic; ; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+        if (*c == '\0') break;
+    }
+    for (const char* c = name; *c; c++) hash = (hash ^ (unsigned char)*c) * 16777619u;
+    return hash;
+}
+
+// Index of the producer's entry, or of the empty entry it would take
+static int find_entry(Producer** table, int size, const char* topic, const char* name, unsigned int hash) {
+    int mask = size - 1;
+    int i = (int)(hash & mask);
+    while (table[i] != NULL && (table[i]->hash != hash || strcmp(table[i]->name, name) != 0 ||
+                                strcmp(table[i]->topic, topic) != 0)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+static int grow() {
+    int size = capacity ? capacity * 2 : PRODUCER_INITIAL_CAPACITY;
+    Producer** table = (Producer**)calloc(size, sizeof(Producer*));
+    if (table == NULL) return -1;
+    
+    for (int i = 0; i < capacity; i++) {
+        Producer* producer = producers[i];
+        if (producer != NULL) table[find_entry(table, size, producer->topic, producer->name, producer->hash)] = producer;
+    }
+    free(producers);
+    producers = table;
+    capacity = size;
+    return 0;
+}
+
+// The producer of that name on the topic, created with an empty window on
+// first use. NULL once --max-producers exist or without memory.
+struct Producer* dedup_producer(const char* topic, const char* name) {
+    unsigned int hash = hash_producer(topic, name);
+    Producer* producer = NULL;
+    
+    EnterCriticalSection(&producers_lock);
+    int index = (capacity > 0) ? find_entry(producers, capacity, topic, name, hash) : -1;
+    if (index >= 0 && producers[index] != NULL) {
+        producer = producers[index];
+    } else if (producer_count == max_producers) {
+        refused++;
+    } else if ((producer_count + 1) * 2 <= capacity || grow() == 0) {
+        producer = (Producer*)calloc(1, sizeof(Producer) + (dedup_window / 64 - 1) * sizeof(UINT64));
+        if (producer != NULL) {
+            strncpy(producer->topic, topic, MAX_TOPIC_LENGTH - 1);
+            strncpy(producer->name, name, MAX_PRODUCER_LENGTH - 1);
+            producer->hash = hash;
+            InitializeCriticalSection(&producer->lock);
+            producers[find_entry(producers, capacity, topic, name, hash)] = producer;
+            producer_count++;
+        }
+    }
+    LeaveCriticalSection(&producers_lock);
+    return producer;
+}
+
+static int test_bit(const Producer* producer, UINT64 sequence) {
+    UINT64 bit = sequence % dedup_window;
+    return (producer->bits[bit / 64] >> (bit % 64)) & 1;
+}
+
+static void set_bit(Producer* producer, UINT64 sequence) {
+    UINT64 bit = sequence % dedup_window;
+    producer->bits[bit / 64] |= 1ULL << (bit % 64);
+}
+
+// Forgets sequences first to last, which wrap onto bits of sequences that
+// fell out of the window; whole words at a time where it can
+static void clear_bits(Producer* producer, UINT64 first, UINT64 last) {
+    UINT64 sequence = first;
+    while (sequence <= last) {
+        UINT64 bit = sequence % dedup_window;
+        if (bit % 64 == 0 && last - sequence >= 63) {
+            producer->bits[bit / 64] = 0;
+            sequence += 64;
+        } else {
+            producer->bits[bit / 64] &= ~(1ULL << (bit % 64));
+            sequence++;
+        }
+    }
+}
+
+// Records a sequence number of the producer. Returns 1 if the message is
+// new, 0 if it was seen within the window or is older than the window, in
+// which case the caller drops it before fan-out. The work is a bit test
+// and set, plus clearing the bits a jump ahead skips, which is bounded by
+// the window.
+int dedup_accept(struct Producer* producer, UINT64 sequence) {
+    int accepted = 1;
+    EnterCriticalSection(&producer->lock);
+    if (sequence > producer->highest) {
+        if (sequence - producer->highest >= (UINT64)dedup_window) {
+            memset(producer->bits, 0, dedup_window / 8);
+        } else {
+            clear_bits(producer, producer->highest + 1, sequence);
+        }
+        set_bit(producer, sequence);
+        producer->highest = sequence;
+    } else if (producer->highest - sequence >= (UINT64)dedup_window) {
+        producer->too_old++;
+        accepted = 0;
+    } else if (test_bit(producer, sequence)) {
+        accepted = 0;
+    } else {
+        set_bit(producer, sequence);   // A gap filled late
+    }
+    if (accepted) {
+        producer->accepted++;
+    } else {
+        producer->duplicates++;
+    }
+    LeaveCriticalSection(&producer->lock);
+    return accepted;
+}
+
+// Strips a leading "=SEQ " from a line of a named producer and checks the
+// sequence. Lines without one, or of publishers without a producer name,
+// are always new. Returns 0 for a duplicate.
+int dedup_line(Client* client, const char** line, int* length, UINT64* sequence) {
+    *sequence = 0;
+    if (client->producer == NULL || *length < 3 || (*line)[0] != '=') return 1;
+    
+    const char* text = *line;
+    UINT64 value = 0;
+    int i = 1;
+    while (i < *length && text[i] >= '0' && text[i] <= '9') {
+        UINT64 digit = (UINT64)(text[i] - '0');
+        if (value > (MAXUINT64 - digit) / 10) return 1;    // Does not fit: not a sequence
+        value = value * 10 + digit;
+        i++;
+    }
+    if (i == 1 || i == *length || text[i] != ' ' || value == 0) return 1;
+    
+    *line += i + 1;
+    *length -= i + 1;
+    *sequence = value;
+    return dedup_accept(client->producer, value);
+}
+
+const char* dedup_producer_name(const struct Producer* producer) {
+    return producer->name;
+}
+
+// Every producer and its window, for a hot restart. Called with every
+// worker paused. Returns the length of *data, or -1 without memory.
+int dedup_export(char** data) {
+    int record_size = (int)sizeof(ProducerHandoff) + dedup_window / 8;
+    *data = NULL;
+    
+    EnterCriticalSection(&producers_lock);
+    int length = producer_count * record_size;
+    char* out = (length > 0) ? (char*)malloc(length) : NULL;
+    if (length > 0 && out == NULL) {
+        LeaveCriticalSection(&producers_lock);
+        return -1;
+    }
+    char* next = out;
+    for (int i = 0; i < capacity; i++) {
+        Producer* producer = producers[i];
+        if (producer == NULL) continue;
+        
+        ProducerHandoff record;
+        memset(&record, 0, sizeof(record));
+        memcpy(record.topic, producer->topic, MAX_TOPIC_LENGTH);
+        memcpy(record.name, producer->name, MAX_PRODUCER_LENGTH);
+        record.highest = producer->highest;
+        record.accepted = producer->accepted;
+        record.duplicates = producer->duplicates;
+        record.too_old = producer->too_old;
+        record.window = dedup_window;
+        memcpy(next, &record, sizeof(record));
+        memcpy(next + sizeof(record), producer->bits, dedup_window / 8);
+        next += record_size;
+    }
+    LeaveCriticalSection(&producers_lock);
+    *data = out;
+    return length;
+}
+
+// Restores the producers dedup_export saved, before any connection is
+// taken over. The old process may have had another --dedup-window; what
+// both windows cover is kept. Returns 0 on success.
+int dedup_import(const char* data, int length) {
+    while (length > 0) {
+        ProducerHandoff record;
+        if (length < (int)sizeof(record)) return -1;
+        memcpy(&record, data, sizeof(record));
+        record.topic[MAX_TOPIC_LENGTH - 1] = '\0';
+        record.name[MAX_PRODUCER_LENGTH - 1] = '\0';
+        if (record.window <= 0 || record.window % 64 != 0 || length < (int)sizeof(record) + record.window / 8) return -1;
+        
+        const UINT64* bits = (const UINT64*)(data + sizeof(record));
+        Producer* producer = dedup_producer(record.topic, record.name);
+        if (producer == NULL) return -1;
+        producer->highest = record.highest;
+        producer->accepted = record.accepted;
+        producer->duplicates = record.duplicates;
+        producer->too_old = record.too_old;
+        int kept = (record.window < dedup_window) ? record.window : dedup_window;
+        for (int back = 0; back < kept && (UINT64)back < record.highest; back++) {
+            UINT64 sequence = record.highest - back;
+            UINT64 bit = sequence % record.window;
+            if ((bits[bit / 64] >> (bit % 64)) & 1) set_bit(producer, sequence);
+        }
+        
+        data += sizeof(record) + record.window / 8;
+        length -= (int)sizeof(record) + record.window / 8;
+    }
+    return 0;
+}
+
+int dedup_report(char* out, int size) {
+    EnterCriticalSection(&producers_lock);
+    LONG64 accepted = 0, duplicates = 0, too_old = 0;
+    for (int i = 0; i < capacity; i++) {
+        Producer* producer = producers[i];
+        if (producer == NULL) continue;
+        EnterCriticalSection(&producer->lock);
+        accepted += producer->accepted;
+        duplicates += producer->duplicates;
+        too_old += producer->too_old;
+        LeaveCriticalSection(&producer->lock);
+    }
+    
+    int len = snprintf(out, size,
+                       "Deduplication: %d of at most %d producers, window of %d sequences (%d bytes each)\n"
+                       "  Messages: %lld new, %lld duplicates dropped (%lld older than the window)\n"
+                       "  Registrations refused for too many producers: %lld\n",
+                       producer_count, max_producers, dedup_window, (int)sizeof(Producer) + dedup_window / 8 - 8,
+                       (long long)accepted, (long long)duplicates, (long long)too_old, (long long)refused);
+    
+    // Leave room for the last line
+    int listed = 0;
+    for (int i = 0; i < capacity && len < size - 256; i++) {
+        Producer* producer = producers[i];
+        if (producer == NULL) continue;
+        EnterCriticalSection(&producer->lock);
+        len += snprintf(out + len, size - len, "  Producer '%s' on %s: sequence %llu, %lld new, %lld duplicates\n",
+                        producer->name, producer->topic, (unsigned long long)producer->highest,
+                        (long long)producer->accepted, (long long)producer->duplicates);
+        LeaveCriticalSection(&producer->lock);
+        listed++;
+    }
+    if (listed < producer_count) {
+        len += snprintf(out + len, size - len, "  ... and %d more\n", producer_count - listed);
+    }
+    LeaveCriticalSection(&producers_lock);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,405 @@
+#include "server.h"
+
+#define MIN_MATCH 4                // Shorter runs of base bytes are cheaper as literals
+#define MAX_LITERAL 128
+#define MAX_COPY (127 + MIN_MATCH)
+#define MATCH_HASH_BITS 10
+
+// The payload last sent for one key of a topic; every delta of the key is
+// taken against it. Slots are numbered from 1 and never reused.
+typedef struct {
+    int route_id;
+    char key[MAX_KEY_LENGTH];
+    char* payload;
+    int length;
+    LONG version;                  // Of payload; 1 for the first message of the key
+} DeltaBase;
+
+// Versions of the keys one delta subscriber holds, by slot
+typedef struct DeltaState {
+    int* slots;                    // Slot + 1, 0 for an empty entry
+    LONG* versions;
+    int capacity;                  // Power of two
+    int used;
+} DeltaState;
+
+// Global variables
+int delta_keyframe = DEFAULT_DELTA_KEYFRAME;
+int delta_keys = DEFAULT_DELTA_KEYS;
+
+// Only touched with clients_mutex held, like every fan-out
+static DeltaBase* bases = NULL;    // Allocated for the first delta subscriber
+static int* base_index = NULL;     // Hash of topic and key -> slot, 0 for empty
+static int base_count = 0;
+static int index_size = 0;
+
+static LONG64 frames_delta = 0;
+static LONG64 frames_keyframe = 0;
+static LONG64 bytes_full = 0;      // Their text lines would have taken this
+static LONG64 bytes_sent = 0;
+static LONG64 messages_encoded = 0;
+static LONG64 encode_ticks = 0;
+static LONG64 keys_untracked = 0;  // Messages of keys beyond --delta-keys
+
+DeltaState* delta_state_create() {
+    DeltaState* state = (DeltaState*)calloc(1, sizeof(DeltaState));
+    if (state == NULL) return NULL;
+    
+    EnterCriticalSection(&clients_mutex);
+    if (bases == NULL) {
+        index_size = 16;
+        while (index_size < 2 * delta_keys) index_size *= 2;
+        bases = (DeltaBase*)calloc(delta_keys, sizeof(DeltaBase));
+        base_index = (int*)calloc(index_size, sizeof(int));
+        if (bases == NULL || base_index == NULL) {
+            free(bases);
+            free(base_index);
+            bases = NULL;
+            base_index = NULL;
+        }
+    }
+    int ready = (bases != NULL);
+    LeaveCriticalSection(&clients_mutex);
+    
+    if (!ready) {
+        free(state);
+        return NULL;
+    }
+    return state;
+}
+
+void delta_state_free(DeltaState* state) {
+    if (state == NULL) return;
+    free(state->slots);
+    free(state->versions);
+    free(state);
+}
+
+static LONG* state_entry(DeltaState* state, int slot, int create) {
+    if (state->capacity > 0) {
+        int mask = state->capacity - 1;
+        for (int i = (slot * 2654435761u) & mask; state->slots[i] != 0; i = (i + 1) & mask) {
+            if (state->slots[i] == slot + 1) return &state->versions[i];
+        }
+    }
+    if (!create) return NULL;
+    
+    // Grown at half full; the old entries are rehashed
+    if ((state->used + 1) * 2 > state->capacity) {
+        int capacity = state->capacity ? state->capacity * 2 : 16;
+        int* slots = (int*)calloc(capacity, sizeof(int));
+        LONG* versions = (LONG*)malloc(capacity * sizeof(LONG));
+        if (slots == NULL || versions == NULL) {
+            free(slots);
+            free(versions);
+            return NULL;
+        }
+        for (int i = 0; i < state->capacity; i++) {
+            if (state->slots[i] == 0) continue;
+            int j = ((state->slots[i] - 1) * 2654435761u) & (capacity - 1);
+            while (slots[j] != 0) j = (j + 1) & (capacity - 1);
+            slots[j] = state->slots[i];
+            versions[j] = state->versions[i];
+        }
+        free(state->slots);
+        free(state->versions);
+        state->slots = slots;
+        state->versions = versions;
+        state->capacity = capacity;
+    }
+    
+    int mask = state->capacity - 1;
+    int i = (slot * 2654435761u) & mask;
+    while (state->slots[i] != 0) i = (i + 1) & mask;
+    state->slots[i] = slot + 1;
+    state->versions[i] = 0;
+    state->used++;
+    return &state->versions[i];
+}
+
+static unsigned int hash_base(int route_id, const char* key) {
+    unsigned int hash = 2166136261u ^ (unsigned int)route_id;   // FNV-1a
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Finds the slot of a topic's key, taking the next one on first use.
+// Returns 0 once --delta-keys keys are tracked.
+static int find_base(int route_id, const char* key) {
+    int mask = index_size - 1;
+    int i = hash_base(route_id, key) & mask;
+    for (; base_index[i] != 0; i = (i + 1) & mask) {
+        DeltaBase* base = &bases[base_index[i] - 1];
+        if (base->route_id == route_id && strcmp(base->key, key) == 0) return base_index[i];
+    }
+    if (base_count == delta_keys) return 0;
+    
+    DeltaBase* base = &bases[base_count++];
+    base->route_id = route_id;
+    strcpy(base->key, key);
+    base_index[i] = base_count;
+    return base_count;
+}
+
+static int put_varint(char* out, unsigned int value) {
+    int len = 0;
+    while (value >= 0x80) {
+        out[len++] = (char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (char)value;
+    return len;
+}
+
+// Compares eight bytes at a time while it can
+static int match_length(const char* a, const char* b, int limit) {
+    int m = 0;
+    while (m + 8 <= limit) {
+        UINT64 x, y;
+        memcpy(&x, a + m, sizeof(x));
+        memcpy(&y, b + m, sizeof(y));
+        if (x != y) break;
+        m += 8;
+    }
+    while (m < limit && a[m] == b[m]) m++;
+    return m;
+}
+
+// Indexes every MIN_MATCH-th position of the base by the four bytes there;
+// a literal run probes at every byte, so it finds one of them within
+// MIN_MATCH bytes of where the common part starts
+static void hash_positions(const char* base, int base_len, unsigned short* positions) {
+    memset(positions, 0xFF, (1 << MATCH_HASH_BITS) * sizeof(unsigned short));
+    for (int j = 0; j + MIN_MATCH <= base_len; j += MIN_MATCH) {
+        UINT32 word;
+        memcpy(&word, base + j, sizeof(word));
+        positions[(word * 2654435761u) >> (32 - MATCH_HASH_BITS)] = (unsigned short)j;
+    }
+}
+
+// Encodes target as copies from base and literals, into at most limit
+// bytes. An op byte below 0x80 is followed by op + 1 literal bytes; one
+// from 0x80 copies (op & 0x7F) + MIN_MATCH bytes from the base offset in
+// the varint after it. Each position tries the shift of the last copy, the
+// same offset and the same distance from the end, so changed fields, and a
+// field that grew or shrank, cost little. Only after MIN_MATCH literals in
+// a row is the base indexed by its four-byte sequences to find the place
+// again. Returns the encoded length, or -1 if it would not be shorter than
+// limit.
+static int encode_delta(const char* base, int base_len, const char* target, int target_len, char* out, int limit) {
+    unsigned short positions[1 << MATCH_HASH_BITS];
+    int hashed = 0;
+    
+    int len = 0, literal_start = 0, shift = 0;
+    int i = 0;
+    while (i < target_len) {
+        int best = 0, best_from = 0;
+        int candidates[4] = { i + shift, i, i + base_len - target_len, -1 };
+        if (i - literal_start >= MIN_MATCH && i + MIN_MATCH <= target_len) {
+            if (!hashed) {
+                hash_positions(base, base_len, positions);
+                hashed = 1;
+            }
+            UINT32 word;
+            memcpy(&word, target + i, sizeof(word));
+            unsigned short j = positions[(word * 2654435761u) >> (32 - MATCH_HASH_BITS)];
+            if (j != 0xFFFF) candidates[3] = j;
+        }
+        for (int c = 0; c < 4 && best < target_len - i; c++) {
+            int from = candidates[c];
+            if (from < 0 || from >= base_len || (c > 0 && from == candidates[0]) || (c > 1 && from == candidates[1])) continue;
+            int limit_m = (base_len - from < target_len - i) ? base_len - from : target_len - i;
+            int m = match_length(base + from, target + i, limit_m);
+            if (m > best) {
+                best = m;
+                best_from = from;
+            }
+        }
+        if (best < MIN_MATCH) {
+            i++;
+            continue;
+        }
+        
+        // Literals before the copy, then the copy in ops of MAX_COPY bytes
+        for (int l = literal_start; l < i; l += MAX_LITERAL) {
+            int n = (i - l < MAX_LITERAL) ? i - l : MAX_LITERAL;
+            if (len + 1 + n >= limit) return -1;
+            out[len++] = (char)(n - 1);
+            memcpy(out + len, target + l, n);
+            len += n;
+        }
+        shift = best_from - i;
+        for (int done = 0; done < best; ) {
+            int n = (best - done < MAX_COPY) ? best - done : MAX_COPY;
+            if (best - done - n > 0 && best - done - n < MIN_MATCH) n -= MIN_MATCH;   // Keep the rest copyable
+            if (len + 4 >= limit) return -1;
+            out[len++] = (char)(0x80 | (n - MIN_MATCH));
+            len += put_varint(out + len, (unsigned int)(best_from + done));
+            done += n;
+        }
+        i += best;
+        literal_start = i;
+    }
+    for (int l = literal_start; l < target_len; l += MAX_LITERAL) {
+        int n = (target_len - l < MAX_LITERAL) ? target_len - l : MAX_LITERAL;
+        if (len + 1 + n >= limit) return -1;
+        out[len++] = (char)(n - 1);
+        memcpy(out + len, target + l, n);
+        len += n;
+    }
+    return len;
+}
+
+// Formats "[TOPIC] Publisher ID KIND SLOT VERSION LENGTH\n" (or "ID@NODE")
+// and the body after it. Frames go in the topic's lane, whatever class the
+// message had, and are never conflated: a subscriber must get every frame
+// of a key in order.
+static Message* create_frame(const Message* message, const char* topic, const char* kind, int slot, LONG version,
+                             const char* body, int length) {
+    int capacity = length + MAX_TOPIC_LENGTH + 96;
+    Message* frame = message_create(capacity);
+    if (frame == NULL) return NULL;
+    
+    char sender[32];
+    if (message->wire.origin > 0) {
+        snprintf(sender, sizeof(sender), "%u@%u", message->wire.publisher_id, message->wire.origin);
+    } else {
+        snprintf(sender, sizeof(sender), "%u", message->wire.publisher_id);
+    }
+    int header_length = snprintf(frame->data, capacity, "[%s] Publisher %s %s %d %ld %d\n",
+                                 topic, sender, kind, slot, (long)version, length);
+    memcpy(frame->data + header_length, body, length);
+    frame->length = header_length + length;
+    
+    TopicPolicy* policy = find_topic_policy(topic);
+    frame->priority = policy ? policy->priority : PRIORITY_NORMAL;
+    return frame;
+}
+
+void delta_fanout_begin(DeltaFanout* fanout, Message* message, const char* topic) {
+    memset(fanout, 0, sizeof(*fanout));
+    fanout->message = message;
+    fanout->topic = topic;
+}
+
+// Takes the next version of the message's key and encodes it against the
+// last one, once per fan-out, when the first delta subscriber needs it
+static void prepare(DeltaFanout* fanout) {
+    fanout->prepared = 1;
+    Message* text = message_encoded(fanout->message, 0);
+    if (text == NULL) return;
+    fanout->text = text;
+    const char* payload = text->data + text->payload_offset;
+    int length = text->length - text->payload_offset;
+    fanout->full_length = text->length;
+    
+    LONGLONG started = trace_now();
+    fanout->slot = find_base((int)text->wire.topic_id, text->conflated ? text->key : "");
+    if (fanout->slot == 0) {
+        keys_untracked++;
+    } else {
+        DeltaBase* base = &bases[fanout->slot - 1];
+        fanout->version = ++base->version;
+        
+        // Every delta_keyframe-th version goes whole to every subscriber
+        char encoded[2 * BUFFER_SIZE];
+        int encoded_length = -1;
+        if (base->payload != NULL && (fanout->version - 1) % delta_keyframe != 0) {
+            encoded_length = encode_delta(base->payload, base->length, payload, length, encoded,
+                                          (length < (int)sizeof(encoded)) ? length : (int)sizeof(encoded));
+        }
+        if (encoded_length >= 0) {
+            fanout->delta = create_frame(text, fanout->topic, "DELTA", fanout->slot, fanout->version,
+                                         encoded, encoded_length);
+        }
+        
+        // The new version is the base of the next delta
+        if (base->payload == NULL || base->length < length) {
+            char* grown = (char*)realloc(base->payload, length > 0 ? length : 1);
+            if (grown == NULL) {
+                free(base->payload);
+                base->payload = NULL;
+                base->version = 0;
+            } else {
+                base->payload = grown;
+            }
+        }
+        if (base->payload != NULL) {
+            memcpy(base->payload, payload, length);
+            base->length = length;
+        }
+    }
+    encode_ticks += trace_now() - started;
+    messages_encoded++;
+}
+
+// Sends a delta subscriber the difference to the version of the key it
+// holds, or the whole payload if it holds another one. Large message
+// chunks and lines that are no topic message pass through unchanged.
+// Called with clients_mutex held.
+OutboundResult delta_deliver(DeltaFanout* fanout, Client* client) {
+    if (fanout->message->chunk || fanout->message->wire.magic != WIRE_MAGIC) {
+        return deliver_to_client(client, fanout->message);
+    }
+    if (!fanout->prepared) prepare(fanout);
+    if (fanout->text == NULL) return OUTBOUND_ERROR;
+    
+    // The keyframe is only made for the first subscriber that needs it
+    LONG* held = (fanout->slot != 0) ? state_entry(client->delta, fanout->slot, 1) : NULL;
+    Message* frame = fanout->delta;
+    if (held == NULL || frame == NULL || *held != fanout->version - 1) {
+        if (fanout->keyframe == NULL) {
+            const Message* text = fanout->text;
+            fanout->keyframe = create_frame(text, fanout->topic, "KEYFRAME", fanout->slot, fanout->version,
+                                            text->data + text->payload_offset, text->length - text->payload_offset);
+        }
+        frame = fanout->keyframe;
+    }
+    if (frame == NULL) return OUTBOUND_ERROR;
+    
+    OutboundResult result = deliver_to_client(client, frame);
+    if (result == OUTBOUND_SENT || result == OUTBOUND_QUEUED) {
+        // A subscriber whose state could not grow gets keyframes only
+        if (held != NULL) *held = fanout->version;
+        if (frame == fanout->delta) {
+            frames_delta++;
+        } else {
+            frames_keyframe++;
+        }
+        bytes_full += fanout->full_length;
+        bytes_sent += frame->length;
+    }
+    return result;
+}
+
+void delta_fanout_end(DeltaFanout* fanout) {
+    if (fanout->delta != NULL) message_release(fanout->delta);
+    if (fanout->keyframe != NULL) message_release(fanout->keyframe);
+}
+
+int delta_report(char* out, int size) {
+    int subscribers = 0;
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < max_clients; i++) {
+        if (clients[i].socket != INVALID_SOCKET && clients[i].delta != NULL) subscribers++;
+    }
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    double encode_ns = messages_encoded ? encode_ticks * 1e9 / (double)frequency.QuadPart / messages_encoded : 0;
+    
+    int len = snprintf(out, size,
+                       "Delta encoding: %d subscriber(s), keyframe every %d versions, %d of %d keys tracked\n"
+                       "  Frames sent: %lld delta, %lld keyframe; %lld message(s) of untracked keys\n"
+                       "  Bytes: %lld as frames instead of %lld as lines (%.1f%% saved)\n"
+                       "  Encoding: %lld message(s), %.0f ns per message\n",
+                       subscribers, delta_keyframe, base_count, delta_keys,
+                       (long long)frames_delta, (long long)frames_keyframe, (long long)keys_untracked,
+                       (long long)bytes_sent, (long long)bytes_full,
+                       bytes_full ? 100.0 * (bytes_full - bytes_sent) / bytes_full : 0.0,
+                       (long long)messages_encoded, encode_ns);
+    LeaveCriticalSection(&clients_mutex);
+    return len < size ? len : size - 1;
+}
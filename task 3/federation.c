@@ -0,0 +1,544 @@
+#include "server.h"
+
+#define MAX_PEERS 16
+#define MAX_PEER_TOPICS 256
+#define PEER_RETRY_MS 1000
+#define PEER_POLL_MS 50
+#define PEER_QUEUE_INITIAL 65536
+#define PEER_QUEUE_BYTES (4 * 1024 * 1024)   // Unsent frames a peer may fall behind by before its link is dropped
+
+// A remote broker in the federation mesh. Each node dials every configured
+// peer and uses that outbound link to send its interest and forwarded
+// publishes; the peer's own outbound link arrives as an inbound client.
+// The link is non-blocking: frames are appended to the peer's queue and
+// written as far as the socket takes them, and the dialer thread writes
+// the rest, so a slow peer never holds up the threads that publish.
+typedef struct {
+    int node_id;
+    char host[INET_ADDRSTRLEN];
+    int port;
+    SOCKET socket;                 // Outbound link (INVALID_SOCKET while down)
+    CRITICAL_SECTION send_lock;    // Guards the socket and the queue; held only to copy and to send without waiting
+    char* queue;                   // Frames the socket did not take yet
+    int queue_head;
+    int queue_used;
+    int queue_capacity;
+    int dropping;                  // The link fell too far behind and was shut down
+    int interest_count;            // Topics the peer has local subscribers for
+    char interest[MAX_PEER_TOPICS][MAX_TOPIC_LENGTH];
+} Peer;
+
+// Inbound link handed from a worker to its own thread
+typedef struct {
+    Client* client;
+    int remote_id;
+    int initial_len;
+    char initial[BUFFER_SIZE];
+} PeerLinkStart;
+
+// Global variables
+int node_id = 0;
+Peer peers[MAX_PEERS];
+int peer_count = 0;
+CRITICAL_SECTION peers_mutex;
+
+// Function prototypes
+Peer* find_peer(int id);
+unsigned __stdcall peer_dialer(void* arg);
+unsigned __stdcall peer_link_thread(void* arg);
+void handle_peer_link(Client* client, int remote_id, const char* initial, int initial_len);
+void send_interest_snapshot(Peer* peer);
+static void queue_for_peer(Peer* peer, const char* data, int len);
+static void flush_peer(Peer* peer);
+void set_peer_interest(Peer* peer, const char* topic, int interested);
+
+// Parses "ID@IP:PORT" and registers the peer
+int add_peer(const char* spec) {
+    if (peer_count >= MAX_PEERS) {
+        fprintf(stderr, "Error: At most %d peers are supported\n", MAX_PEERS);
+        return -1;
+    }
+    
+    Peer* peer = &peers[peer_count];
+    memset(peer, 0, sizeof(*peer));
+    if (sscanf(spec, "%d@%15[^:]:%d", &peer->node_id, peer->host, &peer->port) != 3 ||
+        peer->node_id <= 0 || peer->port <= 0) {
+        fprintf(stderr, "Error: Invalid peer '%s'. Expected ID@IP:PORT\n", spec);
+        return -1;
+    }
+    
+    peer->socket = INVALID_SOCKET;
+    InitializeCriticalSection(&peer->send_lock);
+    if (peer_count == 0) {
+        InitializeCriticalSection(&peers_mutex);
+    }
+    peer_count++;
+    return 0;
+}
+
+int federation_peer_count() {
+    return peer_count;
+}
+
+int federation_connected_peers() {
+    int connected = 0;
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].socket != INVALID_SOCKET) connected++;
+    }
+    return connected;
+}
+
+void cleanup_federation() {
+    for (int i = 0; i < peer_count; i++) {
+        DeleteCriticalSection(&peers[i].send_lock);
+        free(peers[i].queue);
+    }
+    if (peer_count > 0) {
+        DeleteCriticalSection(&peers_mutex);
+    }
+}
+
+Peer* find_peer(int id) {
+    for (int i = 0; i < peer_count; i++) {
+        if (peers[i].node_id == id) return &peers[i];
+    }
+    return NULL;
+}
+
+void start_peer_links() {
+    for (int i = 0; i < peer_count; i++) {
+        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, peer_dialer, &peers[i], 0, NULL);
+        if (thread == NULL) {
+            printf("Failed to create link thread for peer node %d\n", peers[i].node_id);
+        } else {
+            CloseHandle(thread);
+        }
+    }
+}
+
+// Keeps the outbound link to one peer up, reconnecting whenever it drops
+unsigned __stdcall peer_dialer(void* arg) {
+    Peer* peer = (Peer*)arg;
+    
+    while (1) {
+        SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+        if (sock == INVALID_SOCKET) {
+            Sleep(PEER_RETRY_MS);
+            continue;
+        }
+        
+        struct sockaddr_in peer_addr;
+        memset(&peer_addr, 0, sizeof(peer_addr));
+        peer_addr.sin_family = AF_INET;
+        peer_addr.sin_port = htons(peer->port);
+        inet_pton(AF_INET, peer->host, &peer_addr.sin_addr);
+        
+        if (connect(sock, (struct sockaddr*)&peer_addr, sizeof(peer_addr)) < 0) {
+            closesocket(sock);
+            Sleep(PEER_RETRY_MS);
+            continue;
+        }
+        
+        int nodelay = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+        u_long nonblocking = 1;
+        ioctlsocket(sock, FIONBIO, &nonblocking);
+        
+        // Publish the link and queue our current interest atomically with
+        // respect to subscribers joining or leaving, so no SUB/UNSUB is lost
+        // or reordered; the frames are written after the locks are released
+        EnterCriticalSection(&clients_mutex);
+        EnterCriticalSection(&peer->send_lock);
+        char handshake[32];
+        int len = snprintf(handshake, sizeof(handshake), "PEER:%d\n", node_id);
+        peer->socket = sock;
+        peer->dropping = 0;
+        queue_for_peer(peer, handshake, len);
+        send_interest_snapshot(peer);
+        LeaveCriticalSection(&peer->send_lock);
+        LeaveCriticalSection(&clients_mutex);
+        
+        printf("Linked to peer node %d at %s:%d\n", peer->node_id, peer->host, peer->port);
+        
+        // The remote never writes on this link; reading only detects
+        // closure. Queued frames are written whenever the socket drains.
+        while (1) {
+            WSAPOLLFD pfd;
+            pfd.fd = sock;
+            pfd.events = POLLRDNORM;
+            pfd.revents = 0;
+            EnterCriticalSection(&peer->send_lock);
+            if (peer->queue_head < peer->queue_used) pfd.events |= POLLWRNORM;
+            LeaveCriticalSection(&peer->send_lock);
+            
+            if (WSAPoll(&pfd, 1, PEER_POLL_MS) < 0) break;
+            if (pfd.revents & (POLLRDNORM | POLLHUP | POLLERR)) {
+                char scratch[64];
+                int received = recv(sock, scratch, sizeof(scratch), 0);
+                if (received == 0 || (received == SOCKET_ERROR && WSAGetLastError() != WSAEWOULDBLOCK)) break;
+            }
+            
+            EnterCriticalSection(&peer->send_lock);
+            flush_peer(peer);
+            int dropped = peer->dropping;
+            LeaveCriticalSection(&peer->send_lock);
+            if (dropped) break;
+        }
+        
+        EnterCriticalSection(&peer->send_lock);
+        peer->socket = INVALID_SOCKET;
+        peer->queue_head = peer->queue_used = 0;
+        LeaveCriticalSection(&peer->send_lock);
+        printf("Lost link to peer node %d\n", peer->node_id);
+        
+        closesocket(sock);
+        Sleep(PEER_RETRY_MS);
+    }
+    
+    return 0;
+}
+
+// Moves an inbound peer link off its worker onto a dedicated thread; peer
+// links are few and long-lived and parse a framed stream of their own.
+void start_peer_link_handler(Client* client, int remote_id, const char* initial, int initial_len) {
+    PeerLinkStart* start = (PeerLinkStart*)malloc(sizeof(PeerLinkStart));
+    if (start == NULL) {
+        remove_client(client->id);
+        return;
+    }
+    
+    start->client = client;
+    start->remote_id = remote_id;
+    start->initial_len = initial_len;
+    memcpy(start->initial, initial, initial_len);
+    
+    HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, peer_link_thread, start, 0, NULL);
+    if (thread == NULL) {
+        printf("Failed to create thread for peer node %d\n", remote_id);
+        remove_client(client->id);
+        free(start);
+    } else {
+        CloseHandle(thread);
+    }
+}
+
+unsigned __stdcall peer_link_thread(void* arg) {
+    PeerLinkStart* start = (PeerLinkStart*)arg;
+    
+    // This node only reads an inbound link, which blocks on its own thread;
+    // everything it sends the peer goes over the link it dialed
+    u_long blocking = 0;
+    ioctlsocket(start->client->socket, FIONBIO, &blocking);
+    
+    handle_peer_link(start->client, start->remote_id, start->initial, start->initial_len);
+    remove_client(start->client->id);
+    latency_thread_release();
+    pool_thread_release();
+    free(start);
+    return 0;
+}
+
+// Reads exactly len bytes from a blocking socket
+static int receive_exact(SOCKET sock, char* data, int len) {
+    while (len > 0) {
+        int bytes = recv(sock, data, len, 0);
+        if (bytes <= 0) return -1;
+        data += bytes;
+        len -= bytes;
+    }
+    return 0;
+}
+
+// Receives interest updates and forwarded publishes from a peer's outbound link.
+// Frames are "SUB <topic>\n", "UNSUB <topic>\n",
+// "MSG <origin> <publisher> <length> <topic>\n" followed by <length> payload bytes,
+// and "CHUNK <origin> <publisher> <stream> <length> <flag> <topic>\n" followed by
+// <length> bytes of a large message.
+void handle_peer_link(Client* client, int remote_id, const char* initial, int initial_len) {
+    Peer* peer = find_peer(remote_id);
+    if (peer == NULL || remote_id == node_id) {
+        printf("Client %d (%s) announced unknown peer node %d\n", client->id, client_ip(client), remote_id);
+        return;
+    }
+    
+    printf("Peer node %d (%s) linked\n", remote_id, client_ip(client));
+    
+    char buffer[2 * BUFFER_SIZE + 256];
+    int used = 0;
+    
+    // Frames that arrived together with the "PEER:" registration
+    memcpy(buffer, initial, initial_len);
+    int bytes_received = initial_len;
+    
+    while (1) {
+        if (bytes_received <= 0) {
+            bytes_received = recv(client->socket, buffer + used, sizeof(buffer) - 1 - used, 0);
+            if (bytes_received <= 0) break;
+        }
+        used += bytes_received;
+        bytes_received = 0;
+        
+        int pos = 0;
+        int protocol_error = 0;
+        int link_lost = 0;
+        while (pos < used) {
+            char* line = buffer + pos;
+            char* line_end = memchr(line, '\n', used - pos);
+            if (line_end == NULL) break;
+            int header_len = (int)(line_end - line) + 1;
+            *line_end = '\0';
+            
+            if (strncmp(line, "SUB ", 4) == 0) {
+                set_peer_interest(peer, line + 4, 1);
+            } else if (strncmp(line, "UNSUB ", 6) == 0) {
+                set_peer_interest(peer, line + 6, 0);
+            } else if (strncmp(line, "MSG ", 4) == 0) {
+                int origin, publisher, length, topic_offset = 0;
+                if (sscanf(line + 4, "%d %d %d %n", &origin, &publisher, &length, &topic_offset) != 3 ||
+                    topic_offset == 0 || length < 0 || length >= BUFFER_SIZE) {
+                    protocol_error = 1;
+                    break;
+                }
+                if (used - pos - header_len < length) {
+                    *line_end = '\n';  // Wait for the rest of the payload
+                    break;
+                }
+                
+                const char* topic = line + 4 + topic_offset;
+                const char* payload = line_end + 1;
+                
+                // Messages learned from a peer are delivered locally only and never
+                // forwarded again (split horizon), so a full mesh cannot loop
+                if (origin != node_id) {
+                    MessageTrace trace;
+                    latency_begin(&trace, topic, -1);
+                    Message* message = create_topic_message(topic, payload, length, publisher, origin);
+                    if (message != NULL) {
+                        latency_stamp(&trace, TRACE_PARSE);
+                        broadcast_to_topic_subscribers(message, topic, -1, &trace);
+                    }
+                }
+                header_len += length;
+            } else if (strncmp(line, "CHUNK ", 6) == 0) {
+                int origin, publisher, length, topic_offset = 0;
+                char stream[MAX_STREAM_LENGTH + 1];
+                char flag_name[8];
+                ChunkFlag flag;
+                if (sscanf(line + 6, "%d %d %32s %d %7s %n", &origin, &publisher, stream, &length, flag_name, &topic_offset) != 5 ||
+                    topic_offset == 0 || length < 0 || length > MAX_CHUNK_SIZE || strlen(stream) >= MAX_STREAM_LENGTH ||
+                    parse_chunk_flag(flag_name, &flag) != 0) {
+                    protocol_error = 1;
+                    break;
+                }
+                
+                // A chunk is larger than the frame buffer: what is not here yet
+                // is received straight into its message
+                const char* topic = line + 6 + topic_offset;
+                int header_length;
+                Message* message = create_chunk_message(topic, publisher, origin, stream, length, flag, &header_length);
+                if (message == NULL) {
+                    protocol_error = 1;
+                    break;
+                }
+                int buffered = used - pos - header_len;
+                if (buffered > length) buffered = length;
+                memcpy(message->data + header_length, line_end + 1, buffered);
+                if (receive_exact(client->socket, message->data + header_length + buffered, length - buffered) != 0) {
+                    message_release(message);
+                    link_lost = 1;
+                    break;
+                }
+                
+                if (origin != node_id) {
+                    broadcast_to_topic_subscribers(message, topic, -1, NULL);
+                } else {
+                    message_release(message);
+                }
+                header_len += buffered;
+            }
+            pos += header_len;
+        }
+        
+        if (link_lost) break;
+        if (protocol_error || (pos == 0 && used == (int)sizeof(buffer) - 1)) {
+            printf("Peer node %d sent a malformed frame\n", remote_id);
+            break;
+        }
+        memmove(buffer, buffer + pos, used - pos);
+        used -= pos;
+    }
+    
+    // The peer resends its full interest when the link comes back
+    EnterCriticalSection(&peers_mutex);
+    peer->interest_count = 0;
+    LeaveCriticalSection(&peers_mutex);
+    
+    printf("Peer node %d (%s) unlinked\n", remote_id, client_ip(client));
+}
+
+// Stops a link that fell behind or failed; its dialer sees the shutdown,
+// reconnects and resends the full interest. Called with the peer's
+// send_lock held.
+static void drop_peer_link(Peer* peer, const char* reason) {
+    if (peer->dropping) return;
+    peer->dropping = 1;
+    peer->queue_head = peer->queue_used = 0;
+    shutdown(peer->socket, SD_BOTH);
+    printf("Dropping link to peer node %d: %s\n", peer->node_id, reason);
+}
+
+// Writes as much of the peer's queue as the socket takes, without
+// waiting. Called with the peer's send_lock held.
+static void flush_peer(Peer* peer) {
+    if (peer->socket == INVALID_SOCKET || peer->dropping) return;
+    
+    while (peer->queue_head < peer->queue_used) {
+        int sent = send(peer->socket, peer->queue + peer->queue_head, peer->queue_used - peer->queue_head, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) drop_peer_link(peer, "send failed");
+            return;
+        }
+        peer->queue_head += sent;
+    }
+    peer->queue_head = peer->queue_used = 0;
+}
+
+// Appends frame bytes to the peer's queue, which grows up to
+// PEER_QUEUE_BYTES; a peer that falls further behind loses its link.
+// Called with the peer's send_lock held.
+static void queue_for_peer(Peer* peer, const char* data, int len) {
+    if (peer->socket == INVALID_SOCKET || peer->dropping) return;
+    
+    if (peer->queue_used + len > peer->queue_capacity && peer->queue_head > 0) {
+        memmove(peer->queue, peer->queue + peer->queue_head, peer->queue_used - peer->queue_head);
+        peer->queue_used -= peer->queue_head;
+        peer->queue_head = 0;
+    }
+    if (peer->queue_used + len > peer->queue_capacity) {
+        int capacity = peer->queue_capacity ? peer->queue_capacity : PEER_QUEUE_INITIAL;
+        while (capacity < peer->queue_used + len) capacity *= 2;
+        char* grown = (capacity <= PEER_QUEUE_BYTES) ? (char*)realloc(peer->queue, capacity) : NULL;
+        if (grown == NULL) {
+            drop_peer_link(peer, "too far behind");
+            return;
+        }
+        peer->queue = grown;
+        peer->queue_capacity = capacity;
+    }
+    memcpy(peer->queue + peer->queue_used, data, len);
+    peer->queue_used += len;
+}
+
+// Tells every linked peer that this node gained ("SUB") or lost ("UNSUB")
+// its local subscribers for a topic. Called with clients_mutex held, so
+// it never waits for a socket.
+void announce_interest(const char* verb, const char* topic) {
+    char frame[MAX_TOPIC_LENGTH + 16];
+    int len = snprintf(frame, sizeof(frame), "%s %s\n", verb, topic);
+    
+    for (int i = 0; i < peer_count; i++) {
+        EnterCriticalSection(&peers[i].send_lock);
+        queue_for_peer(&peers[i], frame, len);
+        flush_peer(&peers[i]);
+        LeaveCriticalSection(&peers[i].send_lock);
+    }
+}
+
+// Queues one "SUB" per locally subscribed topic. Called with clients_mutex
+// and the peer's send_lock held; the dialer writes them.
+void send_interest_snapshot(Peer* peer) {
+    int route_id;
+    for (int i = 0; (route_id = active_topic_id(i)) != 0; i++) {
+        if (count_subscribers_by_topic(route_id) == 0) continue;
+        
+        char frame[MAX_TOPIC_LENGTH + 16];
+        int len = snprintf(frame, sizeof(frame), "SUB %s\n", wire_topic_name(route_id));
+        queue_for_peer(peer, frame, len);
+    }
+}
+
+void set_peer_interest(Peer* peer, const char* topic, int interested) {
+    EnterCriticalSection(&peers_mutex);
+    
+    int index = -1;
+    for (int i = 0; i < peer->interest_count; i++) {
+        if (strcmp(peer->interest[i], topic) == 0) {
+            index = i;
+            break;
+        }
+    }
+    
+    if (interested && index == -1) {
+        if (peer->interest_count < MAX_PEER_TOPICS) {
+            strncpy(peer->interest[peer->interest_count], topic, MAX_TOPIC_LENGTH - 1);
+            peer->interest[peer->interest_count][MAX_TOPIC_LENGTH - 1] = '\0';
+            peer->interest_count++;
+        } else {
+            printf("Peer node %d exceeded %d topics, ignoring '%s'\n", peer->node_id, MAX_PEER_TOPICS, topic);
+        }
+    } else if (!interested && index != -1) {
+        peer->interest_count--;
+        strcpy(peer->interest[index], peer->interest[peer->interest_count]);
+    }
+    
+    LeaveCriticalSection(&peers_mutex);
+}
+
+// Whether the peer has local subscribers for the topic
+static int peer_interested(Peer* peer, const char* topic) {
+    int interested = 0;
+    EnterCriticalSection(&peers_mutex);
+    for (int j = 0; j < peer->interest_count; j++) {
+        if (strcmp(peer->interest[j], topic) == 0) {
+            interested = 1;
+            break;
+        }
+    }
+    LeaveCriticalSection(&peers_mutex);
+    return interested;
+}
+
+// Peer links are plaintext, so topics under --encrypt stay on this node
+static int topic_encrypted(const char* topic) {
+    TopicPolicy* policy = find_topic_policy(topic);
+    return policy != NULL && policy->encrypted;
+}
+
+// Forwards a local publish to every peer with subscribers for the topic
+void forward_to_peers(const char* payload, int len, const char* topic, int publisher_id) {
+    if (peer_count == 0 || topic_encrypted(topic)) return;
+    
+    char frame[BUFFER_SIZE + MAX_TOPIC_LENGTH + 64];
+    int header_len = snprintf(frame, sizeof(frame), "MSG %d %d %d %s\n", node_id, publisher_id, len, topic);
+    memcpy(frame + header_len, payload, len);
+    
+    for (int i = 0; i < peer_count; i++) {
+        if (!peer_interested(&peers[i], topic)) continue;
+        
+        EnterCriticalSection(&peers[i].send_lock);
+        queue_for_peer(&peers[i], frame, header_len + len);
+        flush_peer(&peers[i]);
+        LeaveCriticalSection(&peers[i].send_lock);
+    }
+}
+
+
+// Forwards one chunk of a large message to every interested peer
+void forward_chunk_to_peers(const char* topic, int publisher_id, const char* stream,
+                            const char* payload, int len, const char* flag) {
+    if (peer_count == 0 || topic_encrypted(topic)) return;
+    
+    char header[MAX_TOPIC_LENGTH + MAX_STREAM_LENGTH + 64];
+    int header_len = snprintf(header, sizeof(header), "CHUNK %d %d %s %d %s %s\n",
+                              node_id, publisher_id, stream, len, flag, topic);
+    
+    for (int i = 0; i < peer_count; i++) {
+        if (!peer_interested(&peers[i], topic)) continue;
+        
+        EnterCriticalSection(&peers[i].send_lock);
+        queue_for_peer(&peers[i], header, header_len);
+        queue_for_peer(&peers[i], payload, len);
+        flush_peer(&peers[i]);
+        LeaveCriticalSection(&peers[i].send_lock);
+    }
+}
@@ -0,0 +1,317 @@
+#include "server.h"
+
+#define INITIAL_GROUP_CAPACITY 64
+#define INITIAL_MEMBER_CAPACITY 8
+
+// A message of a group's topic, from publication until a member
+// acknowledges it
+typedef struct {
+    Message* message;              // Group copy with the "#OFFSET " prefix; NULL once acknowledged
+    int member;                    // Client id it was delivered to, -1 while waiting for a member
+} GroupEntry;
+
+// Members of a queue group share its topic's messages: each message goes to
+// exactly one member, which acknowledges it with "ACK <OFFSET>". Entries
+// from the committed offset (base) to the next offset stay in a ring until
+// acknowledged, so a member that leaves has its messages redelivered and a
+// consumer that comes back resumes at the committed offset.
+typedef struct QueueGroup {
+    char topic[MAX_TOPIC_LENGTH];
+    char name[MAX_GROUP_LENGTH];
+    GroupEntry* ring;              // Power-of-two capacity, indexed by offset
+    int capacity;
+    LONGLONG base;                 // Lowest offset not yet acknowledged
+    LONGLONG next;                 // Offset of the next message
+    LONGLONG first_waiting;        // No entry below this waits for a member
+    int* members;                  // Client ids
+    int member_count;
+    int member_capacity;
+    int cursor;                    // Round-robin position in members
+    LONGLONG delivered;
+    LONGLONG redelivered;
+    LONGLONG acknowledged;
+    LONGLONG dropped;              // Oldest entries discarded at the backlog limit
+} QueueGroup;
+
+// Global variables
+GroupPolicy group_policy = GROUP_LEAST_OUTSTANDING;
+int group_window = DEFAULT_GROUP_WINDOW;
+int group_backlog = DEFAULT_GROUP_BACKLOG;
+
+// Lock order: clients_mutex, then groups_lock, then a client's out_lock
+static CRITICAL_SECTION groups_lock;
+static QueueGroup** groups = NULL;
+static int group_count = 0;
+static int group_capacity = 0;
+
+void initialize_groups() {
+    InitializeCriticalSection(&groups_lock);
+}
+
+void cleanup_groups() {
+    for (int g = 0; g < group_count; g++) {
+        QueueGroup* group = groups[g];
+        for (LONGLONG offset = group->base; offset < group->next; offset++) {
+            GroupEntry* entry = &group->ring[offset & (group->capacity - 1)];
+            if (entry->message != NULL) message_release(entry->message);
+        }
+        free(group->ring);
+        free(group->members);
+        free(group);
+    }
+    free(groups);
+    DeleteCriticalSection(&groups_lock);
+}
+
+static GroupEntry* entry_at(QueueGroup* group, LONGLONG offset) {
+    return &group->ring[offset & (group->capacity - 1)];
+}
+
+static QueueGroup* find_group(const char* topic, const char* name) {
+    for (int g = 0; g < group_count; g++) {
+        if (strcmp(groups[g]->topic, topic) == 0 && strcmp(groups[g]->name, name) == 0) return groups[g];
+    }
+    return NULL;
+}
+
+static QueueGroup* create_group(const char* topic, const char* name) {
+    if (group_count == group_capacity) {
+        int capacity = group_capacity ? group_capacity * 2 : 16;
+        QueueGroup** resized = (QueueGroup**)realloc(groups, capacity * sizeof(QueueGroup*));
+        if (resized == NULL) return NULL;
+        groups = resized;
+        group_capacity = capacity;
+    }
+    
+    QueueGroup* group = (QueueGroup*)calloc(1, sizeof(QueueGroup));
+    if (group == NULL) return NULL;
+    strncpy(group->topic, topic, MAX_TOPIC_LENGTH - 1);
+    strncpy(group->name, name, MAX_GROUP_LENGTH - 1);
+    groups[group_count++] = group;
+    return group;
+}
+
+// Makes room for one more entry, doubling the ring up to the backlog limit
+// and then discarding the oldest entry
+static int reserve_entry(QueueGroup* group) {
+    int used = (int)(group->next - group->base);
+    if (used < group->capacity) return 0;
+    
+    if (used < group_backlog) {
+        int capacity = group->capacity ? group->capacity * 2 : INITIAL_GROUP_CAPACITY;
+        GroupEntry* ring = (GroupEntry*)malloc(capacity * sizeof(GroupEntry));
+        if (ring != NULL) {
+            for (LONGLONG offset = group->base; offset < group->next; offset++) {
+                ring[offset & (capacity - 1)] = *entry_at(group, offset);
+            }
+            free(group->ring);
+            group->ring = ring;
+            group->capacity = capacity;
+            return 0;
+        }
+        if (group->capacity == 0) return -1;
+    }
+    
+    GroupEntry* oldest = entry_at(group, group->base);
+    if (oldest->message != NULL) {
+        if (oldest->member >= 0) clients[oldest->member].group_unacked--;
+        message_release(oldest->message);
+        group->dropped++;
+    }
+    group->base++;
+    if (group->first_waiting < group->base) group->first_waiting = group->base;
+    return 0;
+}
+
+// Member to receive the next message, or NULL if every member's window is
+// full. Least-outstanding picks the member with the fewest unacknowledged
+// messages, starting after the previous pick so ties rotate.
+static Client* pick_member(QueueGroup* group) {
+    Client* chosen = NULL;
+    int chosen_index = -1;
+    for (int n = 1; n <= group->member_count; n++) {
+        int i = (group->cursor + n) % group->member_count;
+        Client* member = &clients[group->members[i]];
+        if (member->slow || member->group_unacked >= group_window) continue;
+        
+        if (chosen == NULL || member->group_unacked < chosen->group_unacked) {
+            chosen = member;
+            chosen_index = i;
+            if (group_policy == GROUP_ROUND_ROBIN || member->group_unacked == 0) break;
+        }
+    }
+    if (chosen != NULL) group->cursor = chosen_index;
+    return chosen;
+}
+
+// Hands waiting entries to members, lowest offset first, until no member
+// has room. Called with clients_mutex and groups_lock held.
+static void dispatch(QueueGroup* group) {
+    if (group->member_count == 0) return;
+    
+    LONGLONG offset = group->first_waiting;
+    if (offset < group->base) offset = group->base;
+    for (; offset < group->next; offset++) {
+        GroupEntry* entry = entry_at(group, offset);
+        if (entry->message == NULL || entry->member >= 0) continue;
+        
+        Client* member = pick_member(group);
+        if (member == NULL) break;
+        
+        entry->member = member->id;
+        member->group_unacked++;
+        group->delivered++;
+        deliver_to_client(member, entry->message);
+    }
+    group->first_waiting = offset;
+}
+
+// Adds a published message to every group of its topic, in text, which
+// is what members read. Called by broadcast_to_topic_subscribers with
+// clients_mutex held.
+void groups_publish(const char* topic, Message* published) {
+    if (group_count == 0) return;
+    
+    EnterCriticalSection(&groups_lock);
+    for (int g = 0; g < group_count; g++) {
+        QueueGroup* group = groups[g];
+        if (strcmp(group->topic, topic) != 0 || reserve_entry(group) != 0) continue;
+        
+        const Message* message = message_encoded(published, 0);
+        if (message == NULL) continue;
+        int capacity = message->length + 24;
+        Message* copy = message_create(capacity);
+        if (copy == NULL) continue;
+        int prefix = snprintf(copy->data, capacity, "#%lld ", (long long)group->next);
+        memcpy(copy->data + prefix, message->data, message->length);
+        copy->length = prefix + message->length;
+        copy->priority = message->priority;
+        
+        GroupEntry* entry = entry_at(group, group->next++);
+        entry->message = copy;
+        entry->member = -1;
+        dispatch(group);
+    }
+    LeaveCriticalSection(&groups_lock);
+}
+
+// Adds a registering subscriber to a group, creating the group on first
+// use, and gives it any backlog. Called with clients_mutex held.
+int group_join(Client* client, const char* name) {
+    EnterCriticalSection(&groups_lock);
+    QueueGroup* group = find_group(client->topic, name);
+    if (group == NULL) group = create_group(client->topic, name);
+    
+    if (group != NULL && group->member_count == group->member_capacity) {
+        int capacity = group->member_capacity ? group->member_capacity * 2 : INITIAL_MEMBER_CAPACITY;
+        int* resized = (int*)realloc(group->members, capacity * sizeof(int));
+        if (resized == NULL) {
+            group = NULL;
+        } else {
+            group->members = resized;
+            group->member_capacity = capacity;
+        }
+    }
+    if (group == NULL) {
+        LeaveCriticalSection(&groups_lock);
+        return -1;
+    }
+    
+    group->members[group->member_count++] = client->id;
+    client->group = group;
+    client->group_unacked = 0;
+    dispatch(group);
+    LeaveCriticalSection(&groups_lock);
+    return 0;
+}
+
+// Removes a member and hands its unacknowledged messages to the others.
+// Called by remove_client with clients_mutex held.
+void group_member_gone(Client* client) {
+    QueueGroup* group = client->group;
+    if (group == NULL) return;
+    
+    EnterCriticalSection(&groups_lock);
+    for (int i = 0; i < group->member_count; i++) {
+        if (group->members[i] == client->id) {
+            group->members[i] = group->members[--group->member_count];
+            break;
+        }
+    }
+    
+    for (LONGLONG offset = group->base; offset < group->next; offset++) {
+        GroupEntry* entry = entry_at(group, offset);
+        if (entry->message != NULL && entry->member == client->id) {
+            entry->member = -1;
+            group->redelivered++;
+            if (offset < group->first_waiting) group->first_waiting = offset;
+        }
+    }
+    client->group = NULL;
+    client->group_unacked = 0;
+    dispatch(group);
+    LeaveCriticalSection(&groups_lock);
+}
+
+// Handles "ACK <OFFSET>" from a member. The committed offset advances past
+// every acknowledged entry, and the freed window takes the next message.
+void group_ack(Client* client, const char* line, int length) {
+    LONGLONG offset = 0;
+    for (int i = 4; i < length && line[i] >= '0' && line[i] <= '9'; i++) {
+        offset = offset * 10 + (line[i] - '0');
+    }
+    
+    EnterCriticalSection(&clients_mutex);
+    EnterCriticalSection(&groups_lock);
+    QueueGroup* group = client->group;
+    if (group != NULL && offset >= group->base && offset < group->next) {
+        GroupEntry* entry = entry_at(group, offset);
+        if (entry->message != NULL && entry->member == client->id) {
+            message_release(entry->message);
+            entry->message = NULL;
+            client->group_unacked--;
+            group->acknowledged++;
+            while (group->base < group->next && entry_at(group, group->base)->message == NULL) {
+                group->base++;
+            }
+            dispatch(group);
+        }
+    }
+    LeaveCriticalSection(&groups_lock);
+    LeaveCriticalSection(&clients_mutex);
+}
+
+const char* group_name(const QueueGroup* group) {
+    return group->name;
+}
+
+int group_report(char* out, int size) {
+    int len = snprintf(out, size, "Queue groups (%s, window %d, backlog limit %d)\n",
+                       group_policy == GROUP_ROUND_ROBIN ? "round-robin" : "least outstanding",
+                       group_window, group_backlog);
+    
+    EnterCriticalSection(&clients_mutex);
+    EnterCriticalSection(&groups_lock);
+    for (int g = 0; g < group_count && len < size - 256; g++) {
+        QueueGroup* group = groups[g];
+        int in_flight = 0;
+        for (int i = 0; i < group->member_count; i++) {
+            in_flight += clients[group->members[i]].group_unacked;
+        }
+        int waiting = 0;
+        for (LONGLONG offset = group->first_waiting; offset < group->next; offset++) {
+            GroupEntry* entry = entry_at(group, offset);
+            if (entry->message != NULL && entry->member < 0) waiting++;
+        }
+        len += snprintf(out + len, size - len,
+                        "  %s:%s %d member(s), committed %lld, next %lld, %d in flight, %d waiting, "
+                        "%lld delivered, %lld redelivered, %lld dropped\n",
+                        group->topic, group->name, group->member_count,
+                        (long long)group->base, (long long)group->next, in_flight, waiting,
+                        (long long)group->delivered, (long long)group->redelivered, (long long)group->dropped);
+    }
+    if (group_count == 0) len += snprintf(out + len, size - len, "  none\n");
+    LeaveCriticalSection(&groups_lock);
+    LeaveCriticalSection(&clients_mutex);
+    return len;
+}
@@ -0,0 +1,812 @@
+#include "server.h"
+#include <afunix.h>
+#include <sddl.h>
+#pragma comment(lib, "advapi32.lib")
+
+#define HANDOFF_MAGIC "HANDOFF5"
+#define PAUSE_TIMEOUT_MS 5000
+#define CATCHUP_DRAIN_MS 2000
+#define EXIT_TIMEOUT_MS 10000
+#define WRITE_BUFFER_SIZE 65536
+#define OWNER_ONLY_SDDL "D:P(A;OICI;GA;;;OW)"   // Protected DACL: full access for the owner, none for anyone else
+
+// A hot restart moves the listener and every client connection to a new
+// server process without closing them. The new process connects to the
+// handoff socket, a Unix socket in a directory only the owner of the
+// broker can open, as "TAKEOVER:<PID>"; the old one stops accepting and
+// polling, duplicates each socket for it and sends what it knows about the
+// connection, then exits once the new process has everything.
+typedef enum {
+    HANDOFF_IDLE = 0,
+    HANDOFF_PAUSE_ACCEPTOR,        // The acceptor stops first, so no accepted socket is left in an inbox
+    HANDOFF_PAUSE_ALL              // Then every worker
+} HandoffStage;
+
+// Sent first, once per handoff. Followed by the names of the topics in
+// wire id order, each as its length and its bytes, the deduplication
+// windows of the producers, then the clients.
+typedef struct {
+    char magic[8];
+    DWORD pid;                     // Old process
+    int max_clients;               // Every client id is below this
+    int client_count;              // Records that follow
+    int topic_count;               // Topic ids in use
+    int producer_len;              // Bytes of producer windows (dedup.c)
+    WSAPROTOCOL_INFOA listener;
+} HandoffHeader;
+
+// One connection. Followed by partial_len bytes of an incomplete line or frame,
+// queued outbound messages and chunk_len bytes of large-message state.
+typedef struct {
+    WSAPROTOCOL_INFOA socket;      // Duplicated for the new process
+    struct sockaddr_in address;
+    int id;                        // Kept, since clients know their id
+    int type;
+    char topic[MAX_TOPIC_LENGTH];
+    char group[MAX_GROUP_LENGTH];  // Queue group, empty if none
+    LONGLONG log_next;
+    int binary;
+    int delta;                     // Delta subscriber; it gets a keyframe of each key first
+    LONGLONG sequence;
+    char producer[MAX_PRODUCER_LENGTH];    // Producer name of a publisher, empty if none
+    int partial_len;
+    int queued;
+    int chunk_len;
+} HandoffClient;
+
+// One queued message, followed by its bytes that were not sent yet
+typedef struct {
+    int length;
+    int priority;
+    int conflated;
+    int chunk;
+    char key[MAX_KEY_LENGTH];
+    UINT32 topic_id;
+    ULONGLONG expires;             // GetTickCount64() counts from boot, so it holds in the new process
+} HandoffMessage;
+
+// Records are gathered into large sends; 10,000 connections are a few
+// megabytes
+typedef struct {
+    SOCKET socket;
+    char* data;
+    int used;
+    int failed;
+} HandoffWriter;
+
+typedef struct {
+    SOCKET control;
+    DWORD pid;
+} HandoffStart;
+
+// A connection received by the new process, joined to its queue group
+// once the old process is gone
+typedef struct {
+    Client* client;
+    int route_id;                  // Held for the client from receive_client on
+    char group[MAX_GROUP_LENGTH];
+} Imported;
+
+// Global variables
+const char* handoff_dir = "handoff";   // --handoff-dir: holds the handoff socket, owner only
+
+static volatile LONG handoff_stage = HANDOFF_IDLE;
+static volatile LONG paused_threads = 0;
+
+static volatile LONG64 handoffs_failed = 0;
+static int took_over = 0;
+static DWORD previous_pid = 0;
+static int connections_taken = 0;
+static LONGLONG messages_taken = 0;
+static LONGLONG bytes_taken = 0;
+static double transfer_ms = 0;
+static double exit_wait_ms = 0;
+static double pause_ms = 0;
+
+// Function prototypes
+static unsigned __stdcall handoff_thread(void* arg);
+static int send_state(SOCKET control, DWORD pid, int* sent_clients);
+static int receive_topics(SOCKET control, int count);
+static int receive_producers(SOCKET control, int length);
+static int receive_client(SOCKET control, Imported* imported, int* imported_count);
+static void install_clients(Imported* imported, int count);
+
+static double elapsed_ms(LONGLONG since) {
+    LARGE_INTEGER now, frequency;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+    return (now.QuadPart - since) * 1000.0 / (double)frequency.QuadPart;
+}
+
+static LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+// Called by the acceptor and by every worker when it wakes up. While a
+// handoff is in progress they wait here, holding no lock, until it fails
+// or the process exits.
+void handoff_checkpoint(int acceptor) {
+    LONG stage = handoff_stage;
+    if (stage == HANDOFF_IDLE || (!acceptor && stage != HANDOFF_PAUSE_ALL)) return;
+    
+    InterlockedIncrement(&paused_threads);
+    while (handoff_stage != HANDOFF_IDLE) Sleep(1);
+    InterlockedDecrement(&paused_threads);
+}
+
+// Workers read nothing while it runs, so silence says nothing about a client
+int handoff_in_progress() {
+    return handoff_stage != HANDOFF_IDLE;
+}
+
+static int wait_for_paused(int threads) {
+    ULONGLONG deadline = GetTickCount64() + PAUSE_TIMEOUT_MS;
+    while (paused_threads < threads) {
+        if (GetTickCount64() > deadline) return -1;
+        Sleep(1);
+    }
+    return 0;
+}
+
+// Connections that could not move and would be closed with this process:
+// multiplexing agents, whose sessions live only here, and subscribers still
+// served from a topic log. A takeover is refused while there are any, with
+// an error line in out listing them; returns 1 then. Catch-up sessions are
+// counted only once they had their time to finish. Called with
+// clients_mutex held.
+static int would_drop(char* out, int size, int count_catching_up) {
+    int carriers = 0, sessions = 0, catching_up = 0;
+    for (int i = 0; i < max_clients; i++) {
+        const Client* client = &clients[i];
+        if (client->socket == INVALID_SOCKET) continue;
+        if (client->type == CLIENT_MUX) carriers++;
+        else if (client->carrier >= 0) sessions++;
+        else if (client->catching_up && count_catching_up) catching_up++;
+    }
+    if (carriers == 0 && catching_up == 0) return 0;
+    
+    snprintf(out, size, "ERROR takeover would drop %d multiplexed connection(s) with %d session(s) and %d subscriber(s) catching up from the log\n",
+             carriers, sessions, catching_up);
+    return 1;
+}
+
+// Handles a "TAKEOVER:<PID>" request on the handoff socket. Only one runs
+// at a time. The handoff runs on its own thread, which owns the control
+// connection from here on.
+static void start_handoff(SOCKET control, DWORD pid) {
+    char dropped[160];
+    EnterCriticalSection(&clients_mutex);
+    int refused = would_drop(dropped, sizeof(dropped), 0);
+    LeaveCriticalSection(&clients_mutex);
+    
+    const char* error = NULL;
+    if (pid == 0) {
+        error = "ERROR expected TAKEOVER:PID\n";
+    } else if (tls_port > 0) {
+        error = "ERROR TLS sessions cannot be handed over\n";
+    } else if (refused) {
+        error = dropped;
+    } else if (InterlockedCompareExchange(&handoff_stage, HANDOFF_PAUSE_ACCEPTOR, HANDOFF_IDLE) != HANDOFF_IDLE) {
+        error = "ERROR takeover already in progress\n";
+    }
+    if (error != NULL) {
+        printf("Process %lu cannot take over: %s", (unsigned long)pid, error + 6);
+        send_all(control, error, (int)strlen(error));
+        closesocket(control);
+        return;
+    }
+    
+    HandoffStart* start = (HandoffStart*)malloc(sizeof(HandoffStart));
+    HANDLE thread = NULL;
+    if (start != NULL) {
+        start->control = control;
+        start->pid = pid;
+        thread = (HANDLE)_beginthreadex(NULL, 0, handoff_thread, start, 0, NULL);
+    }
+    if (thread == NULL) {
+        printf("Failed to create the handoff thread\n");
+        free(start);
+        InterlockedExchange(&handoff_stage, HANDOFF_IDLE);
+        closesocket(control);
+        return;
+    }
+    CloseHandle(thread);
+}
+
+static unsigned __stdcall handoff_thread(void* arg) {
+    HandoffStart* start = (HandoffStart*)arg;
+    SOCKET control = start->control;
+    DWORD pid = start->pid;
+    free(start);
+    
+    printf("Process %lu is taking over; pausing connections\n", (unsigned long)pid);
+    LONGLONG started = now_ticks();
+    const char* failure = NULL;
+    int failure_line = 0;          // failure is an error line sent to the new process
+    
+    // Accepted sockets still in an inbox are adopted by their worker
+    // before it pauses
+    wake_for_handoff(1);
+    if (wait_for_paused(1) != 0) failure = "the acceptor did not pause";
+    if (failure == NULL) {
+        InterlockedExchange(&handoff_stage, HANDOFF_PAUSE_ALL);
+        wake_for_handoff(0);
+        if (wait_for_paused(worker_count + busy_poll_workers + 1) != 0) failure = "a worker did not pause";
+    }
+    
+    // Subscribers being served from a topic log rejoin live delivery first
+    ULONGLONG deadline = GetTickCount64() + CATCHUP_DRAIN_MS;
+    while (failure == NULL && log_sessions_active() > 0 && GetTickCount64() < deadline) Sleep(1);
+    
+    // Messages of partitioned topics already taken in are fanned out too
+    while (failure == NULL && routes_pending() > 0 && GetTickCount64() < deadline) Sleep(1);
+    
+    // Held until the process exits: nothing is routed after the snapshot,
+    // once router threads are done with the subscribers they picked
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < max_clients; i++) route_unpinned(&clients[i]);
+    
+    // Multiplexed connections opened before the acceptor paused, or
+    // subscribers that did not finish catching up
+    char dropped[160];
+    if (failure == NULL && would_drop(dropped, sizeof(dropped), 1)) {
+        send_all(control, dropped, (int)strlen(dropped));
+        failure = dropped + 6;
+        failure_line = 1;
+    }
+    int sent_clients = 0;
+    if (failure == NULL && send_state(control, pid, &sent_clients) != 0) {
+        failure = "sending the connections failed";
+    }
+    
+    // Workers stay paused and clients_mutex held while waiting, so a new
+    // process that stops answering is given up on
+    char reply[8];
+    int length = 0;
+    ULONGLONG confirm_deadline = GetTickCount64() + EXIT_TIMEOUT_MS;
+    WSAPOLLFD pfd;
+    pfd.fd = control;
+    pfd.events = POLLRDNORM;
+    while (failure == NULL && length < 5) {
+        ULONGLONG now = GetTickCount64();
+        pfd.revents = 0;
+        if (now >= confirm_deadline || WSAPoll(&pfd, 1, (int)(confirm_deadline - now)) <= 0) break;
+        int bytes = recv(control, reply + length, 5 - length, 0);
+        if (bytes <= 0) break;
+        length += bytes;
+    }
+    if (failure == NULL && (length != 5 || memcmp(reply, "DONE\n", 5) != 0)) {
+        failure = "the new process did not confirm";
+    }
+    
+    if (failure == NULL) {
+        printf("Handed %d connection(s) to process %lu after %.1f ms; exiting\n",
+               sent_clients, (unsigned long)pid, elapsed_ms(started));
+        capture_close();
+        fflush(stdout);
+        ExitProcess(0);
+    }
+    
+    // The sockets were only duplicated, so this process carries on
+    LeaveCriticalSection(&clients_mutex);
+    InterlockedIncrement64(&handoffs_failed);
+    if (failure_line) {
+        printf("Takeover by process %lu refused; resuming: %s", (unsigned long)pid, failure);
+    } else {
+        printf("Takeover by process %lu failed (%s); resuming\n", (unsigned long)pid, failure);
+    }
+    InterlockedExchange(&handoff_stage, HANDOFF_IDLE);
+    closesocket(control);
+    latency_thread_release();
+    pool_thread_release();
+    return 0;
+}
+
+// The handoff socket of the server on port: <handoff_dir>\server-<port>.sock
+static int handoff_path(int port, SOCKADDR_UN* address) {
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    int length = snprintf(address->sun_path, sizeof(address->sun_path), "%s\\server-%d.sock", handoff_dir, port);
+    return (length > 0 && length < (int)sizeof(address->sun_path)) ? 0 : -1;
+}
+
+// Creates the handoff directory with a protected DACL that lets only its
+// owner in, or puts one on a directory that is already there. Whoever can
+// open the socket inside can take every connection.
+static int owner_only_directory(const char* dir) {
+    PSECURITY_DESCRIPTOR descriptor = NULL;
+    if (!ConvertStringSecurityDescriptorToSecurityDescriptorA(OWNER_ONLY_SDDL, SDDL_REVISION_1, &descriptor, NULL)) return -1;
+    SECURITY_ATTRIBUTES attributes;
+    attributes.nLength = sizeof(attributes);
+    attributes.lpSecurityDescriptor = descriptor;
+    attributes.bInheritHandle = FALSE;
+    int ok = CreateDirectoryA(dir, &attributes) ||
+             (GetLastError() == ERROR_ALREADY_EXISTS && SetFileSecurityA(dir, DACL_SECURITY_INFORMATION, descriptor));
+    LocalFree(descriptor);
+    return ok ? 0 : -1;
+}
+
+// Reads the "TAKEOVER:<PID>" line of a new process; 0 if there is none
+static DWORD read_takeover(SOCKET control) {
+    char line[64];
+    int length = 0;
+    WSAPOLLFD pfd;
+    pfd.fd = control;
+    pfd.events = POLLRDNORM;
+    while (length < (int)sizeof(line) - 1) {
+        pfd.revents = 0;
+        if (WSAPoll(&pfd, 1, PAUSE_TIMEOUT_MS) <= 0 || recv(control, line + length, 1, 0) != 1) return 0;
+        if (line[length] == '\n') break;
+        length++;
+    }
+    line[length] = '\0';
+    if (length > 0 && line[length - 1] == '\r') line[--length] = '\0';
+    if (strncmp(line, "TAKEOVER:", 9) != 0) return 0;
+    return (DWORD)strtoul(line + 9, NULL, 10);
+}
+
+static unsigned __stdcall handoff_listener(void* arg) {
+    SOCKET listener = (SOCKET)(ULONG_PTR)arg;
+    while (1) {
+        SOCKET control = accept(listener, NULL, NULL);
+        if (control == INVALID_SOCKET) {
+            printf("Handoff accept failed. Error: %d\n", WSAGetLastError());
+            Sleep(100);
+            continue;
+        }
+        start_handoff(control, read_takeover(control));
+    }
+    return 0;
+}
+
+// Listens on the handoff socket of the server on port, so a new process
+// can take over. Called once this process owns the port.
+int open_handoff_socket(int port) {
+    SOCKADDR_UN address;
+    if (handoff_path(port, &address) != 0) {
+        printf("Handoff directory '%s' is too long for a socket path\n", handoff_dir);
+        return -1;
+    }
+    if (owner_only_directory(handoff_dir) != 0) {
+        printf("Cannot restrict handoff directory '%s' to its owner. Error: %lu\n", handoff_dir, (unsigned long)GetLastError());
+        return -1;
+    }
+    
+    // A socket file left by a process that is gone
+    DeleteFileA(address.sun_path);
+    SOCKET listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener == INVALID_SOCKET || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, 4) != 0) {
+        printf("Cannot listen on handoff socket %s. Error: %d\n", address.sun_path, WSAGetLastError());
+        if (listener != INVALID_SOCKET) closesocket(listener);
+        return -1;
+    }
+    HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, handoff_listener, (void*)(ULONG_PTR)listener, 0, NULL);
+    if (thread == NULL) {
+        printf("Failed to create the handoff listener thread\n");
+        closesocket(listener);
+        return -1;
+    }
+    CloseHandle(thread);
+    return 0;
+}
+
+static void write_bytes(HandoffWriter* writer, const void* data, int length) {
+    const char* bytes = (const char*)data;
+    while (length > 0 && !writer->failed) {
+        if (writer->used == WRITE_BUFFER_SIZE) {
+            if (send_all(writer->socket, writer->data, writer->used) != 0) writer->failed = 1;
+            writer->used = 0;
+        }
+        int take = WRITE_BUFFER_SIZE - writer->used;
+        if (take > length) take = length;
+        memcpy(writer->data + writer->used, bytes, take);
+        writer->used += take;
+        bytes += take;
+        length -= take;
+    }
+}
+
+static int write_message(void* context, const Message* message, int sent) {
+    HandoffWriter* writer = (HandoffWriter*)context;
+    HandoffMessage record;
+    memset(&record, 0, sizeof(record));
+    record.length = message->length - sent;
+    record.priority = message->priority;
+    record.conflated = message->conflated;
+    record.chunk = message->chunk;
+    memcpy(record.key, message->key, MAX_KEY_LENGTH);
+    record.topic_id = message->wire.topic_id;
+    record.expires = message->expires;
+    
+    // The rest of a partly sent message goes out before anything else
+    if (sent > 0) {
+        record.priority = PRIORITY_HIGH;
+        record.conflated = 0;
+        record.expires = 0;
+    }
+    write_bytes(writer, &record, sizeof(record));
+    write_bytes(writer, message->data + sent, record.length);
+    return writer->failed ? -1 : 0;
+}
+
+// Whether a connection moves to the new process. Peer links are not: both
+// brokers reconnect. Clients being dropped are left behind, and would_drop
+// has refused the takeover while multiplexed connections or catching-up
+// subscribers are left.
+static int hands_over(const Client* client) {
+    return client->socket != INVALID_SOCKET && client->type != CLIENT_PEER &&
+           client->type != CLIENT_MUX && client->carrier < 0 && !client->slow && !client->catching_up;
+}
+
+// Sends the listener and every connection with its queued output. Called
+// with clients_mutex held and every worker paused.
+static int send_state(SOCKET control, DWORD pid, int* sent_clients) {
+    HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HANDOFF_MAGIC, sizeof(header.magic));
+    header.pid = GetCurrentProcessId();
+    header.max_clients = max_clients;
+    header.topic_count = wire_topic_count();
+    for (int i = 0; i < max_clients; i++) {
+        if (hands_over(&clients[i])) header.client_count++;
+    }
+    if (WSADuplicateSocketA(listen_socket, pid, &header.listener) != 0) {
+        printf("Cannot duplicate the listening socket. Error: %d\n", WSAGetLastError());
+        return -1;
+    }
+    char* producers = NULL;
+    header.producer_len = dedup_export(&producers);
+    if (header.producer_len < 0) {
+        printf("Out of memory for the producer windows\n");
+        return -1;
+    }
+    
+    HandoffWriter writer;
+    writer.socket = control;
+    writer.data = (char*)malloc(WRITE_BUFFER_SIZE);
+    writer.used = 0;
+    writer.failed = (writer.data == NULL);
+    write_bytes(&writer, &header, sizeof(header));
+    
+    for (int t = 1; t <= header.topic_count; t++) {
+        const char* name = wire_topic_name(t);
+        int length = (int)strlen(name);
+        write_bytes(&writer, &length, sizeof(length));
+        write_bytes(&writer, name, length);
+    }
+    write_bytes(&writer, producers, header.producer_len);
+    free(producers);
+    
+    for (int i = 0; i < max_clients && !writer.failed; i++) {
+        Client* client = &clients[i];
+        if (!hands_over(client)) continue;
+        
+        HandoffClient record;
+        memset(&record, 0, sizeof(record));
+        if (WSADuplicateSocketA(client->socket, pid, &record.socket) != 0) {
+            printf("Cannot duplicate the socket of client %d. Error: %d\n", client->id, WSAGetLastError());
+            writer.failed = 1;
+            break;
+        }
+        
+        char* chunk_state = NULL;
+        record.chunk_len = chunk_export(client, &chunk_state);
+        if (record.chunk_len < 0) {
+            writer.failed = 1;
+            break;
+        }
+        record.address = client->address;
+        record.id = client->id;
+        record.type = client->type;
+        strcpy(record.topic, client->topic);
+        if (client->group != NULL) strcpy(record.group, group_name(client->group));
+        record.log_next = client->log_next;
+        record.binary = client->binary;
+        record.delta = (client->delta != NULL);
+        record.sequence = client->sequence;
+        if (client->producer != NULL) strcpy(record.producer, dedup_producer_name(client->producer));
+        record.partial_len = client->partial_len;
+        
+        AcquireSRWLockExclusive(&client->out_lock);
+        record.queued = outbound_depth(&client->out);
+        write_bytes(&writer, &record, sizeof(record));
+        write_bytes(&writer, client->partial, client->partial_len);
+        outbound_export(&client->out, write_message, &writer);
+        ReleaseSRWLockExclusive(&client->out_lock);
+        
+        write_bytes(&writer, chunk_state, record.chunk_len);
+        free(chunk_state);
+        (*sent_clients)++;
+    }
+    
+    if (!writer.failed && writer.used > 0 && send_all(control, writer.data, writer.used) != 0) writer.failed = 1;
+    free(writer.data);
+    return writer.failed ? -1 : 0;
+}
+
+// Reads exactly len bytes from a blocking socket
+static int receive_all(SOCKET sock, void* data, int len) {
+    char* bytes = (char*)data;
+    while (len > 0) {
+        int received = recv(sock, bytes, len, 0);
+        if (received <= 0) return -1;
+        bytes += received;
+        len -= received;
+    }
+    return 0;
+}
+
+// Takes over the port from the server process listening on it. Returns
+// the inherited listening socket once every connection is polled by a
+// worker of this process, or INVALID_SOCKET if the takeover failed, in
+// which case the old process carries on.
+SOCKET take_over(int port) {
+    SOCKADDR_UN address;
+    if (handoff_path(port, &address) != 0) {
+        printf("Handoff directory '%s' is too long for a socket path\n", handoff_dir);
+        return INVALID_SOCKET;
+    }
+    SOCKET control = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (control == INVALID_SOCKET || connect(control, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        printf("No server to take over on port %d (handoff socket %s). Error: %d\n", port, address.sun_path, WSAGetLastError());
+        if (control != INVALID_SOCKET) closesocket(control);
+        return INVALID_SOCKET;
+    }
+    
+    LONGLONG started = now_ticks();
+    char registration[64];
+    int length = snprintf(registration, sizeof(registration), "TAKEOVER:%lu\n", (unsigned long)GetCurrentProcessId());
+    send_all(control, registration, length);
+    
+    // A refusal is an error line in place of the header
+    HandoffHeader header;
+    memset(&header, 0, sizeof(header));
+    if (receive_all(control, header.magic, sizeof(header.magic)) != 0 ||
+        memcmp(header.magic, HANDOFF_MAGIC, sizeof(header.magic)) != 0 ||
+        receive_all(control, (char*)&header + sizeof(header.magic), sizeof(header) - sizeof(header.magic)) != 0) {
+        char error[256];
+        int length = 0;
+        if (memcmp(header.magic, "ERROR ", 6) == 0) {
+            memcpy(error, header.magic, sizeof(header.magic));
+            length = sizeof(header.magic);
+            while (length < (int)sizeof(error) - 1 && error[length - 1] != '\n' && recv(control, error + length, 1, 0) == 1) length++;
+        }
+        while (length > 0 && (error[length - 1] == '\n' || error[length - 1] == '\r')) length--;
+        error[length] = '\0';
+        printf("The server on port %d refused the takeover%s%s\n", port, length > 0 ? ": " : "", error + (length > 0 ? 6 : 0));
+        closesocket(control);
+        return INVALID_SOCKET;
+    }
+    if (header.max_clients > max_clients) {
+        printf("The server on port %d allows %d clients; start this one with --max-clients %d or more\n",
+               port, header.max_clients, header.max_clients);
+        send_all(control, "ABORT\n", 6);
+        closesocket(control);
+        return INVALID_SOCKET;
+    }
+    
+    SOCKET listener = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &header.listener, 0, 0);
+    Imported* imported = (Imported*)malloc((header.client_count + 1) * sizeof(Imported));
+    int imported_count = 0;
+    int failed = (listener == INVALID_SOCKET || imported == NULL || receive_topics(control, header.topic_count) != 0 ||
+                  receive_producers(control, header.producer_len) != 0);
+    for (int i = 0; i < header.client_count && !failed; i++) {
+        failed = (receive_client(control, imported, &imported_count) != 0);
+    }
+    
+    // Nothing was written to a connection yet, so the old process can
+    // still carry on; exiting closes the duplicates
+    if (failed) {
+        printf("Takeover from process %lu failed after %d of %d connections\n",
+               (unsigned long)header.pid, imported_count, header.client_count);
+        send_all(control, "ABORT\n", 6);
+        closesocket(control);
+        free(imported);
+        return INVALID_SOCKET;
+    }
+    transfer_ms = elapsed_ms(started);
+    
+    // Topic logs are read from disk once the old process has stopped
+    // appending to them
+    LONGLONG confirmed = now_ticks();
+    send_all(control, "DONE\n", 5);
+    WSAPOLLFD pfd;
+    pfd.fd = control;
+    pfd.events = POLLRDNORM;
+    pfd.revents = 0;
+    char drain[16];
+    if (WSAPoll(&pfd, 1, EXIT_TIMEOUT_MS) <= 0 || recv(control, drain, sizeof(drain), 0) != 0) {
+        printf("Process %lu did not exit after the handoff; carrying on regardless\n", (unsigned long)header.pid);
+    }
+    closesocket(control);
+    exit_wait_ms = elapsed_ms(confirmed);
+    
+    install_clients(imported, imported_count);
+    free(imported);
+    
+    // The clients and queued messages hold their topic ids by now
+    for (int t = 1; t <= header.topic_count; t++) wire_topic_release(t);
+    
+    took_over = 1;
+    previous_pid = header.pid;
+    connections_taken = imported_count;
+    pause_ms = elapsed_ms(started);
+    printf("Took over %d connection(s) and %lld queued message(s) from process %lu in %.1f ms\n",
+           connections_taken, (long long)messages_taken, (unsigned long)previous_pid, pause_ms);
+    return listener;
+}
+
+// Takes the old process's topic ids, in order, so binary clients keep
+// theirs. No topic has an id in this process yet. Each is held until the
+// takeover is complete, so none is reused before its clients are back.
+static int receive_topics(SOCKET control, int count) {
+    char name[BUFFER_SIZE];
+    for (int t = 1; t <= count; t++) {
+        int length;
+        if (receive_all(control, &length, sizeof(length)) != 0 || length <= 0 || length >= BUFFER_SIZE ||
+            receive_all(control, name, length) != 0) {
+            return -1;
+        }
+        name[length] = '\0';
+        if (wire_topic_id(name) != t) {
+            printf("Cannot take over topic id %d of '%s'\n", t, name);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Takes the old process's producer windows, so retransmissions after the
+// restart are still recognised
+static int receive_producers(SOCKET control, int length) {
+    if (length <= 0) return length;
+    
+    char* data = (char*)malloc(length);
+    int result = (data == NULL || receive_all(control, data, length) != 0 || dedup_import(data, length) != 0) ? -1 : 0;
+    if (result != 0) printf("Cannot take over the producer windows\n");
+    free(data);
+    return result;
+}
+
+// Receives one connection into its old client slot. The client stays
+// invisible to routing until install_clients.
+static int receive_client(SOCKET control, Imported* imported, int* imported_count) {
+    HandoffClient record;
+    if (receive_all(control, &record, sizeof(record)) != 0) return -1;
+    record.topic[MAX_TOPIC_LENGTH - 1] = '\0';
+    record.group[MAX_GROUP_LENGTH - 1] = '\0';
+    record.producer[MAX_PRODUCER_LENGTH - 1] = '\0';
+    if (record.id < 0 || record.id >= max_clients || clients[record.id].socket != INVALID_SOCKET ||
+        record.partial_len < 0 || record.partial_len >= BUFFER_SIZE || record.queued < 0 || record.chunk_len < 0) {
+        return -1;
+    }
+    
+    SOCKET sock = WSASocketA(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, &record.socket, 0, 0);
+    if (sock == INVALID_SOCKET) {
+        printf("Cannot take over the socket of client %d. Error: %d\n", record.id, WSAGetLastError());
+        return -1;
+    }
+    u_long nonblocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+    
+    Client* client = &clients[add_client_at(record.id, sock, record.address)];
+    imported = &imported[(*imported_count)++];
+    imported->client = client;
+    imported->route_id = 0;
+    client->type = (ClientType)record.type;
+    if (record.topic[0] != '\0') {
+        imported->route_id = wire_topic_id(record.topic);
+        if (imported->route_id == 0) return -1;
+        client->topic = wire_topic_name(imported->route_id);
+    }
+    client->log_next = record.log_next;
+    client->binary = record.binary;
+    client->sequence = record.sequence;
+    if (record.producer[0] != '\0' && (client->producer = dedup_producer(record.topic, record.producer)) == NULL) return -1;
+    if (record.delta && (client->delta = delta_state_create()) == NULL) return -1;
+    
+    if (record.partial_len > 0) {
+        client->partial = (char*)pool_alloc(BUFFER_SIZE);
+        if (client->partial == NULL || receive_all(control, client->partial, record.partial_len) != 0) return -1;
+        client->partial_len = record.partial_len;
+    }
+    
+    for (int m = 0; m < record.queued; m++) {
+        HandoffMessage header;
+        if (receive_all(control, &header, sizeof(header)) != 0 || header.length <= 0 ||
+            header.priority < 0 || header.priority >= PRIORITY_CLASSES) {
+            return -1;
+        }
+        Message* message = message_create(header.length);
+        if (message == NULL) return -1;
+        message->length = header.length;
+        message->binary = client->binary;
+        message->priority = (Priority)header.priority;
+        message->conflated = header.conflated;
+        message->chunk = header.chunk;
+        if (header.topic_id <= (UINT32)wire_topic_count()) {
+            message->wire.topic_id = header.topic_id;
+            wire_topic_hold(header.topic_id);
+        }
+        message->expires = header.expires;
+        memcpy(message->key, header.key, MAX_KEY_LENGTH);
+        message->key[MAX_KEY_LENGTH - 1] = '\0';
+        
+        int result = receive_all(control, message->data, header.length);
+        if (result == 0) result = (outbound_restore(&client->out, message) == OUTBOUND_QUEUED) ? 0 : -1;
+        message_release(message);
+        if (result != 0) return -1;
+        messages_taken++;
+        bytes_taken += header.length;
+    }
+    
+    if (record.chunk_len > 0) {
+        char* state = (char*)malloc(record.chunk_len);
+        int result = (state == NULL || receive_all(control, state, record.chunk_len) != 0 ||
+                      chunk_import(client, state, record.chunk_len) != 0) ? -1 : 0;
+        free(state);
+        if (result != 0) return -1;
+    }
+    
+    strcpy(imported->group, record.group);
+    return 0;
+}
+
+// Makes the received connections visible to routing and hands them to the
+// workers round-robin, or with --numa to the worker whose node holds their
+// slot; those of busy-poll topics go to the busy-poll workers. Subscribers
+// rejoin their queue group by name and continue in their topic log where
+// they left off.
+static void install_clients(Imported* imported, int count) {
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < count; i++) {
+        Client* client = imported[i].client;
+        if (client->type == CLIENT_UNKNOWN) continue;
+        
+        client->topic_id = latency_topic_id(client->topic);
+        client->route_id = imported[i].route_id;
+        topic_client_added(client);
+        TopicPolicy* policy = find_topic_policy(client->topic);
+        client->busy_poll = (policy != NULL && policy->busy_poll);
+        if (client->type == CLIENT_RESPONDER) request_responder_added(client);
+        if (client->type != CLIENT_SUBSCRIBER) continue;
+        
+        if (imported[i].group[0] != '\0') {
+            if (group_join(client, imported[i].group) != 0) {
+                printf("Client %d could not rejoin queue group '%s'\n", client->id, imported[i].group);
+                shutdown(client->socket, SD_BOTH);
+                client->slow = 1;
+            }
+        } else if (!client->binary && client->delta == NULL) {
+            client->log = topic_log(client->topic);
+        }
+    }
+    LeaveCriticalSection(&clients_mutex);
+    rebuild_free_slots();
+    
+    for (int i = 0; i < count; i++) {
+        Client* client = imported[i].client;
+        int owner = slot_owner(client->id);
+        client->worker = (owner >= 0) ? owner : i % worker_count;
+        client->write_requested = (outbound_depth(&client->out) > 0);
+        resume_client(client);
+    }
+}
+
+int handoff_report(char* out, int size) {
+    if (!took_over) {
+        return snprintf(out, size, "Hot restart: this process did not take over from another "
+                                   "(%lld takeover(s) of it failed)\n", (long long)handoffs_failed);
+    }
+    return snprintf(out, size,
+                    "Hot restart: took over from process %lu\n"
+                    "  Connections: %d, with %lld queued message(s) (%lld bytes)\n"
+                    "  Transfer: %.1f ms, waiting for the old process to exit: %.1f ms\n"
+                    "  Clients paused: %.1f ms\n"
+                    "  Failed takeovers of this process: %lld\n",
+                    (unsigned long)previous_pid, connections_taken, (long long)messages_taken, (long long)bytes_taken,
+                    transfer_ms, exit_wait_ms, pause_ms, (long long)handoffs_failed);
+}
@@ -0,0 +1,126 @@
+#include "server.h"
+
+// Global variables
+int heartbeat_ms = 0;              // --heartbeat, 0 = no PING
+int idle_timeout_ms = 0;           // --idle-timeout, 0 = never closed for silence
+
+static volatile LONG64 pings_sent = 0;
+static volatile LONG64 pongs_received = 0;
+static volatile LONG64 idle_closed = 0;
+static volatile LONG64 checks = 0;
+
+static void check_liveness(Timer* timer);
+
+// Called once per client slot at startup; the timer stays with the slot
+void liveness_init(Client* client) {
+    timer_init(&client->liveness, check_liveness, client);
+}
+
+// Arms the timer of a new connection. Called by add_client_at once the
+// socket is set, so the first check finds the connection.
+void liveness_start(Client* client) {
+    if (heartbeat_ms == 0 && idle_timeout_ms == 0) return;
+    
+    int first = heartbeat_ms;
+    if (first == 0 || (idle_timeout_ms > 0 && idle_timeout_ms < first)) first = idle_timeout_ms;
+    timer_set(&client->liveness, first);
+}
+
+// Called by remove_client with clients_mutex held
+void liveness_stop(Client* client) {
+    timer_cancel(&client->liveness);
+}
+
+// Sends a PING line, or a notice frame to a binary client. A TLS
+// connection still in its handshake gets none: it is not encrypted yet.
+static void send_ping(Client* client) {
+    if (tls_handshaking(client)) return;
+    Message* message = message_create(8);
+    if (message == NULL) return;
+    message->length = snprintf(message->data, 8, "PING\n");
+    
+    EnterCriticalSection(&clients_mutex);
+    if (client->socket != INVALID_SOCKET && !client->slow) {
+        deliver_to_client(client, message);
+        InterlockedIncrement64(&pings_sent);
+    }
+    LeaveCriticalSection(&clients_mutex);
+    message_release(message);
+}
+
+// Shuts a silent connection down; its worker sees the hang-up and removes it
+static void close_idle(Client* client, ULONGLONG last_receive) {
+    EnterCriticalSection(&clients_mutex);
+    if (client->socket != INVALID_SOCKET && !client->slow && client->last_receive == last_receive) {
+        client->slow = 1;
+        shutdown(client->socket, SD_BOTH);
+        InterlockedIncrement64(&idle_closed);
+        printf("Closing client %d (%s): nothing received for %d ms\n", client->id, client_ip(client), idle_timeout_ms);
+    }
+    LeaveCriticalSection(&clients_mutex);
+}
+
+// Runs on the timer thread when a connection may have been silent for a
+// heartbeat interval or the idle timeout. Traffic only stamps
+// last_receive, so a busy connection costs one check per interval and no
+// timer update per message; the timer is set again for whichever is due
+// next. Peers have their own links and sessions share their connection's
+// check, and a subscriber catching up from the log, a throttled publisher,
+// one streaming a large message and every client during a hot restart may
+// be silent because the broker is not reading from it, so they are only
+// checked again later. The slot may have been reused since the timer was
+// set, which the new connection's last_receive makes harmless.
+static void check_liveness(Timer* timer) {
+    Client* client = (Client*)timer->context;
+    if (client->socket == INVALID_SOCKET || client->slow || client->type == CLIENT_PEER || client->carrier >= 0) return;
+    InterlockedIncrement64(&checks);
+    
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG last = client->last_receive;
+    if (client->catching_up || client->throttled || client->chunks != NULL || handoff_in_progress()) {
+        client->last_receive = now;
+        last = now;
+    }
+    
+    if (idle_timeout_ms > 0 && now - last >= (ULONGLONG)idle_timeout_ms) {
+        close_idle(client, last);
+        return;
+    }
+    
+    // Unregistered connections are not pinged, only timed out
+    ULONGLONG quiet_since = (client->last_ping > last) ? client->last_ping : last;
+    if (heartbeat_ms > 0 && client->type != CLIENT_UNKNOWN && now - quiet_since >= (ULONGLONG)heartbeat_ms) {
+        send_ping(client);
+        client->last_ping = now;
+        quiet_since = now;
+    }
+    
+    ULONGLONG next = (ULONGLONG)-1;
+    if (heartbeat_ms > 0) next = quiet_since + heartbeat_ms;
+    if (idle_timeout_ms > 0 && last + idle_timeout_ms < next) next = last + idle_timeout_ms;
+    timer_set(timer, (next > now) ? (int)(next - now) : 0);
+}
+
+// A "PONG" answer only shows the connection is alive, which receiving it
+// already recorded. Returns 1 if the line is one.
+int heartbeat_reply(const char* line, int length) {
+    if (heartbeat_ms == 0 || length < 4 || strncmp(line, "PONG", 4) != 0) return 0;
+    for (int i = 4; i < length; i++) {
+        if (line[i] != '\r' && line[i] != '\n') return 0;
+    }
+    InterlockedIncrement64(&pongs_received);
+    return 1;
+}
+
+int heartbeat_report(char* out, int size) {
+    if (heartbeat_ms == 0 && idle_timeout_ms == 0) {
+        return snprintf(out, size, "Heartbeats: off; no --heartbeat or --idle-timeout\n");
+    }
+    
+    int len = snprintf(out, size,
+                       "Heartbeats: PING after %d ms of silence, close after %d ms (0 = never)\n"
+                       "  Checks: %lld; PINGs sent: %lld; PONGs received: %lld; closed as idle: %lld\n",
+                       heartbeat_ms, idle_timeout_ms, (long long)checks, (long long)pings_sent,
+                       (long long)pongs_received, (long long)idle_closed);
+    return len < size ? len : size - 1;
+}
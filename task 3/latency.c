@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "latency.h"
+
+// Log-linear (HDR style) histogram of nanosecond values: values below
+// HIST_LINEAR are counted exactly, above that each power of two is split
+// into HIST_SUB_BUCKETS buckets, giving ~1.6% relative error up to 2^40 ns.
+#define HIST_PRECISION_BITS 6
+#define HIST_SUB_BUCKETS (1 << HIST_PRECISION_BITS)
+#define HIST_LINEAR (2 * HIST_SUB_BUCKETS)
+#define HIST_MAX_BITS 40
+#define HIST_COUNTS (HIST_LINEAR + (HIST_MAX_BITS - HIST_PRECISION_BITS - 1) * HIST_SUB_BUCKETS)
+
+// Intervals between consecutive stamps, plus the end-to-end total
+typedef enum {
+    INTERVAL_PARSE = 0,
+    INTERVAL_ROUTE,
+    INTERVAL_ENQUEUE,
+    INTERVAL_EGRESS,
+    INTERVAL_TOTAL,
+    TRACE_INTERVALS
+} TraceInterval;
+
+static const char* interval_names[TRACE_INTERVALS] = {
+    "ingress->parse", "parse->route", "route->enqueue", "enqueue->egress", "total"
+};
+
+typedef struct {
+    unsigned int counts[HIST_COUNTS];
+} Histogram;
+
+// Histograms owned and written by exactly one thread at a time, so recording
+// needs no locks or atomics. Recorders are never freed: a thread that exits
+// hands its recorder to the next thread, which keeps accumulating into it.
+typedef struct LatencyRecorder {
+    struct LatencyRecorder* next;
+    volatile LONG in_use;
+    Histogram stages[TRACE_INTERVALS];
+    Histogram* topics[MAX_TRACED_TOPICS];   // End-to-end per topic, allocated on first use
+} LatencyRecorder;
+
+int trace_enabled = 1;
+
+static LatencyRecorder* volatile recorders = NULL;
+static __thread LatencyRecorder* thread_recorder = NULL;
+static double ns_per_tick = 1.0;
+
+// Append-only topic table; ids are published after the name is written
+static char topic_names[MAX_TRACED_TOPICS][LATENCY_TOPIC_LENGTH];
+static volatile LONG topic_count = 0;
+static CRITICAL_SECTION topic_lock;
+
+void latency_init() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ns_per_tick = 1e9 / (double)frequency.QuadPart;
+    InitializeCriticalSection(&topic_lock);
+}
+
+LONGLONG trace_now() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+static int histogram_index(ULONGLONG value) {
+    if (value < HIST_LINEAR) return (int)value;
+    if (value >= (1ULL << HIST_MAX_BITS)) value = (1ULL << HIST_MAX_BITS) - 1;
+    
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_PRECISION_BITS;
+    return HIST_LINEAR + (shift - 1) * HIST_SUB_BUCKETS + (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+// Highest value that falls into a bucket
+static ULONGLONG histogram_value(int index) {
+    if (index < HIST_LINEAR) return (ULONGLONG)index;
+    
+    int shift = (index - HIST_LINEAR) / HIST_SUB_BUCKETS + 1;
+    ULONGLONG sub_bucket = (index - HIST_LINEAR) % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+int latency_topic_id(const char* topic) {
+    LONG count = topic_count;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(topic_names[i], topic) == 0) return i;
+    }
+    
+    EnterCriticalSection(&topic_lock);
+    int id = -1;
+    for (int i = 0; i < topic_count; i++) {
+        if (strcmp(topic_names[i], topic) == 0) {
+            id = i;
+            break;
+        }
+    }
+    if (id == -1 && topic_count < MAX_TRACED_TOPICS) {
+        id = topic_count;
+        strncpy(topic_names[id], topic, LATENCY_TOPIC_LENGTH - 1);
+        topic_names[id][LATENCY_TOPIC_LENGTH - 1] = '\0';
+        MemoryBarrier();
+        topic_count = id + 1;
+    }
+    LeaveCriticalSection(&topic_lock);
+    
+    return id;
+}
+
+static LatencyRecorder* acquire_recorder() {
+    for (LatencyRecorder* r = recorders; r != NULL; r = r->next) {
+        if (r->in_use == 0 && InterlockedCompareExchange(&r->in_use, 1, 0) == 0) {
+            return r;
+        }
+    }
+    
+    LatencyRecorder* r = (LatencyRecorder*)calloc(1, sizeof(LatencyRecorder));
+    if (r == NULL) return NULL;
+    r->in_use = 1;
+    
+    LatencyRecorder* head;
+    do {
+        head = recorders;
+        r->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&recorders, r, head) != head);
+    
+    return r;
+}
+
+// Starts a trace at ingress. topic_id may be -1 to look the topic up by name.
+void latency_begin(MessageTrace* trace, const char* topic, int topic_id) {
+    if (!trace_enabled) return;
+    trace->topic_id = (topic_id >= 0) ? topic_id : latency_topic_id(topic);
+    trace->stamp[TRACE_INGRESS] = trace_now();
+}
+
+void latency_stamp(MessageTrace* trace, TraceStamp stamp) {
+    if (trace == NULL || !trace_enabled) return;
+    trace->stamp[stamp] = trace_now();
+}
+
+static void histogram_add(Histogram* histogram, LONGLONG ticks) {
+    if (ticks < 0) ticks = 0;
+    histogram->counts[histogram_index((ULONGLONG)(ticks * ns_per_tick))]++;
+}
+
+void latency_record(const MessageTrace* trace) {
+    if (trace == NULL || !trace_enabled) return;
+    
+    LatencyRecorder* r = thread_recorder;
+    if (r == NULL) {
+        r = thread_recorder = acquire_recorder();
+        if (r == NULL) return;
+    }
+    
+    for (int i = 0; i < INTERVAL_TOTAL; i++) {
+        histogram_add(&r->stages[i], trace->stamp[i + 1] - trace->stamp[i]);
+    }
+    LONGLONG total = trace->stamp[TRACE_EGRESS] - trace->stamp[TRACE_INGRESS];
+    histogram_add(&r->stages[INTERVAL_TOTAL], total);
+    
+    int id = trace->topic_id;
+    if (id >= 0 && id < MAX_TRACED_TOPICS) {
+        if (r->topics[id] == NULL) {
+            r->topics[id] = (Histogram*)calloc(1, sizeof(Histogram));
+        }
+        if (r->topics[id] != NULL) {
+            histogram_add(r->topics[id], total);
+        }
+    }
+}
+
+// Called when a thread that recorded latencies is about to exit
+void latency_thread_release() {
+    if (thread_recorder != NULL) {
+        InterlockedExchange(&thread_recorder->in_use, 0);
+        thread_recorder = NULL;
+    }
+}
+
+static int format_histogram(char* out, int size, const char* name, const Histogram* h) {
+    ULONGLONG count = 0;
+    for (int i = 0; i < HIST_COUNTS; i++) count += h->counts[i];
+    if (count == 0) return 0;
+    
+    static const double quantiles[] = { 0.50, 0.90, 0.99, 0.999 };
+    ULONGLONG values[4];
+    ULONGLONG min = 0, max = 0, seen = 0;
+    int q = 0;
+    for (int i = 0; i < HIST_COUNTS; i++) {
+        if (h->counts[i] == 0) continue;
+        if (seen == 0) min = histogram_value(i);
+        max = histogram_value(i);
+        seen += h->counts[i];
+        while (q < 4 && seen >= (ULONGLONG)(quantiles[q] * count + 0.5)) {
+            values[q++] = histogram_value(i);
+        }
+    }
+    while (q < 4) values[q++] = max;
+    
+    return snprintf(out, size, "%-18s %10llu %9.1f %9.1f %9.1f %9.1f %9.1f %9.1f\n",
+                    name, count,
+                    min / 1000.0, values[0] / 1000.0, values[1] / 1000.0,
+                    values[2] / 1000.0, values[3] / 1000.0, max / 1000.0);
+}
+
+// Merges all per-thread histograms and writes a text report into out
+int latency_report(char* out, int size) {
+    Histogram* merged = (Histogram*)malloc(sizeof(Histogram));
+    if (merged == NULL) return 0;
+    
+    int len = snprintf(out, size, "%-18s %10s %9s %9s %9s %9s %9s %9s\n",
+                       "stage (us)", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+    
+    for (int s = 0; s < TRACE_INTERVALS && len < size; s++) {
+        memset(merged, 0, sizeof(Histogram));
+        for (LatencyRecorder* r = recorders; r != NULL; r = r->next) {
+            for (int i = 0; i < HIST_COUNTS; i++) merged->counts[i] += r->stages[s].counts[i];
+        }
+        len += format_histogram(out + len, size - len, interval_names[s], merged);
+    }
+    
+    if (len < size) {
+        len += snprintf(out + len, size - len, "\n%-18s\n", "topic total (us)");
+    }
+    LONG count = topic_count;
+    for (int t = 0; t < count && len < size; t++) {
+        memset(merged, 0, sizeof(Histogram));
+        for (LatencyRecorder* r = recorders; r != NULL; r = r->next) {
+            Histogram* h = r->topics[t];
+            if (h == NULL) continue;
+            for (int i = 0; i < HIST_COUNTS; i++) merged->counts[i] += h->counts[i];
+        }
+        len += format_histogram(out + len, size - len, topic_names[t], merged);
+    }
+    
+    free(merged);
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,36 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <winsock2.h>
+
+#define MAX_TRACED_TOPICS 64
+#define LATENCY_TOPIC_LENGTH 64
+
+// Points in a message's life inside the broker
+typedef enum {
+    TRACE_INGRESS = 0,   // recv returned the publisher's bytes
+    TRACE_PARSE,         // message framed and formatted
+    TRACE_ROUTE,         // matching subscribers and peers selected
+    TRACE_ENQUEUE,       // message handed to the first outbound transport
+    TRACE_EGRESS,        // last subscriber copy written to its socket
+    TRACE_STAMPS
+} TraceStamp;
+
+// Monotonic stamps of one message (QueryPerformanceCounter ticks)
+typedef struct {
+    LONGLONG stamp[TRACE_STAMPS];
+    int topic_id;
+} MessageTrace;
+
+extern int trace_enabled;
+
+void latency_init();
+LONGLONG trace_now();
+int latency_topic_id(const char* topic);
+void latency_begin(MessageTrace* trace, const char* topic, int topic_id);
+void latency_stamp(MessageTrace* trace, TraceStamp stamp);
+void latency_record(const MessageTrace* trace);
+void latency_thread_release();
+int latency_report(char* out, int size);
+
+#endif
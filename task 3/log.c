@@ -0,0 +1,470 @@
+#include "server.h"
+#include <mswsock.h>
+#pragma comment(lib, "mswsock.lib")
+
+#define MAX_TOPIC_LOGS 1024
+#define INITIAL_SEGMENT_CAPACITY 16
+#define OFFSET_DIGITS 20
+#define COPY_BUFFER_SIZE 65536
+#define MAX_TRANSMIT_CHUNK (1 << 30)   // TransmitFile takes at most 2^31 - 2 bytes per call
+
+// A file holding the log bytes from start up to the next segment's start
+// (or the log end, for the last one). Named <topic>.<start>.log.
+typedef struct {
+    LONGLONG start;
+    char path[MAX_PATH];
+} LogSegment;
+
+// Every message published to a topic, byte for byte as subscribers receive
+// it, in publication order. Offsets are byte positions in that stream.
+// lock is held from the append until the fan-out of the message is done, so
+// a catch-up session that reaches end under the lock can go live without a
+// gap or a duplicate.
+typedef struct TopicLog {
+    char topic[MAX_TOPIC_LENGTH];
+    char name[3 * MAX_TOPIC_LENGTH];   // Topic escaped for file names
+    CRITICAL_SECTION lock;
+    LogSegment* segments;
+    int segment_count;
+    int segment_capacity;
+    HANDLE file;                   // Last segment, open for appending once written to
+    LONGLONG end;                  // Offset after the last byte appended
+    LONGLONG messages;             // Appended since the server started
+    int failed;                    // A write failed; the log no longer matches the topic
+} TopicLog;
+
+// A subscriber being served from the log on its own thread
+typedef struct {
+    Client* client;
+    TopicLog* log;
+    LONGLONG position;
+    int segment;                   // Index of the segment file held open, -1 if none
+    HANDLE file;
+    char* buffer;                  // --catchup-copy: COPY_BUFFER_SIZE bytes, allocated on first use
+} CatchUp;
+
+// Global variables
+const char* log_dir = NULL;
+LONGLONG segment_size = DEFAULT_SEGMENT_SIZE;
+int catchup_copy = 0;
+
+// Logs are only ever added. Readers scan up to log_count without a lock;
+// a new entry is complete before the count covers it.
+static TopicLog* logs[MAX_TOPIC_LOGS];
+static volatile LONG log_count = 0;
+static CRITICAL_SECTION logs_lock;
+
+static volatile LONG sessions_active = 0;
+static volatile LONG64 sessions_started = 0;
+static volatile LONG64 lagging_handoffs = 0;
+static volatile LONG64 zero_copy_bytes = 0;
+static volatile LONG64 copied_bytes = 0;
+
+// Function prototypes
+static int load_segments(TopicLog* log);
+static int open_segment(TopicLog* log);
+static int stream_range(CatchUp* session, LONGLONG from, LONGLONG to);
+static int send_segment_bytes(CatchUp* session, LONGLONG bytes);
+static unsigned __stdcall catchup_thread(void* arg);
+
+int open_logs() {
+    InitializeCriticalSection(&logs_lock);
+    if (log_dir == NULL) return 0;
+    
+    if (!CreateDirectoryA(log_dir, NULL) && GetLastError() != ERROR_ALREADY_EXISTS) {
+        printf("Cannot create log directory '%s'. Error: %lu\n", log_dir, (unsigned long)GetLastError());
+        return -1;
+    }
+    printf("Logging every topic to '%s' in %lld MB segments%s\n", log_dir,
+           (long long)(segment_size >> 20), catchup_copy ? " (catch-up copies through user space)" : "");
+    return 0;
+}
+
+void close_logs() {
+    for (int i = 0; i < log_count; i++) {
+        TopicLog* log = logs[i];
+        if (log->file != INVALID_HANDLE_VALUE) CloseHandle(log->file);
+        DeleteCriticalSection(&log->lock);
+        free(log->segments);
+        free(log);
+    }
+    log_count = 0;
+    DeleteCriticalSection(&logs_lock);
+}
+
+// Letters, digits, '-' and '_' are kept; anything else becomes %XX, so
+// distinct topics never share a file and the name never contains a '.'
+static void escape_topic(const char* topic, char* name) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *topic; topic++) {
+        unsigned char c = (unsigned char)*topic;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '_') {
+            *name++ = c;
+        } else {
+            *name++ = '%';
+            *name++ = hex[c >> 4];
+            *name++ = hex[c & 15];
+        }
+    }
+    *name = '\0';
+}
+
+static int add_segment(TopicLog* log, LONGLONG start) {
+    if (log->segment_count == log->segment_capacity) {
+        int capacity = log->segment_capacity ? log->segment_capacity * 2 : INITIAL_SEGMENT_CAPACITY;
+        LogSegment* segments = (LogSegment*)realloc(log->segments, capacity * sizeof(LogSegment));
+        if (segments == NULL) return -1;
+        log->segments = segments;
+        log->segment_capacity = capacity;
+    }
+    
+    // Keep the segments ordered by start offset
+    int i = log->segment_count++;
+    while (i > 0 && log->segments[i - 1].start > start) {
+        log->segments[i] = log->segments[i - 1];
+        i--;
+    }
+    log->segments[i].start = start;
+    snprintf(log->segments[i].path, MAX_PATH, "%s\\%s.%0*lld.log", log_dir, log->name, OFFSET_DIGITS, (long long)start);
+    return 0;
+}
+
+// Log of a topic, created on first use and picking up the segments an
+// earlier run left in the log directory. NULL when logging is off.
+TopicLog* topic_log(const char* topic) {
+    if (log_dir == NULL) return NULL;
+    
+    int count = log_count;
+    for (int i = 0; i < count; i++) {
+        if (strcmp(logs[i]->topic, topic) == 0) return logs[i];
+    }
+    
+    EnterCriticalSection(&logs_lock);
+    TopicLog* log = NULL;
+    for (int i = 0; i < log_count; i++) {
+        if (strcmp(logs[i]->topic, topic) == 0) log = logs[i];
+    }
+    if (log == NULL && log_count < MAX_TOPIC_LOGS) {
+        log = (TopicLog*)calloc(1, sizeof(TopicLog));
+        if (log != NULL) {
+            strncpy(log->topic, topic, MAX_TOPIC_LENGTH - 1);
+            escape_topic(log->topic, log->name);
+            InitializeCriticalSection(&log->lock);
+            log->file = INVALID_HANDLE_VALUE;
+            if (load_segments(log) != 0) {
+                printf("Cannot read the log of topic '%s'; it starts over at offset %lld\n", topic, (long long)log->end);
+            }
+            logs[log_count] = log;
+            MemoryBarrier();
+            log_count++;
+        }
+    } else if (log == NULL) {
+        printf("At most %d topics can be logged; topic '%s' is not\n", MAX_TOPIC_LOGS, topic);
+    }
+    LeaveCriticalSection(&logs_lock);
+    return log;
+}
+
+// Finds <topic>.<start>.log files; the log ends where the last one does
+static int load_segments(TopicLog* log) {
+    char pattern[MAX_PATH];
+    snprintf(pattern, sizeof(pattern), "%s\\%s.*.log", log_dir, log->name);
+    
+    WIN32_FIND_DATAA found;
+    HANDLE search = FindFirstFileA(pattern, &found);
+    if (search == INVALID_HANDLE_VALUE) return 0;
+    
+    size_t prefix = strlen(log->name) + 1;
+    do {
+        const char* digits = found.cFileName + prefix;
+        if (strspn(digits, "0123456789") == OFFSET_DIGITS && strcmp(digits + OFFSET_DIGITS, ".log") == 0) {
+            add_segment(log, _atoi64(digits));
+        }
+    } while (FindNextFileA(search, &found));
+    FindClose(search);
+    if (log->segment_count == 0) return 0;
+    
+    LogSegment* last = &log->segments[log->segment_count - 1];
+    HANDLE file = CreateFileA(last->path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+        log->end = last->start;
+        log->segment_count--;
+        return -1;
+    }
+    CloseHandle(file);
+    log->end = last->start + size.QuadPart;
+    printf("Topic '%s' log: %d segment(s), offsets %lld to %lld\n", log->topic, log->segment_count,
+           (long long)log->segments[0].start, (long long)log->end);
+    return 0;
+}
+
+// Opens the last segment for appending, starting a new one at the log end
+// when there is none yet or the last one is full
+static int open_segment(TopicLog* log) {
+    if (log->file != INVALID_HANDLE_VALUE) CloseHandle(log->file);
+    log->file = INVALID_HANDLE_VALUE;
+    
+    if (log->segment_count == 0 || log->end - log->segments[log->segment_count - 1].start >= segment_size) {
+        if (add_segment(log, log->end) != 0) return -1;
+    }
+    
+    // Shared for reading: catch-up sessions stream the segment while it grows
+    LogSegment* last = &log->segments[log->segment_count - 1];
+    log->file = CreateFileA(last->path, FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return (log->file == INVALID_HANDLE_VALUE) ? -1 : 0;
+}
+
+// Appends a message and takes the log lock, which the caller holds until
+// the message is fanned out and then drops with log_release. Returns the
+// offset after the message, or -1 if it could not be logged.
+LONGLONG log_append(TopicLog* log, const Message* message) {
+    EnterCriticalSection(&log->lock);
+    if (log->failed) return -1;
+    
+    if (log->file == INVALID_HANDLE_VALUE ||
+        log->end - log->segments[log->segment_count - 1].start >= segment_size) {
+        if (open_segment(log) != 0) {
+            printf("Cannot open a log segment of topic '%s'. Error: %lu\n", log->topic, (unsigned long)GetLastError());
+            log->failed = 1;
+            return -1;
+        }
+    }
+    
+    // Written through to the page cache, where catch-up reads find it
+    DWORD written = 0;
+    if (!WriteFile(log->file, message->data, message->length, &written, NULL) || written != (DWORD)message->length) {
+        printf("Writing the log of topic '%s' failed; it stops at offset %lld\n", log->topic, (long long)log->end);
+        log->failed = 1;
+        return -1;
+    }
+    log->end += message->length;
+    log->messages++;
+    return log->end;
+}
+
+void log_release(TopicLog* log) {
+    LeaveCriticalSection(&log->lock);
+}
+
+// Whether a subscriber that falls behind can be served from the log
+// instead of being dropped
+int log_can_catch_up(TopicLog* log) {
+    return log != NULL && !log->failed;
+}
+
+// Hands a subscriber to a catch-up session that streams the log from
+// position and then returns it to live delivery. The caller has stopped
+// polling the client and it is excluded from fan-out (catching_up).
+int start_catchup(Client* client, LONGLONG position) {
+    CatchUp* session = (CatchUp*)malloc(sizeof(CatchUp));
+    if (session == NULL) {
+        remove_client(client->id);
+        return -1;
+    }
+    session->client = client;
+    session->log = client->log;
+    session->position = position;
+    session->segment = -1;
+    session->file = INVALID_HANDLE_VALUE;
+    session->buffer = NULL;
+    
+    InterlockedIncrement(&sessions_active);
+    InterlockedIncrement64(&sessions_started);
+    HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, catchup_thread, session, 0, NULL);
+    if (thread == NULL) {
+        printf("Failed to create a catch-up thread for client %d\n", client->id);
+        InterlockedDecrement(&sessions_active);
+        remove_client(client->id);
+        free(session);
+        return -1;
+    }
+    CloseHandle(thread);
+    return 0;
+}
+
+// Called by the owning worker once a subscriber that overflowed its queue
+// has flushed everything it was given live
+void log_lagging_handoff(Client* client) {
+    // A router thread that picked it before it fell behind may still be
+    // writing to it; none picks it while it is catching up
+    EnterCriticalSection(&clients_mutex);
+    route_unpinned(client);
+    LeaveCriticalSection(&clients_mutex);
+    
+    InterlockedIncrement64(&lagging_handoffs);
+    if (verbose) {
+        printf("Client %d on topic '%s' fell behind; serving it from the log at offset %lld\n",
+               client->id, client->topic, (long long)client->log_next);
+    }
+    start_catchup(client, client->log_next);
+}
+
+static unsigned __stdcall catchup_thread(void* arg) {
+    CatchUp* session = (CatchUp*)arg;
+    Client* client = session->client;
+    TopicLog* log = session->log;
+    
+    // The session owns the connection and may block in the transmit, but
+    // not for longer than SEND_TIMEOUT_MS on a subscriber that stopped
+    // reading: that would hold its slot and a hot restart
+    u_long blocking = 0;
+    ioctlsocket(client->socket, FIONBIO, &blocking);
+    DWORD send_timeout = SEND_TIMEOUT_MS;
+    setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&send_timeout, sizeof(send_timeout));
+    
+    while (1) {
+        EnterCriticalSection(&log->lock);
+        LONGLONG end = log->end;
+        if (session->position >= end) {
+            // Publishes wait on the log lock, so nothing is appended between
+            // the last byte streamed and the switch to live delivery
+            u_long nonblocking = 1;
+            DWORD no_timeout = 0;
+            setsockopt(client->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&no_timeout, sizeof(no_timeout));
+            ioctlsocket(client->socket, FIONBIO, &nonblocking);
+            EnterCriticalSection(&clients_mutex);
+            client->log_next = end;
+            client->catching_up = 0;
+            LeaveCriticalSection(&clients_mutex);
+            LeaveCriticalSection(&log->lock);
+            
+            if (verbose) {
+                printf("Client %d caught up with topic '%s' at offset %lld\n", client->id, client->topic, (long long)end);
+            }
+            resume_client(client);
+            break;
+        }
+        LeaveCriticalSection(&log->lock);
+        
+        if (stream_range(session, session->position, end) != 0) {
+            if (verbose) print_client_info(client, "Disconnected (catch-up send failed)");
+            remove_client(client->id);
+            break;
+        }
+        session->position = end;
+    }
+    
+    if (session->file != INVALID_HANDLE_VALUE) CloseHandle(session->file);
+    free(session->buffer);
+    InterlockedDecrement(&sessions_active);
+    latency_thread_release();
+    pool_thread_release();
+    free(session);
+    return 0;
+}
+
+// Sends log bytes [from, to) to the session's subscriber, one segment file
+// range at a time
+static int stream_range(CatchUp* session, LONGLONG from, LONGLONG to) {
+    TopicLog* log = session->log;
+    
+    while (from < to) {
+        // The segment list only grows; look the range up under the lock
+        EnterCriticalSection(&log->lock);
+        int index = log->segment_count - 1;
+        while (index > 0 && log->segments[index].start > from) index--;
+        if (index < 0) {
+            LeaveCriticalSection(&log->lock);
+            return -1;
+        }
+        LogSegment segment = log->segments[index];
+        LONGLONG segment_end = (index + 1 < log->segment_count) ? log->segments[index + 1].start : log->end;
+        LeaveCriticalSection(&log->lock);
+        
+        // An offset before the oldest segment starts at the oldest segment
+        if (from < segment.start) from = segment.start;
+        if (from >= to) break;
+        
+        if (session->segment != index) {
+            if (session->file != INVALID_HANDLE_VALUE) CloseHandle(session->file);
+            session->file = CreateFileA(segment.path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                        OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+            session->segment = (session->file != INVALID_HANDLE_VALUE) ? index : -1;
+            if (session->file == INVALID_HANDLE_VALUE) return -1;
+        }
+        
+        LARGE_INTEGER position;
+        position.QuadPart = from - segment.start;
+        if (!SetFilePointerEx(session->file, position, NULL, FILE_BEGIN)) return -1;
+        
+        LONGLONG bytes = (to < segment_end ? to : segment_end) - from;
+        if (send_segment_bytes(session, bytes) != 0) return -1;
+        from += bytes;
+    }
+    return 0;
+}
+
+// Sends bytes from the current position of the session's segment file.
+// TransmitFile moves them from the file cache to the socket inside the
+// kernel; --catchup-copy reads them into a buffer and sends that instead,
+// for comparison.
+static int send_segment_bytes(CatchUp* session, LONGLONG bytes) {
+    SOCKET sock = session->client->socket;
+    
+    if (!catchup_copy) {
+        while (bytes > 0) {
+            DWORD chunk = (DWORD)(bytes < MAX_TRANSMIT_CHUNK ? bytes : MAX_TRANSMIT_CHUNK);
+            if (!TransmitFile(sock, session->file, chunk, 0, NULL, NULL, 0)) return -1;
+            InterlockedExchangeAdd64(&zero_copy_bytes, chunk);
+            bytes -= chunk;
+        }
+        return 0;
+    }
+    
+    if (session->buffer == NULL) {
+        session->buffer = (char*)malloc(COPY_BUFFER_SIZE);
+        if (session->buffer == NULL) return -1;
+    }
+    char* buffer = session->buffer;
+    while (bytes > 0) {
+        DWORD chunk = (DWORD)(bytes < COPY_BUFFER_SIZE ? bytes : COPY_BUFFER_SIZE);
+        DWORD read = 0;
+        if (!ReadFile(session->file, buffer, chunk, &read, NULL) || read == 0) return -1;
+        for (DWORD sent = 0; sent < read; ) {
+            int result = send(sock, buffer + sent, (int)(read - sent), 0);
+            if (result == SOCKET_ERROR) return -1;
+            sent += result;
+        }
+        // Into the buffer and back out of it
+        InterlockedExchangeAdd64(&copied_bytes, 2 * (LONGLONG)read);
+        bytes -= read;
+    }
+    return 0;
+}
+
+// Catch-up sessions still streaming; a hot restart waits for them to end
+int log_sessions_active() {
+    return sessions_active;
+}
+
+int log_report(char* out, int size) {
+    if (log_dir == NULL) {
+        return snprintf(out, size, "Topic logging is disabled (start the server with --log-dir)\n");
+    }
+    
+    int len = snprintf(out, size, "Topic logs in '%s' (%lld MB segments)\n", log_dir, (long long)(segment_size >> 20));
+    int count = log_count;
+    for (int i = 0; i < count && len < size - 256; i++) {
+        TopicLog* log = logs[i];
+        EnterCriticalSection(&log->lock);
+        len += snprintf(out + len, size - len, "  %s: offsets %lld to %lld in %d segment(s), %lld message(s) appended%s\n",
+                        log->topic, log->segment_count > 0 ? (long long)log->segments[0].start : (long long)log->end,
+                        (long long)log->end, log->segment_count, (long long)log->messages,
+                        log->failed ? ", FAILED" : "");
+        LeaveCriticalSection(&log->lock);
+    }
+    if (count == 0) len += snprintf(out + len, size - len, "  none\n");
+    
+    LONGLONG streamed = zero_copy_bytes + copied_bytes / 2;
+    len += snprintf(out + len, size - len,
+                    "Catch-up: %ld active, %lld started, %lld lagging subscriber(s) moved to the log\n"
+                    "Catch-up bytes: %lld zero-copy, %lld through user space, %.2f user-space copies per byte\n",
+                    (long)sessions_active, (long long)sessions_started, (long long)lagging_handoffs,
+                    (long long)zero_copy_bytes, (long long)(copied_bytes / 2),
+                    streamed > 0 ? (double)copied_bytes / streamed : 0.0);
+    return len;
+}
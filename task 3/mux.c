@@ -0,0 +1,316 @@
+#include "server.h"
+
+#define MUX_INITIAL_CAPACITY 16    // Power of two, grown to stay at most half full
+
+// One session of a multiplexed connection; session 0 marks an empty entry
+typedef struct {
+    UINT32 session;
+    int slot;                      // Client slot the session is registered in
+} MuxEntry;
+
+// Sessions of a multiplexed connection, an open-addressing table from the
+// agent's session ids to client slots. Only the owning worker touches it.
+typedef struct MuxState {
+    MuxEntry* entries;
+    int capacity;
+    int count;
+    char name[MAX_TOPIC_LENGTH];   // From the "MUX:NAME" registration
+} MuxState;
+
+static volatile LONG64 connections_opened = 0;
+static volatile LONG64 sessions_opened = 0;
+static volatile LONG64 sessions_closed = 0;
+static volatile LONG64 sessions_refused = 0;
+static volatile LONG64 frames_demultiplexed = 0;
+static volatile LONG64 shared_deliveries = 0;
+
+static unsigned int hash_session(UINT32 session) {
+    return session * 2654435761u;
+}
+
+// Index of the session's entry, or of the empty entry it would take
+static int find_entry(const MuxState* mux, UINT32 session) {
+    int mask = mux->capacity - 1;
+    int i = (int)(hash_session(session) & mask);
+    while (mux->entries[i].session != 0 && mux->entries[i].session != session) i = (i + 1) & mask;
+    return i;
+}
+
+static int grow(MuxState* mux) {
+    MuxEntry* old = mux->entries;
+    int old_capacity = mux->capacity;
+    MuxEntry* entries = (MuxEntry*)calloc(old_capacity * 2, sizeof(MuxEntry));
+    if (entries == NULL) return -1;
+    
+    mux->entries = entries;
+    mux->capacity = old_capacity * 2;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old[i].session != 0) mux->entries[find_entry(mux, old[i].session)] = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+// Empties an entry, moving later entries of the same probe run back into
+// the hole so lookups never need tombstones
+static void remove_entry(MuxState* mux, int hole) {
+    int mask = mux->capacity - 1;
+    for (int i = (hole + 1) & mask; mux->entries[i].session != 0; i = (i + 1) & mask) {
+        int home = (int)(hash_session(mux->entries[i].session) & mask);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            mux->entries[hole] = mux->entries[i];
+            hole = i;
+        }
+    }
+    mux->entries[hole].session = 0;
+    mux->count--;
+}
+
+// Turns a registered connection into the carrier of an agent's sessions
+// (format: "MUX:NAME"). It speaks wire frames from here on; bytes after
+// the registration line are its first ones. Returns 0 if it was removed.
+int mux_begin(Client* client, const char* name, const char* rest, int rest_len) {
+    MuxState* mux = (MuxState*)calloc(1, sizeof(MuxState));
+    MuxEntry* entries = (MuxEntry*)calloc(MUX_INITIAL_CAPACITY, sizeof(MuxEntry));
+    if (mux == NULL || entries == NULL) {
+        printf("Out of memory for multiplexed connection %d\n", client->id);
+        send_to_client(client, "ERROR out of memory\n", 20);
+        free(mux);
+        free(entries);
+        remove_client(client->id);
+        return 0;
+    }
+    mux->entries = entries;
+    mux->capacity = MUX_INITIAL_CAPACITY;
+    strncpy(mux->name, name, MAX_TOPIC_LENGTH - 1);
+    
+    char ack[32];
+    int ack_len = snprintf(ack, sizeof(ack), "OK %d\n", client->id);
+    if (send_to_client(client, ack, ack_len) != 0) {
+        free(entries);
+        free(mux);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // Frames for many sessions follow each other; with Nagle's algorithm
+    // each one after the first would wait for the agent's delayed ACK
+    int nodelay = 1;
+    setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+    
+    EnterCriticalSection(&clients_mutex);
+    client->type = CLIENT_MUX;
+    client->binary = 1;
+    client->mux = mux;
+    client->topic_id = 0;          // Traces of its frames take the sending session's topic
+    LeaveCriticalSection(&clients_mutex);
+    InterlockedIncrement64(&connections_opened);
+    
+    if (verbose) printf("Client %d (%s) carries the sessions of agent '%s'\n", client->id, client_ip(client), mux->name);
+    if (rest_len > 0) return wire_receive(client, rest, rest_len);
+    return 1;
+}
+
+// Sends a session frame with a reply line to the agent. Called with
+// clients_mutex held.
+static void send_control(Client* carrier, UINT32 session, UINT32 topic_id, const char* text) {
+    int length = (int)strlen(text);
+    Message* message = message_create(sizeof(WireHeader) + length);
+    if (message == NULL) return;
+    
+    WireHeader* header = (WireHeader*)message->data;
+    memset(header, 0, sizeof(WireHeader));
+    header->magic = WIRE_MAGIC;
+    header->version = WIRE_VERSION;
+    header->flags = WIRE_FLAG_SESSION;
+    header->length = length;
+    header->topic_id = topic_id;
+    header->session = session;
+    header->timestamp = wire_now();
+    memcpy(message->data + sizeof(WireHeader), text, length);
+    message->length = sizeof(WireHeader) + length;
+    message->binary = 1;
+    message->payload_offset = sizeof(WireHeader);
+    message->wire = *header;
+    wire_topic_hold(topic_id);
+    
+    deliver_to_client(carrier, message);
+    message_release(message);
+}
+
+static void refuse(Client* carrier, UINT32 session, const char* error) {
+    InterlockedIncrement64(&sessions_refused);
+    EnterCriticalSection(&clients_mutex);
+    send_control(carrier, session, 0, error);
+    LeaveCriticalSection(&clients_mutex);
+}
+
+// Opens a session in a client slot of its own, so routing, rate limits,
+// statistics and capture treat it like a connection of its own; only its
+// socket is the carrier's.
+static void open_session(Client* carrier, UINT32 session, char* registration) {
+    MuxState* mux = carrier->mux;
+    char* topic = strchr(registration, ':');
+    if (topic != NULL) *topic++ = '\0';
+    
+    ClientType type = CLIENT_UNKNOWN;
+    if (strcmp(registration, "PUBLISHER") == 0) type = CLIENT_PUBLISHER;
+    if (strcmp(registration, "SUBSCRIBER") == 0) type = CLIENT_SUBSCRIBER;
+    if (type == CLIENT_UNKNOWN || topic == NULL || *topic == '\0' || strlen(topic) >= MAX_TOPIC_LENGTH ||
+        strpbrk(topic, ":@/") != NULL) {
+        refuse(carrier, session, "ERROR expected PUBLISHER:TOPIC or SUBSCRIBER:TOPIC\n");
+        return;
+    }
+    
+    TopicPolicy* policy = find_topic_policy(topic);
+    if (policy != NULL && policy->encrypted && carrier->tls == NULL) {
+        refuse(carrier, session, "ERROR topic needs TLS\n");
+        return;
+    }
+    
+    int index = find_entry(mux, session);
+    if (mux->entries[index].session != 0) {
+        refuse(carrier, session, "ERROR session already open\n");
+        return;
+    }
+    
+    // Frames carry the topic id, which the agent demultiplexes by
+    int route_id = wire_topic_id(topic);
+    if (route_id == 0) {
+        refuse(carrier, session, "ERROR no topic ids left\n");
+        return;
+    }
+    
+    if ((mux->count + 1) * 2 > mux->capacity) {
+        if (grow(mux) != 0) {
+            wire_topic_release(route_id);
+            refuse(carrier, session, "ERROR out of memory\n");
+            return;
+        }
+        index = find_entry(mux, session);
+    }
+    
+    int slot = add_client(carrier->worker, carrier->socket, carrier->address);
+    if (slot == -1) {
+        wire_topic_release(route_id);
+        refuse(carrier, session, "ERROR server full\n");
+        return;
+    }
+    Client* client = &clients[slot];
+    liveness_stop(client);         // The carrier's check covers it
+    client->worker = carrier->worker;
+    client->carrier = carrier->id;
+    client->session = session;
+    client->binary = 1;
+    mux->entries[index].session = session;
+    mux->entries[index].slot = slot;
+    mux->count++;
+    
+    // Acknowledge before the session becomes visible to routing, as
+    // register_client does
+    char ack[48];
+    snprintf(ack, sizeof(ack), "OK %d %d\n", slot, route_id);
+    EnterCriticalSection(&clients_mutex);
+    send_control(carrier, session, route_id, ack);
+    client->type = type;
+    client->topic = wire_topic_name(route_id);
+    client->topic_id = latency_topic_id(client->topic);
+    client->route_id = route_id;
+    client->busy_poll = 0;         // Served by the carrier's worker
+    topic_client_added(client);
+    if (type == CLIENT_SUBSCRIBER && count_subscribers_by_topic(route_id) == 1) {
+        announce_interest("SUB", client->topic);
+    }
+    LeaveCriticalSection(&clients_mutex);
+    InterlockedIncrement64(&sessions_opened);
+    
+    if (type == CLIENT_SUBSCRIBER) {
+        capture_event(CAPTURE_SUBSCRIBE, slot, client->topic, NULL, 0);
+    }
+    if (verbose) {
+        printf("Client %d (%s) registered as %s for topic '%s' in session %u of agent '%s'\n",
+               slot, client_ip(client), registration, client->topic, session, mux->name);
+    }
+}
+
+// Handles a session frame of a multiplexed connection: "PUBLISHER:TOPIC"
+// or "SUBSCRIBER:TOPIC" opens the session the header names and is answered
+// with "OK <ID> <TOPIC_ID>" or "ERROR ..." in a session frame; an empty
+// payload closes it. Other connections' session frames are ignored.
+// Returns 0 once the client was removed.
+int mux_control(Client* client, const WireHeader* header, const char* payload) {
+    if (client->type != CLIENT_MUX || header->session == 0) return 1;
+    
+    if (header->length == 0) {
+        int index = find_entry(client->mux, header->session);
+        if (client->mux->entries[index].session == 0) return 1;
+        int slot = client->mux->entries[index].slot;
+        remove_entry(client->mux, index);
+        if (verbose) print_client_info(&clients[slot], "Session closed");
+        remove_client(slot);
+        InterlockedIncrement64(&sessions_closed);
+        return 1;
+    }
+    
+    char registration[MAX_TOPIC_LENGTH + 16];
+    int length = (header->length < sizeof(registration)) ? (int)header->length : (int)sizeof(registration) - 1;
+    memcpy(registration, payload, length);
+    while (length > 0 && (registration[length - 1] == '\n' || registration[length - 1] == '\r')) length--;
+    registration[length] = '\0';
+    open_session(client, header->session, registration);
+    return 1;
+}
+
+// The session a data frame of a multiplexed connection names, or NULL
+Client* mux_session(Client* client, UINT32 session) {
+    int index = find_entry(client->mux, session);
+    if (client->mux->entries[index].session == 0) return NULL;
+    InterlockedIncrement64(&frames_demultiplexed);
+    return &clients[client->mux->entries[index].slot];
+}
+
+// Closes every session of a multiplexed connection that is going away.
+// Called by remove_client before it takes clients_mutex.
+void mux_client_gone(Client* client) {
+    MuxState* mux = client->mux;
+    if (mux == NULL) return;
+    
+    client->mux = NULL;
+    for (int i = 0; i < mux->capacity; i++) {
+        if (mux->entries[i].session == 0) continue;
+        remove_client(mux->entries[i].slot);
+        InterlockedIncrement64(&sessions_closed);
+    }
+    free(mux->entries);
+    free(mux);
+}
+
+// A broadcast found another session of a connection it already writes to
+// for the topic. Called with clients_mutex held.
+void mux_shared_delivery() {
+    shared_deliveries++;
+}
+
+int mux_report(char* out, int size) {
+    int connections = 0, publishers = 0, subscribers = 0;
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < max_clients; i++) {
+        if (clients[i].socket == INVALID_SOCKET) continue;
+        if (clients[i].type == CLIENT_MUX) connections++;
+        if (clients[i].carrier < 0) continue;
+        if (clients[i].type == CLIENT_PUBLISHER) publishers++;
+        if (clients[i].type == CLIENT_SUBSCRIBER) subscribers++;
+    }
+    LONG64 shared = shared_deliveries;
+    LeaveCriticalSection(&clients_mutex);
+    
+    int len = snprintf(out, size,
+                       "Multiplexed connections: %d now (%lld in total), carrying %d publisher and %d subscriber sessions\n"
+                       "  Sessions: %lld opened, %lld closed, %lld refused\n"
+                       "  Data frames demultiplexed to sessions: %lld\n"
+                       "  Deliveries shared with another session of the same connection: %lld\n",
+                       connections, (long long)connections_opened, publishers, subscribers,
+                       (long long)sessions_opened, (long long)sessions_closed, (long long)sessions_refused,
+                       (long long)frames_demultiplexed, (long long)shared);
+    return len < size ? len : size - 1;
+}
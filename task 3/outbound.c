@@ -0,0 +1,455 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "outbound.h"
+#include "pool.h"
+
+#define INITIAL_RING_CAPACITY 16
+#define FLUSH_BATCH 16
+
+int max_queue = DEFAULT_MAX_QUEUE;
+
+static const char* priority_names[PRIORITY_CLASSES] = { "HIGH", "NORMAL", "LOW" };
+
+Message* message_create(int capacity) {
+    Message* message = (Message*)pool_alloc(sizeof(Message) + capacity);
+    if (message == NULL) return NULL;
+    
+    message->refs = 1;
+    message->length = 0;
+    message->priority = PRIORITY_NORMAL;
+    message->conflated = 0;
+    message->key[0] = '\0';
+    message->traced = 0;
+    message->chunk = 0;
+    message->expires = 0;
+    message->on_free = NULL;
+    message->free_context = NULL;
+    message->binary = 0;
+    message->payload_offset = 0;
+    message->wire.magic = 0;
+    message->wire.topic_id = 0;
+    message->alternate = NULL;
+    return message;
+}
+
+void message_retain(Message* message) {
+    InterlockedIncrement(&message->refs);
+}
+
+void message_release(Message* message) {
+    if (InterlockedDecrement(&message->refs) != 0) return;
+    
+    // The last subscriber has the message: egress is complete
+    if (message->traced) {
+        latency_stamp(&message->trace, TRACE_EGRESS);
+        latency_record(&message->trace);
+    }
+    if (message->on_free != NULL) message->on_free(message);
+    if (message->alternate != NULL) message_release(message->alternate);
+    wire_topic_release(message->wire.topic_id);
+    pool_free(message);
+}
+
+// The key of a conflated message is its first word
+void message_set_key(Message* message, const char* text, int length) {
+    int i = 0;
+    while (i < length && i < MAX_KEY_LENGTH - 1 &&
+           text[i] != ' ' && text[i] != '\t' && text[i] != '\r' && text[i] != '\n') {
+        message->key[i] = text[i];
+        i++;
+    }
+    message->key[i] = '\0';
+}
+
+const char* priority_name(Priority priority) {
+    return priority_names[priority];
+}
+
+// Accepts "HIGH", "NORMAL" or "LOW" in any case
+int parse_priority(const char* name, Priority* priority) {
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        if (_stricmp(name, priority_names[p]) == 0) {
+            *priority = (Priority)p;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static unsigned int hash_key(const char* key) {
+    unsigned int hash = 2166136261u;   // FNV-1a
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static Message** entry_at(const OutboundLane* lane, LONGLONG seq) {
+    return &lane->ring[seq & (lane->capacity - 1)];
+}
+
+// Finds the pending entry for a key. Index slots of entries that were sent
+// meanwhile are recognised by their sequence number and skipped.
+static LONGLONG find_key(const OutboundLane* lane, const char* key, unsigned int hash) {
+    if (lane->key_capacity == 0) return -1;
+    
+    int mask = lane->key_capacity - 1;
+    for (int i = hash & mask; lane->key_seqs[i] != 0; i = (i + 1) & mask) {
+        LONGLONG seq = lane->key_seqs[i] - 1;
+        if (lane->key_hashes[i] == hash && seq >= lane->head && seq < lane->tail) {
+            Message* pending = *entry_at(lane, seq);
+            if (pending->conflated && strcmp(pending->key, key) == 0) return seq;
+        }
+    }
+    return -1;
+}
+
+static void insert_key(OutboundLane* lane, unsigned int hash, LONGLONG seq) {
+    int mask = lane->key_capacity - 1;
+    int i = hash & mask;
+    while (lane->key_seqs[i] != 0) i = (i + 1) & mask;
+    lane->key_hashes[i] = hash;
+    lane->key_seqs[i] = seq + 1;
+    lane->key_used++;
+}
+
+// Rebuilds the conflation index from the pending entries, dropping stale
+// slots; the index stays proportional to the number of distinct keys
+static int rebuild_keys(OutboundLane* lane) {
+    int pending = (int)(lane->tail - lane->head);
+    int capacity = 16;
+    while (capacity < pending * 2 + 2) capacity *= 2;
+    
+    if (capacity != lane->key_capacity) {
+        unsigned int* hashes = (unsigned int*)malloc(capacity * sizeof(unsigned int));
+        LONGLONG* seqs = (LONGLONG*)malloc(capacity * sizeof(LONGLONG));
+        if (hashes == NULL || seqs == NULL) {
+            free(hashes);
+            free(seqs);
+            return -1;
+        }
+        free(lane->key_hashes);
+        free(lane->key_seqs);
+        lane->key_hashes = hashes;
+        lane->key_seqs = seqs;
+        lane->key_capacity = capacity;
+    }
+    
+    memset(lane->key_seqs, 0, capacity * sizeof(LONGLONG));
+    lane->key_used = 0;
+    for (LONGLONG seq = lane->head; seq < lane->tail; seq++) {
+        Message* message = *entry_at(lane, seq);
+        if (message->conflated) insert_key(lane, hash_key(message->key), seq);
+    }
+    return 0;
+}
+
+static int grow_ring(OutboundLane* lane) {
+    int capacity = lane->capacity ? lane->capacity * 2 : INITIAL_RING_CAPACITY;
+    Message** ring = (Message**)malloc(capacity * sizeof(Message*));
+    if (ring == NULL) return -1;
+    
+    for (LONGLONG seq = lane->head; seq < lane->tail; seq++) {
+        ring[seq & (capacity - 1)] = *entry_at(lane, seq);
+    }
+    free(lane->ring);
+    lane->ring = ring;
+    lane->capacity = capacity;
+    return 0;
+}
+
+// Frees the lanes with their rings and conflation indexes
+static void free_lanes(OutboundQueue* queue) {
+    if (queue->lanes == NULL) return;
+    
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        OutboundLane* lane = &queue->lanes[p];
+        free(lane->ring);
+        free(lane->key_hashes);
+        free(lane->key_seqs);
+    }
+    free(queue->lanes);
+    queue->lanes = NULL;
+}
+
+static int expired(const Message* message, ULONGLONG now) {
+    return message->expires != 0 && now >= message->expires;
+}
+
+// Drops every expired message still waiting, in one pass over each lane
+// that keeps the order of the rest; a partly sent head stays. Returns how
+// many were dropped.
+static int reap_expired(OutboundQueue* queue) {
+    if (queue->lanes == NULL) return 0;
+    
+    ULONGLONG now = GetTickCount64();
+    int reaped = 0;
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        OutboundLane* lane = &queue->lanes[p];
+        LONGLONG first = lane->head + ((queue->offset > 0 && queue->current == p) ? 1 : 0);
+        LONGLONG keep = lane->tail;    // The kept entries move up towards the tail
+        for (LONGLONG seq = lane->tail - 1; seq >= lane->head; seq--) {
+            Message* message = *entry_at(lane, seq);
+            if (seq >= first && expired(message, now)) {
+                ttl_expired(message->wire.topic_id, 1);
+                message_release(message);
+                reaped++;
+            } else {
+                *entry_at(lane, --keep) = message;
+            }
+        }
+        if (keep == lane->head) continue;
+        
+        queue->pending -= (int)(keep - lane->head);
+        lane->head = keep;
+        if (lane->key_capacity > 0) rebuild_keys(lane);   // On failure stale slots are skipped
+    }
+    return reaped;
+}
+
+// Appends a message to the lane of its priority; sent bytes of it are
+// already on the wire. A full queue first drops what expired in it.
+static OutboundResult enqueue(OutboundQueue* queue, Message* message, int sent) {
+    if (queue->pending >= max_queue && reap_expired(queue) == 0) return OUTBOUND_FULL;
+    if (queue->lanes == NULL) {
+        queue->lanes = (OutboundLane*)calloc(PRIORITY_CLASSES, sizeof(OutboundLane));
+        if (queue->lanes == NULL) return OUTBOUND_FULL;
+    }
+    OutboundLane* lane = &queue->lanes[message->priority];
+    if (lane->tail - lane->head == lane->capacity && grow_ring(lane) != 0) return OUTBOUND_FULL;
+    
+    if (sent > 0) {
+        queue->current = message->priority;
+        queue->offset = sent;
+    }
+    *entry_at(lane, lane->tail) = message;
+    message_retain(message);
+    queue->pending++;
+    
+    if (message->conflated) {
+        if (lane->key_capacity == 0 || (lane->key_used + 1) * 2 > lane->key_capacity) {
+            if (rebuild_keys(lane) != 0) {
+                lane->tail++;
+                return OUTBOUND_QUEUED;   // Still delivered, just not merged
+            }
+        }
+        insert_key(lane, hash_key(message->key), lane->tail);
+    }
+    lane->tail++;
+    return OUTBOUND_QUEUED;
+}
+
+// Delivers a message to one subscriber. Called with the subscriber's
+// outbound lock held. An idle subscriber gets it written straight away;
+// otherwise it is queued in the lane of its priority, or, on a conflated
+// topic, replaces the pending message with the same key. A TLS record the
+// socket did not take yet counts as queued, so the worker flushes it.
+OutboundResult outbound_send(SOCKET sock, OutboundQueue* queue, Message* message) {
+    int sent = 0;
+    
+    if (queue->pending == 0) {
+        if (queue->tls != NULL) {
+            WSABUF buffer;
+            buffer.buf = message->data;
+            buffer.len = message->length;
+            sent = tls_write(queue->tls, &buffer, 1);
+            if (sent == message->length) return tls_pending(queue->tls) ? OUTBOUND_QUEUED : OUTBOUND_SENT;
+        } else {
+            sent = send(sock, message->data, message->length, 0);
+            if (sent == message->length) return OUTBOUND_SENT;
+        }
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) return OUTBOUND_ERROR;
+            sent = 0;
+        }
+    } else if (message->conflated && queue->lanes != NULL) {
+        OutboundLane* lane = &queue->lanes[message->priority];
+        unsigned int hash = hash_key(message->key);
+        LONGLONG seq = find_key(lane, message->key, hash);
+        
+        // The head entry cannot change once its first bytes are on the wire
+        int on_wire = (queue->offset > 0 && queue->current == (int)message->priority && seq == lane->head);
+        if (seq >= 0 && !on_wire) {
+            Message** slot = entry_at(lane, seq);
+            message_retain(message);
+            message_release(*slot);
+            *slot = message;
+            queue->merged++;
+            return OUTBOUND_QUEUED;
+        }
+    }
+    
+    return enqueue(queue, message, sent);
+}
+
+// Chooses the lane to send from next: the highest non-empty one, unless a
+// lower lane has been passed over STARVATION_LIMIT times, in which case that
+// lane goes first. Updates the passed-over counts for the choice.
+static int pick_lane(const OutboundQueue* queue, const LONGLONG* next, int* passed, int* promoted) {
+    int chosen = -1;
+    *promoted = 0;
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        if (next[p] == queue->lanes[p].tail) continue;
+        if (chosen < 0) {
+            chosen = p;
+        } else if (passed[p] >= STARVATION_LIMIT) {
+            chosen = p;
+            *promoted = 1;
+            break;
+        }
+    }
+    if (chosen < 0) return -1;
+    
+    for (int p = chosen + 1; p < PRIORITY_CLASSES; p++) {
+        if (next[p] != queue->lanes[p].tail) passed[p]++;
+    }
+    passed[chosen] = 0;
+    return chosen;
+}
+
+// Writes as much of the queue as the socket accepts, highest priority first,
+// gathering several messages per call. Called with the subscriber's
+// outbound lock held. Returns 1 once the queue is empty, 0 if data is still
+// pending and -1 if the socket failed. TLS records that wait go first.
+// Messages that expired are planned with no bytes and retired unsent.
+int outbound_flush(SOCKET sock, OutboundQueue* queue) {
+    if (queue->tls != NULL) {
+        int flushed = tls_flush(queue->tls);
+        if (flushed <= 0) return flushed;
+    }
+    
+    ULONGLONG now = GetTickCount64();
+    while (queue->pending > 0) {
+        WSABUF buffers[FLUSH_BATCH];
+        int batch_lanes[FLUSH_BATCH];
+        int batch_passed[FLUSH_BATCH][PRIORITY_CLASSES];
+        int batch_promoted[FLUSH_BATCH];
+        LONGLONG next[PRIORITY_CLASSES];
+        int passed[PRIORITY_CLASSES];
+        for (int p = 0; p < PRIORITY_CLASSES; p++) {
+            next[p] = queue->lanes[p].head;
+            passed[p] = queue->lanes[p].passed;
+        }
+        
+        // Plan the order first; the counters only change for what gets sent
+        int count = 0;
+        DWORD planned = 0;
+        while (count < FLUSH_BATCH) {
+            int promoted = 0;
+            int lane;
+            if (count == 0 && queue->offset > 0) {
+                lane = queue->current;  // A partly sent message is finished first
+            } else {
+                lane = pick_lane(queue, next, passed, &promoted);
+                if (lane < 0) break;
+            }
+            
+            Message* message = *entry_at(&queue->lanes[lane], next[lane]++);
+            int skip = (count == 0) ? queue->offset : 0;
+            buffers[count].buf = message->data + skip;
+            buffers[count].len = (skip == 0 && expired(message, now)) ? 0 : message->length - skip;
+            planned += buffers[count].len;
+            batch_lanes[count] = lane;
+            memcpy(batch_passed[count], passed, sizeof(passed));
+            batch_promoted[count] = promoted;
+            count++;
+        }
+        
+        // A TLS write takes the whole batch or nothing
+        DWORD sent = 0;
+        if (planned == 0) {
+            // Only expired messages
+        } else if (queue->tls != NULL) {
+            int written = tls_write(queue->tls, buffers, count);
+            if (written == SOCKET_ERROR) return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+            sent = (DWORD)written;
+        } else if (WSASend(sock, buffers, count, &sent, 0, NULL, NULL) == SOCKET_ERROR) {
+            return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+        }
+        
+        // Retire every message that went out completely, and the expired
+        // ones up to the first that did not
+        int i;
+        for (i = 0; i < count; i++) {
+            if (sent == 0 && buffers[i].len > 0) break;
+            for (int p = 0; p < PRIORITY_CLASSES; p++) {
+                queue->lanes[p].passed = batch_passed[i][p];
+            }
+            queue->promoted += batch_promoted[i];
+            
+            if (sent < buffers[i].len) {
+                queue->current = batch_lanes[i];
+                queue->offset = (i == 0 ? queue->offset : 0) + sent;
+                break;
+            }
+            sent -= buffers[i].len;
+            OutboundLane* lane = &queue->lanes[batch_lanes[i]];
+            Message** slot = entry_at(lane, lane->head);
+            if (buffers[i].len == 0) ttl_expired((*slot)->wire.topic_id, 0);
+            message_release(*slot);
+            *slot = NULL;
+            lane->head++;
+            queue->pending--;
+            queue->offset = 0;
+        }
+        
+        if (i < count) return 0;
+    }
+    
+    // Nothing pending: the lanes go until the socket backs up again
+    free_lanes(queue);
+    if (queue->tls != NULL && tls_pending(queue->tls)) return 0;
+    return 1;
+}
+
+// Queues a message without trying the socket first, in the order the
+// messages are restored. Used to rebuild a queue taken over from another
+// process; pending entries are not merged again.
+OutboundResult outbound_restore(OutboundQueue* queue, Message* message) {
+    return enqueue(queue, message, 0);
+}
+
+// Calls visit for every queued message in the order it would be sent: the
+// partly sent head first, with the number of its bytes already written,
+// then each lane from the highest. Stops at the first visit that fails.
+int outbound_export(const OutboundQueue* queue, int (*visit)(void* context, const Message* message, int sent),
+                    void* context) {
+    if (queue->pending == 0) return 0;
+    
+    int head_sent = (queue->offset > 0);
+    if (head_sent) {
+        const OutboundLane* lane = &queue->lanes[queue->current];
+        if (visit(context, *entry_at(lane, lane->head), queue->offset) != 0) return -1;
+    }
+    for (int p = 0; p < PRIORITY_CLASSES; p++) {
+        const OutboundLane* lane = &queue->lanes[p];
+        LONGLONG seq = lane->head + ((head_sent && p == queue->current) ? 1 : 0);
+        for (; seq < lane->tail; seq++) {
+            if (visit(context, *entry_at(lane, seq), 0) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+int outbound_depth(const OutboundQueue* queue) {
+    return queue->pending;
+}
+
+int outbound_lane_depth(const OutboundQueue* queue, Priority priority) {
+    if (queue->lanes == NULL) return 0;
+    return (int)(queue->lanes[priority].tail - queue->lanes[priority].head);
+}
+
+// Releases everything still queued and the queue's own memory
+void outbound_clear(OutboundQueue* queue) {
+    for (int p = 0; queue->lanes != NULL && p < PRIORITY_CLASSES; p++) {
+        OutboundLane* lane = &queue->lanes[p];
+        for (LONGLONG seq = lane->head; seq < lane->tail; seq++) {
+            message_release(*entry_at(lane, seq));
+        }
+    }
+    free_lanes(queue);
+    memset(queue, 0, sizeof(*queue));
+}
@@ -0,0 +1,110 @@
+#ifndef OUTBOUND_H
+#define OUTBOUND_H
+
+#include <winsock2.h>
+#include "latency.h"
+#include "wire.h"
+
+#define MAX_KEY_LENGTH 32
+#define DEFAULT_MAX_QUEUE 65536
+#define STARVATION_LIMIT 16        // Times a waiting lane may be passed over before it is served
+
+// Delivery classes, drained highest first
+typedef enum {
+    PRIORITY_HIGH = 0,
+    PRIORITY_NORMAL,
+    PRIORITY_LOW,
+    PRIORITY_CLASSES
+} Priority;
+
+// A formatted message shared by every subscriber it is queued for. The last
+// release records its egress latency, runs on_free, drops its alternate
+// and frees it. A message that expires is skipped by the queues it still
+// waits in once its time is up.
+typedef struct Message {
+    volatile LONG refs;
+    int length;
+    Priority priority;
+    int conflated;                 // Pending copies may be replaced by a newer message with the same key
+    char key[MAX_KEY_LENGTH];
+    int traced;
+    MessageTrace trace;
+    int chunk;                     // Part of a large message streamed in chunks
+    ULONGLONG expires;             // GetTickCount64() from which it is no longer delivered, 0 = never
+    void (*on_free)(struct Message* message);
+    void* free_context;            // For on_free
+    int binary;                    // data is a WireHeader and the payload, not a text line
+    int payload_offset;            // Where the publisher's payload starts in data
+    WireHeader wire;               // Header fields of a topic message in either encoding, magic 0 otherwise
+    struct Message* volatile alternate; // The same message in the other encoding, made on first use
+    char data[1];
+} Message;
+
+// Pending messages of one priority class. Entries are addressed by
+// ever-increasing sequence numbers; the ring and the conflation index are
+// allocated on first use.
+typedef struct {
+    Message** ring;
+    int capacity;                  // Power of two
+    LONGLONG head;                 // Sequence number of the oldest entry
+    LONGLONG tail;                 // Sequence number of the next entry
+    int passed;                    // Messages of higher lanes sent while this one waited
+    unsigned int* key_hashes;      // Conflation index: key -> sequence number
+    LONGLONG* key_seqs;            // 0 marks an empty slot, otherwise sequence + 1
+    int key_capacity;
+    int key_used;
+} OutboundLane;
+
+struct TlsSession;                 // tls.c
+
+// Messages waiting for one subscriber's socket to drain. The lanes exist
+// only while messages are pending, so an idle subscriber's queue is a few
+// counters.
+typedef struct {
+    OutboundLane* lanes;           // PRIORITY_CLASSES of them, NULL while nothing is pending
+    struct TlsSession* tls;        // Encrypts what is written; NULL for plaintext
+    int pending;                   // Entries over all lanes
+    int offset;                    // Bytes already sent of the head of lane current
+    int current;
+    LONGLONG merged;               // Updates folded into a pending entry
+    LONGLONG promoted;             // Lower-lane messages sent early by starvation protection
+} OutboundQueue;
+
+typedef enum {
+    OUTBOUND_SENT = 0,             // Written to the socket completely
+    OUTBOUND_QUEUED,               // Waiting (or merged) in the queue
+    OUTBOUND_FULL,                 // Subscriber exceeded max_queue
+    OUTBOUND_ERROR                 // Socket failed
+} OutboundResult;
+
+extern int max_queue;
+
+Message* message_create(int capacity);
+void message_retain(Message* message);
+void message_release(Message* message);
+void message_set_key(Message* message, const char* text, int length);
+
+const char* priority_name(Priority priority);
+int parse_priority(const char* name, Priority* priority);
+
+OutboundResult outbound_send(SOCKET sock, OutboundQueue* queue, Message* message);
+int outbound_flush(SOCKET sock, OutboundQueue* queue);
+OutboundResult outbound_restore(OutboundQueue* queue, Message* message);
+int outbound_export(const OutboundQueue* queue, int (*visit)(void* context, const Message* message, int sent),
+                    void* context);
+int outbound_depth(const OutboundQueue* queue);
+int outbound_lane_depth(const OutboundQueue* queue, Priority priority);
+void outbound_clear(OutboundQueue* queue);
+
+// Record layer of a user-space TLS session (tls.c)
+int tls_write(struct TlsSession* session, const WSABUF* buffers, int count);
+int tls_flush(struct TlsSession* session);
+int tls_pending(const struct TlsSession* session);
+
+// Counts expired messages per topic (ttl.c)
+void ttl_expired(UINT32 topic_id, int reaped);
+
+// Drops a message's reference on its topic id (wire.c)
+void wire_topic_release(int id);
+
+#endif
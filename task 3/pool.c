@@ -0,0 +1,269 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+// Blocks of a size class move between a thread's cache and the shared
+// pool in batches of about BATCH_BYTES, so the pool lock is taken once per
+// batch rather than once per message.
+#define BATCH_BYTES 32768
+#define MAX_BATCH 64
+#define SHARED_BYTES_PER_CLASS (4 * 1024 * 1024)
+
+// Header in front of every block. A free block links to the next block of
+// its batch and a batch head to the next batch; a block in use remembers
+// its class, -1 if it came straight from the system allocator.
+typedef union PoolBlock {
+    struct {
+        union PoolBlock* next;
+        union PoolBlock* next_batch;
+    } link;
+    int size_class;
+    char align[16];
+} PoolBlock;
+
+// Free blocks and counters of one thread, written only by that thread. A
+// thread that exits gives its blocks back to the shared pool and its cache
+// to the next thread, like latency recorders.
+typedef struct PoolCache {
+    struct PoolCache* next;
+    volatile LONG in_use;
+    PoolBlock* blocks[POOL_CLASSES];
+    int count[POOL_CLASSES];
+    LONGLONG hits[POOL_CLASSES];   // Served from the thread's own cache
+    LONGLONG refills[POOL_CLASSES];// Batches taken from the shared pool
+    LONGLONG misses[POOL_CLASSES]; // Blocks allocated from the system
+    LONGLONG returns[POOL_CLASSES];// Batches given back to the shared pool
+    LONGLONG oversized;            // Allocations larger than every class
+} PoolCache;
+
+// Full batches shared by all threads
+typedef struct {
+    CRITICAL_SECTION lock;
+    PoolBlock* batches;
+    int batch_count;
+    int max_batches;
+    LONGLONG released;             // Batches freed to the system at the limit
+} SharedClass;
+
+int pool_enabled = 1;
+
+static const int class_sizes[POOL_CLASSES] = {
+    128, 256, 512, 1024, 2048, 4096, 8192, 16384, 32768, 66560
+};
+static int batch_sizes[POOL_CLASSES];
+static SharedClass shared[POOL_CLASSES];
+
+static PoolCache* volatile caches = NULL;
+static __thread PoolCache* thread_cache = NULL;
+
+void pool_init() {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        int batch = BATCH_BYTES / class_sizes[c];
+        if (batch < 2) batch = 2;
+        if (batch > MAX_BATCH) batch = MAX_BATCH;
+        batch_sizes[c] = batch;
+        
+        InitializeCriticalSection(&shared[c].lock);
+        shared[c].max_batches = SHARED_BYTES_PER_CLASS / (batch * class_sizes[c]);
+        if (shared[c].max_batches < 1) shared[c].max_batches = 1;
+    }
+}
+
+static int size_class(int size) {
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        if (size <= class_sizes[c]) return c;
+    }
+    return -1;
+}
+
+static PoolCache* acquire_cache() {
+    for (PoolCache* cache = caches; cache != NULL; cache = cache->next) {
+        if (cache->in_use == 0 && InterlockedCompareExchange(&cache->in_use, 1, 0) == 0) {
+            return cache;
+        }
+    }
+    
+    PoolCache* cache = (PoolCache*)calloc(1, sizeof(PoolCache));
+    if (cache == NULL) return NULL;
+    cache->in_use = 1;
+    
+    PoolCache* head;
+    do {
+        head = caches;
+        cache->next = head;
+    } while (InterlockedCompareExchangePointer((PVOID volatile*)&caches, cache, head) != head);
+    
+    return cache;
+}
+
+// Moves one batch of blocks from the front of the cache to the shared pool,
+// or back to the system if the pool already holds its limit
+static void return_batch(PoolCache* cache, int c) {
+    PoolBlock* head = cache->blocks[c];
+    PoolBlock* tail = head;
+    for (int i = 1; i < batch_sizes[c]; i++) tail = tail->link.next;
+    cache->blocks[c] = tail->link.next;
+    cache->count[c] -= batch_sizes[c];
+    tail->link.next = NULL;
+    cache->returns[c]++;
+    
+    SharedClass* pool = &shared[c];
+    EnterCriticalSection(&pool->lock);
+    if (pool->batch_count < pool->max_batches) {
+        head->link.next_batch = pool->batches;
+        pool->batches = head;
+        pool->batch_count++;
+        head = NULL;
+    } else {
+        pool->released++;
+    }
+    LeaveCriticalSection(&pool->lock);
+    
+    while (head != NULL) {
+        PoolBlock* next = head->link.next;
+        free(head);
+        head = next;
+    }
+}
+
+// Takes a whole batch from the shared pool into an empty cache list
+static int refill(PoolCache* cache, int c) {
+    SharedClass* pool = &shared[c];
+    EnterCriticalSection(&pool->lock);
+    PoolBlock* batch = pool->batches;
+    if (batch != NULL) {
+        pool->batches = batch->link.next_batch;
+        pool->batch_count--;
+    }
+    LeaveCriticalSection(&pool->lock);
+    if (batch == NULL) return -1;
+    
+    cache->blocks[c] = batch;
+    cache->count[c] = batch_sizes[c];
+    cache->refills[c]++;
+    return 0;
+}
+
+// Returns at least size usable bytes. Blocks of a size class come from the
+// calling thread's cache whenever possible; larger requests, and every
+// request with --no-pool, go to the system allocator.
+void* pool_alloc(int size) {
+    int c = pool_enabled ? size_class(size) : -1;
+    PoolCache* cache = thread_cache;
+    if (c >= 0 && cache == NULL) cache = thread_cache = acquire_cache();
+    if (c < 0 || cache == NULL) {
+        if (cache != NULL) cache->oversized++;
+        PoolBlock* block = (PoolBlock*)malloc(sizeof(PoolBlock) + size);
+        if (block == NULL) return NULL;
+        block->size_class = -1;
+        return block + 1;
+    }
+    
+    PoolBlock* block = cache->blocks[c];
+    if (block != NULL) {
+        cache->hits[c]++;
+    } else if (refill(cache, c) == 0) {
+        block = cache->blocks[c];
+    } else {
+        cache->misses[c]++;
+        block = (PoolBlock*)malloc(sizeof(PoolBlock) + class_sizes[c]);
+        if (block == NULL) return NULL;
+        block->size_class = c;
+        return block + 1;
+    }
+    
+    cache->blocks[c] = block->link.next;
+    cache->count[c]--;
+    block->size_class = c;
+    return block + 1;
+}
+
+// Gives a block back to the calling thread's cache, which need not be the
+// one it came from; a cache that grows past two batches hands one back
+void pool_free(void* data) {
+    if (data == NULL) return;
+    
+    PoolBlock* block = (PoolBlock*)data - 1;
+    int c = block->size_class;
+    PoolCache* cache = thread_cache;
+    if (c >= 0 && cache == NULL) cache = thread_cache = acquire_cache();
+    if (c < 0 || cache == NULL) {
+        free(block);
+        return;
+    }
+    
+    block->link.next = cache->blocks[c];
+    cache->blocks[c] = block;
+    if (++cache->count[c] > 2 * batch_sizes[c]) return_batch(cache, c);
+}
+
+// Called when a thread that allocated messages is about to exit
+void pool_thread_release() {
+    PoolCache* cache = thread_cache;
+    if (cache == NULL) return;
+    
+    for (int c = 0; c < POOL_CLASSES; c++) {
+        while (cache->count[c] >= batch_sizes[c]) return_batch(cache, c);
+        while (cache->blocks[c] != NULL) {
+            PoolBlock* next = cache->blocks[c]->link.next;
+            free(cache->blocks[c]);
+            cache->blocks[c] = next;
+        }
+        cache->count[c] = 0;
+    }
+    InterlockedExchange(&cache->in_use, 0);
+    thread_cache = NULL;
+}
+
+int pool_report(char* out, int size) {
+    if (!pool_enabled) {
+        return snprintf(out, size, "Message buffer pool is disabled (--no-pool); every message uses the system allocator\n");
+    }
+    
+    int len = snprintf(out, size, "Message buffer pool (%d size classes, batches of up to %d KB)\n"
+                       "%8s %12s %10s %10s %10s %10s %10s %9s\n",
+                       POOL_CLASSES, BATCH_BYTES / 1024,
+                       "class", "allocations", "pooled %", "refills", "misses", "returns", "released", "held KB");
+    
+    LONGLONG total_allocations = 0, total_hits = 0, total_held = 0, oversized = 0;
+    for (int c = 0; c < POOL_CLASSES && len < size; c++) {
+        LONGLONG hits = 0, refills = 0, misses = 0, returns = 0, cached = 0;
+        for (PoolCache* cache = caches; cache != NULL; cache = cache->next) {
+            hits += cache->hits[c];
+            refills += cache->refills[c];
+            misses += cache->misses[c];
+            returns += cache->returns[c];
+            cached += cache->count[c];
+        }
+        
+        EnterCriticalSection(&shared[c].lock);
+        cached += (LONGLONG)shared[c].batch_count * batch_sizes[c];
+        LONGLONG released = shared[c].released;
+        LeaveCriticalSection(&shared[c].lock);
+        
+        // Every refill hands out the first block of its batch
+        LONGLONG allocations = hits + refills + misses;
+        LONGLONG held = cached * (class_sizes[c] + (LONGLONG)sizeof(PoolBlock));
+        total_allocations += allocations;
+        total_hits += hits + refills;
+        total_held += held;
+        if (allocations == 0 && held == 0) continue;
+        
+        len += snprintf(out + len, size - len, "%8d %12lld %9.2f%% %10lld %10lld %10lld %10lld %9lld\n",
+                        class_sizes[c], (long long)allocations,
+                        allocations ? 100.0 * (hits + refills) / allocations : 0.0,
+                        (long long)refills, (long long)misses, (long long)returns,
+                        (long long)released, (long long)(held / 1024));
+    }
+    for (PoolCache* cache = caches; cache != NULL; cache = cache->next) oversized += cache->oversized;
+    
+    if (len < size) {
+        len += snprintf(out + len, size - len,
+                        "Total: %lld allocations, %.2f%% without the system allocator, %lld KB held, %lld oversized\n",
+                        (long long)total_allocations,
+                        total_allocations ? 100.0 * total_hits / total_allocations : 0.0,
+                        (long long)(total_held / 1024), (long long)oversized);
+    }
+    return len < size ? len : size - 1;
+}
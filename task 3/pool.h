@@ -0,0 +1,16 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <winsock2.h>
+
+#define POOL_CLASSES 10            // 128 bytes up to one large message chunk
+
+extern int pool_enabled;
+
+void pool_init();
+void* pool_alloc(int size);
+void pool_free(void* block);
+void pool_thread_release();
+int pool_report(char* out, int size);
+
+#endif
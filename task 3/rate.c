@@ -0,0 +1,148 @@
+#include "server.h"
+
+// Global variables
+double publisher_message_rate = 0;
+double publisher_byte_rate = 0;
+int ingress_quantum = DEFAULT_INGRESS_QUANTUM;
+
+static double ticks_per_second = 1.0;
+
+static volatile LONG64 messages_charged = 0;
+static volatile LONG64 throttles = 0;
+static volatile LONG64 throttled_ms = 0;
+static volatile LONG throttled_now = 0;
+
+void rate_init() {
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    ticks_per_second = (double)frequency.QuadPart;
+}
+
+// Starts with a full bucket: one second's worth of messages and bytes
+void rate_limit_init(RateLimit* limit, double message_rate, double byte_rate) {
+    limit->message_rate = message_rate;
+    limit->byte_rate = byte_rate;
+    limit->message_tokens = message_rate;
+    limit->byte_tokens = byte_rate;
+    limit->updated = trace_now();
+}
+
+int rate_limited(const RateLimit* limit) {
+    return limit->message_rate > 0 || limit->byte_rate > 0;
+}
+
+// Accepts "MSGS" or "MSGS:BYTES" per second; 0 leaves a dimension unlimited
+int parse_rate_limit(const char* spec, double* message_rate, double* byte_rate) {
+    char* end;
+    *message_rate = strtod(spec, &end);
+    *byte_rate = 0;
+    if (end == spec || *message_rate < 0) return -1;
+    if (*end == ':') {
+        const char* bytes = end + 1;
+        *byte_rate = strtod(bytes, &end);
+        if (end == bytes || *byte_rate < 0) return -1;
+    }
+    return (*end == '\0' && (*message_rate > 0 || *byte_rate > 0)) ? 0 : -1;
+}
+
+// Takes one message of the given size from the buckets, which may go into
+// debt. Returns how many milliseconds it takes until they are out of debt,
+// 0 if they are not in debt.
+static int charge(RateLimit* limit, int bytes) {
+    LONGLONG now = trace_now();
+    double elapsed = (now - limit->updated) / ticks_per_second;
+    limit->updated = now;
+    
+    double wait = 0;
+    if (limit->message_rate > 0) {
+        limit->message_tokens += elapsed * limit->message_rate;
+        if (limit->message_tokens > limit->message_rate) limit->message_tokens = limit->message_rate;
+        limit->message_tokens -= 1;
+        if (limit->message_tokens < 0) wait = -limit->message_tokens / limit->message_rate;
+    }
+    if (limit->byte_rate > 0) {
+        limit->byte_tokens += elapsed * limit->byte_rate;
+        if (limit->byte_tokens > limit->byte_rate) limit->byte_tokens = limit->byte_rate;
+        limit->byte_tokens -= bytes;
+        if (limit->byte_tokens < 0 && -limit->byte_tokens / limit->byte_rate > wait) {
+            wait = -limit->byte_tokens / limit->byte_rate;
+        }
+    }
+    return (wait > 0) ? (int)(wait * 1000.0) + 1 : 0;
+}
+
+// Charges a message a publisher sent to its own and its topic's buckets.
+// Messages are never dropped: a publisher over either limit has its
+// throttle_ms set, and its worker stops reading from it for that long once
+// the data already received is handled. Called by the owning worker.
+void rate_publish(Client* client, int bytes) {
+    // A publisher's buckets are made on its first message, so subscribers
+    // carry none
+    if (client->limit == NULL && (publisher_message_rate > 0 || publisher_byte_rate > 0)) {
+        client->limit = (RateLimit*)malloc(sizeof(RateLimit));
+        if (client->limit != NULL) rate_limit_init(client->limit, publisher_message_rate, publisher_byte_rate);
+    }
+    
+    int wait = 0;
+    if (client->limit != NULL && rate_limited(client->limit)) wait = charge(client->limit, bytes);
+    
+    TopicPolicy* policy = find_topic_policy(client->topic);
+    if (policy != NULL && rate_limited(&policy->limit)) {
+        EnterCriticalSection(&policy->limit_lock);
+        int topic_wait = charge(&policy->limit, bytes);
+        LeaveCriticalSection(&policy->limit_lock);
+        if (topic_wait > wait) {
+            // Counted once per pause the topic limit starts
+            if (client->throttle_ms == 0) InterlockedIncrement64(&policy->throttles);
+            wait = topic_wait;
+        }
+    }
+    
+    InterlockedIncrement64(&messages_charged);
+    if (wait > client->throttle_ms) client->throttle_ms = wait;
+}
+
+// Bookkeeping of the workers' throttle and resume. Called before the
+// worker marks the client throttled; a throttled client that is charged
+// again only has its pause extended.
+void rate_throttled(Client* client) {
+    InterlockedIncrement64(&throttles);
+    InterlockedAdd64(&throttled_ms, client->throttle_ms);
+    if (!client->throttled) InterlockedIncrement(&throttled_now);
+}
+
+void rate_resumed() {
+    InterlockedDecrement(&throttled_now);
+}
+
+int rate_report(char* out, int size) {
+    char publisher[96];
+    if (publisher_message_rate > 0 || publisher_byte_rate > 0) {
+        snprintf(publisher, sizeof(publisher), "%.0f msg/s, %.0f bytes/s per publisher (0 = unlimited)",
+                 publisher_message_rate, publisher_byte_rate);
+    } else {
+        snprintf(publisher, sizeof(publisher), "no per-publisher limit");
+    }
+    
+    int len = snprintf(out, size,
+                       "Ingress: %s; deficit round-robin quantum %d bytes\n"
+                       "  Messages charged: %lld\n"
+                       "  Throttles: %lld, %lld ms in total; publishers throttled now: %ld\n",
+                       publisher, ingress_quantum, (long long)messages_charged,
+                       (long long)throttles, (long long)throttled_ms, (long)throttled_now);
+    
+    int header = 0;
+    for (int i = 0; i < topic_policy_count && len < size; i++) {
+        TopicPolicy* policy = &topic_policies[i];
+        if (!rate_limited(&policy->limit)) continue;
+        if (!header) {
+            len += snprintf(out + len, size - len, "  %-24s %12s %14s %10s\n", "topic limit", "msg/s", "bytes/s", "throttles");
+            header = 1;
+        }
+        if (len < size) {
+            len += snprintf(out + len, size - len, "  %-24s %12.0f %14.0f %10lld\n", policy->topic,
+                            policy->limit.message_rate, policy->limit.byte_rate, (long long)policy->throttles);
+        }
+    }
+    return len < size ? len : size - 1;
+}
@@ -0,0 +1,520 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#include "capture.h"
+#pragma comment(lib, "ws2_32.lib")
+
+#define BUFFER_SIZE 1024
+#define LINE_BUFFER_SIZE 4096
+#define DRAIN_IDLE_MS 1000
+
+// One captured publisher (capture id and topic) and the replay connection
+// standing in for it
+typedef struct {
+    int capture_id;
+    char topic[256];
+    SOCKET socket;
+    int server_id;                 // Id the server assigned to the replay connection
+    LONGLONG* sent_ticks;          // Send time of each replayed message, in order
+    int message_count;
+    volatile LONG sent;
+} ReplayPublisher;
+
+// One captured subscriber, recreated before the replay starts
+typedef struct {
+    int capture_id;
+    char topic[256];
+    SOCKET socket;
+    char line[LINE_BUFFER_SIZE];
+    int line_len;
+} ReplaySubscriber;
+
+// Outcome of one replay pass
+typedef struct {
+    double publish_rate;           // Messages per second sent
+    LONG64 delivered;
+    double latency_p50;            // Microseconds
+    double latency_p99;
+    double latency_max;
+} ReplayResult;
+
+// Global variables
+const char* server_ip;
+int port;
+int with_subscribers = 1;
+
+char* capture = NULL;
+long capture_size = 0;
+
+ReplayPublisher* publishers = NULL;
+int publisher_count = 0;
+ReplaySubscriber* subscribers = NULL;
+int subscriber_count = 0;
+int* publisher_by_server_id = NULL;
+int max_server_id = 0;
+int* received_counts = NULL;       // [subscriber][publisher] messages received so far
+
+double* latencies_us = NULL;
+volatile LONG64 deliveries = 0;
+LONG64 expected_deliveries = 0;
+volatile LONG64 delivered_bytes = 0;
+volatile LONGLONG last_delivery_ticks = 0;
+volatile int running = 1;
+double us_per_tick;
+
+// Function prototypes
+int load_capture(const char* path);
+int build_topology();
+int replay_pass(double speed, ReplayResult* result);
+ReplayPublisher* find_publisher(int capture_id, const char* topic, int topic_length);
+SOCKET connect_and_register(const char* type, const char* topic, int* server_id);
+unsigned __stdcall receiver_thread(void* arg);
+void handle_delivery(int subscriber, const char* line, int length, LONGLONG now);
+int send_all(SOCKET sock, const char* data, int len);
+LONGLONG now_ticks();
+int compare_doubles(const void* a, const void* b);
+void print_usage(const char* program_name);
+
+int main(int argc, char *argv[]) {
+    if (argc < 4) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    
+    server_ip = argv[1];
+    port = atoi(argv[2]);
+    double speed = 1.0;
+    int baseline = 0;
+    for (int i = 4; i < argc; i++) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            i++;
+            speed = (strcmp(argv[i], "max") == 0) ? 0 : atof(argv[i]);
+            if (speed < 0 || (speed == 0 && strcmp(argv[i], "max") != 0)) {
+                print_usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--baseline") == 0) {
+            baseline = 1;
+        } else if (strcmp(argv[i], "--no-subscribers") == 0) {
+            with_subscribers = 0;
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    
+    if (load_capture(argv[3]) != 0 || build_topology() != 0) return 1;
+    
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2,2), &wsa) != 0) {
+        printf("Failed to initialize Winsock. Error Code : %d\n", WSAGetLastError());
+        return 1;
+    }
+    
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    us_per_tick = 1e6 / (double)frequency.QuadPart;
+    
+    ReplayResult base, run;
+    if (baseline && replay_pass(1.0, &base) != 0) return 1;
+    if (replay_pass(speed, &run) != 0) return 1;
+    
+    // How the requested speed compares with the original traffic shape
+    if (baseline) {
+        printf("delta vs 1x: throughput %.2fx", run.publish_rate / base.publish_rate);
+        if (run.delivered > 0 && base.delivered > 0) {
+            printf(", latency p50 %+.1f us  p99 %+.1f us  max %+.1f us",
+                   run.latency_p50 - base.latency_p50, run.latency_p99 - base.latency_p99,
+                   run.latency_max - base.latency_max);
+        }
+        printf("\n");
+    }
+    
+    WSACleanup();
+    return 0;
+}
+
+// Recreates the topology, replays every publish at the given speed (0 for
+// as fast as possible), prints the results and closes all connections
+int replay_pass(double speed, ReplayResult* result) {
+    memset(result, 0, sizeof(*result));
+    deliveries = 0;
+    delivered_bytes = 0;
+    running = 1;
+    memset(received_counts, 0, (size_t)(subscriber_count > 0 ? subscriber_count : 1) * (publisher_count > 0 ? publisher_count : 1) * sizeof(int));
+    
+    // Recreate the subscriber topology first so every replayed message has
+    // the fan-out it had in production
+    for (int s = 0; s < subscriber_count && with_subscribers; s++) {
+        subscribers[s].socket = connect_and_register("SUBSCRIBER", subscribers[s].topic, NULL);
+        subscribers[s].line_len = 0;
+    }
+    max_server_id = 0;
+    for (int p = 0; p < publisher_count; p++) {
+        publishers[p].socket = connect_and_register("PUBLISHER", publishers[p].topic, &publishers[p].server_id);
+        publishers[p].sent = 0;
+        if (publishers[p].server_id > max_server_id) max_server_id = publishers[p].server_id;
+    }
+    
+    free(publisher_by_server_id);
+    publisher_by_server_id = (int*)malloc((max_server_id + 1) * sizeof(int));
+    if (publisher_by_server_id == NULL) return -1;
+    for (int i = 0; i <= max_server_id; i++) publisher_by_server_id[i] = -1;
+    for (int p = 0; p < publisher_count; p++) publisher_by_server_id[publishers[p].server_id] = p;
+    
+    HANDLE receiver = NULL;
+    if (with_subscribers && subscriber_count > 0) {
+        receiver = (HANDLE)_beginthreadex(NULL, 0, receiver_thread, NULL, 0, NULL);
+    }
+    
+    // Replay the publishes on the original schedule, compressed by speed
+    int publish_count = 0;
+    LONG64 publish_bytes = 0;
+    unsigned long long first_ns = 0, last_ns = 0;
+    double* lag_ms = (double*)malloc((capture_size / sizeof(CaptureRecord) + 1) * sizeof(double));
+    if (lag_ms == NULL) return -1;
+    LONGLONG start = now_ticks();
+    last_delivery_ticks = start;
+    
+    for (long pos = sizeof(CaptureHeader); pos < capture_size; ) {
+        CaptureRecord record;
+        memcpy(&record, capture + pos, sizeof(record));
+        const char* topic = capture + pos + sizeof(record);
+        const char* payload = topic + record.topic_length;
+        pos += (long)sizeof(record) + record.topic_length + record.payload_length;
+        if (record.type != CAPTURE_PUBLISH) continue;
+        
+        if (publish_count == 0) first_ns = record.time_ns;
+        last_ns = record.time_ns;
+        if (speed > 0) {
+            double due_us = (record.time_ns - first_ns) / 1000.0 / speed;
+            double early_us;
+            while ((early_us = due_us - (now_ticks() - start) * us_per_tick) > 0) {
+                if (early_us > 2000) Sleep(1); else SwitchToThread();
+            }
+            lag_ms[publish_count] = ((now_ticks() - start) * us_per_tick - due_us) / 1000.0;
+        }
+        
+        ReplayPublisher* publisher = find_publisher(record.client_id, topic, record.topic_length);
+        publisher->sent_ticks[publisher->sent] = now_ticks();
+        InterlockedIncrement(&publisher->sent);
+        if (send_all(publisher->socket, payload, record.payload_length) != 0) {
+            printf("Send failed for captured publisher %d. Error: %d\n", publisher->capture_id, WSAGetLastError());
+            break;
+        }
+        publish_count++;
+        publish_bytes += record.payload_length;
+    }
+    double replay_seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    
+    // Wait until every delivery arrived or none came for a while
+    while (receiver != NULL && deliveries < expected_deliveries &&
+           (now_ticks() - last_delivery_ticks) * us_per_tick < DRAIN_IDLE_MS * 1000.0) {
+        Sleep(10);
+    }
+    double drain_seconds = (now_ticks() - start) * us_per_tick / 1e6;
+    running = 0;
+    if (receiver != NULL) {
+        WaitForSingleObject(receiver, INFINITE);
+        CloseHandle(receiver);
+    }
+    
+    double capture_seconds = (last_ns - first_ns) / 1e9;
+    result->publish_rate = publish_count / replay_seconds;
+    printf("capture: %d publishes from %d publishers, %d subscribers, %.3f s (%.0f msg/s)\n",
+           publish_count, publisher_count, subscriber_count, capture_seconds,
+           capture_seconds > 0 ? publish_count / capture_seconds : 0.0);
+    if (speed > 0) {
+        printf("replay at %.2fx: ", speed);
+    } else {
+        printf("replay at max speed: ");
+    }
+    printf("%.3f s, %.0f msg/s, %.2f MB/s (%.2fx the captured rate)\n",
+           replay_seconds, result->publish_rate,
+           publish_bytes / replay_seconds / (1024.0 * 1024.0),
+           capture_seconds > 0 ? capture_seconds / replay_seconds : 0.0);
+    
+    if (speed > 0 && publish_count > 0) {
+        qsort(lag_ms, publish_count, sizeof(double), compare_doubles);
+        printf("  schedule lag (ms): p50 %.3f  p99 %.3f  max %.3f\n",
+               lag_ms[publish_count / 2], lag_ms[(int)(publish_count * 0.99)], lag_ms[publish_count - 1]);
+    }
+    free(lag_ms);
+    
+    if (receiver != NULL) {
+        LONG64 got = deliveries;
+        result->delivered = got;
+        printf("deliveries: %lld/%lld in %.3f s (%.0f msg/s, %.2f MB/s)\n",
+               (long long)got, (long long)expected_deliveries, drain_seconds,
+               got / drain_seconds, delivered_bytes / drain_seconds / (1024.0 * 1024.0));
+        if (got > 0) {
+            qsort(latencies_us, got, sizeof(double), compare_doubles);
+            result->latency_p50 = latencies_us[got / 2];
+            result->latency_p99 = latencies_us[(int)(got * 0.99)];
+            result->latency_max = latencies_us[got - 1];
+            printf("  delivery latency (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+                   result->latency_p50, latencies_us[(int)(got * 0.90)],
+                   result->latency_p99, result->latency_max);
+        }
+    }
+    
+    for (int p = 0; p < publisher_count; p++) closesocket(publishers[p].socket);
+    for (int s = 0; s < subscriber_count && with_subscribers; s++) closesocket(subscribers[s].socket);
+    return 0;
+}
+
+int load_capture(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        printf("Cannot open capture file '%s'\n", path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    capture_size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    
+    capture = (char*)malloc(capture_size > 0 ? capture_size : 1);
+    if (capture == NULL || fread(capture, 1, capture_size, file) != (size_t)capture_size) {
+        printf("Cannot read capture file '%s'\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    
+    CaptureHeader header;
+    if (capture_size < (long)sizeof(header)) {
+        printf("'%s' is not a capture file\n", path);
+        return -1;
+    }
+    memcpy(&header, capture, sizeof(header));
+    if (memcmp(header.magic, CAPTURE_MAGIC, sizeof(header.magic)) != 0 || header.version != CAPTURE_VERSION) {
+        printf("'%s' is not a version %d capture file\n", path, CAPTURE_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+// Collects the publishers and subscribers of the capture. A record cut off
+// by a server that stopped mid-write ends the capture.
+int build_topology() {
+    int capacity = 64;
+    publishers = (ReplayPublisher*)calloc(capacity, sizeof(ReplayPublisher));
+    subscribers = (ReplaySubscriber*)calloc(capacity, sizeof(ReplaySubscriber));
+    int subscriber_capacity = capacity;
+    if (publishers == NULL || subscribers == NULL) return -1;
+    
+    long pos = sizeof(CaptureHeader);
+    while (pos + (long)sizeof(CaptureRecord) <= capture_size) {
+        CaptureRecord record;
+        memcpy(&record, capture + pos, sizeof(record));
+        long size = (long)sizeof(record) + record.topic_length + record.payload_length;
+        if (pos + size > capture_size) break;
+        const char* topic = capture + pos + sizeof(record);
+        
+        if (record.type == CAPTURE_PUBLISH) {
+            ReplayPublisher* publisher = find_publisher(record.client_id, topic, record.topic_length);
+            if (publisher == NULL) {
+                if (publisher_count == capacity) {
+                    capacity *= 2;
+                    publishers = (ReplayPublisher*)realloc(publishers, capacity * sizeof(ReplayPublisher));
+                    if (publishers == NULL) return -1;
+                }
+                publisher = &publishers[publisher_count++];
+                memset(publisher, 0, sizeof(*publisher));
+                publisher->capture_id = record.client_id;
+                memcpy(publisher->topic, topic, record.topic_length);
+                publisher->topic[record.topic_length] = '\0';
+            }
+            publisher->message_count++;
+        } else if (record.type == CAPTURE_SUBSCRIBE) {
+            if (subscriber_count == subscriber_capacity) {
+                subscriber_capacity *= 2;
+                subscribers = (ReplaySubscriber*)realloc(subscribers, subscriber_capacity * sizeof(ReplaySubscriber));
+                if (subscribers == NULL) return -1;
+            }
+            ReplaySubscriber* subscriber = &subscribers[subscriber_count++];
+            memset(subscriber, 0, sizeof(*subscriber));
+            subscriber->capture_id = record.client_id;
+            memcpy(subscriber->topic, topic, record.topic_length);
+            subscriber->topic[record.topic_length] = '\0';
+        }
+        pos += size;
+    }
+    capture_size = pos;
+    
+    for (int p = 0; p < publisher_count; p++) {
+        ReplayPublisher* publisher = &publishers[p];
+        publisher->sent_ticks = (LONGLONG*)malloc(publisher->message_count * sizeof(LONGLONG));
+        if (publisher->sent_ticks == NULL) return -1;
+        
+        // Every subscriber of the topic receives every message of the publisher
+        for (int s = 0; s < subscriber_count && with_subscribers; s++) {
+            if (strcmp(subscribers[s].topic, publisher->topic) == 0) {
+                expected_deliveries += publisher->message_count;
+            }
+        }
+    }
+    
+    received_counts = (int*)calloc((size_t)(subscriber_count > 0 ? subscriber_count : 1) * (publisher_count > 0 ? publisher_count : 1), sizeof(int));
+    latencies_us = (double*)malloc((expected_deliveries > 0 ? expected_deliveries : 1) * sizeof(double));
+    if (received_counts == NULL || latencies_us == NULL) {
+        printf("Out of memory\n");
+        return -1;
+    }
+    return 0;
+}
+
+ReplayPublisher* find_publisher(int capture_id, const char* topic, int topic_length) {
+    for (int p = 0; p < publisher_count; p++) {
+        if (publishers[p].capture_id == capture_id &&
+            (int)strlen(publishers[p].topic) == topic_length &&
+            memcmp(publishers[p].topic, topic, topic_length) == 0) {
+            return &publishers[p];
+        }
+    }
+    return NULL;
+}
+
+SOCKET connect_and_register(const char* type, const char* topic, int* server_id) {
+    SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+    
+    struct sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    inet_pton(AF_INET, server_ip, &server_addr.sin_addr);
+    
+    if (sock == INVALID_SOCKET || connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        printf("Connection to port %d failed. Error: %d\n", port, WSAGetLastError());
+        exit(1);
+    }
+    
+    char message[300];
+    snprintf(message, sizeof(message), "%s:%s\n", type, topic);
+    send_all(sock, message, strlen(message));
+    
+    // "OK <id>" carries the id subscribers will see in "Publisher <id>:"
+    char reply[64];
+    int len = 0;
+    char c;
+    do {
+        if (recv(sock, &c, 1, 0) <= 0) {
+            printf("Registration of %s:%s failed\n", type, topic);
+            exit(1);
+        }
+        if (len < (int)sizeof(reply) - 1) reply[len++] = c;
+    } while (c != '\n');
+    reply[len] = '\0';
+    
+    if (strncmp(reply, "OK ", 3) != 0) {
+        printf("Registration of %s:%s refused: %s", type, topic, reply);
+        exit(1);
+    }
+    if (server_id != NULL) *server_id = atoi(reply + 3);
+    return sock;
+}
+
+// Reads every recreated subscriber and times each delivery against the
+// moment its message was replayed
+unsigned __stdcall receiver_thread(void* arg) {
+    (void)arg;
+    WSAPOLLFD* fds = (WSAPOLLFD*)malloc(subscriber_count * sizeof(WSAPOLLFD));
+    char buffer[16 * BUFFER_SIZE];
+    if (fds == NULL) return 1;
+    
+    for (int s = 0; s < subscriber_count; s++) {
+        fds[s].fd = subscribers[s].socket;
+        fds[s].events = POLLRDNORM;
+    }
+    
+    while (running) {
+        for (int s = 0; s < subscriber_count; s++) fds[s].revents = 0;
+        if (WSAPoll(fds, subscriber_count, 100) <= 0) continue;
+        
+        for (int s = 0; s < subscriber_count; s++) {
+            if (fds[s].revents == 0) continue;
+            
+            int bytes_received = recv(fds[s].fd, buffer, sizeof(buffer), 0);
+            if (bytes_received <= 0) {
+                fds[s].fd = INVALID_SOCKET;  // Negative descriptors are ignored by WSAPoll
+                continue;
+            }
+            LONGLONG now = now_ticks();
+            last_delivery_ticks = now;
+            
+            ReplaySubscriber* subscriber = &subscribers[s];
+            for (int i = 0; i < bytes_received; i++) {
+                if (subscriber->line_len < LINE_BUFFER_SIZE) subscriber->line[subscriber->line_len++] = buffer[i];
+                if (buffer[i] == '\n') {
+                    handle_delivery(s, subscriber->line, subscriber->line_len, now);
+                    subscriber->line_len = 0;
+                }
+            }
+        }
+    }
+    
+    free(fds);
+    return 0;
+}
+
+// Lines look like "[TOPIC] Publisher <id>: payload". Messages of one
+// publisher arrive in the order they were sent, so the n-th line from it
+// is its n-th replayed message.
+void handle_delivery(int subscriber, const char* line, int length, LONGLONG now) {
+    const char* marker = strstr(line, "] Publisher ");
+    if (marker == NULL || marker >= line + length) return;
+    
+    char* end;
+    int server_id = (int)strtol(marker + 12, &end, 10);
+    if (*end != ':' || server_id < 0 || server_id > max_server_id) return;  // Not ours, or from a peer
+    
+    int p = publisher_by_server_id[server_id];
+    if (p < 0) return;
+    
+    int* count = &received_counts[subscriber * publisher_count + p];
+    if (*count < publishers[p].sent) {
+        LONG64 index = deliveries;
+        latencies_us[index] = (now - publishers[p].sent_ticks[*count]) * us_per_tick;
+        (*count)++;
+        delivered_bytes += length;
+        deliveries = index + 1;
+    }
+}
+
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) return -1;
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+LONGLONG now_ticks() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <SERVER_IP> <PORT> <CAPTURE_FILE> [--speed N|max] [--baseline] [--no-subscribers]\n", program_name);
+    printf("Replays a capture written by 'server.exe --capture' into a server: the\n");
+    printf("captured subscribers are recreated first, then every publish is sent on\n");
+    printf("its original schedule (--speed 1, the default), N times faster, or as\n");
+    printf("fast as possible (--speed max). --baseline replays at 1x first and\n");
+    printf("reports the throughput and latency deltas of the requested speed.\n");
+    printf("Examples:\n");
+    printf("  %s 127.0.0.1 5000 traffic.cap\n", program_name);
+    printf("  %s 127.0.0.1 5000 traffic.cap --speed 10\n", program_name);
+    printf("  %s 127.0.0.1 5000 traffic.cap --speed max --baseline\n", program_name);
+}
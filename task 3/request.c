@@ -0,0 +1,357 @@
+#include "server.h"
+
+#define INITIAL_REQUEST_CAPACITY 1024
+#define HANDLE_SLOT_BITS 24            // Low bits of a handle are the table slot
+
+// A request forwarded to a responder and not yet answered. Live entries are
+// linked in the order they were issued, which is also deadline order since
+// every request gets the same timeout; free entries are chained through next.
+typedef struct {
+    LONGLONG handle;               // 0 while the slot is free
+    int requester;                 // Client id of the requesting connection
+    unsigned int generation;       // Requester's generation when the request was made
+    int responder;                 // Client id of the responder it was sent to
+    ULONGLONG deadline;            // GetTickCount64() value after which it times out
+    char correlation[MAX_CORRELATION_LENGTH];
+    int prev;
+    int next;
+} PendingRequest;
+
+// Global variables
+int request_timeout_ms = DEFAULT_REQUEST_TIMEOUT_MS;
+int max_outstanding = DEFAULT_MAX_OUTSTANDING;
+
+// Lock order: clients_mutex, then requests_lock, then a client's out_lock
+static CRITICAL_SECTION requests_lock;
+static PendingRequest* table = NULL;
+static int capacity = 0;
+static int free_head = -1;
+static int oldest = -1;
+static int newest = -1;
+static int pending_count = 0;
+static LONGLONG next_serial = 0;
+
+// Per client slot, so requests of a closed connection are recognised
+static unsigned int* generations = NULL;
+static int* outstanding = NULL;
+
+// Client ids of all responders and the round-robin position, under clients_mutex
+static int* responders = NULL;
+static int responder_count = 0;
+static int responder_cursor = 0;
+
+// Set for the deadline of the oldest request while any is pending
+static Timer expiry;
+static int started = 0;
+
+static LONGLONG requests_total = 0;
+static LONGLONG replies_total = 0;
+static LONGLONG timeouts_total = 0;
+static LONGLONG rejected_total = 0;    // No responder or too many outstanding
+static LONGLONG abandoned_total = 0;   // Responder disconnected
+static LONGLONG late_replies = 0;
+
+static void expire_requests(Timer* timer);
+
+int start_requests() {
+    InitializeCriticalSection(&requests_lock);
+    generations = (unsigned int*)calloc(max_clients, sizeof(unsigned int));
+    outstanding = (int*)calloc(max_clients, sizeof(int));
+    responders = (int*)malloc(max_clients * sizeof(int));
+    if (generations == NULL || outstanding == NULL || responders == NULL) {
+        printf("Failed to allocate request tracking for %d clients\n", max_clients);
+        return -1;
+    }
+    
+    timer_init(&expiry, expire_requests, NULL);
+    started = 1;
+    return 0;
+}
+
+void stop_requests() {
+    if (!started) return;
+    
+    started = 0;
+    timer_cancel(&expiry);
+    DeleteCriticalSection(&requests_lock);
+    free(table);
+    free(generations);
+    free(outstanding);
+    free(responders);
+}
+
+// Doubles the table, chaining the new slots onto the free list
+static int grow_table() {
+    int grown = capacity ? capacity * 2 : INITIAL_REQUEST_CAPACITY;
+    if (grown > (1 << HANDLE_SLOT_BITS)) return -1;
+    
+    PendingRequest* resized = (PendingRequest*)realloc(table, grown * sizeof(PendingRequest));
+    if (resized == NULL) return -1;
+    
+    for (int i = capacity; i < grown; i++) {
+        resized[i].handle = 0;
+        resized[i].next = (i + 1 < grown) ? i + 1 : free_head;
+    }
+    free_head = capacity;
+    table = resized;
+    capacity = grown;
+    return 0;
+}
+
+static PendingRequest* find_pending(LONGLONG handle) {
+    int index = (int)(handle & ((1 << HANDLE_SLOT_BITS) - 1));
+    if (handle <= 0 || index >= capacity || table[index].handle != handle) return NULL;
+    return &table[index];
+}
+
+// Records a request and returns its handle, or 0 if the requester already
+// has max_outstanding requests in flight or the table cannot grow
+static LONGLONG add_pending(Client* requester, Client* responder, const char* correlation, int length) {
+    if (outstanding[requester->id] >= max_outstanding) return 0;
+    if (free_head < 0 && grow_table() != 0) return 0;
+    
+    int index = free_head;
+    PendingRequest* request = &table[index];
+    free_head = request->next;
+    
+    request->handle = (++next_serial << HANDLE_SLOT_BITS) | index;
+    request->requester = requester->id;
+    request->generation = generations[requester->id];
+    request->responder = responder->id;
+    request->deadline = GetTickCount64() + request_timeout_ms;
+    memcpy(request->correlation, correlation, length);
+    request->correlation[length] = '\0';
+    
+    request->prev = newest;
+    request->next = -1;
+    if (newest >= 0) table[newest].next = index; else oldest = index;
+    newest = index;
+    
+    // Later requests expire after this one, so only the first needs the timer
+    if (oldest == index) timer_set(&expiry, request_timeout_ms);
+    
+    outstanding[requester->id]++;
+    pending_count++;
+    return request->handle;
+}
+
+static void remove_pending(PendingRequest* request) {
+    int index = (int)(request - table);
+    if (request->prev >= 0) table[request->prev].next = request->next; else oldest = request->next;
+    if (request->next >= 0) table[request->next].prev = request->prev; else newest = request->prev;
+    
+    if (request->generation == generations[request->requester]) {
+        outstanding[request->requester]--;
+    }
+    request->handle = 0;
+    request->next = free_head;
+    free_head = index;
+    pending_count--;
+}
+
+// Queues "TAG ID TEXT\n" for a client. Called with clients_mutex held.
+static void deliver_line(Client* client, const char* tag, const char* id, const char* text, int length) {
+    while (length > 0 && (text[length - 1] == '\n' || text[length - 1] == '\r')) length--;
+    
+    int size = (int)strlen(id) + length + 16;
+    Message* message = message_create(size);
+    if (message == NULL) return;
+    
+    message->length = snprintf(message->data, size, "%s %s%s%.*s\n",
+                               tag, id, length > 0 ? " " : "", length, text);
+    deliver_to_client(client, message);
+    message_release(message);
+}
+
+// The requester is told why its request failed, unless it is gone.
+// Called with clients_mutex and requests_lock held.
+static void fail_pending(PendingRequest* request, const char* reason) {
+    Client* requester = &clients[request->requester];
+    if (request->generation == generations[request->requester] && requester->type == CLIENT_REQUESTER) {
+        deliver_line(requester, "ERR", request->correlation, reason, (int)strlen(reason));
+    }
+    remove_pending(request);
+}
+
+// Next responder of the topic after the previous pick. Only registered
+// responders are scanned, not every client slot. Called with clients_mutex held.
+static Client* pick_responder(const char* topic) {
+    for (int n = 1; n <= responder_count; n++) {
+        int i = (responder_cursor + n) % responder_count;
+        Client* client = &clients[responders[i]];
+        if (!client->slow && strcmp(client->topic, topic) == 0) {
+            responder_cursor = i;
+            return client;
+        }
+    }
+    return NULL;
+}
+
+// A requester line is "<CORRELATION_ID> <payload>". The request goes to one
+// responder of the topic as "REQ <handle> <payload>"; the requester later
+// receives "REP <CORRELATION_ID> <reply>" or "ERR <CORRELATION_ID> <reason>".
+int handle_request(Client* client, const char* line, int length) {
+    int id_len = 0;
+    while (id_len < length && line[id_len] != ' ' && line[id_len] != '\r' && line[id_len] != '\n') {
+        id_len++;
+    }
+    const char* payload = line + id_len;
+    int payload_len = length - id_len;
+    if (payload_len > 0 && *payload == ' ') {
+        payload++;
+        payload_len--;
+    }
+    
+    char correlation[MAX_CORRELATION_LENGTH];
+    int valid = (id_len > 0 && id_len < MAX_CORRELATION_LENGTH);
+    snprintf(correlation, sizeof(correlation), "%.*s", valid ? id_len : 1, valid ? line : "-");
+    
+    EnterCriticalSection(&clients_mutex);
+    if (client->socket == INVALID_SOCKET) {
+        LeaveCriticalSection(&clients_mutex);
+        return 0;
+    }
+    
+    const char* error = NULL;
+    LONGLONG handle = 0;
+    Client* responder = valid ? pick_responder(client->topic) : NULL;
+    if (!valid) {
+        error = "BAD_REQUEST";
+    } else if (responder == NULL) {
+        error = "NO_RESPONDER";
+    } else {
+        EnterCriticalSection(&requests_lock);
+        handle = add_pending(client, responder, correlation, id_len);
+        if (handle != 0) requests_total++;
+        LeaveCriticalSection(&requests_lock);
+        if (handle == 0) error = "BUSY";
+    }
+    
+    if (error != NULL) {
+        EnterCriticalSection(&requests_lock);
+        rejected_total++;
+        LeaveCriticalSection(&requests_lock);
+        deliver_line(client, "ERR", correlation, error, (int)strlen(error));
+    } else {
+        char id[24];
+        snprintf(id, sizeof(id), "%lld", (long long)handle);
+        deliver_line(responder, "REQ", id, payload, payload_len);
+    }
+    LeaveCriticalSection(&clients_mutex);
+    
+    if (verbose) {
+        printf("[%s] Request %s from client %d %s%s\n", client->topic, correlation, client->id,
+               error ? "failed: " : "sent to responder ", error ? error : "");
+    }
+    return 1;
+}
+
+// A responder line is "<handle> <reply>". The reply is routed straight back
+// to the connection that made the request.
+int handle_reply(Client* client, const char* line, int length) {
+    LONGLONG handle = 0;
+    int pos = 0;
+    while (pos < length && line[pos] >= '0' && line[pos] <= '9' && handle < ((LONGLONG)1 << 60)) {
+        handle = handle * 10 + (line[pos++] - '0');
+    }
+    const char* payload = line + pos;
+    int payload_len = length - pos;
+    if (payload_len > 0 && *payload == ' ') {
+        payload++;
+        payload_len--;
+    }
+    
+    EnterCriticalSection(&clients_mutex);
+    EnterCriticalSection(&requests_lock);
+    PendingRequest* request = find_pending(handle);
+    if (request == NULL || request->responder != client->id) {
+        late_replies++;   // Timed out already, or not this responder's request
+        LeaveCriticalSection(&requests_lock);
+        LeaveCriticalSection(&clients_mutex);
+        return 1;
+    }
+    
+    Client* requester = &clients[request->requester];
+    if (request->generation == generations[request->requester] && requester->type == CLIENT_REQUESTER) {
+        deliver_line(requester, "REP", request->correlation, payload, payload_len);
+    }
+    remove_pending(request);
+    replies_total++;
+    LeaveCriticalSection(&requests_lock);
+    LeaveCriticalSection(&clients_mutex);
+    return 1;
+}
+
+// Called by register_client with clients_mutex held once a responder's
+// topic is set
+void request_responder_added(Client* client) {
+    responders[responder_count++] = client->id;
+}
+
+// Called by remove_client with clients_mutex held. Replies for a closed
+// requester are discarded; requests held by a closed responder fail at once
+// instead of waiting for their timeout.
+void request_client_gone(Client* client) {
+    EnterCriticalSection(&requests_lock);
+    generations[client->id]++;
+    outstanding[client->id] = 0;
+    
+    if (client->type == CLIENT_RESPONDER) {
+        for (int i = 0; i < responder_count; i++) {
+            if (responders[i] == client->id) {
+                responders[i] = responders[--responder_count];
+                break;
+            }
+        }
+        
+        for (int i = oldest; i >= 0; ) {
+            PendingRequest* request = &table[i];
+            i = request->next;
+            if (request->responder == client->id) {
+                fail_pending(request, "RESPONDER_GONE");
+                abandoned_total++;
+            }
+        }
+    }
+    LeaveCriticalSection(&requests_lock);
+}
+
+// Fails requests past their deadline and sets the timer for the next one.
+// Runs on the timer thread when the oldest request may have expired; the
+// oldest is checked first without clients_mutex, since it is usually
+// answered by then.
+static void expire_requests(Timer* timer) {
+    ULONGLONG now = GetTickCount64();
+    
+    EnterCriticalSection(&requests_lock);
+    int due = (oldest >= 0 && table[oldest].deadline <= now);
+    LeaveCriticalSection(&requests_lock);
+    
+    if (due) {
+        EnterCriticalSection(&clients_mutex);
+        EnterCriticalSection(&requests_lock);
+        while (oldest >= 0 && table[oldest].deadline <= now) {
+            fail_pending(&table[oldest], "TIMEOUT");
+            timeouts_total++;
+        }
+        LeaveCriticalSection(&requests_lock);
+        LeaveCriticalSection(&clients_mutex);
+    }
+    
+    EnterCriticalSection(&requests_lock);
+    if (oldest >= 0) timer_set(timer, (int)(table[oldest].deadline - now));
+    LeaveCriticalSection(&requests_lock);
+}
+
+int request_report(char* out, int size) {
+    EnterCriticalSection(&requests_lock);
+    int len = snprintf(out, size,
+                       "Requests: %lld forwarded, %lld answered, %lld timed out, %lld rejected, "
+                       "%lld lost their responder, %lld late replies, %d pending\n"
+                       "(timeout %d ms, at most %d outstanding per connection)\n",
+                       (long long)requests_total, (long long)replies_total, (long long)timeouts_total,
+                       (long long)rejected_total, (long long)abandoned_total, (long long)late_replies,
+                       pending_count, request_timeout_ms, max_outstanding);
+    LeaveCriticalSection(&requests_lock);
+    return len;
+}
@@ -0,0 +1,301 @@
+#include "server.h"
+
+#define ROUTE_QUEUE_SIZE 4096      // Messages waiting for one router thread before its publishers are paused
+
+// A message of a partitioned topic waiting to be fanned out
+typedef struct {
+    Message* message;
+    char topic[MAX_TOPIC_LENGTH];
+    int sender_id;
+    int traced;
+    MessageTrace trace;
+} RouteEntry;
+
+// A publisher a full lane stopped reading from, by its slot and the
+// slot's generation then
+typedef struct {
+    int id;
+    LONG generation;
+} PausedPublisher;
+
+// One router thread and its queue. All messages of a key, and all unkeyed
+// ones of a publisher, go through the same lane, which fans them out one
+// at a time in the order they came; different lanes run side by side.
+typedef struct {
+    int index;
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE ready;      // Entries were queued
+    CONDITION_VARIABLE space;      // Entries were taken
+    RouteEntry* entries;           // Ring, ROUTE_QUEUE_SIZE entries until a full queue grows it
+    int capacity;
+    int head;
+    int count;
+    int busy;                      // Fanning out the entry it took last
+    PausedPublisher* paused;       // Not read from until the queue is down to half
+    int paused_count;
+    int paused_capacity;
+    LONG64 routed;
+    int deepest;
+    LONG64 pauses;                 // Publishers paused by a full queue
+    LONG64 waits;                  // Publishes from outside the workers that waited for room
+} RouteLane;
+
+// Global variables
+int route_threads = 0;             // --route-threads, 0 = one per worker
+
+static RouteLane* lanes = NULL;
+static int lane_count = 0;
+static volatile int stopping = 0;
+static volatile LONG64 keyed = 0;
+static volatile LONG64 unkeyed = 0;
+
+// route_unpinned sleeps on pins_released until the router threads are done
+// with a client
+static CRITICAL_SECTION pins_lock;
+static CONDITION_VARIABLE pins_released;
+static volatile LONG unpin_waiters = 0;
+
+static unsigned __stdcall router_thread(void* arg);
+
+// Starts the router threads when some topic is partitioned
+int start_routers() {
+    int partitioned = 0;
+    for (int i = 0; i < topic_policy_count; i++) partitioned += topic_policies[i].partitioned;
+    if (partitioned == 0) return 0;
+    
+    InitializeCriticalSection(&pins_lock);
+    InitializeConditionVariable(&pins_released);
+    
+    int count = (route_threads > 0) ? route_threads : worker_count;
+    lanes = (RouteLane*)calloc(count, sizeof(RouteLane));
+    if (lanes == NULL) {
+        printf("Out of memory for %d router threads\n", count);
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        RouteLane* lane = &lanes[i];
+        lane->index = i;
+        lane->entries = (RouteEntry*)malloc(ROUTE_QUEUE_SIZE * sizeof(RouteEntry));
+        lane->capacity = ROUTE_QUEUE_SIZE;
+        InitializeCriticalSection(&lane->lock);
+        InitializeConditionVariable(&lane->ready);
+        InitializeConditionVariable(&lane->space);
+        if (lane->entries != NULL) lane->thread = (HANDLE)_beginthreadex(NULL, 0, router_thread, lane, 0, NULL);
+        if (lane->thread == NULL) {
+            printf("Failed to create router thread %d\n", i);
+            lane_count = i + 1;
+            stop_routers();
+            return -1;
+        }
+        lane_count = i + 1;
+    }
+    return 0;
+}
+
+void stop_routers() {
+    if (lanes == NULL) return;
+    
+    stopping = 1;
+    for (int i = 0; i < lane_count; i++) {
+        RouteLane* lane = &lanes[i];
+        EnterCriticalSection(&lane->lock);
+        WakeAllConditionVariable(&lane->ready);
+        WakeAllConditionVariable(&lane->space);
+        LeaveCriticalSection(&lane->lock);
+        if (lane->thread != NULL) {
+            WaitForSingleObject(lane->thread, INFINITE);
+            CloseHandle(lane->thread);
+        }
+        for (; lane->count > 0; lane->count--) {
+            message_release(lane->entries[lane->head].message);
+            lane->head = (lane->head + 1) % lane->capacity;
+        }
+        DeleteCriticalSection(&lane->lock);
+        free(lane->entries);
+        free(lane->paused);
+    }
+    free(lanes);
+    lanes = NULL;
+    lane_count = 0;
+}
+
+// Doubles a full ring. Called with the lane's lock held.
+static int grow_lane(RouteLane* lane) {
+    RouteEntry* entries = (RouteEntry*)malloc(2 * lane->capacity * sizeof(RouteEntry));
+    if (entries == NULL) return -1;
+    for (int i = 0; i < lane->count; i++) entries[i] = lane->entries[(lane->head + i) % lane->capacity];
+    free(lane->entries);
+    lane->entries = entries;
+    lane->head = 0;
+    lane->capacity *= 2;
+    return 0;
+}
+
+// Stops reading from a publisher whose message found its lane full, as a
+// full chunk window does; the router thread has its worker read again
+// once the lane is down to half. A session's connection is the one paused.
+// Called by the publisher's worker with the lane's lock held.
+static void pause_publisher(RouteLane* lane, int sender_id) {
+    Client* publisher = &clients[sender_id];
+    if (publisher->carrier >= 0) publisher = &clients[publisher->carrier];
+    for (int i = 0; i < lane->paused_count; i++) {
+        if (lane->paused[i].id == publisher->id && lane->paused[i].generation == publisher->generation) return;
+    }
+    
+    if (lane->paused_count == lane->paused_capacity) {
+        int capacity = lane->paused_capacity ? lane->paused_capacity * 2 : 16;
+        PausedPublisher* paused = (PausedPublisher*)realloc(lane->paused, capacity * sizeof(PausedPublisher));
+        if (paused == NULL) return;   // It goes on publishing; the ring grows instead
+        lane->paused = paused;
+        lane->paused_capacity = capacity;
+    }
+    lane->paused[lane->paused_count].id = publisher->id;
+    lane->paused[lane->paused_count].generation = publisher->generation;
+    lane->paused_count++;
+    lane->pauses++;
+    set_reading(publisher, 0);
+}
+
+// Queues a message of a partitioned topic for the router thread of its key,
+// or of its publisher when it has none, and takes over the caller's
+// reference. A full lane still takes the message, so the publisher's worker
+// never waits, and pauses the publisher; threads outside the workers, such
+// as peer links, wait for room instead. Returns 0 for other topics, which
+// the caller fans out itself.
+int route_message(Message* message, const char* topic, int sender_id, const MessageTrace* trace) {
+    if (lane_count == 0) return 0;
+    TopicPolicy* policy = find_topic_policy(topic);
+    if (policy == NULL || !policy->partitioned) return 0;
+    
+    // Chunks have no header and go with their publisher's other messages
+    UINT64 key = (message->wire.magic == WIRE_MAGIC) ? message->wire.key : 0;
+    UINT64 hash = (key != 0) ? key : (UINT64)(UINT32)sender_id;
+    InterlockedIncrement64(key != 0 ? &keyed : &unkeyed);
+    RouteLane* lane = &lanes[(int)(((hash * 0x9E3779B97F4A7C15ULL) >> 32) % (UINT64)lane_count)];
+    
+    EnterCriticalSection(&lane->lock);
+    if (lane->count >= ROUTE_QUEUE_SIZE && sender_id >= 0) {
+        pause_publisher(lane, sender_id);
+    } else if (lane->count >= ROUTE_QUEUE_SIZE) {
+        lane->waits++;
+        while (lane->count >= ROUTE_QUEUE_SIZE && !stopping) SleepConditionVariableCS(&lane->space, &lane->lock, INFINITE);
+    }
+    
+    // Without memory to grow, even a worker waits
+    while (lane->count == lane->capacity && !stopping && grow_lane(lane) != 0) {
+        lane->waits++;
+        SleepConditionVariableCS(&lane->space, &lane->lock, INFINITE);
+    }
+    if (stopping) {
+        LeaveCriticalSection(&lane->lock);
+        message_release(message);
+        return 1;
+    }
+    
+    RouteEntry* entry = &lane->entries[(lane->head + lane->count) % lane->capacity];
+    entry->message = message;
+    strncpy(entry->topic, topic, MAX_TOPIC_LENGTH - 1);
+    entry->topic[MAX_TOPIC_LENGTH - 1] = '\0';
+    entry->sender_id = sender_id;
+    entry->traced = (trace != NULL);
+    if (trace != NULL) entry->trace = *trace;
+    lane->count++;
+    if (lane->count > lane->deepest) lane->deepest = lane->count;
+    WakeConditionVariable(&lane->ready);
+    LeaveCriticalSection(&lane->lock);
+    return 1;
+}
+
+// Fans out its lane's messages one at a time; fan_out writes to the
+// subscribers it selected after releasing clients_mutex, so lanes only
+// contend for the lock while selecting
+static unsigned __stdcall router_thread(void* arg) {
+    RouteLane* lane = (RouteLane*)arg;
+    RouteEntry entry;
+    
+    EnterCriticalSection(&lane->lock);
+    while (1) {
+        while (lane->count == 0 && !stopping) SleepConditionVariableCS(&lane->ready, &lane->lock, INFINITE);
+        if (stopping) break;
+        
+        entry = lane->entries[lane->head];
+        lane->head = (lane->head + 1) % lane->capacity;
+        lane->count--;
+        lane->busy = 1;
+        WakeConditionVariable(&lane->space);
+        
+        // Its worker drops the request of a publisher that left meanwhile
+        if (lane->paused_count > 0 && lane->count <= ROUTE_QUEUE_SIZE / 2) {
+            for (int i = 0; i < lane->paused_count; i++) request_read(&clients[lane->paused[i].id], lane->paused[i].generation);
+            lane->paused_count = 0;
+        }
+        LeaveCriticalSection(&lane->lock);
+        
+        fan_out(entry.message, entry.topic, entry.sender_id, entry.traced ? &entry.trace : NULL, 1);
+        
+        EnterCriticalSection(&lane->lock);
+        lane->busy = 0;
+        lane->routed++;
+    }
+    LeaveCriticalSection(&lane->lock);
+    return 0;
+}
+
+// Messages queued for or being fanned out by the router threads
+int routes_pending() {
+    int pending = 0;
+    for (int i = 0; i < lane_count; i++) {
+        EnterCriticalSection(&lanes[i].lock);
+        pending += lanes[i].count + lanes[i].busy;
+        LeaveCriticalSection(&lanes[i].lock);
+    }
+    return pending;
+}
+
+// Ends a router thread's write to a client pinned by fan_out
+void route_unpin(Client* client) {
+    if (InterlockedDecrement(&client->pins) != 0 || unpin_waiters == 0) return;
+    
+    EnterCriticalSection(&pins_lock);
+    WakeAllConditionVariable(&pins_released);
+    LeaveCriticalSection(&pins_lock);
+}
+
+// Waits until no router thread is writing to the client. Called with
+// clients_mutex held, so no fan-out can pin it meanwhile; the router
+// threads finish with pinned clients without taking it, and a write
+// they are in never blocks, so the wait is short. It sleeps rather than
+// spins, leaving the CPU to the router thread.
+void route_unpinned(Client* client) {
+    if (client->pins == 0) return;
+    
+    EnterCriticalSection(&pins_lock);
+    InterlockedIncrement(&unpin_waiters);
+    while (client->pins > 0) SleepConditionVariableCS(&pins_released, &pins_lock, INFINITE);
+    InterlockedDecrement(&unpin_waiters);
+    LeaveCriticalSection(&pins_lock);
+}
+
+int route_report(char* out, int size) {
+    if (lane_count == 0) {
+        return snprintf(out, size, "Partitioned routing: off; no --partition topics\n");
+    }
+    
+    int len = snprintf(out, size, "Partitioned routing: %d router threads for", lane_count);
+    for (int i = 0; i < topic_policy_count && len < size; i++) {
+        if (topic_policies[i].partitioned) len += snprintf(out + len, size - len, " %s", topic_policies[i].topic);
+    }
+    if (len < size) {
+        len += snprintf(out + len, size - len, "\n  Messages: %lld by key, %lld without one (by publisher)\n",
+                        (long long)keyed, (long long)unkeyed);
+    }
+    for (int i = 0; i < lane_count && len < size; i++) {
+        RouteLane* lane = &lanes[i];
+        EnterCriticalSection(&lane->lock);
+        len += snprintf(out + len, size - len, "  Router %d: %lld fanned out, %d queued, %d at most; publishers paused %lld times, %lld waits\n",
+                        i, (long long)lane->routed, lane->count, lane->deepest, (long long)lane->pauses, (long long)lane->waits);
+        LeaveCriticalSection(&lane->lock);
+    }
+    return len < size ? len : size - 1;
+}
@@ -1,91 +1,117 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <winsock2.h>
-#include <ws2tcpip.h>
-#include <process.h>
+#include "server.h"
 #pragma comment(lib, "ws2_32.lib")
 
-#define BUFFER_SIZE 1024
-#define MAX_CLIENTS 50
-#define MAX_TOPIC_LENGTH 64
+// Global variables
+Client* clients = NULL;
+int max_clients = DEFAULT_MAX_CLIENTS;
+volatile LONG client_count = 0;
+CRITICAL_SECTION clients_mutex;
+
+int verbose = 1;
+int worker_count = 0;
+int listen_backlog = SOMAXCONN;
 
-typedef enum {
-    CLIENT_UNKNOWN = 0,
-    CLIENT_PUBLISHER = 1,
-    CLIENT_SUBSCRIBER = 2
-} ClientType;
+int send_buffer_size = 0;
+const char* capture_path = NULL;
+int takeover = 0;
+SOCKET listen_socket = INVALID_SOCKET;
+int stats_interval = 0;            // --stats-interval in seconds, 0 = off
+Timer stats_timer;
 
+// Delivery settings of topics named by --conflate and --priority
+TopicPolicy topic_policies[MAX_TOPIC_POLICIES];
+int topic_policy_count = 0;
+
+// Free client slots, kept apart from clients_mutex so registering a new
+// connection never waits behind message routing. With --numa each worker
+// owns a partition of partition_size slots on its node, and its free slots
+// are the stack at free_slots + worker * partition_size; otherwise there is
+// a single partition.
+int* free_slots = NULL;
+int* free_counts = NULL;
+int slot_partitions = 1;
+int partition_size = 0;
+LONG64 borrowed_slots = 0;         // Taken from another worker's partition, under slots_mutex
+CRITICAL_SECTION slots_mutex;
+
+// Registered clients of a topic, by wire topic id, under clients_mutex.
+// Fan-out walks the subscriber list and the statistics the active topics,
+// so neither visits every client slot.
 typedef struct {
-    SOCKET socket;
-    struct sockaddr_in address;
-    ClientType type;
-    int id;
-    char ip_str[INET_ADDRSTRLEN];
-    char topic[MAX_TOPIC_LENGTH];
-} Client;
+    int clients;
+    int publishers;
+    int subscribers;
+    int responders;
+    int first_subscriber;          // Slot, -1 for none; the rest follow next_subscriber
+    int active;                    // Position in active_topics while it has clients
+} TopicClients;
 
-// Global variables
-Client clients[MAX_CLIENTS];
-int client_count = 0;
-CRITICAL_SECTION clients_mutex;
+static TopicClients* topic_clients = NULL;
+static int* active_topics = NULL;
+static int active_topic_count = 0;
 
 // Function prototypes
 void initialize_server();
 void cleanup_server();
 SOCKET create_server_socket(int port);
 void display_server_info(int port);
-unsigned __stdcall handle_client(void* arg);
-void broadcast_to_topic_subscribers(const char* message, const char* topic, int sender_id);
-void remove_client(int client_id);
-int add_client(SOCKET client_socket, struct sockaddr_in client_addr);
-void print_client_info(Client* client, const char* action);
-void display_topic_statistics();
-int count_publishers_by_topic(const char* topic);
-int count_subscribers_by_topic(const char* topic);
+int register_client(Client* client, char* buffer, int bytes_received);
+int handle_message(Client* client, char* buffer, int bytes_received);
+int handle_line(Client* client, const char* line, int length, const MessageTrace* ingress);
+TopicPolicy* add_topic_policy(const char* topic);
+int parse_message_priority(const char** payload, int* length, Priority* priority);
+int queue_report(char* out, int size);
+int parse_server_options(int argc, char *argv[]);
+void print_usage(const char* program_name);
+void send_stats_report(Client* client, const char* report);
+void flush_stats(Timer* timer);
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <PORT>\n", argv[0]);
+    if (argc < 2) {
+        print_usage(argv[0]);
         return 1;
     }
-
-    initialize_server();
     
     int port = atoi(argv[1]);
-    SOCKET server_socket = create_server_socket(port);
+    if (parse_server_options(argc, argv) != 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
     
-    display_server_info(port);
+    initialize_server();
+    if (tls_init() != 0 || start_timers() != 0 || start_requests() != 0 || start_routers() != 0 || open_logs() != 0 ||
+        (capture_path != NULL && capture_open(capture_path) != 0)) {
+        cleanup_server();
+        return 1;
+    }
     
-    // Accept connections loop
-    while (1) {
-        struct sockaddr_in client_addr;
-        int addr_len = sizeof(client_addr);
-        
-        SOCKET client_socket = accept(server_socket, (struct sockaddr*)&client_addr, &addr_len);
-        if (client_socket == INVALID_SOCKET) {
-            printf("Accept failed. Error: %d\n", WSAGetLastError());
-            continue;
-        }
-        
-        int client_id = add_client(client_socket, client_addr);
-        if (client_id == -1) {
-            printf("Maximum clients reached. Rejecting connection.\n");
-            closesocket(client_socket);
-            continue;
-        }
-        
-        // Create thread to handle client
-        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, handle_client, &clients[client_id], 0, NULL);
-        if (thread == NULL) {
-            printf("Failed to create thread for client %d\n", client_id);
-            remove_client(client_id);
-        } else {
-            CloseHandle(thread);
-        }
+    // A takeover inherits the listener from the process it replaces
+    SOCKET server_socket = takeover ? INVALID_SOCKET : create_server_socket(port);
+    if (tls_port > 0) tls_listen_socket = create_server_socket(tls_port);
+    
+    display_server_info(port);
+    if (start_workers() != 0) {
+        closesocket(server_socket);
+        cleanup_server();
+        return 1;
+    }
+    if (takeover && (server_socket = take_over(port)) == INVALID_SOCKET) {
+        cleanup_server();
+        return 1;
+    }
+    listen_socket = server_socket;
+    if (open_handoff_socket(port) != 0) printf("Hot restart is not available for this process\n");
+    start_peer_links();
+    if (stats_interval > 0) {
+        timer_init(&stats_timer, flush_stats, NULL);
+        timer_set(&stats_timer, stats_interval * 1000);
     }
     
+    // Accept connections and hand them to the workers
+    run_acceptor(server_socket);
+    
     closesocket(server_socket);
+    if (tls_listen_socket != INVALID_SOCKET) closesocket(tls_listen_socket);
     cleanup_server();
     return 0;
 }
@@ -98,20 +124,63 @@ void initialize_server() {
     }
     
     InitializeCriticalSection(&clients_mutex);
+    InitializeCriticalSection(&slots_mutex);
+    latency_init();
+    pool_init();
+    rate_init();
+    wire_init();
+    dedup_init();
+    initialize_groups();
+    
+    if (busy_poll_init() != 0 || plan_workers() != 0) {
+        printf("Failed to plan %d workers\n", worker_count);
+        exit(1);
+    }
+    slot_partitions = numa_placement ? worker_count : 1;
+    partition_size = (max_clients + slot_partitions - 1) / slot_partitions;
+    
+    clients = allocate_clients(max_clients, partition_size);
+    free_slots = (int*)malloc(max_clients * sizeof(int));
+    free_counts = (int*)calloc(slot_partitions, sizeof(int));
+    topic_clients = (TopicClients*)calloc(MAX_WIRE_TOPICS + 1, sizeof(TopicClients));
+    active_topics = (int*)malloc(MAX_WIRE_TOPICS * sizeof(int));
+    if (clients == NULL || free_slots == NULL || free_counts == NULL || topic_clients == NULL || active_topics == NULL) {
+        printf("Failed to allocate %d client slots\n", max_clients);
+        exit(1);
+    }
+    for (int t = 0; t <= MAX_WIRE_TOPICS; t++) topic_clients[t].first_subscriber = -1;
     
-    // Initialize clients array
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    // Initialize clients array; slots are handed out lowest id first
+    for (int i = 0; i < max_clients; i++) {
         clients[i].socket = INVALID_SOCKET;
         clients[i].type = CLIENT_UNKNOWN;
         clients[i].id = -1;
-        memset(clients[i].topic, 0, MAX_TOPIC_LENGTH);
+        clients[i].carrier = -1;
+        clients[i].pins = 0;
+        clients[i].generation = 0;
+        clients[i].topic = "";
+        InitializeSRWLock(&clients[i].out_lock);
+        liveness_init(&clients[i]);
     }
+    rebuild_free_slots();
     
     printf("=== Topic-Based Publisher-Subscriber Server ===\n");
 }
 
 void cleanup_server() {
+    capture_close();
+    stop_routers();
+    stop_requests();
+    stop_timers();
+    close_logs();
+    cleanup_federation();
+    cleanup_groups();
+    tls_cleanup();
+    DeleteCriticalSection(&slots_mutex);
     DeleteCriticalSection(&clients_mutex);
+    free(free_slots);
+    free(free_counts);
+    free_clients(clients);
     WSACleanup();
 }
 
@@ -138,7 +207,9 @@ SOCKET create_server_socket(int port) {
         exit(1);
     }
     
-    if (listen(server_socket, 5) < 0) {
+    // A deep backlog lets a reconnect storm queue in the kernel instead of
+    // being refused while the acceptor drains it
+    if (listen(server_socket, listen_backlog) < 0) {
         printf("Listen failed. Error: %d\n", WSAGetLastError());
         exit(1);
     }
@@ -162,38 +233,79 @@ void display_server_info(int port) {
     } else {
         printf("Server listening on port %d...\n", port);
     }
+    if (tls_port > 0) printf("TLS on port %d\n", tls_port);
     printf("Supporting topic-based message routing\n");
+    if (federation_peer_count() > 0) {
+        printf("Federation node %d with %d peer(s)\n", node_id, federation_peer_count());
+    }
     printf("Waiting for client connections...\n");
     printf("----------------------------------------\n");
 }
 
-unsigned __stdcall handle_client(void* arg) {
-    Client* client = (Client*)arg;
+// Called by the owning worker whenever the client's socket is readable.
+// Returns 1 to keep polling the client, 0 once it was removed or handed off.
+int handle_client(Client* client) {
     char buffer[BUFFER_SIZE];
-    char message[BUFFER_SIZE + 150];
     
-    print_client_info(client, "Connected");
+    // The payload of a large message chunk goes straight into the message
+    client->last_receive = GetTickCount64();
+    if (client->type == CLIENT_PUBLISHER && chunk_pending(client)) return chunk_receive(client);
+    if (tls_handshaking(client)) return tls_handshake(client);
+    
+    int bytes_received = receive_from_client(client, buffer, BUFFER_SIZE - 1);
+    if (bytes_received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+        return 1;  // Woken for an error or hang-up that recv has not seen yet
+    }
+    
+    if (bytes_received > 0) {
+        client->ingress_bytes = bytes_received;
+        client->ingress_drained = bytes_received < BUFFER_SIZE - 1;
+    }
+    
+    if (client->type == CLIENT_UNKNOWN) {
+        // First, receive client type and topic
+        if (bytes_received <= 0) {
+            if (verbose) print_client_info(client, "Disconnected (failed to receive type and topic)");
+            remove_client(client->id);
+            return 0;
+        }
+        return register_client(client, buffer, bytes_received);
+    }
     
-    // First, receive client type and topic
-    int bytes_received = recv(client->socket, buffer, BUFFER_SIZE - 1, 0);
     if (bytes_received <= 0) {
-        print_client_info(client, "Disconnected (failed to receive type and topic)");
+        if (verbose) {
+            print_client_info(client, "Disconnected");
+        }
         remove_client(client->id);
+        if (verbose) display_topic_statistics();
         return 0;
     }
     
+    return handle_message(client, buffer, bytes_received);
+}
+
+// Parses the "TYPE:TOPIC" registration. Bytes after the first newline belong
+// to the client's message stream.
+int register_client(Client* client, char* buffer, int bytes_received) {
     buffer[bytes_received] = '\0';
     
     // Remove newline if present
+    char* rest = NULL;
+    int rest_len = 0;
     char* newline = strchr(buffer, '\n');
-    if (newline) *newline = '\0';
+    if (newline) {
+        *newline = '\0';
+        rest = newline + 1;
+        rest_len = bytes_received - (int)(rest - buffer);
+    }
     newline = strchr(buffer, '\r');
     if (newline) *newline = '\0';
     
     // Parse type and topic (format: "TYPE:TOPIC")
     char* colon = strchr(buffer, ':');
     if (colon == NULL) {
-        printf("Client %d (%s) sent invalid format. Expected TYPE:TOPIC\n", client->id, client->ip_str);
+        printf("Client %d (%s) sent invalid format. Expected TYPE:TOPIC\n", client->id, client_ip(client));
+        send_to_client(client, "ERROR expected TYPE:TOPIC\n", 26);
         remove_client(client->id);
         return 0;
     }
@@ -202,212 +314,1324 @@ unsigned __stdcall handle_client(void* arg) {
     char* type_str = buffer;
     char* topic_str = colon + 1;
     
+    // Publishers and subscribers may exchange wire frames instead of lines
+    // (format: "PUBLISHER/BINARY:TOPIC"), and subscribers may take deltas
+    // (format: "SUBSCRIBER/DELTA:TOPIC")
+    char* encoding_str = strchr(type_str, '/');
+    if (encoding_str != NULL) *encoding_str++ = '\0';
+    
+    // A subscriber may name a queue group (format: "SUBSCRIBER:TOPIC:GROUP"),
+    // and a publisher its producer name in the same place
+    char* group_str = strchr(topic_str, ':');
+    if (group_str != NULL) *group_str++ = '\0';
+    
+    // ...or start from a byte offset of the topic log (format: "SUBSCRIBER:TOPIC@OFFSET")
+    char* offset_str = strchr(topic_str, '@');
+    if (offset_str != NULL) *offset_str++ = '\0';
+    if (strlen(topic_str) >= MAX_TOPIC_LENGTH) topic_str[MAX_TOPIC_LENGTH - 1] = '\0';
+    
+    char ack[32];
+    int ack_len = snprintf(ack, sizeof(ack), "OK %d\n", client->id);
+    
+    // Peer links pass the raw socket on, which carries the TLS records of
+    // a connection from the TLS port
+    if (client->tls != NULL && strcmp(type_str, "PEER") == 0) {
+        printf("Client %d (%s) sent %s on the TLS port\n", client->id, client_ip(client), type_str);
+        send_to_client(client, "ERROR PEER needs the plaintext port\n", 36);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // Another broker of the federation mesh (format: "PEER:NODE_ID")
+    if (strcmp(type_str, "PEER") == 0) {
+        client->type = CLIENT_PEER;
+        send_to_client(client, ack, ack_len);
+        start_peer_link_handler(client, atoi(topic_str), rest, rest_len);
+        return 0;
+    }
+    
+    // An agent carrying many sessions over this connection (format: "MUX:NAME")
+    if (strcmp(type_str, "MUX") == 0) {
+        return mux_begin(client, topic_str, rest, rest_len);
+    }
+    
+    // One-shot report request (format: "STATS:REPORT")
+    if (strcmp(type_str, "STATS") == 0) {
+        send_stats_report(client, topic_str);
+        remove_client(client->id);
+        return 0;
+    }
+    
     // Set client type
+    ClientType type;
     if (strcmp(type_str, "PUBLISHER") == 0) {
-        client->type = CLIENT_PUBLISHER;
+        type = CLIENT_PUBLISHER;
     } else if (strcmp(type_str, "SUBSCRIBER") == 0) {
-        client->type = CLIENT_SUBSCRIBER;
+        type = CLIENT_SUBSCRIBER;
+    } else if (strcmp(type_str, "REQUESTER") == 0) {
+        type = CLIENT_REQUESTER;
+    } else if (strcmp(type_str, "RESPONDER") == 0) {
+        type = CLIENT_RESPONDER;
     } else {
-        printf("Client %d (%s) sent invalid type: %s\n", client->id, client->ip_str, type_str);
+        printf("Client %d (%s) sent invalid type: %s\n", client->id, client_ip(client), type_str);
+        send_to_client(client, "ERROR invalid type\n", 19);
         remove_client(client->id);
         return 0;
     }
     
-    // Set client topic
-    strncpy(client->topic, topic_str, MAX_TOPIC_LENGTH - 1);
-    client->topic[MAX_TOPIC_LENGTH - 1] = '\0';
+    // A publisher may name itself as a producer whose sequence numbers are
+    // deduplicated (format: "PUBLISHER:TOPIC:PRODUCER")
+    char* producer_str = NULL;
+    if (type == CLIENT_PUBLISHER && group_str != NULL) {
+        producer_str = group_str;
+        group_str = NULL;
+        if (*producer_str == '\0' || strlen(producer_str) >= MAX_PRODUCER_LENGTH || strpbrk(producer_str, ":@/ ") != NULL) {
+            printf("Client %d (%s) sent an invalid producer name\n", client->id, client_ip(client));
+            send_to_client(client, "ERROR invalid producer name\n", 28);
+            remove_client(client->id);
+            return 0;
+        }
+    }
     
-    printf("Client %d (%s) registered as %s for topic '%s'\n", 
-           client->id, client->ip_str, 
-           (client->type == CLIENT_PUBLISHER ? "PUBLISHER" : "SUBSCRIBER"), 
-           client->topic);
+    // Binary subscribers are served neither by queue groups nor from the
+    // topic log, which are text; nor are delta subscribers, since each of
+    // their frames depends on the ones before
+    int delta = (encoding_str != NULL && strcmp(encoding_str, "DELTA") == 0);
+    int binary = (encoding_str != NULL && !delta);
+    if (binary && (strcmp(encoding_str, "BINARY") != 0 || (type != CLIENT_PUBLISHER && type != CLIENT_SUBSCRIBER) ||
+                   group_str != NULL || offset_str != NULL)) {
+        printf("Client %d (%s) sent an invalid encoding\n", client->id, client_ip(client));
+        send_to_client(client, "ERROR BINARY needs a PUBLISHER or SUBSCRIBER outside groups and the log\n", 72);
+        remove_client(client->id);
+        return 0;
+    }
+    if (delta && (type != CLIENT_SUBSCRIBER || group_str != NULL || offset_str != NULL)) {
+        printf("Client %d (%s) sent an invalid encoding\n", client->id, client_ip(client));
+        send_to_client(client, "ERROR DELTA needs a SUBSCRIBER outside groups and the log\n", 58);
+        remove_client(client->id);
+        return 0;
+    }
     
-    // Display current topic statistics
-    display_topic_statistics();
+    if (group_str != NULL && (type != CLIENT_SUBSCRIBER || *group_str == '\0' || strlen(group_str) >= MAX_GROUP_LENGTH)) {
+        printf("Client %d (%s) sent an invalid queue group\n", client->id, client_ip(client));
+        send_to_client(client, "ERROR invalid queue group\n", 26);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // Topics under --encrypt are only for connections from the TLS port
+    TopicPolicy* policy = find_topic_policy(topic_str);
+    if (policy != NULL && policy->encrypted && client->tls == NULL) {
+        printf("Client %d (%s) needs TLS for topic '%s'\n", client->id, client_ip(client), topic_str);
+        send_to_client(client, "ERROR topic needs TLS\n", 22);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // Subscribers outside queue groups can be served from the topic log.
+    // Catch-up writes the log file to the socket as it is, so a TLS
+    // connection, whose records are encrypted in user space, does not qualify.
+    struct TopicLog* log = (type == CLIENT_SUBSCRIBER && group_str == NULL && encoding_str == NULL && client->out.tls == NULL)
+                         ? topic_log(topic_str) : NULL;
+    if (offset_str != NULL && (type != CLIENT_SUBSCRIBER || group_str != NULL || *offset_str == '\0' ||
+                               strspn(offset_str, "0123456789") != strlen(offset_str) || log == NULL)) {
+        printf("Client %d (%s) sent an invalid catch-up offset\n", client->id, client_ip(client));
+        const char* error = !log_dir ? "ERROR topic log disabled\n" :
+                            (client->out.tls != NULL) ? "ERROR catch-up needs plaintext\n" : "ERROR invalid catch-up offset\n";
+        send_to_client(client, error, (int)strlen(error));
+        remove_client(client->id);
+        return 0;
+    }
     
-    // Handle messages from client
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_received = recv(client->socket, buffer, BUFFER_SIZE - 1, 0);
+    // A binary client learns the topic id its frames carry, and every client
+    // refers to its topic by the name stored with the id. The client holds
+    // the id from here on; remove_client lets it go.
+    int route_id = wire_topic_id(topic_str);
+    if (route_id == 0) {
+        printf("Client %d (%s) cannot register for topic '%s': no topic ids left\n", client->id, client_ip(client), topic_str);
+        send_to_client(client, "ERROR no topic ids left\n", 24);
+        remove_client(client->id);
+        return 0;
+    }
+    client->route_id = route_id;
+    
+    struct DeltaState* delta_state = delta ? delta_state_create() : NULL;
+    if (delta && delta_state == NULL) {
+        printf("Out of memory for delta subscriber %d\n", client->id);
+        send_to_client(client, "ERROR out of memory\n", 20);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // The producer's window outlives its connections, so a publisher that
+    // reconnects continues where it left off
+    struct Producer* producer = NULL;
+    if (producer_str != NULL && (producer = dedup_producer(topic_str, producer_str)) == NULL) {
+        printf("Client %d (%s) cannot register producer '%s': too many producers\n", client->id, client_ip(client), producer_str);
+        send_to_client(client, "ERROR too many producers\n", 25);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    if (binary) ack_len = snprintf(ack, sizeof(ack), "OK %d %d\n", client->id, route_id);
+    
+    // Acknowledge before the client becomes visible to routing, so the
+    // acknowledgement is always the first line a subscriber reads
+    if (send_to_client(client, ack, ack_len) != 0) {
+        remove_client(client->id);
+        return 0;
+    }
+    
+    // Set client type and topic together so the first subscriber of a topic
+    // is announced to the federation exactly once
+    EnterCriticalSection(&clients_mutex);
+    client->type = type;
+    client->topic = wire_topic_name(route_id);
+    client->topic_id = latency_topic_id(client->topic);
+    client->binary = binary;
+    client->delta = delta_state;
+    client->producer = producer;
+    client->busy_poll = (policy != NULL && policy->busy_poll);
+    client->log = log;
+    client->catching_up = (offset_str != NULL);
+    topic_client_added(client);
+    if (type == CLIENT_SUBSCRIBER && count_subscribers_by_topic(route_id) == 1) {
+        announce_interest("SUB", client->topic);
+    }
+    if (type == CLIENT_RESPONDER) request_responder_added(client);
+    int joined = (group_str == NULL || group_join(client, group_str) == 0);
+    LeaveCriticalSection(&clients_mutex);
+    
+    if (!joined) {
+        printf("Client %d (%s) could not join queue group '%s'\n", client->id, client_ip(client), group_str);
+        remove_client(client->id);
+        return 0;
+    }
+    
+    if (type == CLIENT_SUBSCRIBER) {
+        capture_event(CAPTURE_SUBSCRIBE, client->id, client->topic, NULL, 0);
+    }
+    
+    if (verbose) {
+        printf("Client %d (%s) registered as %s for topic '%s'%s%s%s%s\n",
+               client->id, client_ip(client), type_str, client->topic,
+               group_str ? " in queue group " : "", group_str ? group_str : "",
+               producer_str ? " as producer " : "", producer_str ? producer_str : "");
         
-        if (bytes_received <= 0) {
-            print_client_info(client, "Disconnected");
-            remove_client(client->id);
-            display_topic_statistics();
-            break;
+        // Display current topic statistics
+        display_topic_statistics();
+    }
+    
+    // A catch-up session owns the connection until it reaches the log end
+    if (offset_str != NULL) {
+        start_catchup(client, _atoi64(offset_str));
+        return 0;
+    }
+    
+    if (rest_len > 0) {
+        memmove(buffer, rest, rest_len);
+        return handle_message(client, buffer, rest_len);
+    }
+    return 1;
+}
+
+// Handles one chunk of data from a registered client. Every '\n'-terminated
+// line is one message; an incomplete line waits for the next chunk, and a
+// line longer than a message is passed on in BUFFER_SIZE - 1 byte pieces.
+// Bytes following a "CHUNK" header are the payload of a large message chunk.
+// The buffer for an incomplete line comes from the pool and goes back once
+// it is empty, so an idle connection holds none.
+int handle_message(Client* client, char* buffer, int bytes_received) {
+    // Binary clients send frames, not lines
+    if (client->binary) return wire_receive(client, buffer, bytes_received);
+    
+    MessageTrace trace;
+    latency_begin(&trace, client->topic, client->topic_id);
+    
+    int pos = 0;
+    while (pos < bytes_received) {
+        if (chunk_pending(client)) {
+            pos += chunk_fill(client, buffer + pos, bytes_received - pos);
+            continue;
         }
         
-        buffer[bytes_received] = '\0';
+        char* line = buffer + pos;
+        char* newline = memchr(line, '\n', bytes_received - pos);
+        int length = newline ? (int)(newline - line) + 1 : bytes_received - pos;
         
-        // Check for termination message
-        if (strncmp(buffer, "terminate", 9) == 0) {
-            print_client_info(client, "Terminated");
-            remove_client(client->id);
-            display_topic_statistics();
-            break;
+        // Whole lines straight from the receive buffer need no copy
+        if (client->partial_len == 0 && newline != NULL) {
+            pos += length;
+            if (!handle_line(client, line, length, &trace)) return 0;
+            continue;
         }
         
-        // If client is a publisher, broadcast message to subscribers of the same topic
-        if (client->type == CLIENT_PUBLISHER) {
-            printf("[%s] Publisher %d (%s): %s", client->topic, client->id, client->ip_str, buffer);
-            
-            // Create formatted message with topic and publisher info
-            snprintf(message, sizeof(message), "[%s] Publisher %d: %s", client->topic, client->id, buffer);
-            broadcast_to_topic_subscribers(message, client->topic, client->id);
+        if (client->partial == NULL) {
+            client->partial = (char*)pool_alloc(BUFFER_SIZE);
+            if (client->partial == NULL) {
+                printf("Out of memory buffering client %d\n", client->id);
+                remove_client(client->id);
+                return 0;
+            }
+        }
+        
+        if (length > BUFFER_SIZE - 1 - client->partial_len) {
+            length = BUFFER_SIZE - 1 - client->partial_len;
         }
-        // If subscriber sends a message, just log it
-        else if (client->type == CLIENT_SUBSCRIBER) {
-            printf("[%s] Subscriber %d (%s): %s", client->topic, client->id, client->ip_str, buffer);
+        memcpy(client->partial + client->partial_len, line, length);
+        client->partial_len += length;
+        pos += length;
+        
+        if (client->partial[client->partial_len - 1] == '\n' || client->partial_len == BUFFER_SIZE - 1) {
+            int complete = client->partial_len;
+            client->partial_len = 0;
+            if (!handle_line(client, client->partial, complete, &trace)) return 0;
         }
     }
     
-    return 0;
+    release_partial(client);
+    return 1;
 }
 
-void broadcast_to_topic_subscribers(const char* message, const char* topic, int sender_id) {
+// Gives an empty line or frame buffer back to the pool
+void release_partial(Client* client) {
+    if (client->partial != NULL && client->partial_len == 0) {
+        pool_free(client->partial);
+        client->partial = NULL;
+    }
+}
+
+// Handles one message line. Returns 0 once the client was removed.
+int handle_line(Client* client, const char* line, int length, const MessageTrace* ingress) {
+    // Check for termination message
+    if (length >= 9 && strncmp(line, "terminate", 9) == 0) {
+        if (verbose) print_client_info(client, "Terminated");
+        remove_client(client->id);
+        if (verbose) display_topic_statistics();
+        return 0;
+    }
+    
+    // Answers to the broker's PINGs are not messages
+    if (heartbeat_reply(line, length)) return 1;
+    
+    // Messages larger than a line are streamed in chunks
+    if (client->type == CLIENT_PUBLISHER && length > 6 && strncmp(line, "CHUNK ", 6) == 0) {
+        return chunk_begin(client, line, length);
+    }
+    
+    // If client is a publisher, broadcast message to subscribers of the same topic
+    if (client->type == CLIENT_PUBLISHER) {
+        MessageTrace trace = *ingress;
+        if (verbose) {
+            printf("[%s] Publisher %d (%s): %.*s", client->topic, client->id, client_ip(client), length, line);
+        }
+        
+        // A named producer's retransmission is dropped before it is
+        // captured, counted against rate limits or fanned out
+        UINT64 sequence;
+        if (!dedup_line(client, &line, &length, &sequence)) {
+            if (verbose) printf("Dropped duplicate %llu of producer '%s'\n", (unsigned long long)sequence,
+                                dedup_producer_name(client->producer));
+            return 1;
+        }
+        
+        capture_event(CAPTURE_PUBLISH, client->id, client->topic, line, length);
+        rate_publish(client, length);
+        
+        // Create formatted message with topic and publisher info
+        Message* message = create_topic_message(client->topic, line, length, client->id, 0);
+        if (message == NULL) return 1;
+        client->sequence++;
+        message->wire.sequence = (sequence != 0) ? sequence : (UINT64)client->sequence;
+        latency_stamp(&trace, TRACE_PARSE);
+        
+        broadcast_to_topic_subscribers(message, client->topic, client->id, &trace);
+        forward_to_peers(line, length, client->topic, client->id);
+    }
+    // Requests go to one responder of the topic, replies back to the requester
+    else if (client->type == CLIENT_REQUESTER) {
+        return handle_request(client, line, length);
+    }
+    else if (client->type == CLIENT_RESPONDER) {
+        return handle_reply(client, line, length);
+    }
+    // Queue group members acknowledge each message they processed
+    else if (client->type == CLIENT_SUBSCRIBER && client->group != NULL && length > 4 && strncmp(line, "ACK ", 4) == 0) {
+        group_ack(client, line, length);
+    }
+    // If subscriber sends a message, just log it
+    else if (client->type == CLIENT_SUBSCRIBER) {
+        printf("[%s] Subscriber %d (%s): %.*s", client->topic, client->id, client_ip(client), length, line);
+    }
+    
+    return 1;
+}
+
+// Formats a publish for subscribers: "[TOPIC] Publisher ID: payload", or
+// "[TOPIC] Publisher ID@NODE: payload" when it came from another broker.
+// The message takes its topic's priority unless the payload starts with a
+// "!HIGH ", "!NORMAL " or "!LOW " override, and its topic's TTL unless a
+// "~MS " override follows. On a conflated topic the first word of the
+// payload is the message key; on another partitioned topic a first word
+// "#KEY" is, and stays in the payload. The header fields a binary
+// subscriber gets are filled in as well.
+Message* create_topic_message(const char* topic, const char* payload, int length, int publisher_id, int origin) {
+    TopicPolicy* policy = find_topic_policy(topic);
+    Priority priority = policy ? policy->priority : PRIORITY_NORMAL;
+    int ttl_ms = policy ? policy->ttl_ms : 0;
+    parse_message_priority(&payload, &length, &priority);
+    parse_message_ttl(&payload, &length, &ttl_ms);
+    
+    int capacity = length + MAX_TOPIC_LENGTH + 64;
+    Message* message = message_create(capacity);
+    if (message == NULL) return NULL;
+    
+    if (origin > 0) {
+        message->length = snprintf(message->data, capacity, "[%s] Publisher %d@%d: %.*s",
+                                   topic, publisher_id, origin, length, payload);
+    } else {
+        message->length = snprintf(message->data, capacity, "[%s] Publisher %d: %.*s",
+                                   topic, publisher_id, length, payload);
+    }
+    if (message->length >= capacity) message->length = capacity - 1;
+    message->payload_offset = (message->length > length) ? message->length - length : 0;
+    message->priority = priority;
+    message->expires = ttl_deadline(ttl_ms);
+    
+    WireHeader* wire = &message->wire;
+    memset(wire, 0, sizeof(WireHeader));
+    wire->magic = WIRE_MAGIC;
+    wire->version = WIRE_VERSION;
+    wire->flags = (UINT8)(priority + 1);
+    wire->topic_id = wire_topic_id(topic);
+    wire->publisher_id = publisher_id;
+    wire->origin = (UINT16)origin;
+    wire->timestamp = wire_now();
+    
+    if (policy && policy->conflated) {
+        message_set_key(message, payload, length);
+        message->conflated = (message->key[0] != '\0');
+        wire->key = 14695981039346656037ULL;   // FNV-1a of the key
+        for (const char* k = message->key; *k; k++) wire->key = (wire->key ^ (unsigned char)*k) * 1099511628211ULL;
+    } else if (policy && policy->partitioned && length > 1 && payload[0] == '#') {
+        wire->key = 14695981039346656037ULL;
+        for (int i = 1; i < length && payload[i] != ' ' && payload[i] != '\n'; i++) {
+            wire->key = (wire->key ^ (unsigned char)payload[i]) * 1099511628211ULL;
+        }
+    }
+    return message;
+}
+
+// Strips a leading "!CLASS " priority override from a payload
+int parse_message_priority(const char** payload, int* length, Priority* priority) {
+    const char* text = *payload;
+    if (*length < 2 || text[0] != '!') return 0;
+    
+    char name[8];
+    int i = 1;
+    while (i < *length && i - 1 < (int)sizeof(name) - 1 && text[i] != ' ' && text[i] != '\n') {
+        name[i - 1] = text[i];
+        i++;
+    }
+    name[i - 1] = '\0';
+    if (i == *length || text[i] != ' ' || parse_priority(name, priority) != 0) return 0;
+    
+    *payload += i + 1;
+    *length -= i + 1;
+    return 1;
+}
+
+TopicPolicy* find_topic_policy(const char* topic) {
+    for (int i = 0; i < topic_policy_count; i++) {
+        if (strcmp(topic_policies[i].topic, topic) == 0) return &topic_policies[i];
+    }
+    return NULL;
+}
+
+// Looks up or creates the policy of a topic while options are parsed
+TopicPolicy* add_topic_policy(const char* topic) {
+    TopicPolicy* policy = find_topic_policy(topic);
+    if (policy != NULL) return policy;
+    
+    if (topic_policy_count == MAX_TOPIC_POLICIES) {
+        fprintf(stderr, "Error: at most %d topics can have --conflate, --priority, --topic-limit, --busy-poll, --partition, --encrypt or --ttl settings\n", MAX_TOPIC_POLICIES);
+        return NULL;
+    }
+    policy = &topic_policies[topic_policy_count++];
+    strncpy(policy->topic, topic, MAX_TOPIC_LENGTH - 1);
+    policy->topic[MAX_TOPIC_LENGTH - 1] = '\0';
+    policy->conflated = 0;
+    policy->priority = PRIORITY_NORMAL;
+    rate_limit_init(&policy->limit, 0, 0);
+    InitializeCriticalSection(&policy->limit_lock);
+    policy->throttles = 0;
+    policy->busy_poll = 0;
+    policy->partitioned = 0;
+    policy->encrypted = 0;
+    policy->ttl_ms = 0;
+    return policy;
+}
+
+// Hands the message to every subscriber of the topic and drops the caller's
+// reference. A partitioned topic's message is fanned out by the router
+// thread of its key instead of the caller's.
+void broadcast_to_topic_subscribers(Message* message, const char* topic, int sender_id, MessageTrace* trace) {
+    if (route_message(message, topic, sender_id, trace)) return;
+    fan_out(message, topic, sender_id, trace, 0);
+}
+
+// Subscribers that keep up get the message written immediately; the rest
+// get it queued and their worker flushes it once the socket drains. The
+// trace is completed when the last subscriber's copy is out. With --log-dir
+// the message is appended to the topic log first, and the log stays locked
+// until the fan-out is done, so log order is delivery order. A router
+// thread passes pinned: it selects under clients_mutex and writes to the
+// plain subscribers after releasing it, pinning them so they are not
+// removed meanwhile, which lets router threads write side by side.
+void fan_out(Message* message, const char* topic, int sender_id, MessageTrace* trace, int pinned) {
+    // Per-thread scratch list of matching subscribers
+    static __thread int* targets = NULL;
+    if (targets == NULL) {
+        targets = (int*)malloc(max_clients * sizeof(int));
+        if (targets == NULL) {
+            message_release(message);
+            return;
+        }
+    }
+    
+    // The log keeps text. log_append returns holding the log's lock, even
+    // when it fails; a message that could not be encoded never took it.
+    struct TopicLog* log = topic_log(topic);
+    Message* text = (log != NULL) ? message_encoded(message, 0) : NULL;
+    int log_locked = (text != NULL);
+    LONGLONG log_end = log_locked ? log_append(log, text) : -1;
+    
     EnterCriticalSection(&clients_mutex);
     
-    int subscribers_count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && 
-            clients[i].type == CLIENT_SUBSCRIBER && 
-            clients[i].id != sender_id &&
-            strcmp(clients[i].topic, topic) == 0) {
-            
-            int send_result = send(clients[i].socket, message, strlen(message), 0);
-            if (send_result == SOCKET_ERROR) {
-                printf("Failed to send message to subscriber %d\n", clients[i].id);
-            } else {
-                subscribers_count++;
+    // Select the matching subscribers first so routing and sending can be
+    // timed separately. They are listed under the topic id in the message
+    // header; a message whose topic got no id has none, since every
+    // subscriber holds its topic's id. A multiplexed connection gets one
+    // copy however many of its sessions subscribe; its agent hands it to
+    // each of them by topic id.
+    static LONG64 fanout_serial = 0;
+    LONG64 fanout_id = ++fanout_serial;
+    int route_id = (int)message->wire.topic_id;
+    int first = (route_id != 0) ? topic_clients[route_id].first_subscriber : -1;
+    int target_count = 0;
+    for (int i = first; i >= 0; i = clients[i].next_subscriber) {
+        if (clients[i].id != sender_id &&
+            clients[i].group == NULL &&
+            !clients[i].slow &&
+            !clients[i].catching_up) {
+            if (clients[i].carrier >= 0) {
+                Client* carrier = &clients[clients[i].carrier];
+                if (carrier->slow) continue;
+                if (carrier->fanout == fanout_id) {
+                    mux_shared_delivery();
+                    continue;
+                }
+                carrier->fanout = fanout_id;
             }
+            targets[target_count++] = i;
+        }
+    }
+    latency_stamp(trace, TRACE_ROUTE);
+    
+    if (trace_enabled && trace != NULL) {
+        message->trace = *trace;
+        message->traced = 1;
+    }
+    
+    int subscribers_count = 0;
+    int pinned_count = 0;
+    DeltaFanout fanout;
+    delta_fanout_begin(&fanout, message, topic);
+    latency_stamp(&message->trace, TRACE_ENQUEUE);
+    for (int t = 0; t < target_count; t++) {
+        Client* target = &clients[targets[t]];
+        if (pinned && !target->delta) {
+            InterlockedIncrement(&target->pins);
+            targets[pinned_count++] = targets[t];
+            continue;
+        }
+        OutboundResult result = target->delta ? delta_deliver(&fanout, target) : deliver_to_client(target, message);
+        if (result == OUTBOUND_SENT || result == OUTBOUND_QUEUED) {
+            subscribers_count++;
+            if (log_end >= 0) target->log_next = log_end;
         }
     }
+    delta_fanout_end(&fanout);
+    
+    // Each queue group of the topic gets one copy for one of its members;
+    // a chunk is only part of a message, so groups do not take those
+    if (!message->chunk) groups_publish(topic, message);
     
     LeaveCriticalSection(&clients_mutex);
     
-    printf("Message broadcasted to %d subscribers on topic '%s'\n", subscribers_count, topic);
+    for (int t = 0; t < pinned_count; t++) {
+        Client* target = &clients[targets[t]];
+        OutboundResult result = deliver_to_client(target, message);
+        if (result == OUTBOUND_SENT || result == OUTBOUND_QUEUED) {
+            subscribers_count++;
+            if (log_end >= 0) target->log_next = log_end;
+        }
+        route_unpin(target);
+    }
+    if (log_locked) log_release(log);
+    message_release(message);
+    
+    if (verbose) {
+        printf("Message broadcasted to %d subscribers on topic '%s'\n", subscribers_count, topic);
+    }
 }
 
-int add_client(SOCKET client_socket, struct sockaddr_in client_addr) {
-    EnterCriticalSection(&clients_mutex);
+// Writes or queues a message for one client, keeping the caller's
+// reference. Called with clients_mutex held, or by a router thread for a
+// client it pinned. A client whose socket failed
+// is cut off, and so is one whose queue overflowed, unless it can continue
+// from the topic log. What is for a session goes out on its connection.
+OutboundResult deliver_to_client(Client* client, Message* message) {
+    if (client->carrier >= 0) client = &clients[client->carrier];
+    
+    // A client of the other encoding gets the converted copy; without memory
+    // for one it misses the message
+    message = message_encoded(message, client->binary);
+    if (message == NULL) return OUTBOUND_ERROR;
+    
+    AcquireSRWLockExclusive(&client->out_lock);
+    OutboundResult result = outbound_send(client->socket, &client->out, message);
+    ReleaseSRWLockExclusive(&client->out_lock);
     
+    if (result == OUTBOUND_QUEUED) {
+        request_write(client);
+    } else if (result == OUTBOUND_FULL && log_can_catch_up(client->log)) {
+        // No more fan-out; once its worker has flushed the queue the
+        // subscriber continues from the log after the last message it got
+        client->catching_up = 1;
+        request_write(client);
+    } else if (result != OUTBOUND_SENT) {
+        // Only the owning worker removes a client; shutting the socket
+        // down makes its next poll report the disconnect
+        client->slow = 1;
+        shutdown(client->socket, SD_BOTH);
+        printf("Dropping client %d on topic '%s': %s\n", client->id, client->topic,
+               result == OUTBOUND_FULL ? "outbound queue full (slow consumer)" : "send failed");
+    }
+    return result;
+}
+
+// Takes a free slot for a connection adopted by the given worker, from the
+// worker's own partition while it has one
+int add_client(int worker, SOCKET client_socket, struct sockaddr_in client_addr) {
     int client_id = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket == INVALID_SOCKET) {
-            clients[i].socket = client_socket;
-            clients[i].address = client_addr;
-            clients[i].type = CLIENT_UNKNOWN;
-            clients[i].id = i;
-            
-            // Convert IP to string
-            inet_ntop(AF_INET, &client_addr.sin_addr, clients[i].ip_str, INET_ADDRSTRLEN);
-            
-            client_count++;
-            client_id = i;
-            break;
-        }
+    EnterCriticalSection(&slots_mutex);
+    for (int n = 0; n < slot_partitions && client_id == -1; n++) {
+        int partition = (worker + n) % slot_partitions;
+        if (free_counts[partition] == 0) continue;
+        client_id = free_slots[partition * partition_size + --free_counts[partition]];
+        if (n > 0) borrowed_slots++;
     }
+    LeaveCriticalSection(&slots_mutex);
     
-    LeaveCriticalSection(&clients_mutex);
+    if (client_id == -1) return -1;
+    return add_client_at(client_id, client_socket, client_addr);
+}
+
+// Fills in a slot that is already taken off the free list, or, during a
+// takeover, one that rebuild_free_slots takes off afterwards
+int add_client_at(int client_id, SOCKET client_socket, struct sockaddr_in client_addr) {
+    // The slot is ours alone until the client registers, so it can be filled
+    // in without holding clients_mutex
+    Client* client = &clients[client_id];
+    client->address = client_addr;
+    client->type = CLIENT_UNKNOWN;
+    client->id = client_id;
+    client->topic_id = -1;
+    client->write_requested = 0;
+    client->slow = 0;
+    client->group = NULL;
+    client->log = NULL;
+    client->log_next = 0;
+    client->catching_up = 0;
+    client->chunks = NULL;
+    client->limit = NULL;
+    client->throttle_ms = 0;
+    client->throttled = 0;
+    client->ingress_deficit = 0;
+    client->binary = 0;
+    client->route_id = 0;
+    client->sequence = 0;
+    client->delta = NULL;
+    client->busy_poll = 0;
+    client->last_receive = GetTickCount64();
+    client->last_ping = 0;
+    client->carrier = -1;
+    client->session = 0;
+    client->mux = NULL;
+    client->fanout = 0;
+    client->producer = NULL;
+    client->tls = NULL;
+    
+    client->socket = client_socket;
+    liveness_start(client);
+    InterlockedIncrement(&client_count);
     return client_id;
 }
 
+// Recomputes the free list from the slots in use after a takeover placed
+// clients at their old ids. Called before the acceptor starts.
+void rebuild_free_slots() {
+    EnterCriticalSection(&slots_mutex);
+    for (int p = 0; p < slot_partitions; p++) free_counts[p] = 0;
+    for (int i = max_clients - 1; i >= 0; i--) {
+        int partition = i / partition_size;
+        if (clients[i].socket == INVALID_SOCKET) {
+            free_slots[partition * partition_size + free_counts[partition]++] = i;
+        }
+    }
+    LeaveCriticalSection(&slots_mutex);
+}
+
+// Worker whose node holds the slot with --numa, -1 without
+int slot_owner(int client_id) {
+    return numa_placement ? client_id / partition_size : -1;
+}
+
+LONG64 slots_borrowed() {
+    EnterCriticalSection(&slots_mutex);
+    LONG64 borrowed = borrowed_slots;
+    LeaveCriticalSection(&slots_mutex);
+    return borrowed;
+}
+
 void remove_client(int client_id) {
-    if (client_id < 0 || client_id >= MAX_CLIENTS) return;
+    if (client_id < 0 || client_id >= max_clients) return;
     
+    // Streams a publisher left unfinished are aborted before it is gone,
+    // and so are the sessions of a multiplexed connection
+    chunk_client_gone(&clients[client_id]);
+    mux_client_gone(&clients[client_id]);
+    
+    int removed = 0;
     EnterCriticalSection(&clients_mutex);
     
     if (clients[client_id].socket != INVALID_SOCKET) {
-        closesocket(clients[client_id].socket);
+        int was_subscriber = (clients[client_id].type == CLIENT_SUBSCRIBER);
+        char topic[MAX_TOPIC_LENGTH];
+        strcpy(topic, clients[client_id].topic);
+        request_client_gone(&clients[client_id]);
+        group_member_gone(&clients[client_id]);
+        liveness_stop(&clients[client_id]);
+        route_unpinned(&clients[client_id]);
+        topic_client_gone(&clients[client_id]);
+        int last_subscriber = was_subscriber && count_subscribers_by_topic(clients[client_id].route_id) == 0;
+        
+        // A session's socket is its connection's
+        if (clients[client_id].carrier < 0) closesocket(clients[client_id].socket);
+        clients[client_id].carrier = -1;
         clients[client_id].socket = INVALID_SOCKET;
         clients[client_id].type = CLIENT_UNKNOWN;
         clients[client_id].id = -1;
-        memset(clients[client_id].topic, 0, MAX_TOPIC_LENGTH);
-        client_count--;
+        clients[client_id].generation++;
+        clients[client_id].topic = "";
+        wire_topic_release(clients[client_id].route_id);
+        clients[client_id].route_id = 0;
+        InterlockedDecrement(&client_count);
+        
+        // Messages still queued for the client will never be sent
+        AcquireSRWLockExclusive(&clients[client_id].out_lock);
+        outbound_clear(&clients[client_id].out);
+        tls_close(&clients[client_id]);
+        ReleaseSRWLockExclusive(&clients[client_id].out_lock);
+        pool_free(clients[client_id].partial);
+        clients[client_id].partial = NULL;
+        clients[client_id].partial_len = 0;
+        free(clients[client_id].limit);
+        clients[client_id].limit = NULL;
+        delta_state_free(clients[client_id].delta);
+        clients[client_id].delta = NULL;
+        removed = 1;
+        
+        // Withdraw interest from the federation when the last local subscriber leaves
+        if (last_subscriber) {
+            announce_interest("UNSUB", topic);
+        }
+        if (was_subscriber) {
+            capture_event(CAPTURE_UNSUBSCRIBE, client_id, topic, NULL, 0);
+        }
     }
     
     LeaveCriticalSection(&clients_mutex);
+    
+    if (removed) {
+        int partition = client_id / partition_size;
+        EnterCriticalSection(&slots_mutex);
+        free_slots[partition * partition_size + free_counts[partition]++] = client_id;
+        LeaveCriticalSection(&slots_mutex);
+    }
+}
+
+// The client's address as text for log lines, kept until the thread's
+// next call rather than in every slot
+const char* client_ip(const Client* client) {
+    static __thread char text[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, (void*)&client->address.sin_addr, text, sizeof(text));
+    return text;
 }
 
 void print_client_info(Client* client, const char* action) {
     if (strlen(client->topic) > 0) {
-        printf("Client %d (%s:%d) [%s] %s\n", 
-               client->id, 
-               client->ip_str, 
+        printf("Client %d (%s:%d) [%s] %s\n",
+               client->id,
+               client_ip(client),
                ntohs(client->address.sin_port),
                client->topic,
                action);
     } else {
-        printf("Client %d (%s:%d) %s\n", 
-               client->id, 
-               client->ip_str, 
-               ntohs(client->address.sin_port), 
+        printf("Client %d (%s:%d) %s\n",
+               client->id,
+               client_ip(client),
+               ntohs(client->address.sin_port),
                action);
     }
 }
 
+// Formats the report in one pass over the active topics with
+// clients_mutex held, and prints it after letting go, so a slow console
+// never holds up routing. The buffer is sized before taking the lock;
+// topics that appeared since are summed up in the last line.
 void display_topic_statistics() {
+    int size = 512 + (active_topic_count + 16) * (MAX_TOPIC_LENGTH + 64);
+    char* report = (char*)malloc(size);
+    if (report == NULL) return;
+    
     EnterCriticalSection(&clients_mutex);
     
-    printf("\n--- Topic Statistics ---\n");
-    printf("Total connected clients: %d\n", client_count);
-    
-    // Count unique topics
-    char topics[MAX_CLIENTS][MAX_TOPIC_LENGTH];
-    int topic_count = 0;
-    
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && strlen(clients[i].topic) > 0) {
-            // Check if topic already counted
-            int found = 0;
-            for (int j = 0; j < topic_count; j++) {
-                if (strcmp(topics[j], clients[i].topic) == 0) {
-                    found = 1;
-                    break;
-                }
+    int len = snprintf(report, size, "\n--- Topic Statistics ---\nTotal connected clients: %ld\n", (long)client_count);
+    if (active_topic_count > 0) {
+        len += snprintf(report + len, size - len, "Active topics: %d\n", active_topic_count);
+        int listed = 0;
+        for (; listed < active_topic_count && len < size - 256; listed++) {
+            const TopicClients* topic = &topic_clients[active_topics[listed]];
+            len += snprintf(report + len, size - len, "  - '%s': %d publishers, %d subscribers",
+                            wire_topic_name(active_topics[listed]), topic->publishers, topic->subscribers);
+            if (topic->responders > 0) len += snprintf(report + len, size - len, ", %d responders", topic->responders);
+            len += snprintf(report + len, size - len, "\n");
+        }
+        if (listed < active_topic_count) {
+            len += snprintf(report + len, size - len, "  ... and %d more\n", active_topic_count - listed);
+        }
+    } else {
+        len += snprintf(report + len, size - len, "No active topics\n");
+    }
+    if (federation_peer_count() > 0) {
+        len += snprintf(report + len, size - len, "Federation node %d: %d/%d peers connected\n",
+                        node_id, federation_connected_peers(), federation_peer_count());
+    }
+    snprintf(report + len, size - len, "------------------------\n\n");
+    
+    LeaveCriticalSection(&clients_mutex);
+    
+    fputs(report, stdout);
+    free(report);
+}
+
+// Prints the topic statistics every --stats-interval seconds, also with
+// --quiet. Runs on the timer thread, which holds clients_mutex only while
+// the report visits the active topics.
+void flush_stats(Timer* timer) {
+    display_topic_statistics();
+    fflush(stdout);
+    timer_set(timer, stats_interval * 1000);
+}
+
+// Counts a registered client under its topic and puts a subscriber at the
+// head of the topic's list. Called with clients_mutex held once the
+// client's type and route_id are set.
+void topic_client_added(Client* client) {
+    if (client->route_id == 0) return;
+    
+    TopicClients* topic = &topic_clients[client->route_id];
+    if (client->type == CLIENT_SUBSCRIBER) {
+        client->prev_subscriber = -1;
+        client->next_subscriber = topic->first_subscriber;
+        if (topic->first_subscriber >= 0) clients[topic->first_subscriber].prev_subscriber = client->id;
+        topic->first_subscriber = client->id;
+        topic->subscribers++;
+    }
+    if (client->type == CLIENT_PUBLISHER) topic->publishers++;
+    if (client->type == CLIENT_RESPONDER) topic->responders++;
+    
+    if (topic->clients++ == 0) {
+        active_topics[active_topic_count] = client->route_id;
+        topic->active = active_topic_count++;
+    }
+}
+
+// Undoes topic_client_added. Called with clients_mutex held.
+void topic_client_gone(Client* client) {
+    if (client->route_id == 0 || client->type == CLIENT_UNKNOWN) return;
+    
+    TopicClients* topic = &topic_clients[client->route_id];
+    if (client->type == CLIENT_SUBSCRIBER) {
+        if (client->prev_subscriber >= 0) {
+            clients[client->prev_subscriber].next_subscriber = client->next_subscriber;
+        } else {
+            topic->first_subscriber = client->next_subscriber;
+        }
+        if (client->next_subscriber >= 0) clients[client->next_subscriber].prev_subscriber = client->prev_subscriber;
+        topic->subscribers--;
+    }
+    if (client->type == CLIENT_PUBLISHER) topic->publishers--;
+    if (client->type == CLIENT_RESPONDER) topic->responders--;
+    
+    // The last active topic takes the place of one that has no clients left
+    if (--topic->clients == 0) {
+        int last = active_topics[--active_topic_count];
+        active_topics[topic->active] = last;
+        topic_clients[last].active = topic->active;
+    }
+}
+
+// Called with clients_mutex held
+int count_subscribers_by_topic(int route_id) {
+    return (route_id != 0) ? topic_clients[route_id].subscribers : 0;
+}
+
+// The route id of the index-th topic that has clients, 0 past the last.
+// Called with clients_mutex held.
+int active_topic_id(int index) {
+    return (index < active_topic_count) ? active_topics[index] : 0;
+}
+
+int parse_server_options(int argc, char *argv[]) {
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--node-id") == 0 && i + 1 < argc) {
+            node_id = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (add_peer(argv[++i]) != 0) return -1;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            verbose = 0;
+        } else if (strcmp(argv[i], "--no-trace") == 0) {
+            trace_enabled = 0;
+        } else if (strcmp(argv[i], "--no-pool") == 0) {
+            pool_enabled = 0;
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            if (parse_cpu_list(argv[++i], worker_cpus, &worker_cpu_count) != 0) {
+                fprintf(stderr, "Error: --cpus expects CPUs below %d such as 0-3,8, got '%s'\n", MAX_WORKER_CPUS, argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--acceptor-cpu") == 0 && i + 1 < argc) {
+            acceptor_cpu = atoi(argv[++i]);
+            if (acceptor_cpu < 0 || acceptor_cpu >= MAX_WORKER_CPUS) {
+                fprintf(stderr, "Error: --acceptor-cpu expects a CPU below %d, got '%s'\n", MAX_WORKER_CPUS, argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--busy-poll") == 0 && i + 1 < argc) {
+            TopicPolicy* policy = add_topic_policy(argv[++i]);
+            if (policy == NULL) return -1;
+            policy->busy_poll = 1;
+        } else if (strcmp(argv[i], "--partition") == 0 && i + 1 < argc) {
+            TopicPolicy* policy = add_topic_policy(argv[++i]);
+            if (policy == NULL) return -1;
+            policy->partitioned = 1;
+        } else if (strcmp(argv[i], "--encrypt") == 0 && i + 1 < argc) {
+            TopicPolicy* policy = add_topic_policy(argv[++i]);
+            if (policy == NULL) return -1;
+            policy->encrypted = 1;
+        } else if (strcmp(argv[i], "--tls-port") == 0 && i + 1 < argc) {
+            tls_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--tls-cert") == 0 && i + 1 < argc) {
+            tls_cert = argv[++i];
+        } else if (strcmp(argv[i], "--tls-key") == 0 && i + 1 < argc) {
+            tls_key = argv[++i];
+        } else if (strcmp(argv[i], "--route-threads") == 0 && i + 1 < argc) {
+            route_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--dedup-window") == 0 && i + 1 < argc) {
+            dedup_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-producers") == 0 && i + 1 < argc) {
+            max_producers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--busy-poll-cpus") == 0 && i + 1 < argc) {
+            if (parse_cpu_list(argv[++i], busy_poll_cpus, &busy_poll_cpu_count) != 0) {
+                fprintf(stderr, "Error: --busy-poll-cpus expects CPUs below %d such as 4-5, got '%s'\n", MAX_WORKER_CPUS, argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--busy-poll-us") == 0 && i + 1 < argc) {
+            busy_poll_us = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numa_placement = 1;
+        } else if (strcmp(argv[i], "--rss-steer") == 0) {
+            rss_steering = 1;
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            listen_backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            max_clients = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-queue") == 0 && i + 1 < argc) {
+            max_queue = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--conflate") == 0 && i + 1 < argc) {
+            TopicPolicy* policy = add_topic_policy(argv[++i]);
+            if (policy == NULL) return -1;
+            policy->conflated = 1;
+        } else if (strcmp(argv[i], "--priority") == 0 && i + 1 < argc) {
+            // Format: TOPIC=CLASS
+            char spec[MAX_TOPIC_LENGTH + 16];
+            strncpy(spec, argv[++i], sizeof(spec) - 1);
+            spec[sizeof(spec) - 1] = '\0';
+            char* equals = strrchr(spec, '=');
+            Priority priority;
+            if (equals == NULL || (*equals = '\0', parse_priority(equals + 1, &priority)) != 0) {
+                fprintf(stderr, "Error: --priority expects TOPIC=HIGH|NORMAL|LOW, got '%s'\n", argv[i]);
+                return -1;
+            }
+            TopicPolicy* policy = add_topic_policy(spec);
+            if (policy == NULL) return -1;
+            policy->priority = priority;
+        } else if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            // Format: TOPIC=MS
+            char spec[MAX_TOPIC_LENGTH + 16];
+            strncpy(spec, argv[++i], sizeof(spec) - 1);
+            spec[sizeof(spec) - 1] = '\0';
+            char* equals = strrchr(spec, '=');
+            int ttl_ms;
+            if (equals == NULL || (*equals = '\0', parse_ttl(equals + 1, (int)strlen(equals + 1), &ttl_ms)) != 0 || ttl_ms == 0) {
+                fprintf(stderr, "Error: --ttl expects TOPIC=MS, 1 to 86400000 milliseconds, got '%s'\n", argv[i]);
+                return -1;
             }
-            if (!found) {
-                strcpy(topics[topic_count], clients[i].topic);
-                topic_count++;
+            TopicPolicy* policy = add_topic_policy(spec);
+            if (policy == NULL) return -1;
+            policy->ttl_ms = ttl_ms;
+        } else if (strcmp(argv[i], "--publisher-limit") == 0 && i + 1 < argc) {
+            if (parse_rate_limit(argv[++i], &publisher_message_rate, &publisher_byte_rate) != 0) {
+                fprintf(stderr, "Error: --publisher-limit expects MSGS[:BYTES] per second, got '%s'\n", argv[i]);
+                return -1;
             }
+        } else if (strcmp(argv[i], "--topic-limit") == 0 && i + 1 < argc) {
+            // Format: TOPIC=MSGS[:BYTES]
+            char spec[MAX_TOPIC_LENGTH + 48];
+            strncpy(spec, argv[++i], sizeof(spec) - 1);
+            spec[sizeof(spec) - 1] = '\0';
+            char* equals = strrchr(spec, '=');
+            double message_rate, byte_rate;
+            if (equals == NULL || (*equals = '\0', parse_rate_limit(equals + 1, &message_rate, &byte_rate)) != 0) {
+                fprintf(stderr, "Error: --topic-limit expects TOPIC=MSGS[:BYTES] per second, got '%s'\n", argv[i]);
+                return -1;
+            }
+            TopicPolicy* policy = add_topic_policy(spec);
+            if (policy == NULL) return -1;
+            rate_limit_init(&policy->limit, message_rate, byte_rate);
+        } else if (strcmp(argv[i], "--ingress-quantum") == 0 && i + 1 < argc) {
+            ingress_quantum = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--send-buffer") == 0 && i + 1 < argc) {
+            send_buffer_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "--request-timeout") == 0 && i + 1 < argc) {
+            request_timeout_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--max-outstanding") == 0 && i + 1 < argc) {
+            max_outstanding = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-policy") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "least") == 0) {
+                group_policy = GROUP_LEAST_OUTSTANDING;
+            } else if (strcmp(argv[i], "round-robin") == 0) {
+                group_policy = GROUP_ROUND_ROBIN;
+            } else {
+                fprintf(stderr, "Error: --group-policy expects least or round-robin, got '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (strcmp(argv[i], "--group-window") == 0 && i + 1 < argc) {
+            group_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--group-backlog") == 0 && i + 1 < argc) {
+            group_backlog = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--log-dir") == 0 && i + 1 < argc) {
+            log_dir = argv[++i];
+        } else if (strcmp(argv[i], "--segment-mb") == 0 && i + 1 < argc) {
+            segment_size = _atoi64(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--catchup-copy") == 0) {
+            catchup_copy = 1;
+        } else if (strcmp(argv[i], "--chunk-window") == 0 && i + 1 < argc) {
+            chunk_window = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--delta-keyframe") == 0 && i + 1 < argc) {
+            delta_keyframe = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--delta-keys") == 0 && i + 1 < argc) {
+            delta_keys = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--heartbeat") == 0 && i + 1 < argc) {
+            heartbeat_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--idle-timeout") == 0 && i + 1 < argc) {
+            idle_timeout_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--stats-interval") == 0 && i + 1 < argc) {
+            stats_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--takeover") == 0) {
+            takeover = 1;
+        } else if (strcmp(argv[i], "--handoff-dir") == 0 && i + 1 < argc) {
+            handoff_dir = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
         }
     }
     
-    if (topic_count > 0) {
-        printf("Active topics: %d\n", topic_count);
-        for (int i = 0; i < topic_count; i++) {
-            int publishers = count_publishers_by_topic(topics[i]);
-            int subscribers = count_subscribers_by_topic(topics[i]);
-            printf("  - '%s': %d publishers, %d subscribers\n", topics[i], publishers, subscribers);
-        }
-    } else {
-        printf("No active topics\n");
+    if (federation_peer_count() > 0 && node_id <= 0) {
+        fprintf(stderr, "Error: --node-id must be a positive number when peers are configured\n");
+        return -1;
+    }
+    if (worker_count < 0 || listen_backlog <= 0 || max_clients <= 0 || max_queue <= 0 || send_buffer_size < 0 ||
+        request_timeout_ms <= 0 || max_outstanding <= 0 || group_window <= 0 || group_backlog <= 0 || segment_size <= 0 ||
+        chunk_window <= 0 || ingress_quantum <= 0 || delta_keyframe <= 0 || delta_keys <= 0 || busy_poll_us < BUSY_POLL_MIN_SPIN_US) {
+        fprintf(stderr, "Error: --workers, --backlog, --max-clients, --max-queue, --request-timeout, --max-outstanding,\n"
+                        "--group-window, --group-backlog, --segment-mb, --chunk-window, --ingress-quantum, --delta-keyframe\n"
+                        "and --delta-keys must be positive, and --busy-poll-us at least %d\n", BUSY_POLL_MIN_SPIN_US);
+        return -1;
     }
-    printf("------------------------\n\n");
     
-    LeaveCriticalSection(&clients_mutex);
+    if (heartbeat_ms < 0 || idle_timeout_ms < 0 || stats_interval < 0 || route_threads < 0) {
+        fprintf(stderr, "Error: --heartbeat, --idle-timeout, --stats-interval and --route-threads cannot be negative\n");
+        return -1;
+    }
+    
+    if (dedup_window <= 0 || dedup_window % 64 != 0 || max_producers <= 0) {
+        fprintf(stderr, "Error: --dedup-window must be a positive multiple of 64 and --max-producers positive\n");
+        return -1;
+    }
+    
+    // The TLS listener cannot be taken over: a session's keys live in this
+    // process, not in the socket
+    int encrypted_topics = 0;
+    for (int i = 0; i < topic_policy_count; i++) encrypted_topics += topic_policies[i].encrypted;
+    if (tls_port > 0 && (tls_cert == NULL || tls_key == NULL)) {
+        fprintf(stderr, "Error: --tls-port needs --tls-cert and --tls-key\n");
+        return -1;
+    }
+    if (tls_port > 0 && takeover) {
+        fprintf(stderr, "Error: --takeover cannot be combined with --tls-port\n");
+        return -1;
+    }
+    if (encrypted_topics > 0 && tls_port <= 0) {
+        fprintf(stderr, "Error: --encrypt needs --tls-port\n");
+        return -1;
+    }
+    
+    int busy_topics = 0;
+    for (int i = 0; i < topic_policy_count; i++) busy_topics += topic_policies[i].busy_poll;
+    if (busy_poll_cpu_count > 0 && busy_topics == 0) {
+        fprintf(stderr, "Error: --busy-poll-cpus needs at least one --busy-poll topic\n");
+        return -1;
+    }
+    return 0;
+}
+
+void print_usage(const char* program_name) {
+    printf("Usage: %s <PORT> [options]\n", program_name);
+    printf("Options:\n");
+    printf("  --node-id <ID>              Node id of this broker in a federation mesh\n");
+    printf("  --peer <ID>@<IP>:<PORT>     Federate with another broker (repeatable)\n");
+    printf("  --priority <TOPIC>=<CLASS>  Delivery class HIGH, NORMAL (default) or LOW of a topic (repeatable)\n");
+    printf("  --publisher-limit <MSGS>[:<BYTES>]  Messages (and bytes) per second each publisher may send\n");
+    printf("  --topic-limit <TOPIC>=<MSGS>[:<BYTES>]  Per second limit shared by a topic's publishers (repeatable)\n");
+    printf("  --ingress-quantum <BYTES>   Bytes read from a connection per poll round (default: %d)\n", DEFAULT_INGRESS_QUANTUM);
+    printf("  --send-buffer <BYTES>       Kernel send buffer of client sockets (default: system default)\n");
+    printf("  --capture <FILE>            Record publishes and subscriptions for replay.exe\n");
+    printf("  --request-timeout <MS>      Time a responder has to answer a request (default: %d)\n", DEFAULT_REQUEST_TIMEOUT_MS);
+    printf("  --max-outstanding <N>       Unanswered requests allowed per requester (default: %d)\n", DEFAULT_MAX_OUTSTANDING);
+    printf("  --group-policy <POLICY>     Queue group member choice: least (outstanding, default) or round-robin\n");
+    printf("  --group-window <N>          Unacknowledged messages per queue group member (default: %d)\n", DEFAULT_GROUP_WINDOW);
+    printf("  --group-backlog <N>         Messages a queue group holds before dropping the oldest (default: %d)\n", DEFAULT_GROUP_BACKLOG);
+    printf("  --log-dir <DIR>             Append every topic to a log there for catch-up subscribers\n");
+    printf("  --segment-mb <MB>           Size of a log segment file (default: %lld)\n", DEFAULT_SEGMENT_SIZE >> 20);
+    printf("  --catchup-copy              Serve catch-up by read and send instead of TransmitFile (for comparison)\n");
+    printf("  --chunk-window <N>          Chunks of a publisher in memory before it is paused (default: %d)\n", DEFAULT_CHUNK_WINDOW);
+    printf("  --delta-keyframe <N>        Send every Nth version of a key whole to delta subscribers (default: %d)\n", DEFAULT_DELTA_KEYFRAME);
+    printf("  --delta-keys <N>            Topic keys whose last payload is kept for delta subscribers (default: %d)\n", DEFAULT_DELTA_KEYS);
+    printf("  --heartbeat <MS>            Send PING to a client silent that long; clients answer PONG (default: off)\n");
+    printf("  --idle-timeout <MS>         Close a connection nothing was received from for that long (default: off)\n");
+    printf("  --stats-interval <S>        Print the topic statistics every S seconds (default: off)\n");
+    printf("  --takeover                  Take over the port and its connections from the server running on it\n");
+    printf("  --handoff-dir <DIR>         Owner-only directory of the handoff socket a --takeover connects to (default: handoff)\n");
+    printf("  --quiet                     Do not log every published message\n");
+    printf("  --no-trace                  Disable per-stage latency histograms\n");
+    printf("  --no-pool                   Allocate messages with the system allocator instead of the buffer pool\n");
+    printf("  --workers <N>               Connection worker threads (default: one per CPU, or per CPU in --cpus)\n");
+    printf("  --cpus <LIST>               Pin worker N to the Nth CPU of a list such as 0-3,8-11\n");
+    printf("  --acceptor-cpu <CPU>        Pin the acceptor thread\n");
+    printf("  --numa                      Keep each worker's connections in memory on its NUMA node (pins workers)\n");
+    printf("  --rss-steer                 Give each connection to the worker on the CPU that receives its packets\n");
+    printf("  --busy-poll <TOPIC>         Serve the topic's connections from workers that spin instead of sleeping (repeatable)\n");
+    printf("  --busy-poll-cpus <LIST>     One busy-poll worker pinned to each CPU of the list (default: one, unpinned)\n");
+    printf("  --busy-poll-us <US>         Longest spin after a topic's last message before sleeping (default: %d)\n", DEFAULT_BUSY_POLL_US);
+    printf("  --partition <TOPIC>         Fan the topic out on router threads by message key, in order per key (repeatable)\n");
+    printf("  --route-threads <N>         Router threads for --partition topics (default: one per worker)\n");
+    printf("  --dedup-window <N>          Sequences remembered per named producer to drop retransmissions (default: %d)\n", DEFAULT_DEDUP_WINDOW);
+    printf("  --max-producers <N>         Named producers whose windows are kept (default: %d)\n", DEFAULT_MAX_PRODUCERS);
+    printf("  --tls-port <PORT>           Also accept TLS connections on this port (servers built with -DWITH_TLS)\n");
+    printf("  --tls-cert <FILE>           PEM certificate chain for --tls-port\n");
+    printf("  --tls-key <FILE>            PEM private key for --tls-port\n");
+    printf("  --encrypt <TOPIC>           Refuse the topic on the plaintext port (repeatable)\n");
+    printf("  --backlog <N>               Listen backlog (default: SOMAXCONN)\n");
+    printf("  --max-clients <N>           Maximum concurrent connections (default: %d)\n", DEFAULT_MAX_CLIENTS);
+    printf("  --max-queue <N>             Messages queued for a slow subscriber before it is dropped, or moved\n");
+    printf("                              to the topic log with --log-dir (default: %d)\n", DEFAULT_MAX_QUEUE);
+    printf("  --conflate <TOPIC>          Send lagging subscribers only the newest message per key (repeatable)\n");
+    printf("  --ttl <TOPIC>=<MS>          Drop the topic's messages not delivered within MS; a \"~MS \" payload prefix overrides it (repeatable)\n");
+    printf("Examples:\n");
+    printf("  %s 5000\n", program_name);
+    printf("  %s 5000 --node-id 1 --peer 2@127.0.0.1:5001\n", program_name);
+    printf("  %s 5000 --conflate PRICES --priority CONTROL=HIGH --priority BULK=LOW\n", program_name);
+    printf("  %s 5000 --ttl QUOTES=500 --max-queue 10000\n", program_name);
+    printf("  %s 5000 --log-dir logs\n", program_name);
+    printf("  %s 5000 --busy-poll TICKS --busy-poll-cpus 3\n", program_name);
+    printf("  %s 5000 --partition ORDERS --route-threads 4\n", program_name);
+    printf("  %s 5000 --heartbeat 15000 --idle-timeout 45000\n", program_name);
+    printf("  %s 5000 --takeover --log-dir logs\n", program_name);
+    printf("  %s 5000 --tls-port 5443 --tls-cert server.crt --tls-key server.key --encrypt ORDERS\n", program_name);
 }
 
-int count_publishers_by_topic(const char* topic) {
-    int count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && 
-            clients[i].type == CLIENT_PUBLISHER &&
-            strcmp(clients[i].topic, topic) == 0) {
-            count++;
+// Writes everything, waiting for the non-blocking socket to drain when needed
+int send_all(SOCKET sock, const char* data, int len) {
+    while (len > 0) {
+        int sent = send(sock, data, len, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) return -1;
+            
+            WSAPOLLFD pfd;
+            pfd.fd = sock;
+            pfd.events = POLLWRNORM;
+            pfd.revents = 0;
+            if (WSAPoll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) return -1;
+            continue;
         }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Writes everything to a client, through its TLS session when it encrypts
+// in user space
+int send_to_client(Client* client, const char* data, int len) {
+    if (client->out.tls == NULL) return send_all(client->socket, data, len);
+    
+    AcquireSRWLockExclusive(&client->out_lock);
+    int result = tls_send_all(client->out.tls, data, len);
+    ReleaseSRWLockExclusive(&client->out_lock);
+    return result;
+}
+
+// Reads like recv, decrypted for a connection from the TLS port
+int receive_from_client(Client* client, char* buffer, int len) {
+    if (client->tls != NULL) return tls_recv(client, buffer, len);
+    return recv(client->socket, buffer, len, 0);
+}
+
+// Answers a "STATS:<REPORT>" request and lets the caller close the connection
+void send_stats_report(Client* client, const char* report) {
+    char* out = (char*)malloc(STATS_REPORT_SIZE);
+    if (out == NULL) return;
+    
+    int len;
+    if (strcmp(report, "LATENCY") == 0) {
+        len = trace_enabled ? latency_report(out, STATS_REPORT_SIZE)
+                            : snprintf(out, STATS_REPORT_SIZE, "Latency tracing is disabled (--no-trace)\n");
+    } else if (strcmp(report, "QUEUES") == 0) {
+        len = queue_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "CAPTURE") == 0) {
+        len = capture_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "REQUESTS") == 0) {
+        len = request_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "GROUPS") == 0) {
+        len = group_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "LOG") == 0) {
+        len = log_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "CHUNKS") == 0) {
+        len = chunk_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "POOL") == 0) {
+        len = pool_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "HANDOFF") == 0) {
+        len = handoff_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "RATES") == 0) {
+        len = rate_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "CPU") == 0) {
+        len = affinity_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "WIRE") == 0) {
+        len = wire_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "DELTA") == 0) {
+        len = delta_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "BUSY") == 0) {
+        len = busy_poll_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "TIMERS") == 0) {
+        len = timer_report(out, STATS_REPORT_SIZE);
+        len += heartbeat_report(out + len, STATS_REPORT_SIZE - len);
+    } else if (strcmp(report, "MUX") == 0) {
+        len = mux_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "ROUTES") == 0) {
+        len = route_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "DEDUP") == 0) {
+        len = dedup_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "TLS") == 0) {
+        len = tls_report(out, STATS_REPORT_SIZE);
+    } else if (strcmp(report, "TTL") == 0) {
+        len = ttl_report(out, STATS_REPORT_SIZE);
+    } else {
+        len = snprintf(out, STATS_REPORT_SIZE, "Unknown report '%s'. Available: LATENCY, QUEUES, CAPTURE, REQUESTS, GROUPS, LOG, CHUNKS, POOL, HANDOFF, RATES, CPU, WIRE, DELTA, BUSY, TIMERS, MUX, ROUTES, DEDUP, TLS, TTL\n", report);
+    }
+    
+    send_to_client(client, out, len);
+    free(out);
+    
+    if (verbose) {
+        printf("Client %d (%s) requested %s report\n", client->id, client_ip(client), report);
     }
-    return count;
 }
 
-int count_subscribers_by_topic(const char* topic) {
-    int count = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && 
-            clients[i].type == CLIENT_SUBSCRIBER &&
-            strcmp(clients[i].topic, topic) == 0) {
-            count++;
+// Outbound backlog of every subscriber that is behind or had updates merged
+int queue_report(char* out, int size) {
+    int len = snprintf(out, size, "Outbound queues (limit %d messages per subscriber, lanes HIGH/NORMAL/LOW)\n", max_queue);
+    int lagging = 0;
+    LONGLONG lane_totals[PRIORITY_CLASSES] = { 0 };
+    LONGLONG merged_total = 0;
+    LONGLONG promoted_total = 0;
+    
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < max_clients; i++) {
+        Client* client = &clients[i];
+        if (client->socket == INVALID_SOCKET || client->type != CLIENT_SUBSCRIBER) continue;
+        
+        int lanes[PRIORITY_CLASSES];
+        AcquireSRWLockExclusive(&client->out_lock);
+        int pending = outbound_depth(&client->out);
+        for (int p = 0; p < PRIORITY_CLASSES; p++) {
+            lanes[p] = outbound_lane_depth(&client->out, (Priority)p);
+        }
+        LONGLONG merged = client->out.merged;
+        LONGLONG promoted = client->out.promoted;
+        ReleaseSRWLockExclusive(&client->out_lock);
+        
+        for (int p = 0; p < PRIORITY_CLASSES; p++) {
+            lane_totals[p] += lanes[p];
+        }
+        merged_total += merged;
+        promoted_total += promoted;
+        if (pending == 0 && merged == 0 && promoted == 0) continue;
+        lagging++;
+        
+        // Leave room for the summary line
+        if (len < size - 256) {
+            TopicPolicy* policy = find_topic_policy(client->topic);
+            len += snprintf(out + len, size - len,
+                            "  Client %d [%s]%s: %d/%d/%d pending, %lld merged, %lld promoted\n",
+                            client->id, client->topic,
+                            (policy && policy->conflated) ? " (conflated)" : "",
+                            lanes[PRIORITY_HIGH], lanes[PRIORITY_NORMAL], lanes[PRIORITY_LOW],
+                            (long long)merged, (long long)promoted);
         }
     }
-    return count;
+    LeaveCriticalSection(&clients_mutex);
+    
+    len += snprintf(out + len, size - len,
+                    "%d subscriber(s) behind, conflated or promoted: %lld/%lld/%lld pending, %lld merged, %lld promoted\n",
+                    lagging, (long long)lane_totals[PRIORITY_HIGH], (long long)lane_totals[PRIORITY_NORMAL],
+                    (long long)lane_totals[PRIORITY_LOW], (long long)merged_total, (long long)promoted_total);
+    return len;
 }
@@ -0,0 +1,453 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#include "latency.h"
+#include "outbound.h"
+#include "capture.h"
+#include "pool.h"
+
+#define BUFFER_SIZE 1024
+#define DEFAULT_MAX_CLIENTS 4096
+#define MAX_TOPIC_LENGTH 64
+#define STATS_REPORT_SIZE 65536
+#define MAX_TOPIC_POLICIES 64
+#define SEND_TIMEOUT_MS 5000
+#define MAX_CORRELATION_LENGTH 32
+#define DEFAULT_REQUEST_TIMEOUT_MS 5000
+#define DEFAULT_MAX_OUTSTANDING 1024
+#define MAX_GROUP_LENGTH 32
+#define DEFAULT_GROUP_WINDOW 64
+#define DEFAULT_GROUP_BACKLOG 100000
+#define DEFAULT_SEGMENT_SIZE (64LL * 1024 * 1024)
+#define MAX_CHUNK_SIZE 65536
+#define MAX_STREAM_LENGTH 33
+#define DEFAULT_CHUNK_WINDOW 4
+#define DEFAULT_INGRESS_QUANTUM 4096
+#define MAX_WORKER_CPUS 64                  // One processor group's affinity mask
+#define DEFAULT_DELTA_KEYFRAME 32
+#define DEFAULT_DELTA_KEYS 65536
+#define DEFAULT_BUSY_POLL_US 50000
+#define BUSY_POLL_MIN_SPIN_US 50
+#define TIMER_TICK_MS 10
+#define MAX_PRODUCER_LENGTH 32
+#define DEFAULT_DEDUP_WINDOW 1024
+#define DEFAULT_MAX_PRODUCERS 65536
+#define MAX_WIRE_TOPICS 65536
+
+typedef enum {
+    CLIENT_UNKNOWN = 0,
+    CLIENT_PUBLISHER = 1,
+    CLIENT_SUBSCRIBER = 2,
+    CLIENT_PEER = 3,
+    CLIENT_REQUESTER = 4,
+    CLIENT_RESPONDER = 5,
+    CLIENT_MUX = 6                 // Carries the sessions of a multiplexing agent (mux.c)
+} ClientType;
+
+// How a queue group picks the member for a message
+typedef enum {
+    GROUP_LEAST_OUTSTANDING = 0,
+    GROUP_ROUND_ROBIN = 1
+} GroupPolicy;
+
+struct QueueGroup;                 // group.c
+struct TopicLog;                   // log.c
+struct ChunkState;                 // chunk.c
+struct DeltaState;                 // delta.c
+struct Producer;                   // dedup.c
+struct BusyPoll;                   // busypoll.c
+struct MuxState;                   // mux.c
+struct TlsSession;                 // tls.c
+
+// A timer of the timing wheel (timer.c). It is pending while next is set;
+// the callback runs on the timer thread.
+typedef struct Timer Timer;
+typedef void (*TimerCallback)(Timer* timer);
+struct Timer {
+    Timer* next;
+    Timer* prev;
+    ULONGLONG expires;             // Tick it is due at
+    TimerCallback callback;
+    void* context;
+};
+
+// Flag ending a chunk frame
+typedef enum {
+    CHUNK_MORE = 0,                // More chunks of the stream follow
+    CHUNK_END,                     // Last chunk of the stream
+    CHUNK_ABORT                    // The publisher left before the stream ended
+} ChunkFlag;
+
+// Token buckets for messages and bytes per second, holding at most one
+// second's worth of each; a rate of 0 is unlimited
+typedef struct {
+    double message_rate;
+    double byte_rate;
+    double message_tokens;         // Negative while the publisher is in debt
+    double byte_tokens;
+    LONGLONG updated;              // trace_now() of the last refill
+} RateLimit;
+
+// Delivery settings of a topic
+typedef struct {
+    char topic[MAX_TOPIC_LENGTH];
+    int conflated;                 // Lagging subscribers get only the newest message per key
+    Priority priority;             // Outbound lane of the topic's messages
+    RateLimit limit;               // Shared by all publishers of the topic (--topic-limit)
+    CRITICAL_SECTION limit_lock;
+    volatile LONG64 throttles;     // Publishers paused by the topic limit
+    int busy_poll;                 // Its connections are served by busy-poll workers (--busy-poll)
+    int partitioned;               // Fanned out by router threads, by message key (--partition)
+    int encrypted;                 // Only connections from the TLS port may use it (--encrypt)
+    int ttl_ms;                    // Messages not delivered within it are dropped, 0 = never (--ttl)
+} TopicPolicy;
+
+typedef struct {
+    SOCKET socket;
+    struct sockaddr_in address;
+    ClientType type;
+    int id;
+    const char* topic;             // Name stored with its wire topic id, "" until it registers
+    int topic_id;                  // Latency tracing id of the topic
+    int worker;                    // Index of the worker that polls this connection
+    int poll_index;                // Position in that worker's poll set
+    SRWLOCK out_lock;              // Guards out; taken by every thread that fans out to this client
+    OutboundQueue out;             // Messages waiting for the socket to drain
+    volatile LONG write_requested; // Owner worker was asked to poll for writability
+    int slow;                      // Outbound queue overflowed, connection is being dropped
+    char* partial;                 // Incomplete line or frame carried over to the next recv, from the pool
+    int partial_len;
+    struct QueueGroup* group;      // Queue group of a subscriber, NULL if it gets every message
+    int group_unacked;             // Group messages delivered but not acknowledged, under groups_lock
+    struct TopicLog* log;          // Log of a subscriber's topic when --log-dir is set and it is in no group
+    LONGLONG log_next;             // Log offset after the last message fanned out to it
+    volatile int catching_up;      // Served from the log instead of fan-out
+    struct ChunkState* chunks;     // Large messages a publisher is streaming, NULL until its first chunk
+    RateLimit* limit;              // Publisher's own budget (--publisher-limit), made on its first message
+    int throttle_ms;               // Set when a message put it over a budget, owner worker only
+    int throttled;                 // Not read from until its buckets refill
+    volatile LONG generation;      // Bumped when the slot is freed, so a late request_read cannot reach its next client
+    int ingress_deficit;           // Bytes it may still read this poll round
+    int ingress_bytes;             // Received by the last handle_client call
+    int ingress_drained;           // That call found no more data waiting
+    int binary;                    // Exchanges wire frames (wire.h) instead of text lines
+    int route_id;                  // Wire id of the topic; subscribers are matched on it
+    int next_subscriber;           // Slot of the topic's next subscriber, -1 for the last; under clients_mutex
+    int prev_subscriber;
+    LONGLONG sequence;             // Messages published, numbering those that come without one
+    struct DeltaState* delta;      // Key versions a delta subscriber holds, NULL for other clients
+    int busy_poll;                 // Registered on a busy-poll topic; moves to a busy-poll worker
+    Timer liveness;                // Heartbeat and idle timeout check (--heartbeat, --idle-timeout)
+    volatile ULONGLONG last_receive;   // GetTickCount64() when the socket was last readable
+    ULONGLONG last_ping;           // When it was last sent a PING, timer thread only
+    int carrier;                   // Slot of the multiplexed connection a session lives on, else -1
+    UINT32 session;                // The session's id on that connection
+    struct MuxState* mux;          // Sessions of a multiplexed connection, NULL for other clients
+    LONG64 fanout;                 // Broadcast that last selected one of its sessions, under clients_mutex
+    volatile LONG pins;            // Router threads writing to it outside clients_mutex (route.c)
+    struct Producer* producer;     // Deduplication window of a publisher registered with a producer name, else NULL
+    struct TlsSession* tls;        // Connection from the TLS port, NULL for plaintext
+} Client;
+
+// The delta and keyframe of one message, each made when the first delta
+// subscriber of a fan-out needs it
+typedef struct {
+    Message* message;
+    const char* topic;
+    int prepared;
+    Message* text;                 // The message as a line, NULL without memory for it
+    int slot;                      // Key of the message, 0 if it is not tracked
+    LONG version;
+    int full_length;               // Of the message as a text line
+    Message* delta;                // NULL if no delta is sent for this version
+    Message* keyframe;
+} DeltaFanout;
+
+// Global variables (server.c)
+extern Client* clients;
+extern int max_clients;
+extern volatile LONG client_count;
+extern CRITICAL_SECTION clients_mutex;
+extern int verbose;
+extern int worker_count;
+extern int listen_backlog;
+extern int send_buffer_size;
+extern SOCKET listen_socket;
+extern TopicPolicy topic_policies[MAX_TOPIC_POLICIES];
+extern int topic_policy_count;
+
+// Global variables (federation.c)
+extern int node_id;
+
+// Global variables (group.c)
+extern GroupPolicy group_policy;
+extern int group_window;
+extern int group_backlog;
+
+// Global variables (log.c)
+extern const char* log_dir;
+extern LONGLONG segment_size;
+extern int catchup_copy;
+
+// Global variables (chunk.c)
+extern int chunk_window;
+
+// Global variables (handoff.c)
+extern const char* handoff_dir;
+
+// Global variables (affinity.c)
+extern int worker_cpus[MAX_WORKER_CPUS];
+extern int worker_cpu_count;
+extern int acceptor_cpu;
+extern int numa_placement;
+extern int rss_steering;
+
+// Global variables (delta.c)
+extern int delta_keyframe;
+extern int delta_keys;
+
+// Global variables (busypoll.c)
+extern int busy_poll_cpus[MAX_WORKER_CPUS];
+extern int busy_poll_cpu_count;
+extern int busy_poll_us;
+extern int busy_poll_workers;
+
+// Global variables (heartbeat.c)
+extern int heartbeat_ms;
+extern int idle_timeout_ms;
+
+// Global variables (route.c)
+extern int route_threads;
+
+// Global variables (dedup.c)
+extern int dedup_window;
+extern int max_producers;
+
+// Global variables (tls.c)
+extern int tls_port;
+extern const char* tls_cert;
+extern const char* tls_key;
+extern SOCKET tls_listen_socket;
+
+// Global variables (rate.c)
+extern double publisher_message_rate;
+extern double publisher_byte_rate;
+extern int ingress_quantum;
+
+// Global variables (request.c)
+extern int request_timeout_ms;
+extern int max_outstanding;
+
+// server.c
+int handle_client(Client* client);
+Message* create_topic_message(const char* topic, const char* payload, int length, int publisher_id, int origin);
+TopicPolicy* find_topic_policy(const char* topic);
+void broadcast_to_topic_subscribers(Message* message, const char* topic, int sender_id, MessageTrace* trace);
+void fan_out(Message* message, const char* topic, int sender_id, MessageTrace* trace, int pinned);
+OutboundResult deliver_to_client(Client* client, Message* message);
+int add_client(int worker, SOCKET client_socket, struct sockaddr_in client_addr);
+int add_client_at(int client_id, SOCKET client_socket, struct sockaddr_in client_addr);
+void rebuild_free_slots();
+int slot_owner(int client_id);
+LONG64 slots_borrowed();
+void remove_client(int client_id);
+void release_partial(Client* client);
+const char* client_ip(const Client* client);
+void print_client_info(Client* client, const char* action);
+void display_topic_statistics();
+int count_subscribers_by_topic(int route_id);
+int active_topic_id(int index);
+void topic_client_added(Client* client);
+void topic_client_gone(Client* client);
+int send_all(SOCKET sock, const char* data, int len);
+int send_to_client(Client* client, const char* data, int len);
+int receive_from_client(Client* client, char* buffer, int len);
+
+// workers.c
+int start_workers();
+void run_acceptor(SOCKET server_socket);
+void request_write(Client* client);
+void resume_client(Client* client);
+void set_reading(Client* client, int enabled);
+void request_read(Client* client, LONG generation);
+void wake_for_handoff(int acceptor);
+int worker_connections(int index);
+int busy_poll_worker();
+
+// federation.c
+int add_peer(const char* spec);
+int federation_peer_count();
+int federation_connected_peers();
+void start_peer_links();
+void start_peer_link_handler(Client* client, int remote_id, const char* initial, int initial_len);
+void announce_interest(const char* verb, const char* topic);
+void forward_to_peers(const char* payload, int len, const char* topic, int publisher_id);
+void forward_chunk_to_peers(const char* topic, int publisher_id, const char* stream,
+                            const char* payload, int len, const char* flag);
+void cleanup_federation();
+
+// chunk.c
+Message* create_chunk_message(const char* topic, int publisher_id, int origin, const char* stream,
+                              int length, ChunkFlag flag, int* header_length);
+int parse_chunk_flag(const char* name, ChunkFlag* flag);
+int chunk_begin(Client* client, const char* line, int length);
+int chunk_pending(Client* client);
+int chunk_window_full(Client* client);
+int chunk_fill(Client* client, const char* data, int available);
+int chunk_receive(Client* client);
+void chunk_client_gone(Client* client);
+int chunk_export(Client* client, char** data);
+int chunk_import(Client* client, const char* data, int length);
+int chunk_report(char* out, int size);
+
+// group.c
+void initialize_groups();
+void cleanup_groups();
+void groups_publish(const char* topic, Message* message);
+int group_join(Client* client, const char* name);
+void group_member_gone(Client* client);
+void group_ack(Client* client, const char* line, int length);
+const char* group_name(const struct QueueGroup* group);
+int group_report(char* out, int size);
+
+// log.c
+int open_logs();
+void close_logs();
+struct TopicLog* topic_log(const char* topic);
+LONGLONG log_append(struct TopicLog* log, const Message* message);
+void log_release(struct TopicLog* log);
+int log_can_catch_up(struct TopicLog* log);
+int start_catchup(Client* client, LONGLONG position);
+void log_lagging_handoff(Client* client);
+int log_sessions_active();
+int log_report(char* out, int size);
+
+// handoff.c
+void handoff_checkpoint(int acceptor);
+int open_handoff_socket(int port);
+SOCKET take_over(int port);
+int handoff_in_progress();
+int handoff_report(char* out, int size);
+
+// wire.c
+void wire_init();
+int wire_topic_id(const char* topic);
+void wire_topic_hold(int id);
+const char* wire_topic_name(int id);
+int wire_topic_count();
+int wire_receive(Client* client, const char* data, int length);
+Message* message_encoded(Message* message, int binary);
+int wire_report(char* out, int size);
+
+// delta.c
+struct DeltaState* delta_state_create();
+void delta_state_free(struct DeltaState* state);
+void delta_fanout_begin(DeltaFanout* fanout, Message* message, const char* topic);
+OutboundResult delta_deliver(DeltaFanout* fanout, Client* client);
+void delta_fanout_end(DeltaFanout* fanout);
+int delta_report(char* out, int size);
+
+// mux.c
+int mux_begin(Client* client, const char* name, const char* rest, int rest_len);
+int mux_control(Client* client, const WireHeader* header, const char* payload);
+Client* mux_session(Client* client, UINT32 session);
+void mux_client_gone(Client* client);
+void mux_shared_delivery();
+int mux_report(char* out, int size);
+
+// route.c
+int start_routers();
+void stop_routers();
+int route_message(Message* message, const char* topic, int sender_id, const MessageTrace* trace);
+int routes_pending();
+void route_unpin(Client* client);
+void route_unpinned(Client* client);
+int route_report(char* out, int size);
+
+// dedup.c
+void dedup_init();
+struct Producer* dedup_producer(const char* topic, const char* name);
+int dedup_accept(struct Producer* producer, UINT64 sequence);
+int dedup_line(Client* client, const char** line, int* length, UINT64* sequence);
+const char* dedup_producer_name(const struct Producer* producer);
+int dedup_export(char** data);
+int dedup_import(const char* data, int length);
+int dedup_report(char* out, int size);
+
+// busypoll.c
+int busy_poll_init();
+struct BusyPoll* busy_poll_state(int index);
+int busy_poll_wait(struct BusyPoll* poll, int ready, int timeout);
+int busy_poll_report(char* out, int size);
+
+// timer.c
+int start_timers();
+void stop_timers();
+void timer_init(Timer* timer, TimerCallback callback, void* context);
+void timer_set(Timer* timer, int ms);
+void timer_cancel(Timer* timer);
+int timer_report(char* out, int size);
+
+// heartbeat.c
+void liveness_init(Client* client);
+void liveness_start(Client* client);
+void liveness_stop(Client* client);
+int heartbeat_reply(const char* line, int length);
+int heartbeat_report(char* out, int size);
+
+// affinity.c
+int parse_cpu_list(const char* list, int* cpus, int* count);
+int plan_workers();
+int worker_cpu_of(int index);
+void pin_thread(int cpu, const char* name);
+Client* allocate_clients(int count, int partition_size);
+void free_clients(Client* slots);
+int steer_connection(SOCKET sock);
+void print_placement();
+int affinity_report(char* out, int size);
+
+// rate.c
+void rate_init();
+void rate_limit_init(RateLimit* limit, double message_rate, double byte_rate);
+int rate_limited(const RateLimit* limit);
+int parse_rate_limit(const char* spec, double* message_rate, double* byte_rate);
+void rate_publish(Client* client, int bytes);
+void rate_throttled(Client* client);
+void rate_resumed();
+int rate_report(char* out, int size);
+
+// tls.c
+int tls_init();
+void tls_cleanup();
+int tls_accept(Client* client);
+void tls_close(Client* client);
+int tls_handshaking(const Client* client);
+int tls_handshake(Client* client);
+int tls_recv(Client* client, char* buffer, int len);
+int tls_buffered(const Client* client);
+int tls_send_all(struct TlsSession* session, const char* data, int len);
+int tls_report(char* out, int size);
+
+// ttl.c
+ULONGLONG ttl_deadline(int ttl_ms);
+int parse_ttl(const char* text, int length, int* ttl_ms);
+int parse_message_ttl(const char** payload, int* length, int* ttl_ms);
+void ttl_topic_reused(UINT32 topic_id);
+int ttl_report(char* out, int size);
+
+// request.c
+int start_requests();
+void stop_requests();
+int handle_request(Client* client, const char* line, int length);
+int handle_reply(Client* client, const char* line, int length);
+void request_responder_added(Client* client);
+void request_client_gone(Client* client);
+int request_report(char* out, int size);
+
+#endif
@@ -0,0 +1,221 @@
+#include "server.h"
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4                 // 64^4 ticks, about 46 hours at 10 ms
+#define WHEEL_SPAN (1ULL << (WHEEL_BITS * WHEEL_LEVELS))
+
+// Hierarchical timing wheel. Level 0 has a slot per tick; a slot of level
+// n covers 64^n ticks, and its timers are spread over the level below when
+// the wheel reaches it. Setting and cancelling a timer is linking or
+// unlinking it from a slot list, whatever the number of timers; a tick
+// touches only the timers that are due or move down a level.
+//
+// Lock order: the wheel lock is taken last, after clients_mutex and any
+// module lock. Callbacks run on the timer thread without it.
+static CRITICAL_SECTION wheel_lock;
+static Timer wheel[WHEEL_LEVELS][WHEEL_SLOTS];     // Sentinels of circular lists
+static ULONGLONG current = 0;      // Next tick to process
+static ULONGLONG started = 0;      // GetTickCount64() at tick 0
+static volatile int stopping = 0;
+static HANDLE thread = NULL;
+
+static LONG64 timers_set = 0;
+static LONG64 timers_cancelled = 0;
+static LONG64 timers_fired = 0;
+static LONG64 timers_cascaded = 0; // Moved down a level
+static LONG64 timers_pending = 0;
+static LONG64 ticks = 0;
+static LONGLONG tick_time = 0;     // QueryPerformanceCounter ticks spent in run_tick, callbacks included
+static LONGLONG longest_tick = 0;
+static double counter_us = 1.0;    // Microseconds per QueryPerformanceCounter tick
+
+static unsigned __stdcall timer_thread(void* arg);
+
+static void list_init(Timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static void link_timer(Timer* head, Timer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(Timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+// Links a timer into the slot of its expiry: on level 0 if it is due
+// within 64 ticks, else on the lowest level whose span reaches it. One due
+// already goes into the next tick's slot; one beyond the wheel waits in the
+// top level and is placed again when that slot comes round. Called with
+// wheel_lock held.
+static void place(Timer* timer) {
+    ULONGLONG expires = (timer->expires < current) ? current : timer->expires;
+    ULONGLONG delta = expires - current;
+    if (delta >= WHEEL_SPAN) {
+        expires = current + WHEEL_SPAN - 1;
+        delta = WHEEL_SPAN - 1;
+    }
+    
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS * (level + 1)))) level++;
+    int slot = (int)((expires >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    link_timer(&wheel[level][slot], timer);
+}
+
+int start_timers() {
+    InitializeCriticalSection(&wheel_lock);
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++) list_init(&wheel[level][slot]);
+    }
+    started = GetTickCount64();
+    LARGE_INTEGER frequency;
+    QueryPerformanceFrequency(&frequency);
+    counter_us = 1e6 / (double)frequency.QuadPart;
+    
+    thread = (HANDLE)_beginthreadex(NULL, 0, timer_thread, NULL, 0, NULL);
+    if (thread == NULL) {
+        printf("Failed to create timer thread\n");
+        return -1;
+    }
+    return 0;
+}
+
+void stop_timers() {
+    if (thread == NULL) return;
+    
+    stopping = 1;
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+    thread = NULL;
+    DeleteCriticalSection(&wheel_lock);
+}
+
+void timer_init(Timer* timer, TimerCallback callback, void* context) {
+    timer->next = NULL;
+    timer->prev = NULL;
+    timer->expires = 0;
+    timer->callback = callback;
+    timer->context = context;
+}
+
+// Runs the callback once ms have passed, rounded up to whole ticks. A
+// pending timer is moved to the new time.
+void timer_set(Timer* timer, int ms) {
+    if (ms < 0) ms = 0;
+    ULONGLONG due = (GetTickCount64() - started + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    
+    EnterCriticalSection(&wheel_lock);
+    if (timer->next != NULL) {
+        unlink_timer(timer);
+    } else {
+        timers_pending++;
+    }
+    timer->expires = due;
+    place(timer);
+    timers_set++;
+    LeaveCriticalSection(&wheel_lock);
+}
+
+// The callback is not run unless it has already been taken off the wheel;
+// callbacks check the state they act on for that reason
+void timer_cancel(Timer* timer) {
+    EnterCriticalSection(&wheel_lock);
+    if (timer->next != NULL) {
+        unlink_timer(timer);
+        timers_pending--;
+        timers_cancelled++;
+    }
+    LeaveCriticalSection(&wheel_lock);
+}
+
+// Places the timers of a slot again, now that the wheel has come close
+// enough to spread them over the level below. Returns the slot's index.
+static int cascade(int level) {
+    int slot = (int)((current >> (WHEEL_BITS * level)) & WHEEL_MASK);
+    Timer* head = &wheel[level][slot];
+    while (head->next != head) {
+        Timer* timer = head->next;
+        unlink_timer(timer);
+        place(timer);
+        timers_cascaded++;
+    }
+    return slot;
+}
+
+// Processes one tick: the levels above are cascaded when the level below
+// wraps, then the tick's due timers are taken off the wheel together and
+// their callbacks run one at a time with the lock released, so a callback
+// may set timers, including its own.
+static void run_tick() {
+    Timer due;
+    list_init(&due);
+    LARGE_INTEGER begin, end;
+    QueryPerformanceCounter(&begin);
+    
+    EnterCriticalSection(&wheel_lock);
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (((current >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0) break;
+        if (cascade(level) != 0) break;
+    }
+    
+    Timer* head = &wheel[0][current & WHEEL_MASK];
+    if (head->next != head) {
+        due.next = head->next;
+        due.prev = head->prev;
+        due.next->prev = &due;
+        due.prev->next = &due;
+        list_init(head);
+    }
+    current++;
+    ticks++;
+    
+    while (due.next != &due) {
+        Timer* timer = due.next;
+        unlink_timer(timer);
+        timers_pending--;
+        timers_fired++;
+        LeaveCriticalSection(&wheel_lock);
+        timer->callback(timer);
+        EnterCriticalSection(&wheel_lock);
+    }
+    
+    QueryPerformanceCounter(&end);
+    tick_time += end.QuadPart - begin.QuadPart;
+    if (end.QuadPart - begin.QuadPart > longest_tick) longest_tick = end.QuadPart - begin.QuadPart;
+    LeaveCriticalSection(&wheel_lock);
+}
+
+// Catches up with the clock after each sleep, so a late wake-up delays the
+// timers but does not lose ticks
+static unsigned __stdcall timer_thread(void* arg) {
+    (void)arg;
+    while (!stopping) {
+        Sleep(TIMER_TICK_MS);
+        ULONGLONG now = (GetTickCount64() - started) / TIMER_TICK_MS;
+        while (current <= now && !stopping) run_tick();
+    }
+    return 0;
+}
+
+int timer_report(char* out, int size) {
+    EnterCriticalSection(&wheel_lock);
+    int len = snprintf(out, size,
+                       "Timer wheel: %d levels of %d slots, %d ms per tick, %lld ticks\n"
+                       "  Timers: %lld pending, %lld set, %lld cancelled, %lld fired, %lld moved down a level\n"
+                       "  Tick time with callbacks: %.1f us on average, %.0f us at most\n",
+                       WHEEL_LEVELS, WHEEL_SLOTS, TIMER_TICK_MS, (long long)ticks,
+                       (long long)timers_pending, (long long)timers_set, (long long)timers_cancelled,
+                       (long long)timers_fired, (long long)timers_cascaded,
+                       ticks > 0 ? tick_time * counter_us / ticks : 0.0, longest_tick * counter_us);
+    LeaveCriticalSection(&wheel_lock);
+    return len < size ? len : size - 1;
+}
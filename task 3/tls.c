@@ -0,0 +1,415 @@
+#include "server.h"
+
+// Global variables
+int tls_port = 0;                  // --tls-port, 0 = no TLS listener
+const char* tls_cert = NULL;       // --tls-cert, PEM certificate chain
+const char* tls_key = NULL;        // --tls-key, PEM private key
+SOCKET tls_listen_socket = INVALID_SOCKET;
+
+// The TLS port needs OpenSSL, so it is built only with -DWITH_TLS and
+// -lssl -lcrypto. Without it the functions below the #else refuse
+// --tls-port and are never reached otherwise.
+#ifdef WITH_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#pragma comment(lib, "libssl.lib")
+#pragma comment(lib, "libcrypto.lib")
+
+#define TLS_RECORD_PLAINTEXT 16384     // Most plaintext one record carries
+
+// TLS state of a connection from the TLS port. Winsock has no kernel TLS
+// offload, so the handshake and every record run in user space: records
+// are encrypted here, straight to the socket, with what it does not take
+// waiting in out.
+typedef struct TlsSession {
+    SSL* ssl;
+    SOCKET socket;
+    int established;               // Handshake done
+    char* out;                     // Records the socket did not take yet, NULL while none wait
+    int out_len;
+    int out_sent;
+    int out_capacity;
+    int broken;                    // The socket failed under a write
+} TlsSession;
+
+static SSL_CTX* context = NULL;
+static BIO_METHOD* record_method = NULL;
+static volatile LONG64 handshakes = 0;
+static volatile LONG64 handshake_failures = 0;
+static volatile LONG open_sessions = 0;
+static volatile LONG64 encrypted_bytes = 0;    // Plaintext encrypted by tls_write
+
+static int record_write(BIO* bio, const char* data, int len);
+static long record_ctrl(BIO* bio, int command, long number, void* pointer);
+
+// Loads the certificate and key for the TLS port. Returns 0 on success,
+// and when there is no TLS port.
+int tls_init() {
+    if (tls_port == 0) return 0;
+    
+    context = SSL_CTX_new(TLS_server_method());
+    if (context == NULL) {
+        printf("Failed to create the TLS context\n");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(context, TLS1_2_VERSION);
+    
+    // Without session tickets nothing but messages is written after the
+    // handshake, and idle connections keep no record buffers
+    SSL_CTX_set_num_tickets(context, 0);
+    SSL_CTX_set_mode(context, SSL_MODE_RELEASE_BUFFERS);
+    
+    if (SSL_CTX_use_certificate_chain_file(context, tls_cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context, tls_key, SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context) != 1) {
+        printf("Failed to load the TLS certificate %s with key %s\n", tls_cert, tls_key);
+        ERR_print_errors_fp(stdout);
+        SSL_CTX_free(context);
+        context = NULL;
+        return -1;
+    }
+    
+    record_method = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "tls records");
+    if (record_method == NULL) {
+        printf("Failed to create the TLS record writer\n");
+        return -1;
+    }
+    BIO_meth_set_write(record_method, record_write);
+    BIO_meth_set_ctrl(record_method, record_ctrl);
+    return 0;
+}
+
+void tls_cleanup() {
+    if (context != NULL) SSL_CTX_free(context);
+    if (record_method != NULL) BIO_meth_free(record_method);
+    context = NULL;
+    record_method = NULL;
+}
+
+// Starts the server side of a handshake on a connection accepted from the
+// TLS port. Returns 0 on success.
+int tls_accept(Client* client) {
+    TlsSession* session = (TlsSession*)calloc(1, sizeof(TlsSession));
+    if (session == NULL) return -1;
+    
+    session->ssl = SSL_new(context);
+    if (session->ssl == NULL || SSL_set_fd(session->ssl, (int)client->socket) != 1) {
+        if (session->ssl != NULL) SSL_free(session->ssl);
+        free(session);
+        return -1;
+    }
+    SSL_set_accept_state(session->ssl);
+    session->socket = client->socket;
+    client->tls = session;
+    InterlockedIncrement(&open_sessions);
+    return 0;
+}
+
+// Frees the session of a removed client. Called with its out_lock held.
+void tls_close(Client* client) {
+    TlsSession* session = client->tls;
+    if (session == NULL) return;
+    
+    InterlockedDecrement(&open_sessions);
+    SSL_free(session->ssl);
+    free(session->out);
+    free(session);
+    client->tls = NULL;
+    client->out.tls = NULL;
+}
+
+int tls_handshaking(const Client* client) {
+    return client->tls != NULL && !client->tls->established;
+}
+
+// Continues the handshake when the socket is readable. Once it is done the
+// connection's records are written through record_write. Returns 1 to keep
+// polling, 0 once the client was removed.
+int tls_handshake(Client* client) {
+    TlsSession* session = client->tls;
+    while (1) {
+        int result = SSL_accept(session->ssl);
+        if (result == 1) break;
+        
+        int error = SSL_get_error(session->ssl, result);
+        if (error == SSL_ERROR_WANT_READ) return 1;
+        
+        // The handshake's few kilobytes rarely fill a socket buffer
+        WSAPOLLFD pfd;
+        pfd.fd = client->socket;
+        pfd.events = POLLWRNORM;
+        pfd.revents = 0;
+        if (error != SSL_ERROR_WANT_WRITE || WSAPoll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) {
+            InterlockedIncrement64(&handshake_failures);
+            if (verbose) {
+                char reason[128];
+                ERR_error_string_n(ERR_peek_last_error(), reason, sizeof(reason));
+                printf("Client %d (%s) failed the TLS handshake: %s\n", client->id, client_ip(client), reason);
+            }
+            ERR_clear_error();
+            remove_client(client->id);
+            return 0;
+        }
+    }
+    
+    BIO* bio = BIO_new(record_method);
+    if (bio == NULL) {
+        InterlockedIncrement64(&handshake_failures);
+        remove_client(client->id);
+        return 0;
+    }
+    BIO_set_data(bio, session);
+    BIO_set_init(bio, 1);
+    SSL_set0_wbio(session->ssl, bio);
+    
+    AcquireSRWLockExclusive(&client->out_lock);
+    session->established = 1;
+    client->out.tls = session;
+    ReleaseSRWLockExclusive(&client->out_lock);
+    InterlockedIncrement64(&handshakes);
+    
+    if (verbose) {
+        printf("Client %d (%s) completed the TLS handshake: %s, %s\n", client->id, client_ip(client),
+               SSL_get_version(session->ssl), SSL_get_cipher_name(session->ssl));
+    }
+    return 1;
+}
+
+// Reads plaintext like recv: SOCKET_ERROR with WSAEWOULDBLOCK when no
+// complete record is there yet, 0 after the peer closed
+int tls_recv(Client* client, char* buffer, int len) {
+    TlsSession* session = client->tls;
+    
+    // A read may answer the peer with a record, and fan-out writes under
+    // out_lock from other threads
+    AcquireSRWLockExclusive(&client->out_lock);
+    int result = SSL_read(session->ssl, buffer, len);
+    int error = (result > 0) ? SSL_ERROR_NONE : SSL_get_error(session->ssl, result);
+    ReleaseSRWLockExclusive(&client->out_lock);
+    
+    if (result > 0) return result;
+    if (error == SSL_ERROR_WANT_READ) {
+        WSASetLastError(WSAEWOULDBLOCK);
+        return SOCKET_ERROR;
+    }
+    ERR_clear_error();
+    if (error == SSL_ERROR_ZERO_RETURN) return 0;
+    WSASetLastError(WSAECONNRESET);
+    return SOCKET_ERROR;
+}
+
+// Plaintext OpenSSL decrypted but not returned yet. Poll does not see it,
+// so the worker keeps reading while there is some.
+int tls_buffered(const Client* client) {
+    TlsSession* session = client->tls;
+    return session != NULL && session->established && SSL_pending(session->ssl) > 0;
+}
+
+static int reserve(struct TlsSession* session, int len) {
+    if (session->out_len + len <= session->out_capacity) return 0;
+    
+    int capacity = session->out_capacity ? session->out_capacity : TLS_RECORD_PLAINTEXT + 1024;
+    while (capacity < session->out_len + len) capacity *= 2;
+    char* out = (char*)realloc(session->out, capacity);
+    if (out == NULL) return -1;
+    session->out = out;
+    session->out_capacity = capacity;
+    return 0;
+}
+
+// Where OpenSSL writes a session's records: to the socket
+// directly, and what it does not take into out, so a write never fails for
+// a full socket and SSL_write always takes the whole message
+static int record_write(BIO* bio, const char* data, int len) {
+    TlsSession* session = (TlsSession*)BIO_get_data(bio);
+    int sent = 0;
+    if (session->out_len == session->out_sent) {
+        session->out_len = session->out_sent = 0;
+        sent = send(session->socket, data, len, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                session->broken = 1;
+                return -1;
+            }
+            sent = 0;
+        }
+    }
+    if (sent < len) {
+        if (reserve(session, len - sent) != 0) {
+            session->broken = 1;
+            return -1;
+        }
+        memcpy(session->out + session->out_len, data + sent, len - sent);
+        session->out_len += len - sent;
+    }
+    return len;
+}
+
+static long record_ctrl(BIO* bio, int command, long number, void* pointer) {
+    return (command == BIO_CTRL_FLUSH) ? 1 : 0;
+}
+
+// Writes records that waited for the socket. Called with out_lock held.
+// Returns 1 once none wait, 0 while the socket is full and -1 if it failed.
+// The buffer goes once it is empty, so an idle connection holds none.
+int tls_flush(struct TlsSession* session) {
+    while (session->out_sent < session->out_len) {
+        int sent = send(session->socket, session->out + session->out_sent, session->out_len - session->out_sent, 0);
+        if (sent == SOCKET_ERROR) return (WSAGetLastError() == WSAEWOULDBLOCK) ? 0 : -1;
+        session->out_sent += sent;
+    }
+    free(session->out);
+    session->out = NULL;
+    session->out_len = session->out_sent = session->out_capacity = 0;
+    return 1;
+}
+
+int tls_pending(const struct TlsSession* session) {
+    return session->out_len - session->out_sent;
+}
+
+// Encrypts the buffers and writes the records, like WSASend. Small messages
+// share a record, which saves a header and tag each. All or nothing: once
+// records of an earlier write are on their way it returns the total length,
+// with what the socket did not take waiting for tls_flush; while they still
+// wait it returns SOCKET_ERROR with WSAEWOULDBLOCK. Called with out_lock held.
+int tls_write(struct TlsSession* session, const WSABUF* buffers, int count) {
+    int flushed = tls_flush(session);
+    if (flushed <= 0) {
+        WSASetLastError(flushed == 0 ? WSAEWOULDBLOCK : WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+    
+    char gathered[TLS_RECORD_PLAINTEXT];
+    int used = 0;
+    int total = 0;
+    int failed = 0;
+    for (int i = 0; i <= count && !failed; i++) {
+        int len = (i < count) ? (int)buffers[i].len : 0;
+        
+        // Write what was gathered when this buffer does not fit, or at the end
+        if (used > 0 && (i == count || used + len > TLS_RECORD_PLAINTEXT)) {
+            failed = (SSL_write(session->ssl, gathered, used) != used);
+            used = 0;
+        }
+        if (i == count || failed) break;
+        
+        if (len <= TLS_RECORD_PLAINTEXT / 4) {
+            memcpy(gathered + used, buffers[i].buf, len);
+            used += len;
+        } else {
+            failed = (SSL_write(session->ssl, buffers[i].buf, len) != len);
+        }
+        total += len;
+    }
+    if (failed || session->broken) {
+        ERR_clear_error();
+        WSASetLastError(WSAECONNRESET);
+        return SOCKET_ERROR;
+    }
+    InterlockedAdd64(&encrypted_bytes, total);
+    return total;
+}
+
+// Writes everything, waiting for the socket to drain when needed, like
+// send_all. Called with out_lock held.
+int tls_send_all(struct TlsSession* session, const char* data, int len) {
+    WSABUF buffer;
+    buffer.buf = (char*)data;
+    buffer.len = len;
+    
+    int written = 0;
+    while (1) {
+        int flushed = 1;
+        if (!written) {
+            if (tls_write(session, &buffer, 1) == len) {
+                written = 1;
+                continue;
+            }
+            if (WSAGetLastError() != WSAEWOULDBLOCK) return -1;
+        } else {
+            flushed = tls_flush(session);
+            if (flushed < 0) return -1;
+            if (flushed == 1) return 0;
+        }
+        
+        WSAPOLLFD pfd;
+        pfd.fd = session->socket;
+        pfd.events = POLLWRNORM;
+        pfd.revents = 0;
+        if (WSAPoll(&pfd, 1, SEND_TIMEOUT_MS) <= 0) return -1;
+    }
+}
+
+int tls_report(char* out, int size) {
+    if (tls_port == 0) {
+        return snprintf(out, size, "TLS: off; no --tls-port\n");
+    }
+    
+    int len = snprintf(out, size,
+                       "TLS: port %d, records encrypted in user space (Winsock has no kernel TLS offload)\n"
+                       "  Handshakes: %lld completed, %lld failed\n"
+                       "  Connections: %ld open\n"
+                       "  Encrypted: %lld bytes\n",
+                       tls_port, (long long)handshakes, (long long)handshake_failures,
+                       (long)open_sessions, (long long)encrypted_bytes);
+    return len < size ? len : size - 1;
+}
+
+#else
+
+int tls_init() {
+    if (tls_port == 0) return 0;
+    printf("This server was built without TLS; build it with -DWITH_TLS and -lssl -lcrypto for --tls-port\n");
+    return -1;
+}
+
+void tls_cleanup() {
+}
+
+int tls_accept(Client* client) {
+    return -1;
+}
+
+void tls_close(Client* client) {
+}
+
+int tls_handshaking(const Client* client) {
+    return 0;
+}
+
+int tls_handshake(Client* client) {
+    return 1;
+}
+
+int tls_recv(Client* client, char* buffer, int len) {
+    return recv(client->socket, buffer, len, 0);
+}
+
+int tls_buffered(const Client* client) {
+    return 0;
+}
+
+int tls_flush(struct TlsSession* session) {
+    return 1;
+}
+
+int tls_pending(const struct TlsSession* session) {
+    return 0;
+}
+
+int tls_write(struct TlsSession* session, const WSABUF* buffers, int count) {
+    WSASetLastError(WSAECONNRESET);
+    return SOCKET_ERROR;
+}
+
+int tls_send_all(struct TlsSession* session, const char* data, int len) {
+    return -1;
+}
+
+int tls_report(char* out, int size) {
+    int len = snprintf(out, size, "TLS: not built in; build the server with -DWITH_TLS and -lssl -lcrypto\n");
+    return len < size ? len : size - 1;
+}
+
+#endif
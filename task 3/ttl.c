@@ -0,0 +1,115 @@
+#include "server.h"
+
+#define MAX_TTL_MS 86400000        // A day; longer lived data belongs in the topic log
+
+// Expired messages of one topic
+typedef struct {
+    volatile LONG64 skipped;       // Passed over when their queue was flushed
+    volatile LONG64 reaped;        // Dropped to make room in a full queue
+} TopicExpiry;
+
+// By wire topic id, 0 for messages without one; made at the first expiry,
+// so a broker without TTLs never allocates it
+static TopicExpiry* volatile expiries = NULL;
+
+// The deadline of a message published now with the given TTL, 0 for none
+ULONGLONG ttl_deadline(int ttl_ms) {
+    return (ttl_ms > 0) ? GetTickCount64() + ttl_ms : 0;
+}
+
+// Parses a TTL in milliseconds for --ttl and the "~MS " prefix
+int parse_ttl(const char* text, int length, int* ttl_ms) {
+    if (length < 1 || length > 8) return -1;
+    
+    int value = 0;
+    for (int i = 0; i < length; i++) {
+        if (text[i] < '0' || text[i] > '9') return -1;
+        value = value * 10 + (text[i] - '0');
+    }
+    if (value > MAX_TTL_MS) return -1;
+    *ttl_ms = value;
+    return 0;
+}
+
+// Strips a leading "~MS " TTL override from a payload; "~0 " publishes a
+// message that never expires on a topic with a TTL
+int parse_message_ttl(const char** payload, int* length, int* ttl_ms) {
+    const char* text = *payload;
+    if (*length < 3 || text[0] != '~') return 0;
+    
+    int i = 1;
+    while (i < *length && text[i] != ' ' && text[i] != '\n') i++;
+    if (i == *length || text[i] != ' ' || parse_ttl(text + 1, i - 1, ttl_ms) != 0) return 0;
+    
+    *payload += i + 1;
+    *length -= i + 1;
+    return 1;
+}
+
+// Counts one expired message. Called with a subscriber's outbound lock
+// held, so it takes no lock of its own.
+void ttl_expired(UINT32 topic_id, int reaped) {
+    TopicExpiry* counts = expiries;
+    if (counts == NULL) {
+        counts = (TopicExpiry*)calloc(MAX_WIRE_TOPICS + 1, sizeof(TopicExpiry));
+        if (counts == NULL) return;
+        TopicExpiry* first = (TopicExpiry*)InterlockedCompareExchangePointer((PVOID volatile*)&expiries, counts, NULL);
+        if (first != NULL) {
+            free(counts);
+            counts = first;
+        }
+    }
+    if (topic_id > MAX_WIRE_TOPICS) topic_id = 0;
+    InterlockedIncrement64(reaped ? &counts[topic_id].reaped : &counts[topic_id].skipped);
+}
+
+// Starts the counts of a topic id over when it passes to another topic
+void ttl_topic_reused(UINT32 topic_id) {
+    TopicExpiry* counts = expiries;
+    if (counts == NULL || topic_id > MAX_WIRE_TOPICS) return;
+    counts[topic_id].skipped = 0;
+    counts[topic_id].reaped = 0;
+}
+
+int ttl_report(char* out, int size) {
+    int configured = 0;
+    for (int i = 0; i < topic_policy_count; i++) configured += (topic_policies[i].ttl_ms > 0);
+    
+    TopicExpiry* counts = expiries;
+    LONG64 skipped = 0, reaped = 0;
+    int topics = wire_topic_count();
+    for (int id = 0; counts != NULL && id <= topics; id++) {
+        skipped += counts[id].skipped;
+        reaped += counts[id].reaped;
+    }
+    
+    int len = snprintf(out, size,
+                       "Message expiry: %d topic(s) with a TTL (--ttl), others only by \"~MS \" prefix\n"
+                       "  Expired: %lld skipped when their queue was flushed, %lld reaped from full queues\n",
+                       configured, (long long)skipped, (long long)reaped);
+    for (int i = 0; i < topic_policy_count && len < size; i++) {
+        if (topic_policies[i].ttl_ms > 0) {
+            len += snprintf(out + len, size - len, "  TTL of '%s': %d ms\n", topic_policies[i].topic, topic_policies[i].ttl_ms);
+        }
+    }
+    
+    // Leave room for the last line
+    int unlisted = 0;
+    for (int id = 0; counts != NULL && id <= topics; id++) {
+        if (counts[id].skipped == 0 && counts[id].reaped == 0) continue;
+        if (len >= size - 256) {
+            unlisted++;
+            continue;
+        }
+        const char* topic = wire_topic_name(id);
+        if (topic != NULL) {
+            len += snprintf(out + len, size - len, "  Topic '%s': %lld skipped, %lld reaped\n",
+                            topic, (long long)counts[id].skipped, (long long)counts[id].reaped);
+        } else {
+            len += snprintf(out + len, size - len, "  Topics beyond the id limit: %lld skipped, %lld reaped\n",
+                            (long long)counts[id].skipped, (long long)counts[id].reaped);
+        }
+    }
+    if (unlisted > 0) len += snprintf(out + len, size - len, "  ... and %d more\n", unlisted);
+    return len < size ? len : size - 1;
+}
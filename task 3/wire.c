@@ -0,0 +1,414 @@
+#include "server.h"
+
+#define TOPIC_INDEX_SIZE (2 * MAX_WIRE_TOPICS)   // Power of two, never more than half full
+
+// Topic ids are handed out from 1 and held by the clients registered for a
+// topic and the messages published to it, so a binary client keeps the id
+// from its registration reply. An id nobody holds stays with its topic,
+// which gets it back if it returns, until every id was handed out once;
+// then it goes to the next new topic. A hot restart passes them on.
+static char topic_names[MAX_WIRE_TOPICS + 1][MAX_TOPIC_LENGTH];
+static volatile LONG topic_refs[MAX_WIRE_TOPICS + 1];
+static volatile LONG topic_index[TOPIC_INDEX_SIZE];
+static volatile LONG topic_count = 0;
+static CRITICAL_SECTION topics_lock;
+
+// Ids whose last reference went, oldest first; under topics_lock
+static int free_ids[MAX_WIRE_TOPICS];
+static char freed[MAX_WIRE_TOPICS + 1];
+static int free_head = 0;
+static int free_count = 0;
+static LONG64 ids_reused = 0;
+
+static volatile LONG64 frames_received = 0;
+static volatile LONG64 frames_rejected = 0;
+static volatile LONG64 encoded_text = 0;
+static volatile LONG64 encoded_binary = 0;
+
+// Function prototypes
+static int handle_frame(Client* client, const char* frame, const MessageTrace* ingress);
+
+void wire_init() {
+    InitializeCriticalSection(&topics_lock);
+}
+
+static unsigned int hash_topic(const char* topic) {
+    unsigned int hash = 2166136261u;   // FNV-1a
+    while (*topic) {
+        hash ^= (unsigned char)*topic++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the topic's id, or 0 with the index slot it would take. Without
+// topics_lock it may miss a topic that is being moved or read a name that
+// is being replaced, so a caller without the lock checks what it found.
+static int lookup_topic(const char* topic, unsigned int hash, int* empty) {
+    for (int i = hash & (TOPIC_INDEX_SIZE - 1); ; i = (i + 1) & (TOPIC_INDEX_SIZE - 1)) {
+        LONG id = topic_index[i];
+        if (id == 0) {
+            *empty = i;
+            return 0;
+        }
+        if (strcmp(topic_names[id], topic) == 0) return id;
+    }
+}
+
+// Takes a reference on an id somebody already holds
+static int hold_if_held(int id) {
+    LONG refs = topic_refs[id];
+    while (refs > 0) {
+        LONG seen = InterlockedCompareExchange(&topic_refs[id], refs + 1, refs);
+        if (seen == refs) return 1;
+        refs = seen;
+    }
+    return 0;
+}
+
+// Takes an id nobody holds away from its old topic. Linear probing leaves
+// no holes: later entries of the run move up into the freed index slot.
+// Called with topics_lock held.
+static void unlink_topic(int id) {
+    int mask = TOPIC_INDEX_SIZE - 1;
+    int i = hash_topic(topic_names[id]) & mask;
+    while (topic_index[i] != id) i = (i + 1) & mask;
+    
+    for (int j = (i + 1) & mask; topic_index[j] != 0; j = (j + 1) & mask) {
+        int home = hash_topic(topic_names[topic_index[j]]) & mask;
+        int between = (i <= j) ? (home > i && home <= j) : (home > i || home <= j);
+        if (between) continue;
+        topic_index[i] = topic_index[j];
+        i = j;
+    }
+    topic_index[i] = 0;
+}
+
+// The next id for a new topic: one never handed out, else the one that
+// has been free longest. Called with topics_lock held.
+static int next_free_id() {
+    if (topic_count < MAX_WIRE_TOPICS) return topic_count + 1;
+    
+    while (free_count > 0) {
+        int id = free_ids[free_head];
+        free_head = (free_head + 1) % MAX_WIRE_TOPICS;
+        free_count--;
+        freed[id] = 0;
+        if (topic_refs[id] == 0) return id;   // Else its topic came back
+    }
+    return 0;
+}
+
+// Looks up a topic's id and takes a reference on it, assigning an id on
+// first use. The lookup takes no lock while the topic is held. Returns 0
+// if the name is too long or every id is held.
+int wire_topic_id(const char* topic) {
+    size_t length = strlen(topic) + 1;
+    if (length > MAX_TOPIC_LENGTH) return 0;
+    
+    unsigned int hash = hash_topic(topic);
+    int empty = 0;
+    int id = lookup_topic(topic, hash, &empty);
+    if (id != 0 && hold_if_held(id)) {
+        if (strcmp(topic_names[id], topic) == 0) return id;
+        wire_topic_release(id);
+    }
+    
+    EnterCriticalSection(&topics_lock);
+    id = lookup_topic(topic, hash, &empty);
+    if (id != 0) {
+        InterlockedIncrement(&topic_refs[id]);
+    } else if ((id = next_free_id()) != 0) {
+        if (id <= topic_count) {
+            unlink_topic(id);
+            lookup_topic(topic, hash, &empty);
+            ttl_topic_reused(id);
+            ids_reused++;
+        }
+        memcpy(topic_names[id], topic, length);
+        topic_refs[id] = 1;
+        MemoryBarrier();
+        topic_index[empty] = id;
+        if (id > topic_count) topic_count = id;
+    }
+    LeaveCriticalSection(&topics_lock);
+    return id;
+}
+
+// Takes another reference on an id the caller holds
+void wire_topic_hold(int id) {
+    if (id > 0 && id <= topic_count) InterlockedIncrement(&topic_refs[id]);
+}
+
+void wire_topic_release(int id) {
+    if (id <= 0 || id > topic_count || InterlockedDecrement(&topic_refs[id]) != 0) return;
+    
+    EnterCriticalSection(&topics_lock);
+    if (topic_refs[id] == 0 && !freed[id]) {
+        freed[id] = 1;
+        free_ids[(free_head + free_count) % MAX_WIRE_TOPICS] = id;
+        free_count++;
+    }
+    LeaveCriticalSection(&topics_lock);
+}
+
+// The topic an id stands for; an id nobody holds keeps the name of its
+// last topic until it is reused
+const char* wire_topic_name(int id) {
+    return (id > 0 && id <= topic_count) ? topic_names[id] : NULL;
+}
+
+int wire_topic_count() {
+    return topic_count;
+}
+
+// Handles a chunk of data from a binary client: every frame that is
+// complete in the buffer is handled in place, and one split across receives
+// is gathered in client->partial first. Returns 0 once the client was
+// removed.
+int wire_receive(Client* client, const char* data, int length) {
+    MessageTrace trace;
+    latency_begin(&trace, client->topic, client->topic_id);
+    
+    int pos = 0;
+    while (pos < length) {
+        int available = length - pos;
+        if (client->partial_len == 0 && available >= (int)sizeof(WireHeader)) {
+            const WireHeader* header = (const WireHeader*)(data + pos);
+            int size = (int)sizeof(WireHeader) + (int)header->length;
+            if (header->length <= (UINT32)MAX_WIRE_PAYLOAD && available >= size) {
+                if (!handle_frame(client, data + pos, &trace)) return 0;
+                pos += size;
+                continue;
+            }
+        }
+        
+        if (client->partial == NULL) {
+            client->partial = (char*)pool_alloc(BUFFER_SIZE);
+            if (client->partial == NULL) {
+                printf("Out of memory buffering client %d\n", client->id);
+                remove_client(client->id);
+                return 0;
+            }
+        }
+        
+        // The header first, then as much payload as it announces
+        int needed = (int)sizeof(WireHeader);
+        if (client->partial_len >= needed) needed += (int)((WireHeader*)client->partial)->length;
+        int take = (needed - client->partial_len < available) ? needed - client->partial_len : available;
+        memcpy(client->partial + client->partial_len, data + pos, take);
+        client->partial_len += take;
+        pos += take;
+        
+        // A frame too long to be one is rejected as soon as its header is in
+        if (client->partial_len < (int)sizeof(WireHeader)) continue;
+        const WireHeader* header = (const WireHeader*)client->partial;
+        if (header->length <= (UINT32)MAX_WIRE_PAYLOAD &&
+            client->partial_len < (int)sizeof(WireHeader) + (int)header->length) continue;
+        client->partial_len = 0;
+        if (!handle_frame(client, client->partial, &trace)) return 0;
+    }
+    release_partial(client);
+    return 1;
+}
+
+// Publishes one frame. The broker's fields are patched into the copy that
+// goes to the subscribers; nothing is parsed or formatted. A subscriber has
+// nothing to publish, so its frames are dropped, and so are notice frames.
+// Session frames open and close the sessions of a multiplexed connection.
+// A frame that is not one ends the connection.
+static int handle_frame(Client* client, const char* frame, const MessageTrace* ingress) {
+    const WireHeader* header = (const WireHeader*)frame;
+    if (header->magic != WIRE_MAGIC || header->version != WIRE_VERSION || header->length > (UINT32)MAX_WIRE_PAYLOAD) {
+        InterlockedIncrement64(&frames_rejected);
+        printf("Client %d (%s) sent an invalid frame\n", client->id, client_ip(client));
+        remove_client(client->id);
+        return 0;
+    }
+    InterlockedIncrement64(&frames_received);
+    
+    // A notice from a client is a PONG or nothing the broker knows
+    if (header->flags & WIRE_FLAG_NOTICE) {
+        heartbeat_reply(frame + sizeof(WireHeader), (int)header->length);
+        return 1;
+    }
+    if (header->flags & WIRE_FLAG_SESSION) return mux_control(client, header, frame + sizeof(WireHeader));
+    
+    // A multiplexed connection publishes as the session the frame names
+    Client* carrier = NULL;
+    if (client->type == CLIENT_MUX) {
+        carrier = client;
+        client = mux_session(carrier, header->session);
+        if (client == NULL) return 1;
+    }
+    if (client->type != CLIENT_PUBLISHER) return 1;
+    
+    // A named producer's retransmission carries the sequence it had before
+    if (client->producer != NULL && header->sequence != 0 && !dedup_accept(client->producer, header->sequence)) {
+        if (verbose) printf("Dropped duplicate %llu of producer '%s'\n", (unsigned long long)header->sequence,
+                            dedup_producer_name(client->producer));
+        return 1;
+    }
+    
+    MessageTrace trace = *ingress;
+    trace.topic_id = client->topic_id;
+    const char* payload = frame + sizeof(WireHeader);
+    int size = (int)sizeof(WireHeader) + (int)header->length;
+    if (verbose) {
+        printf("[%s] Publisher %d (%s): %u byte frame\n", client->topic, client->id, client_ip(client), header->length);
+    }
+    
+    capture_event(CAPTURE_PUBLISH, client->id, client->topic, payload, header->length);
+    rate_publish(client, header->length);
+    
+    // Only the connection can stop being read, so a session over its limit
+    // pauses every session on it
+    if (carrier != NULL && client->throttle_ms > 0) {
+        if (client->throttle_ms > carrier->throttle_ms) carrier->throttle_ms = client->throttle_ms;
+        client->throttle_ms = 0;
+    }
+    
+    Message* message = message_create(size);
+    if (message == NULL) return 1;
+    memcpy(message->data, frame, size);
+    message->length = size;
+    message->binary = 1;
+    message->payload_offset = sizeof(WireHeader);
+    
+    // Subscribers see the class the message was delivered in
+    TopicPolicy* policy = find_topic_policy(client->topic);
+    WireHeader* stamped = (WireHeader*)message->data;
+    message->priority = policy ? policy->priority : PRIORITY_NORMAL;
+    if (stamped->flags & WIRE_PRIORITY_MASK) message->priority = (Priority)((stamped->flags & WIRE_PRIORITY_MASK) - 1);
+    message->expires = ttl_deadline(policy ? policy->ttl_ms : 0);
+    stamped->flags = (UINT8)((stamped->flags & ~WIRE_PRIORITY_MASK) | (message->priority + 1));
+    stamped->topic_id = client->route_id;
+    wire_topic_hold(client->route_id);
+    stamped->publisher_id = client->id;
+    stamped->origin = 0;
+    stamped->session = 0;
+    client->sequence++;
+    if (stamped->sequence == 0) stamped->sequence = client->sequence;
+    if (stamped->timestamp == 0) stamped->timestamp = wire_now();
+    message->wire = *stamped;
+    
+    if (policy && policy->conflated && stamped->key != 0) {
+        snprintf(message->key, MAX_KEY_LENGTH, "%llx", (unsigned long long)stamped->key);
+        message->conflated = 1;
+    }
+    latency_stamp(&trace, TRACE_PARSE);
+    
+    // Other brokers take text; the conversion is kept for local text subscribers
+    if (federation_peer_count() > 0) {
+        Message* text = message_encoded(message, 0);
+        if (text != NULL) {
+            forward_to_peers(text->data + text->payload_offset, text->length - text->payload_offset,
+                             client->topic, client->id);
+        }
+    }
+    broadcast_to_topic_subscribers(message, client->topic, client->id, &trace);
+    return 1;
+}
+
+// The text line of a binary message: "[TOPIC] Publisher ID: payload", with
+// a newline added if the payload has none
+static Message* encode_text(const Message* message) {
+    const char* topic = wire_topic_name(message->wire.topic_id);
+    const char* payload = message->data + message->payload_offset;
+    int length = (int)message->wire.length;
+    int newline = (length == 0 || payload[length - 1] != '\n');
+    
+    int capacity = length + MAX_TOPIC_LENGTH + 64;
+    Message* copy = message_create(capacity);
+    if (copy == NULL) return NULL;
+    
+    int prefix;
+    if (message->wire.origin > 0) {
+        prefix = snprintf(copy->data, capacity, "[%s] Publisher %u@%u: ", topic ? topic : "?",
+                          message->wire.publisher_id, message->wire.origin);
+    } else {
+        prefix = snprintf(copy->data, capacity, "[%s] Publisher %u: ", topic ? topic : "?", message->wire.publisher_id);
+    }
+    memcpy(copy->data + prefix, payload, length);
+    if (newline) copy->data[prefix + length] = '\n';
+    copy->length = prefix + length + newline;
+    copy->payload_offset = prefix;
+    InterlockedIncrement64(&encoded_text);
+    return copy;
+}
+
+// The frame of a text message. Lines that are no topic message, such as
+// THROTTLED notices, travel whole as the payload of a notice frame.
+static Message* encode_binary(const Message* message) {
+    int length = message->length - message->payload_offset;
+    Message* copy = message_create(sizeof(WireHeader) + length);
+    if (copy == NULL) return NULL;
+    
+    WireHeader* header = (WireHeader*)copy->data;
+    if (message->wire.magic == WIRE_MAGIC) {
+        *header = message->wire;
+    } else {
+        memset(header, 0, sizeof(WireHeader));
+        header->magic = WIRE_MAGIC;
+        header->version = WIRE_VERSION;
+        header->flags = WIRE_FLAG_NOTICE;
+        header->timestamp = wire_now();
+    }
+    header->length = length;
+    memcpy(copy->data + sizeof(WireHeader), message->data + message->payload_offset, length);
+    copy->length = sizeof(WireHeader) + length;
+    copy->binary = 1;
+    copy->payload_offset = sizeof(WireHeader);
+    InterlockedIncrement64(&encoded_binary);
+    return copy;
+}
+
+// Returns the message in the encoding a subscriber reads: the message
+// itself, or its alternate, which is made once and kept with the message.
+// The caller's reference to the message covers the alternate. NULL if out
+// of memory.
+Message* message_encoded(Message* message, int binary) {
+    if (message->binary == binary) return message;
+    
+    Message* alternate = message->alternate;
+    if (alternate != NULL) return alternate;
+    
+    alternate = binary ? encode_binary(message) : encode_text(message);
+    if (alternate == NULL) return NULL;
+    alternate->wire = message->wire;
+    wire_topic_hold(alternate->wire.topic_id);
+    alternate->priority = message->priority;
+    alternate->conflated = message->conflated;
+    memcpy(alternate->key, message->key, MAX_KEY_LENGTH);
+    alternate->chunk = message->chunk;
+    alternate->expires = message->expires;
+    
+    // Two threads may convert the same message; the first one's copy is kept
+    Message* first = (Message*)InterlockedCompareExchangePointer((PVOID volatile*)&message->alternate, alternate, NULL);
+    if (first != NULL) {
+        message_release(alternate);
+        return first;
+    }
+    return alternate;
+}
+
+int wire_report(char* out, int size) {
+    int publishers = 0, subscribers = 0;
+    EnterCriticalSection(&clients_mutex);
+    for (int i = 0; i < max_clients; i++) {
+        if (clients[i].socket == INVALID_SOCKET || !clients[i].binary) continue;
+        if (clients[i].type == CLIENT_PUBLISHER) publishers++;
+        if (clients[i].type == CLIENT_SUBSCRIBER) subscribers++;
+    }
+    LeaveCriticalSection(&clients_mutex);
+    
+    int len = snprintf(out, size,
+                       "Wire: %d byte header, %d byte payloads at most, %ld topic ids (%lld reused)\n"
+                       "  Binary connections: %d publishers, %d subscribers\n"
+                       "  Frames received: %lld, rejected: %lld\n"
+                       "  Converted for subscribers of the other encoding: %lld to text, %lld to binary\n",
+                       (int)sizeof(WireHeader), MAX_WIRE_PAYLOAD, (long)topic_count, (long long)ids_reused, publishers, subscribers,
+                       (long long)frames_received, (long long)frames_rejected,
+                       (long long)encoded_text, (long long)encoded_binary);
+    return len < size ? len : size - 1;
+}
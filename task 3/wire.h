@@ -0,0 +1,53 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <winsock2.h>
+
+#define WIRE_MAGIC 0x5742          // "BW" in memory
+#define WIRE_VERSION 1
+#define MAX_WIRE_FRAME 1023        // Header and payload, no longer than a text line
+#define MAX_WIRE_PAYLOAD (MAX_WIRE_FRAME - (int)sizeof(WireHeader))
+
+// Bits of WireHeader.flags
+#define WIRE_PRIORITY_MASK 0x03    // 0: the topic's class, else HIGH, NORMAL or LOW plus one
+#define WIRE_FLAG_CHUNK 0x04       // Payload is a large message chunk frame, header line and bytes
+#define WIRE_FLAG_NOTICE 0x08      // Payload is a line from the broker, such as "THROTTLED <MS>"
+#define WIRE_FLAG_SESSION 0x10     // Opens or closes a session of a multiplexed connection (mux.c)
+
+// Content types are chosen by publishers and passed through untouched;
+// values above these are the application's own
+typedef enum {
+    WIRE_CONTENT_TEXT = 0,
+    WIRE_CONTENT_BYTES = 1,
+    WIRE_CONTENT_JSON = 2
+} WireContent;
+
+// Fixed header in front of every message on a binary connection, in the
+// machine's (little-endian) byte order. Every field is naturally aligned, so
+// it is read and written in place in a receive buffer. Publishers fill in
+// flags, content_type, key and optionally sequence and timestamp; the broker
+// patches in topic_id, publisher_id and origin, and sequence and timestamp
+// when they are 0.
+typedef struct {
+    UINT16 magic;
+    UINT8 version;
+    UINT8 flags;
+    UINT32 length;                 // Payload bytes after the header
+    UINT32 topic_id;               // Broker's id of the topic, from the "OK <ID> <TOPIC_ID>" reply
+    UINT32 publisher_id;
+    UINT16 origin;                 // Broker node the message came from, 0 for this one
+    UINT16 content_type;
+    UINT32 session;                // Session of a multiplexed connection that publishes it, else 0
+    UINT64 sequence;               // Per publisher, from 1
+    UINT64 timestamp;              // Microseconds since 1970 UTC
+    UINT64 key;                    // Conflation or partition key, 0 for none
+} WireHeader;
+
+// Microseconds since 1970 UTC
+static inline UINT64 wire_now() {
+    FILETIME now;
+    GetSystemTimePreciseAsFileTime(&now);
+    return ((((UINT64)now.dwHighDateTime << 32) | now.dwLowDateTime) - 116444736000000000ULL) / 10;
+}
+
+#endif
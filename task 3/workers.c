@@ -0,0 +1,782 @@
+#include "server.h"
+
+#define ACCEPT_BATCH 256
+#define INITIAL_INBOX_CAPACITY 256
+#define INITIAL_POLL_CAPACITY 64
+
+// Publisher the worker stopped reading from until its rate limit allows
+typedef struct {
+    int client_id;
+    ULONGLONG until;               // GetTickCount64() when reading resumes
+} Throttle;
+
+// Paused publisher that may send again, by its slot and the slot's generation
+typedef struct {
+    int id;
+    LONG generation;
+} ReadRequest;
+
+// Accepted connection waiting to be adopted by a worker
+typedef struct {
+    SOCKET socket;
+    struct sockaddr_in address;
+    int tls;                       // Came in on the TLS listener
+} PendingConnection;
+
+// A worker polls all connections it owns with WSAPoll. New connections
+// arrive through its inbox, and a datagram on wake_socket interrupts the
+// poll so they are picked up immediately.
+typedef struct {
+    int index;
+    CRITICAL_SECTION inbox_lock;
+    PendingConnection* inbox;      // Filled by the acceptor
+    int inbox_count;
+    int inbox_capacity;
+    PendingConnection* spare;      // Swapped with inbox when adopting
+    int spare_capacity;
+    int* write_requests;           // Ids of clients with queued output, under inbox_lock
+    int write_count;
+    int write_capacity;
+    ReadRequest* read_requests;    // Paused publishers that may send again, under inbox_lock
+    int read_count;
+    int read_capacity;
+    int* resumed;                  // Ids of clients handed back by catch-up sessions, under inbox_lock
+    int resumed_count;
+    int resumed_capacity;
+    Throttle* throttles;           // Owned by the worker thread
+    int throttle_count;
+    int throttle_capacity;
+    int* tls_ready;                // Ids of TLS clients whose decrypted input OpenSSL holds, owned by the worker thread
+    int tls_ready_count;
+    int tls_ready_capacity;
+    SOCKET wake_socket;
+    struct sockaddr_in wake_address;
+    volatile LONG wake_pending;
+    WSAPOLLFD* fds;                // fds[0] is the wake socket
+    Client** conns;                // conns[i] is polled through fds[i]
+    int count;
+    int capacity;
+    struct BusyPoll* busy;         // Spin state of a busy-poll worker, NULL for the others
+} Worker;
+
+// Global variables
+Worker* workers = NULL;
+
+// Interrupts the acceptor's poll, like a worker's wake socket
+static SOCKET acceptor_wake = INVALID_SOCKET;
+static struct sockaddr_in acceptor_wake_address;
+
+// Function prototypes
+SOCKET create_wake_socket(struct sockaddr_in* address);
+void wake_worker(Worker* worker);
+unsigned __stdcall worker_thread(void* arg);
+void adopt_connections(Worker* worker);
+int track_connection(Worker* worker, Client* client);
+void enable_write_polling(Worker* worker);
+void enable_read_polling(Worker* worker);
+int serve_ingress(Worker* worker, int index);
+void throttle_client(Worker* worker, Client* client);
+int resume_throttled(Worker* worker);
+int flush_client(Worker* worker, int index);
+void drop_connection(Worker* worker, int index);
+void note_tls_ready(Worker* worker, Client* client);
+int tls_ready_waiting(Worker* worker, int mark);
+void hand_off(PendingConnection* batch, int count, int* next_worker);
+void accept_batches(SOCKET listener, int tls, PendingConnection* batch, int* next_worker);
+
+// The number of workers and their CPUs were decided by plan_workers.
+// Busy-poll workers follow the others and take no new connections; they
+// serve the connections of busy-poll topics once those registered.
+int start_workers() {
+    int total = worker_count + busy_poll_workers;
+    workers = (Worker*)calloc(total, sizeof(Worker));
+    if (workers == NULL) {
+        printf("Failed to allocate %d workers\n", total);
+        return -1;
+    }
+    
+    for (int i = 0; i < total; i++) {
+        Worker* worker = &workers[i];
+        worker->index = i;
+        worker->busy = (i >= worker_count) ? busy_poll_state(i - worker_count) : NULL;
+        InitializeCriticalSection(&worker->inbox_lock);
+        worker->inbox_capacity = worker->spare_capacity = INITIAL_INBOX_CAPACITY;
+        worker->inbox = (PendingConnection*)malloc(INITIAL_INBOX_CAPACITY * sizeof(PendingConnection));
+        worker->spare = (PendingConnection*)malloc(INITIAL_INBOX_CAPACITY * sizeof(PendingConnection));
+        worker->write_capacity = INITIAL_INBOX_CAPACITY;
+        worker->write_requests = (int*)malloc(INITIAL_INBOX_CAPACITY * sizeof(int));
+        worker->read_capacity = INITIAL_INBOX_CAPACITY;
+        worker->read_requests = (ReadRequest*)malloc(INITIAL_INBOX_CAPACITY * sizeof(ReadRequest));
+        worker->resumed_capacity = INITIAL_INBOX_CAPACITY;
+        worker->resumed = (int*)malloc(INITIAL_INBOX_CAPACITY * sizeof(int));
+        worker->throttle_capacity = INITIAL_INBOX_CAPACITY;
+        worker->throttles = (Throttle*)malloc(INITIAL_INBOX_CAPACITY * sizeof(Throttle));
+        worker->capacity = INITIAL_POLL_CAPACITY;
+        worker->fds = (WSAPOLLFD*)malloc(INITIAL_POLL_CAPACITY * sizeof(WSAPOLLFD));
+        worker->conns = (Client**)malloc(INITIAL_POLL_CAPACITY * sizeof(Client*));
+        worker->wake_socket = create_wake_socket(&worker->wake_address);
+        
+        if (worker->inbox == NULL || worker->spare == NULL || worker->write_requests == NULL || worker->read_requests == NULL ||
+            worker->resumed == NULL || worker->throttles == NULL ||
+            worker->fds == NULL || worker->conns == NULL || worker->wake_socket == INVALID_SOCKET) {
+            printf("Failed to initialize worker %d\n", i);
+            return -1;
+        }
+        
+        worker->fds[0].fd = worker->wake_socket;
+        worker->fds[0].events = POLLRDNORM;
+        worker->fds[0].revents = 0;
+        worker->conns[0] = NULL;
+        worker->count = 1;
+        
+        HANDLE thread = (HANDLE)_beginthreadex(NULL, 0, worker_thread, worker, 0, NULL);
+        if (thread == NULL) {
+            printf("Failed to create worker thread %d\n", i);
+            return -1;
+        }
+        CloseHandle(thread);
+    }
+    
+    printf("Started %d connection workers (listen backlog %d)\n", worker_count, listen_backlog);
+    if (busy_poll_workers > 0) {
+        printf("Started %d busy-poll worker(s), spinning up to %d us after the last message\n",
+               busy_poll_workers, busy_poll_us);
+    }
+    print_placement();
+    return 0;
+}
+
+// Loopback UDP socket used only to interrupt the worker's WSAPoll
+SOCKET create_wake_socket(struct sockaddr_in* address) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock == INVALID_SOCKET) return INVALID_SOCKET;
+    
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address->sin_port = 0;
+    
+    int addr_len = sizeof(*address);
+    if (bind(sock, (struct sockaddr*)address, sizeof(*address)) < 0 ||
+        getsockname(sock, (struct sockaddr*)address, &addr_len) < 0) {
+        closesocket(sock);
+        return INVALID_SOCKET;
+    }
+    
+    u_long nonblocking = 1;
+    ioctlsocket(sock, FIONBIO, &nonblocking);
+    return sock;
+}
+
+// At most one wake datagram is in flight per worker
+void wake_worker(Worker* worker) {
+    if (InterlockedExchange(&worker->wake_pending, 1) == 0) {
+        sendto(worker->wake_socket, "w", 1, 0,
+               (struct sockaddr*)&worker->wake_address, sizeof(worker->wake_address));
+    }
+}
+
+unsigned __stdcall worker_thread(void* arg) {
+    Worker* worker = (Worker*)arg;
+    int timeout = -1;
+    pin_thread(worker_cpu_of(worker->index), "worker");
+    
+    while (1) {
+        int ready = WSAPoll(worker->fds, worker->count, timeout);
+        if (ready == SOCKET_ERROR) {
+            printf("Worker %d poll failed. Error: %d\n", worker->index, WSAGetLastError());
+            Sleep(10);
+            continue;
+        }
+        
+        // Input OpenSSL already decrypted does not make the socket readable
+        if (worker->tls_ready_count > 0) tls_ready_waiting(worker, 1);
+        
+        for (int i = 1; i < worker->count; i++) {
+            short revents = worker->fds[i].revents;
+            if (revents == 0) continue;
+            worker->fds[i].revents = 0;
+            
+            int keep = 1;
+            if (revents & POLLWRNORM) keep = flush_client(worker, i);
+            if (keep && (revents & ~POLLWRNORM)) keep = serve_ingress(worker, i);
+            
+            if (!keep) {
+                // The last entry moves into this slot; it keeps its revents
+                // and is serviced on the next iteration
+                drop_connection(worker, i);
+                i--;
+            }
+        }
+        
+        if (worker->fds[0].revents != 0) {
+            worker->fds[0].revents = 0;
+            adopt_connections(worker);
+            enable_write_polling(worker);
+            enable_read_polling(worker);
+            handoff_checkpoint(0);
+        }
+        
+        // Sleeps only until the next throttled publisher may send again;
+        // a busy-poll worker does not sleep while its topics are busy
+        timeout = resume_throttled(worker);
+        if (worker->busy != NULL) timeout = busy_poll_wait(worker->busy, ready, timeout);
+        if (worker->tls_ready_count > 0 && tls_ready_waiting(worker, 0)) timeout = 0;
+    }
+    
+    return 0;
+}
+
+// Registers every connection waiting in the inbox and starts polling it,
+// along with clients returning from a catch-up session
+void adopt_connections(Worker* worker) {
+    char drain[16];
+    
+    // Clear the flag before draining so a hand-off that races with us
+    // sends a fresh datagram
+    InterlockedExchange(&worker->wake_pending, 0);
+    while (recv(worker->wake_socket, drain, sizeof(drain), 0) > 0) {
+    }
+    
+    EnterCriticalSection(&worker->inbox_lock);
+    PendingConnection* batch = worker->inbox;
+    int batch_count = worker->inbox_count;
+    int batch_capacity = worker->inbox_capacity;
+    worker->inbox = worker->spare;
+    worker->inbox_capacity = worker->spare_capacity;
+    worker->inbox_count = 0;
+    
+    // Few and rare, so they are tracked while the lock is held
+    for (int i = 0; i < worker->resumed_count; i++) {
+        Client* client = &clients[worker->resumed[i]];
+        if (track_connection(worker, client) != 0) {
+            shutdown(client->socket, SD_BOTH);
+            client->slow = 1;
+            continue;
+        }
+        // Fan-out may have queued output, and asked for a write, before
+        // the client was back in the poll set
+        if (client->write_requested) worker->fds[client->poll_index].events |= POLLWRNORM;
+    }
+    worker->resumed_count = 0;
+    LeaveCriticalSection(&worker->inbox_lock);
+    worker->spare = batch;
+    worker->spare_capacity = batch_capacity;
+    
+    for (int i = 0; i < batch_count; i++) {
+        PendingConnection* pending = &batch[i];
+        
+        int client_id = add_client(worker->index, pending->socket, pending->address);
+        if (client_id == -1) {
+            printf("Maximum clients reached. Rejecting connection.\n");
+            send(pending->socket, "ERROR server full\n", 18, 0);
+            closesocket(pending->socket);
+            continue;
+        }
+        
+        // Accepted sockets inherit the listener's non-blocking mode, which
+        // fan-out relies on: a full socket buffer queues instead of blocking
+        if (send_buffer_size > 0) {
+            setsockopt(pending->socket, SOL_SOCKET, SO_SNDBUF, (char*)&send_buffer_size, sizeof(send_buffer_size));
+        }
+        
+        Client* client = &clients[client_id];
+        if (pending->tls && tls_accept(client) != 0) {
+            printf("Cannot start a TLS session. Rejecting connection.\n");
+            remove_client(client_id);
+            continue;
+        }
+        if (track_connection(worker, client) != 0) {
+            printf("Worker %d cannot grow its poll set. Rejecting connection.\n", worker->index);
+            remove_client(client_id);
+            continue;
+        }
+        
+        if (verbose) print_client_info(client, "Connected");
+    }
+}
+
+// Adds a client to the worker's poll set
+int track_connection(Worker* worker, Client* client) {
+    if (worker->count == worker->capacity) {
+        int capacity = worker->capacity * 2;
+        WSAPOLLFD* fds = (WSAPOLLFD*)realloc(worker->fds, capacity * sizeof(WSAPOLLFD));
+        if (fds != NULL) worker->fds = fds;
+        Client** conns = (Client**)realloc(worker->conns, capacity * sizeof(Client*));
+        if (conns != NULL) worker->conns = conns;
+        if (fds == NULL || conns == NULL) return -1;
+        worker->capacity = capacity;
+    }
+    
+    client->worker = worker->index;
+    client->poll_index = worker->count;
+    worker->fds[worker->count].fd = client->socket;
+    worker->fds[worker->count].events = POLLRDNORM;
+    worker->fds[worker->count].revents = 0;
+    worker->conns[worker->count] = client;
+    worker->count++;
+    return 0;
+}
+
+// Starts polling for writability on every client whose outbound queue
+// was filled by another thread since the last wake-up
+void enable_write_polling(Worker* worker) {
+    EnterCriticalSection(&worker->inbox_lock);
+    for (int i = 0; i < worker->write_count; i++) {
+        Client* client = &clients[worker->write_requests[i]];
+        
+        // The client may have disconnected, or its slot been reused, since
+        int index = client->poll_index;
+        if (client->worker == worker->index && index > 0 && index < worker->count &&
+            worker->conns[index] == client) {
+            worker->fds[index].events |= POLLWRNORM;
+        }
+    }
+    worker->write_count = 0;
+    LeaveCriticalSection(&worker->inbox_lock);
+}
+
+// Resumes reading from publishers whose chunk window opened up again,
+// unless they are over their rate limit. A request for a publisher that
+// left is dropped: only this thread adopts connections, so a slot of the
+// same generation still holds the client that was paused.
+void enable_read_polling(Worker* worker) {
+    EnterCriticalSection(&worker->inbox_lock);
+    for (int i = 0; i < worker->read_count; i++) {
+        Client* client = &clients[worker->read_requests[i].id];
+        
+        int index = client->poll_index;
+        if (client->worker == worker->index && index > 0 && index < worker->count && worker->conns[index] == client &&
+            client->generation == worker->read_requests[i].generation && !client->throttled) {
+            worker->fds[index].events |= POLLRDNORM;
+        }
+    }
+    worker->read_count = 0;
+    LeaveCriticalSection(&worker->inbox_lock);
+}
+
+// Reads from a readable client until it used up its share of this poll
+// round: deficit round-robin with a quantum of ingress_quantum bytes, so a
+// publisher with a full socket buffer cannot keep the worker from the
+// other connections. What it sent beyond its share waits in the kernel and
+// is read in the next round. Returns 0 once the client was removed or
+// handed off.
+int serve_ingress(Worker* worker, int index) {
+    Client* client = worker->conns[index];
+    client->ingress_deficit += ingress_quantum;
+    
+    do {
+        client->ingress_bytes = 0;
+        client->ingress_drained = 1;
+        if (!handle_client(client)) return 0;
+        client->ingress_deficit -= client->ingress_bytes;
+    } while (!client->ingress_drained && client->ingress_deficit > 0 && client->throttle_ms == 0 &&
+             (worker->fds[index].events & POLLRDNORM));
+    
+    // An idle connection does not save up credit
+    if (client->ingress_drained) client->ingress_deficit = 0;
+    if (client->throttle_ms > 0) throttle_client(worker, client);
+    if (client->tls != NULL && tls_buffered(client)) note_tls_ready(worker, client);
+    
+    // A connection that registered on a busy-poll topic moves to a
+    // busy-poll worker, once it is not paused
+    if (client->busy_poll && worker->busy == NULL && (worker->fds[index].events & POLLRDNORM)) {
+        resume_client(client);
+        return 0;
+    }
+    return 1;
+}
+
+// Stops reading from a publisher over its rate limit and tells it for how
+// long. Its unread messages stay in the socket, so the kernel's flow
+// control slows the publisher down instead of the broker dropping them.
+void throttle_client(Worker* worker, Client* client) {
+    ULONGLONG until = GetTickCount64() + client->throttle_ms;
+    
+    // Charged again by data read while throttled: the pause is extended
+    int slot = -1;
+    if (client->throttled) {
+        for (int t = 0; t < worker->throttle_count && slot < 0; t++) {
+            if (worker->throttles[t].client_id == client->id) slot = t;
+        }
+    }
+    if (slot < 0) {
+        if (worker->throttle_count == worker->throttle_capacity) {
+            int capacity = worker->throttle_capacity * 2;
+            Throttle* throttles = (Throttle*)realloc(worker->throttles, capacity * sizeof(Throttle));
+            if (throttles == NULL) {
+                client->throttle_ms = 0;  // Not paused, charged again on its next message
+                return;
+            }
+            worker->throttles = throttles;
+            worker->throttle_capacity = capacity;
+        }
+        slot = worker->throttle_count++;
+        worker->throttles[slot].client_id = client->id;
+        worker->throttles[slot].until = 0;
+    }
+    if (until > worker->throttles[slot].until) worker->throttles[slot].until = until;
+    
+    rate_throttled(client);
+    client->throttled = 1;
+    set_reading(client, 0);
+    
+    char notice[32];
+    int length = snprintf(notice, sizeof(notice), "THROTTLED %d\n", client->throttle_ms);
+    client->throttle_ms = 0;
+    Message* message = message_create(length + 1);
+    if (message != NULL) {
+        memcpy(message->data, notice, length);
+        message->length = length;
+        EnterCriticalSection(&clients_mutex);
+        deliver_to_client(client, message);
+        LeaveCriticalSection(&clients_mutex);
+        message_release(message);
+    }
+}
+
+// Reads again from throttled publishers whose pause is over. Returns the
+// poll timeout until the next one is due, -1 if none is throttled.
+int resume_throttled(Worker* worker) {
+    if (worker->throttle_count == 0) return -1;
+    
+    ULONGLONG now = GetTickCount64();
+    ULONGLONG next = 0;
+    for (int t = 0; t < worker->throttle_count; t++) {
+        Throttle* throttle = &worker->throttles[t];
+        if (throttle->until > now) {
+            if (next == 0 || throttle->until < next) next = throttle->until;
+            continue;
+        }
+        
+        // The publisher may have disconnected, or its slot been reused, since
+        Client* client = &clients[throttle->client_id];
+        int index = client->poll_index;
+        if (client->throttled && client->worker == worker->index && index > 0 && index < worker->count &&
+            worker->conns[index] == client) {
+            client->throttled = 0;
+            if (!chunk_window_full(client)) set_reading(client, 1);
+        }
+        rate_resumed();
+        worker->throttles[t--] = worker->throttles[--worker->throttle_count];
+    }
+    return (next == 0) ? -1 : (int)(next - now);
+}
+
+// Stops or resumes reading from a client. Called by its owning worker only;
+// other threads use request_read.
+void set_reading(Client* client, int enabled) {
+    Worker* worker = &workers[client->worker];
+    int index = client->poll_index;
+    if (index <= 0 || index >= worker->count || worker->conns[index] != client) return;
+    
+    if (enabled) {
+        worker->fds[index].events |= POLLRDNORM;
+    } else {
+        worker->fds[index].events &= ~POLLRDNORM;
+    }
+}
+
+// Asks the worker owning a paused publisher to read from it again. The
+// generation is the slot's when the publisher was paused, since it may
+// have left meanwhile.
+void request_read(Client* client, LONG generation) {
+    Worker* worker = &workers[client->worker];
+    EnterCriticalSection(&worker->inbox_lock);
+    if (worker->read_count == worker->read_capacity) {
+        int capacity = worker->read_capacity * 2;
+        ReadRequest* requests = (ReadRequest*)realloc(worker->read_requests, capacity * sizeof(ReadRequest));
+        if (requests == NULL) {
+            LeaveCriticalSection(&worker->inbox_lock);
+            printf("Worker %d cannot queue a read request for client %d\n", worker->index, client->id);
+            return;
+        }
+        worker->read_requests = requests;
+        worker->read_capacity = capacity;
+    }
+    worker->read_requests[worker->read_count].id = (int)(client - clients);
+    worker->read_requests[worker->read_count].generation = generation;
+    worker->read_count++;
+    LeaveCriticalSection(&worker->inbox_lock);
+    
+    wake_worker(worker);
+}
+
+// Asks the worker owning the client to flush its outbound queue once the
+// socket drains. Only the first request until the queue empties goes out.
+void request_write(Client* client) {
+    if (InterlockedExchange(&client->write_requested, 1) != 0) return;
+    
+    Worker* worker = &workers[client->worker];
+    EnterCriticalSection(&worker->inbox_lock);
+    if (worker->write_count == worker->write_capacity) {
+        int capacity = worker->write_capacity * 2;
+        int* requests = (int*)realloc(worker->write_requests, capacity * sizeof(int));
+        if (requests == NULL) {
+            LeaveCriticalSection(&worker->inbox_lock);
+            client->write_requested = 0;
+            printf("Worker %d cannot queue a write request for client %d\n", worker->index, client->id);
+            return;
+        }
+        worker->write_requests = requests;
+        worker->write_capacity = capacity;
+    }
+    worker->write_requests[worker->write_count++] = client->id;
+    LeaveCriticalSection(&worker->inbox_lock);
+    
+    wake_worker(worker);
+}
+
+// Writes queued messages after the socket became writable again. Returns 0
+// if the client was removed because the socket failed, or handed to a
+// catch-up session because it fell behind and its queue is now empty.
+int flush_client(Worker* worker, int index) {
+    Client* client = worker->conns[index];
+    
+    AcquireSRWLockExclusive(&client->out_lock);
+    int result = outbound_flush(client->socket, &client->out);
+    if (result == 1) {
+        // Cleared under out_lock, so a concurrent enqueue requests anew
+        worker->fds[index].events &= ~POLLWRNORM;
+        InterlockedExchange(&client->write_requested, 0);
+    }
+    ReleaseSRWLockExclusive(&client->out_lock);
+    
+    if (result < 0) {
+        if (verbose) print_client_info(client, "Disconnected (send failed)");
+        remove_client(client->id);
+        return 0;
+    }
+    if (result == 1 && client->catching_up) {
+        log_lagging_handoff(client);
+        return 0;
+    }
+    return 1;
+}
+
+// Takes back a client from a catch-up session that reached the end of the
+// topic log; its socket is non-blocking again and fan-out already includes it.
+// Also takes connections of busy-poll topics to a busy-poll worker.
+void resume_client(Client* client) {
+    if (client->busy_poll && client->worker < worker_count && busy_poll_workers > 0) {
+        client->worker = busy_poll_worker();
+    }
+    Worker* worker = &workers[client->worker];
+    
+    EnterCriticalSection(&worker->inbox_lock);
+    if (worker->resumed_count == worker->resumed_capacity) {
+        int capacity = worker->resumed_capacity * 2;
+        int* resumed = (int*)realloc(worker->resumed, capacity * sizeof(int));
+        if (resumed == NULL) {
+            LeaveCriticalSection(&worker->inbox_lock);
+            printf("Worker %d cannot take back client %d\n", worker->index, client->id);
+            remove_client(client->id);
+            return;
+        }
+        worker->resumed = resumed;
+        worker->resumed_capacity = capacity;
+    }
+    worker->resumed[worker->resumed_count++] = client->id;
+    LeaveCriticalSection(&worker->inbox_lock);
+    
+    wake_worker(worker);
+}
+
+// Wakes the acceptor, or every worker, so that it stops at its handoff
+// checkpoint
+void wake_for_handoff(int acceptor) {
+    if (acceptor) {
+        sendto(acceptor_wake, "w", 1, 0, (struct sockaddr*)&acceptor_wake_address, sizeof(acceptor_wake_address));
+        return;
+    }
+    for (int i = 0; i < worker_count + busy_poll_workers; i++) wake_worker(&workers[i]);
+}
+
+// Connections a worker polls, read without its lock for reports
+int worker_connections(int index) {
+    return workers[index].count - 1;
+}
+
+// The busy-poll worker with the fewest connections
+int busy_poll_worker() {
+    int best = worker_count;
+    for (int i = worker_count + 1; i < worker_count + busy_poll_workers; i++) {
+        if (worker_connections(i) < worker_connections(best)) best = i;
+    }
+    return best;
+}
+
+// Stops polling a removed or handed-off client by moving the last entry
+// into its slot
+void drop_connection(Worker* worker, int index) {
+    worker->count--;
+    if (index == worker->count) return;
+    
+    worker->fds[index] = worker->fds[worker->count];
+    worker->conns[index] = worker->conns[worker->count];
+    worker->conns[index]->poll_index = index;
+}
+
+// Remembers a TLS client whose last record was not read to the end, so
+// the rest is served in the next poll round even though the socket has
+// nothing new for it
+void note_tls_ready(Worker* worker, Client* client) {
+    for (int i = 0; i < worker->tls_ready_count; i++) {
+        if (worker->tls_ready[i] == client->id) return;
+    }
+    if (worker->tls_ready_count == worker->tls_ready_capacity) {
+        int capacity = worker->tls_ready_capacity ? worker->tls_ready_capacity * 2 : 16;
+        int* ready = (int*)realloc(worker->tls_ready, capacity * sizeof(int));
+        if (ready == NULL) return;  // Served when its next record arrives
+        worker->tls_ready = ready;
+        worker->tls_ready_capacity = capacity;
+    }
+    worker->tls_ready[worker->tls_ready_count++] = client->id;
+}
+
+// Returns whether a remembered TLS client can be read from now. With mark
+// set, those clients are also flagged readable for this poll round and
+// forgotten; clients paused for their rate limit or chunk window stay
+// until reading resumes. Clients gone or drained are dropped either way.
+int tls_ready_waiting(Worker* worker, int mark) {
+    int waiting = 0;
+    for (int i = 0; i < worker->tls_ready_count; i++) {
+        Client* client = &clients[worker->tls_ready[i]];
+        int index = client->poll_index;
+        int valid = client->worker == worker->index && index > 0 && index < worker->count &&
+                    worker->conns[index] == client && client->tls != NULL && tls_buffered(client);
+        int readable = valid && (worker->fds[index].events & POLLRDNORM);
+        if (readable) {
+            waiting = 1;
+            if (mark) worker->fds[index].revents |= POLLRDNORM;
+        }
+        if (!valid || (readable && mark)) {
+            worker->tls_ready[i--] = worker->tls_ready[--worker->tls_ready_count];
+        }
+    }
+    return waiting;
+}
+
+// Distributes a batch of accepted sockets, taking each worker's inbox lock
+// and waking it once per batch rather than once per connection. Sockets go
+// round-robin, or with --rss-steer to the worker on the CPU, or at least
+// the node, that receives their packets.
+void hand_off(PendingConnection* batch, int count, int* next_worker) {
+    int targets[ACCEPT_BATCH];
+    for (int i = 0; i < count; i++) {
+        targets[i] = rss_steering ? steer_connection(batch[i].socket) : -1;
+        if (targets[i] < 0) {
+            targets[i] = *next_worker;
+            *next_worker = (*next_worker + 1) % worker_count;
+        }
+    }
+    
+    for (int w = 0; w < worker_count; w++) {
+        Worker* worker = &workers[w];
+        int locked = 0;
+        
+        for (int i = 0; i < count; i++) {
+            if (targets[i] != w) continue;
+            if (!locked) {
+                EnterCriticalSection(&worker->inbox_lock);
+                locked = 1;
+            }
+            if (worker->inbox_count == worker->inbox_capacity) {
+                int capacity = worker->inbox_capacity * 2;
+                PendingConnection* inbox = (PendingConnection*)realloc(worker->inbox, capacity * sizeof(PendingConnection));
+                if (inbox == NULL) {
+                    closesocket(batch[i].socket);
+                    continue;
+                }
+                worker->inbox = inbox;
+                worker->inbox_capacity = capacity;
+            }
+            worker->inbox[worker->inbox_count++] = batch[i];
+        }
+        if (!locked) continue;
+        LeaveCriticalSection(&worker->inbox_lock);
+        
+        wake_worker(worker);
+    }
+}
+
+// Accept loop for the listening sockets, the plaintext one and the TLS
+// one with --tls-port. The listeners are non-blocking and drained in
+// batches until the kernel accept queue is empty.
+void run_acceptor(SOCKET server_socket) {
+    PendingConnection batch[ACCEPT_BATCH];
+    int next_worker = 0;
+    
+    u_long nonblocking = 1;
+    ioctlsocket(server_socket, FIONBIO, &nonblocking);
+    if (tls_listen_socket != INVALID_SOCKET) ioctlsocket(tls_listen_socket, FIONBIO, &nonblocking);
+    acceptor_wake = create_wake_socket(&acceptor_wake_address);
+    pin_thread(acceptor_cpu, "acceptor");
+    
+    WSAPOLLFD fds[3];
+    int fd_count = 0;
+    fds[fd_count].fd = server_socket;
+    fds[fd_count++].events = POLLRDNORM;
+    int tls_index = -1;
+    if (tls_listen_socket != INVALID_SOCKET) {
+        tls_index = fd_count;
+        fds[fd_count].fd = tls_listen_socket;
+        fds[fd_count++].events = POLLRDNORM;
+    }
+    int wake_index = -1;
+    if (acceptor_wake != INVALID_SOCKET) {
+        wake_index = fd_count;
+        fds[fd_count].fd = acceptor_wake;
+        fds[fd_count++].events = POLLRDNORM;
+    }
+    
+    while (1) {
+        for (int i = 0; i < fd_count; i++) fds[i].revents = 0;
+        if (WSAPoll(fds, fd_count, -1) == SOCKET_ERROR) {
+            printf("Accept poll failed. Error: %d\n", WSAGetLastError());
+            Sleep(10);
+            continue;
+        }
+        
+        // A takeover stops accepting; pending connections wait in the
+        // listen backlog, which moves to the new process with the listener
+        if (wake_index >= 0 && fds[wake_index].revents != 0) {
+            char drain[16];
+            while (recv(acceptor_wake, drain, sizeof(drain), 0) > 0) {
+            }
+            handoff_checkpoint(1);
+            continue;
+        }
+        
+        if (fds[0].revents != 0) accept_batches(server_socket, 0, batch, &next_worker);
+        if (tls_index >= 0 && fds[tls_index].revents != 0) accept_batches(tls_listen_socket, 1, batch, &next_worker);
+    }
+}
+
+// Accepts from one listener until its accept queue is empty and hands the
+// connections to the workers a batch at a time
+void accept_batches(SOCKET listener, int tls, PendingConnection* batch, int* next_worker) {
+    int accepted;
+    do {
+        accepted = 0;
+        while (accepted < ACCEPT_BATCH) {
+            int addr_len = sizeof(batch[accepted].address);
+            SOCKET client_socket = accept(listener, (struct sockaddr*)&batch[accepted].address, &addr_len);
+            if (client_socket == INVALID_SOCKET) {
+                int error = WSAGetLastError();
+                if (error != WSAEWOULDBLOCK) {
+                    printf("Accept failed. Error: %d\n", error);
+                    // Out of descriptors or buffers: back off instead of spinning
+                    if (error == WSAEMFILE || error == WSAENOBUFS) Sleep(10);
+                }
+                break;
+            }
+            batch[accepted].tls = tls;
+            batch[accepted++].socket = client_socket;
+        }
+        
+        if (accepted > 0) {
+            hand_off(batch, accepted, next_worker);
+        }
+    } while (accepted == ACCEPT_BATCH);
+}